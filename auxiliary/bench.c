@@ -0,0 +1,1736 @@
+#include "emufs-disk.h"
+#include "emufs.h"
+#include <pthread.h>
+
+/*
+    * Micro benchmarks for the emufs device and filesystem layers
+    * Usage: ./bench <benchmark> [arguments]
+    * Build: gcc -O2 -o bench bench.c emufs-disk.c emufs-ops.c -lpthread
+*/
+
+#define BENCH_DEVICE "bench_disk"
+
+double get_time_in_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int entity_name(char* name, char prefix, int number) {
+    /*
+        * Zero padded name of a numbered entity, e.g. f12, in a buffer of MAX_ENTITY_NAME bytes
+        * Return value: -1, the name does not fit in MAX_ENTITY_NAME - 1 characters
+                         length of the name, success
+    */
+    char text[16];
+    int length = snprintf(text, sizeof(text), "%c%d", prefix, number);
+    memset(name, 0, MAX_ENTITY_NAME);
+    if (length >= MAX_ENTITY_NAME)
+        return -1;
+    memcpy(name, text, length);
+    return length;
+}
+
+/*-----------BLOCK I/O------------*/
+
+typedef struct {
+    int fd;
+    int positional;         // 1: readblock/writeblock, 0: shared-offset lseek+read/write
+    int num_ops;
+    unsigned int seed;
+    double latency;         // total time spent in block operations (seconds)
+    long syscalls;
+} blockio_arg_t;
+
+pthread_mutex_t seek_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* blockio_thread(void* arg) {
+    blockio_arg_t* a = (blockio_arg_t*)arg;
+    char buf[BLOCKSIZE];
+
+    memset(buf, 'A', BLOCKSIZE);
+    for (int i = 0; i < a->num_ops; i++) {
+        int block = rand_r(&a->seed) % MAX_BLOCKS;
+        int write_op = rand_r(&a->seed) % 4 == 0;   // same 75/25 mix as test.c
+        double start = get_time_in_seconds();
+
+        if (a->positional) {
+            if (write_op)
+                writeblock(a->fd, block, buf, BLOCKSIZE);
+            else
+                readblock(a->fd, block, buf, BLOCKSIZE);
+            a->syscalls += 1;
+        } else {
+            // The seek and the transfer share the file offset, so they must not interleave
+            pthread_mutex_lock(&seek_mutex);
+            lseek(a->fd, (off_t)block * BLOCKSIZE, SEEK_SET);
+            if (write_op)
+                write(a->fd, buf, BLOCKSIZE);
+            else
+                read(a->fd, buf, BLOCKSIZE);
+            pthread_mutex_unlock(&seek_mutex);
+            a->syscalls += 2;
+        }
+        a->latency += get_time_in_seconds() - start;
+    }
+    return NULL;
+}
+
+void run_blockio(int fd, int positional, int num_threads, int ops_per_thread) {
+    pthread_t threads[num_threads];
+    blockio_arg_t args[num_threads];
+    double latency = 0;
+    long syscalls = 0;
+
+    double start_time = get_time_in_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (blockio_arg_t){fd, positional, ops_per_thread, (unsigned int)i + 1, 0, 0};
+        pthread_create(&threads[i], NULL, blockio_thread, &args[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        latency += args[i].latency;
+        syscalls += args[i].syscalls;
+    }
+    double elapsed = get_time_in_seconds() - start_time;
+
+    long ops = (long)num_threads * ops_per_thread;
+    printf("%s: %ld syscalls, %.2f syscalls/op, %.3f us/op, %f seconds\n",
+           positional ? "pread/pwrite" : "lseek+read/write",
+           syscalls, (double)syscalls / ops, latency / ops * 1e6, elapsed);
+}
+
+int bench_blockio(int argc, char* argv[]) {
+    /*
+        * Compares the old lseek+read/write device access (serialized by a lock,
+        * as a shared file offset requires) with positional readblock/writeblock
+        * Arguments: <threads> [operations per thread]
+    */
+    if (argc < 1) {
+        printf("Usage: bench blockio <threads> [ops_per_thread]\n");
+        return 1;
+    }
+    int num_threads = atoi(argv[0]);
+    int ops_per_thread = argc > 1 ? atoi(argv[1]) : 200;
+
+    int fd = open(BENCH_DEVICE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, MAX_BLOCKS * BLOCKSIZE) < 0) {
+        printf("Error: Unable to create %s\n", BENCH_DEVICE);
+        return 1;
+    }
+
+    printf("Threads: %d, operations per thread: %d\n", num_threads, ops_per_thread);
+    run_blockio(fd, 0, num_threads, ops_per_thread);
+    run_blockio(fd, 1, num_threads, ops_per_thread);
+
+    close(fd);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------I/O MODES------------*/
+
+char bench_data[] = "!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!";
+const char* bench_files[] = {"file1", "file2", "file3", "file4"};
+
+void run_file_scenario(int dir_handle, int iterations) {
+    /*
+        * The pattern of testcase1-4: create files, fill them, read them back, delete them
+    */
+    char buf[BLOCKSIZE * MAX_FILE_SIZE];
+
+    for (int it = 0; it < iterations; it++) {
+        for (int f = 0; f < 4; f++) {
+            emufs_create(dir_handle, (char*)bench_files[f], 0);
+            int fd = open_file(dir_handle, (char*)bench_files[f]);
+            for (int b = 0; b < MAX_FILE_SIZE; b++)
+                emufs_write(fd, bench_data, BLOCKSIZE);
+            emufs_seek(fd, -BLOCKSIZE * MAX_FILE_SIZE);
+            emufs_read(fd, buf, BLOCKSIZE * MAX_FILE_SIZE);
+            emufs_close(fd, 0);
+        }
+        for (int f = 0; f < 4; f++)
+            emufs_delete(dir_handle, (char*)bench_files[f]);
+    }
+}
+
+void run_mixed_workload(int dir_handle, int num_ops) {
+    /*
+        * The workload of test.c: 75% whole-file reads, 25% one byte writes over four files
+    */
+    char buf[BLOCKSIZE];
+    unsigned int seed = 1;
+
+    for (int f = 0; f < 4; f++) {
+        emufs_create(dir_handle, (char*)bench_files[f], 0);
+        int fd = open_file(dir_handle, (char*)bench_files[f]);
+        emufs_write(fd, bench_data, BLOCKSIZE);
+        emufs_close(fd, 0);
+    }
+
+    for (int i = 0; i < num_ops; i++) {
+        int fd = open_file(dir_handle, (char*)bench_files[rand_r(&seed) % 4]);
+        if (rand_r(&seed) % 4 < 3)
+            emufs_read(fd, buf, BLOCKSIZE);
+        else
+            emufs_write(fd, "A", 1);
+        emufs_close(fd, 0);
+    }
+
+    for (int f = 0; f < 4; f++)
+        emufs_delete(dir_handle, (char*)bench_files[f]);
+}
+
+int bench_iomode(int argc, char* argv[]) {
+    /*
+        * Runs the testcase pattern and the test.c workload on one device access mode
+        * Arguments: <fd|mmap|cached> [fs_number] [iterations]
+        * fs_number 1 asks for the encryption key on stdin
+    */
+    if (argc < 1) {
+        printf("Usage: bench iomode <fd|mmap|cached> [fs_number] [iterations]\n");
+        return 1;
+    }
+    struct device_config_t config = {0};
+    config.io_mode = EMUFS_IO_FD;
+    config.sync_policy = EMUFS_SYNC_OPERATION;
+    if (strcmp(argv[0], "mmap") == 0)
+        config.io_mode = EMUFS_IO_MMAP;
+    else if (strcmp(argv[0], "cached") == 0)
+        config.cache_blocks = MAX_BLOCKS;
+    int fs_number = argc > 1 ? atoi(argv[1]) : 0;
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, MAX_BLOCKS, &config);
+    if (mnt == -1 || create_file_system(mnt, fs_number) == -1)
+        return 1;
+    int dir_handle = open_root(mnt);
+
+    double start_time = get_time_in_seconds();
+    run_file_scenario(dir_handle, iterations);
+    double scenario_time = get_time_in_seconds() - start_time;
+
+    start_time = get_time_in_seconds();
+    run_mixed_workload(dir_handle, iterations * 10);
+    double workload_time = get_time_in_seconds() - start_time;
+
+    start_time = get_time_in_seconds();
+    closedevice(mnt);
+    double close_time = get_time_in_seconds() - start_time;
+
+    printf("\nMode: %s, fs_number: %d, iterations: %d\n", argv[0], fs_number, iterations);
+    printf("File scenario time: %f seconds\n", scenario_time);
+    printf("Mixed workload time: %f seconds\n", workload_time);
+    printf("Close (write back) time: %f seconds\n", close_time);
+
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------ALLOCATOR------------*/
+
+int linear_alloc(char* bitmap, int first, int end) {
+    // The byte-per-bit first-fit scan the allocator used before
+    for (int i = first; i < end; i++)
+        if (bitmap[i] == UNUSED) {
+            bitmap[i] = USED;
+            return i;
+        }
+    return -1;
+}
+
+int bench_alloc(int argc, char* argv[]) {
+    /*
+        * Allocation churn on a half-full bitmap: each round frees a random
+        * allocated bit and allocates a new one
+        * Arguments: [bits] [rounds]
+    */
+    int nbits = argc > 0 ? atoi(argv[0]) : 1 << 16;
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    char* bytes = (char*)calloc(nbits, 1);
+    u_int64_t* words = (u_int64_t*)calloc(BITMAP_WORDS(nbits), sizeof(u_int64_t));
+    int* allocated = (int*)malloc(nbits * sizeof(int));
+    int num_allocated, cursor = 0;
+    unsigned int seed;
+
+    // Linear scan
+    seed = 1;
+    num_allocated = 0;
+    for (int i = 0; i < nbits / 2; i++)
+        allocated[num_allocated++] = linear_alloc(bytes, 0, nbits);
+    double start_time = get_time_in_seconds();
+    for (int r = 0; r < rounds; r++) {
+        int victim = rand_r(&seed) % num_allocated;
+        bytes[allocated[victim]] = UNUSED;
+        allocated[victim] = linear_alloc(bytes, 0, nbits);
+    }
+    double linear_time = get_time_in_seconds() - start_time;
+
+    // Packed words with next-fit
+    seed = 1;
+    num_allocated = 0;
+    for (int i = 0; i < nbits / 2; i++)
+        allocated[num_allocated++] = bitmap_next_fit(words, 0, nbits, &cursor);
+    start_time = get_time_in_seconds();
+    for (int r = 0; r < rounds; r++) {
+        int victim = rand_r(&seed) % num_allocated;
+        bitmap_clear(words, allocated[victim]);
+        allocated[victim] = bitmap_next_fit(words, 0, nbits, &cursor);
+    }
+    double word_time = get_time_in_seconds() - start_time;
+
+    // Runs of 4 blocks (alloc_datablocks) on the same, now fragmented, bitmap
+    int runs = 0;
+    start_time = get_time_in_seconds();
+    for (int r = 0; r < rounds / 4; r++) {
+        int start = bitmap_find_run(words, 0, nbits, cursor, 4);
+        if (start == -1)
+            break;
+        for (int i = 0; i < 4; i++)
+            bitmap_set(words, start + i);
+        cursor = start + 4;
+        runs++;
+        for (int i = 0; i < 4; i++)
+            bitmap_clear(words, allocated[rand_r(&seed) % num_allocated]);
+    }
+    double run_time = get_time_in_seconds() - start_time;
+
+    printf("Bits: %d, rounds: %d\n", nbits, rounds);
+    printf("Linear scan: %.0f allocs/s\n", rounds / linear_time);
+    printf("Word next-fit: %.0f allocs/s\n", rounds / word_time);
+    printf("Word 4-block runs: %.0f runs/s\n", runs / run_time);
+
+    free(bytes);
+    free(words);
+    free(allocated);
+    return 0;
+}
+
+/*-----------LOOKUP------------*/
+
+int bench_lookup(int argc, char* argv[]) {
+    /*
+        * Path resolution (change_dir) in a deep tree: every level holds three
+        * files and the next directory (created last, so a scan passes the files first)
+        * Arguments: [depth] [lookups]
+    */
+    int depth = argc > 0 ? atoi(argv[0]) : 7;
+    int lookups = argc > 1 ? atoi(argv[1]) : 100000;
+    char path[MAX_ENTITY_NAME * 64 + 64] = "";
+    char name[MAX_ENTITY_NAME];
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice(BENCH_DEVICE, MAX_BLOCKS);
+    if (mnt == -1 || create_file_system(mnt, 0) == -1)
+        return 1;
+    int walker = open_root(mnt);
+    int absolute = open_root(mnt);
+
+    for (int level = 0; level < depth; level++) {
+        for (int f = 0; f < 3; f++) {
+            entity_name(name, 'f', f);
+            if (emufs_create(walker, name, 0) == -1)
+                break;
+        }
+        if (entity_name(name, 'd', level) == -1 || emufs_create(walker, name, 1) == -1 || change_dir(walker, name) == -1) {
+            printf("Error: Tree limited to depth %d\n", level);
+            depth = level;
+            break;
+        }
+        strcat(path, "/");
+        strcat(path, name);
+    }
+
+    double start_time = get_time_in_seconds();
+    for (int i = 0; i < lookups; i++)
+        change_dir(absolute, path);
+    double absolute_time = get_time_in_seconds() - start_time;
+
+    // From the deepest directory: up two levels and back down through "." and "//"
+    char relative[64];
+    sprintf(relative, "../.././/d%d/.///d%d", depth - 2, depth - 1);
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < lookups; i++)
+        change_dir(walker, relative);
+    double relative_time = get_time_in_seconds() - start_time;
+
+    printf("Depth: %d, lookups: %d\n", depth, lookups);
+    printf("Absolute path lookup: %.3f us (%s)\n", absolute_time / lookups * 1e6, path);
+    printf("Relative path lookup: %.3f us (%s)\n", relative_time / lookups * 1e6, relative);
+
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+int bench_dirsize(int argc, char* argv[]) {
+    /*
+        * Operations on one large directory (extent format, hashed directory entries):
+          creating its entries, looking random ones up by path and deleting them all
+        * Arguments: [entries] [lookups]
+    */
+    int entries = argc > 0 ? atoi(argv[0]) : 10000;
+    int lookups = argc > 1 ? atoi(argv[1]) : 100000;
+    struct fs_config_t fs_config = { EMUFS_FORMAT_EXTENT, entries + 16, 0 };
+    char name[MAX_ENTITY_NAME], path[32];
+
+    if (entries < 1 || entity_name(name, 'e', entries - 1) == -1) {
+        printf("Invalid number of entries (names have at most %d characters)\n", MAX_ENTITY_NAME - 1);
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice(BENCH_DEVICE, 1 << 18);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    memset(name, 0, MAX_ENTITY_NAME);
+    strcpy(name, "big");
+    emufs_create(root, name, 1);
+    int dir = open_root(mnt);
+    change_dir(dir, name);
+
+    int created = 0;
+    double start_time = get_time_in_seconds();
+    for (; created < entries; created++) {
+        entity_name(name, 'e', created);
+        if (emufs_create(dir, name, 0) == -1)
+            break;
+    }
+    double create_time = get_time_in_seconds() - start_time;
+
+    unsigned int seed = 1;
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < lookups && created > 0; i++) {
+        sprintf(path, "/big/e%d", rand_r(&seed) % created);
+        emufs_close(open_file(root, path), 0);
+    }
+    double lookup_time = get_time_in_seconds() - start_time;
+
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < created; i++) {
+        sprintf(path, "e%d", i);
+        emufs_delete(dir, path);
+    }
+    double delete_time = get_time_in_seconds() - start_time;
+
+    printf("Entries: %d\n", created);
+    printf("Create: %.3f us per entry\n", create_time / (created > 0 ? created : 1) * 1e6);
+    printf("Lookup: %.3f us per path\n", lookup_time / lookups * 1e6);
+    printf("Delete: %.3f us per entry\n", delete_time / (created > 0 ? created : 1) * 1e6);
+
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------HANDLES------------*/
+
+typedef struct {
+    int dir_handle;
+    int count;
+    int* handles;
+    int opened;
+} handles_arg_t;
+
+void* handles_open_thread(void* arg) {
+    handles_arg_t* a = (handles_arg_t*)arg;
+    for (int i = 0; i < a->count; i++) {
+        a->handles[i] = open_file(a->dir_handle, "file1");
+        if (a->handles[i] != -1)
+            a->opened++;
+    }
+    return NULL;
+}
+
+void* handles_close_thread(void* arg) {
+    handles_arg_t* a = (handles_arg_t*)arg;
+    for (int i = 0; i < a->count; i++)
+        emufs_close(a->handles[i], 0);
+    return NULL;
+}
+
+int bench_handles(int argc, char* argv[]) {
+    /*
+        * Opens count file handles on one file from several threads, then closes them all
+        * Closed handles must be rejected even after their slots are reused
+        * While they are open, deleting another (opened) file must not depend on their number
+        * Arguments: [count] [threads]
+    */
+    int count = argc > 0 ? atoi(argv[0]) : 200000;
+    int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+    pthread_t threads[num_threads];
+    handles_arg_t args[num_threads];
+    int* handles = (int*)malloc(count * sizeof(int));
+    int opened = 0;
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice(BENCH_DEVICE, MAX_BLOCKS);
+    if (mnt == -1 || create_file_system(mnt, 0) == -1 || !handles)
+        return 1;
+    int dir_handle = open_root(mnt);
+    emufs_create(dir_handle, "file1", 0);
+
+    for (int t = 0; t < num_threads; t++) {
+        args[t].dir_handle = dir_handle;
+        args[t].handles = handles + (long)count * t / num_threads;
+        args[t].count = (long)count * (t + 1) / num_threads - (long)count * t / num_threads;
+        args[t].opened = 0;
+    }
+
+    double start_time = get_time_in_seconds();
+    for (int t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, handles_open_thread, &args[t]);
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+        opened += args[t].opened;
+    }
+    double open_time = get_time_in_seconds() - start_time;
+
+    int deletes = 1000;
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < deletes; i++) {
+        emufs_create(dir_handle, "file2", 0);
+        emufs_close(open_file(dir_handle, "file2"), 0);
+        open_file(dir_handle, "file2");
+        emufs_delete(dir_handle, "file2");
+    }
+    double delete_time = get_time_in_seconds() - start_time;
+
+    start_time = get_time_in_seconds();
+    for (int t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, handles_close_thread, &args[t]);
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    double close_time = get_time_in_seconds() - start_time;
+
+    // Reuse the freed slots, then try the old handles
+    int stale_accepted = 0;
+    int fd = open_file(dir_handle, "file1");
+    char c;
+    for (int i = 0; i < count; i++)
+        if (handles[i] != -1 && handles[i] != fd && emufs_seek(handles[i], 0) != -1)
+            stale_accepted++;
+    emufs_close(fd, 0);
+
+    printf("Handles: %d requested, %d opened, threads: %d\n", count, opened, num_threads);
+    printf("Open: %.3f us per handle\n", open_time / count * 1e6);
+    printf("Close: %.3f us per handle\n", close_time / count * 1e6);
+    printf("Create/open/delete: %.3f us with %d other handles open\n", delete_time / deletes * 1e6, opened);
+    printf("Stale handles accepted: %d\n", stale_accepted + (emufs_read(fd, &c, 0) != -1));
+
+    free(handles);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------SCALING------------*/
+
+int bench_scale(int argc, char* argv[]) {
+    /*
+        * Cost of the file system as the device grows (extent format, bitmaps in their own blocks)
+        * The device is first filled to half by one large file, then files are created in
+        * directories of 64 entries, looked up by absolute path and dumped with fsdump
+        * Arguments: [blocks] [files]
+    */
+    int blocks = argc > 0 ? atoi(argv[0]) : 1 << 18;
+    int files = argc > 1 ? atoi(argv[1]) : 10000;
+    int per_dir = 64;
+    int dirs = (files + per_dir - 1) / per_dir;
+    struct fs_config_t fs_config = {0};
+    struct superblock_t superblock;
+    char name[MAX_ENTITY_NAME], path[32];
+    char block[BLOCKSIZE];
+    fs_config.format = EMUFS_FORMAT_EXTENT;
+
+    if (files < 1 || entity_name(name, 'd', dirs - 1) == -1) {
+        printf("Invalid number of files (names have at most %d characters)\n", MAX_ENTITY_NAME - 1);
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice(BENCH_DEVICE, blocks);
+    if (mnt == -1)
+        return 1;
+    double start_time = get_time_in_seconds();
+    if (create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    double format_time = get_time_in_seconds() - start_time;
+    int root = open_root(mnt);
+
+    // Fill half of the device with one file, 1 MB per write
+    int chunk = 1 << 20;
+    char* fill = (char*)calloc(1, chunk);
+    long fill_bytes = (long)blocks / 2 * BLOCKSIZE;
+    memset(name, 0, MAX_ENTITY_NAME);
+    strcpy(name, "fill");
+    emufs_create(root, name, 0);
+    int fd = open_file(root, name);
+    start_time = get_time_in_seconds();
+    for (long done = 0; done < fill_bytes; done += chunk)
+        emufs_write(fd, fill, fill_bytes - done < chunk ? (int)(fill_bytes - done) : chunk);
+    double fill_time = get_time_in_seconds() - start_time;
+    emufs_close(fd, 0);
+    free(fill);
+
+    // Remount: the bitmaps are read back from the device
+    start_time = get_time_in_seconds();
+    closedevice(mnt);
+    mnt = opendevice(BENCH_DEVICE, blocks);
+    double mount_time = get_time_in_seconds() - start_time;
+    root = open_root(mnt);
+
+    // Block allocation on the half-full device
+    int allocs = 100000;
+    int* allocated = (int*)malloc(allocs * sizeof(int));
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < allocs; i++)
+        allocated[i] = alloc_datablock(mnt);
+    for (int i = 0; i < allocs; i++)
+        if (allocated[i] != -1)
+            free_datablock(mnt, allocated[i]);
+    double alloc_time = get_time_in_seconds() - start_time;
+    free(allocated);
+
+    // Files of one block in directories of per_dir entries
+    memset(block, 'x', BLOCKSIZE);
+    int created = 0;
+    start_time = get_time_in_seconds();
+    for (int d = 0; d < dirs; d++) {
+        int dir = open_root(mnt);
+        entity_name(name, 'd', d);
+        if (emufs_create(dir, name, 1) == -1 || change_dir(dir, name) == -1)
+            break;
+        for (int f = 0; f < per_dir && created < files; f++, created++) {
+            entity_name(name, 'f', f);
+            if (emufs_create(dir, name, 0) == -1)
+                break;
+            fd = open_file(dir, name);
+            emufs_write(fd, block, BLOCKSIZE);
+            emufs_close(fd, 0);
+        }
+        emufs_close(dir, 1);
+    }
+    double create_time = get_time_in_seconds() - start_time;
+
+    unsigned int seed = 1;
+    int lookups = 100000;
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < lookups && created > 0; i++) {
+        int n = rand_r(&seed) % created;
+        sprintf(path, "/d%d/f%d", n / per_dir, n % per_dir);
+        emufs_close(open_file(root, path), 0);
+    }
+    double lookup_time = get_time_in_seconds() - start_time;
+
+    // fsdump prints every entity, its output is discarded
+    fflush(stdout);
+    int saved_stdout = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    start_time = get_time_in_seconds();
+    fsdump(mnt);
+    fflush(stdout);
+    double fsdump_time = get_time_in_seconds() - start_time;
+    dup2(saved_stdout, 1);
+    close(devnull);
+    close(saved_stdout);
+
+    read_superblock(mnt, &superblock);
+    printf("Blocks: %d, inodes: %d, files: %d\n", blocks, superblock.inode_count, created);
+    printf("Format: %.6f seconds\n", format_time);
+    printf("Fill: %.3f MB/s\n", fill_bytes / fill_time / (1 << 20));
+    printf("Mount: %.6f seconds\n", mount_time);
+    printf("Allocate: %.3f us per block\n", alloc_time / allocs * 1e6);
+    printf("Create: %.3f us per file\n", create_time / (created > 0 ? created : 1) * 1e6);
+    printf("Lookup: %.3f us per path\n", lookup_time / lookups * 1e6);
+    printf("Fsdump: %.6f seconds\n", fsdump_time);
+
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------BLOCK SIZE------------*/
+
+int bench_blocksize(int argc, char* argv[]) {
+    /*
+        * The same workloads on an extent format device formatted with a given block size
+        * The device length and the cache size (1 MB) are the same whatever the block size
+        * Workloads: sequential write and read of a large file in 1 MB requests,
+          random 4 KB reads and overwrites, creation of small files (and the space they take)
+        * Arguments: <block size> [fs_number] [device MB] [small files]
+    */
+    if (argc < 1) {
+        printf("Usage: bench blocksize <block size> [fs_number] [device MB] [small files]\n");
+        return 1;
+    }
+    int block_size = atoi(argv[0]);
+    int fs_number = argc > 1 ? atoi(argv[1]) : 0;
+    long device_bytes = (argc > 2 ? atol(argv[2]) : 128) << 20;
+    int small_files = argc > 3 ? atoi(argv[3]) : 2000;
+    int chunk = 1 << 20;
+    long file_bytes = device_bytes / 4;
+    int random_ops = 20000;
+    int io_size = 4096;
+    struct device_config_t device_config = {0};
+    struct fs_config_t fs_config = { EMUFS_FORMAT_EXTENT, 0, block_size };
+    struct superblock_t superblock;
+    char name[MAX_ENTITY_NAME];
+    device_config.cache_blocks = (1 << 20) / block_size;
+    device_config.io_mode = EMUFS_IO_FD;
+    device_config.sync_policy = EMUFS_SYNC_OPERATION;
+    device_config.block_size = block_size;
+
+    if (small_files < 0 || entity_name(name, 's', small_files) == -1) {
+        printf("Invalid number of small files (names have at most %d characters)\n", MAX_ENTITY_NAME - 1);
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, device_bytes / block_size, &device_config);
+    if (mnt == -1 || create_file_system_ex(mnt, fs_number, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    char* data = (char*)malloc(chunk);
+    for (int i = 0; i < chunk; i++)
+        data[i] = (char)i;
+
+    memset(name, 0, MAX_ENTITY_NAME);
+    strcpy(name, "large");
+    emufs_create(root, name, 0);
+    int fd = open_file(root, name);
+    double start_time = get_time_in_seconds();
+    for (long done = 0; done < file_bytes; done += chunk)
+        emufs_write(fd, data, chunk);
+    flush_device(mnt);
+    double write_time = get_time_in_seconds() - start_time;
+    emufs_close(fd, 0);
+
+    fd = open_file(root, name);
+    start_time = get_time_in_seconds();
+    for (long done = 0; done < file_bytes; done += chunk)
+        emufs_read(fd, data, chunk);
+    double read_time = get_time_in_seconds() - start_time;
+
+    // Random 4 KB requests, emufs_seek moves relative to the current offset
+    unsigned int seed = 1;
+    int ios = (int)(file_bytes / io_size);
+    int offset = (int)file_bytes;
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < random_ops; i++) {
+        int target = rand_r(&seed) % ios * io_size;
+        emufs_seek(fd, target - offset);
+        emufs_read(fd, data, io_size);
+        offset = target + io_size;
+    }
+    double random_read_time = get_time_in_seconds() - start_time;
+
+    start_time = get_time_in_seconds();
+    for (int i = 0; i < random_ops; i++) {
+        int target = rand_r(&seed) % ios * io_size;
+        emufs_seek(fd, target - offset);
+        emufs_write(fd, data, io_size);
+        offset = target + io_size;
+    }
+    flush_device(mnt);
+    double random_write_time = get_time_in_seconds() - start_time;
+    emufs_close(fd, 0);
+
+    // Small files of 1 KB in their own directory
+    memset(name, 0, MAX_ENTITY_NAME);
+    strcpy(name, "small");
+    emufs_create(root, name, 1);
+    int dir = open_root(mnt);
+    change_dir(dir, name);
+    read_superblock(mnt, &superblock);
+    unsigned long long blocks_before = superblock.blocks_in_use;
+    int created = 0;
+    start_time = get_time_in_seconds();
+    for (; created < small_files; created++) {
+        entity_name(name, 's', created);
+        if (emufs_create(dir, name, 0) == -1)
+            break;
+        fd = open_file(dir, name);
+        emufs_write(fd, data, 1024);
+        emufs_close(fd, 0);
+    }
+    flush_device(mnt);
+    double small_time = get_time_in_seconds() - start_time;
+    read_superblock(mnt, &superblock);
+    double small_bytes = (double)(superblock.blocks_in_use - blocks_before) * block_size;
+    emufs_close(dir, 1);
+
+    printf("Block size: %d, fs_number: %d, device: %ld MB, blocks: %d\n",
+           block_size, fs_number, device_bytes >> 20, superblock.disk_size);
+    printf("Sequential write: %.3f MB/s\n", file_bytes / write_time / (1 << 20));
+    printf("Sequential read: %.3f MB/s\n", file_bytes / read_time / (1 << 20));
+    printf("Random read: %.3f us per 4 KB\n", random_read_time / random_ops * 1e6);
+    printf("Random write: %.3f us per 4 KB\n", random_write_time / random_ops * 1e6);
+    printf("Small files: %.3f us per file, %.1f bytes per file\n",
+           small_time / (created > 0 ? created : 1) * 1e6, small_bytes / (created > 0 ? created : 1));
+
+    free(data);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------ENCRYPTION------------*/
+
+int check_crypt_kernel(int checks, unsigned int seed) {
+    /*
+        * Compares encrypt/decrypt with the selected kernel against the scalar
+        * routines on random buffers, sizes, alignments and keys
+        * Returns the number of mismatching buffers
+    */
+    char* expected = malloc(MAX_BLOCKSIZE + 64);
+    char* actual = malloc(MAX_BLOCKSIZE + 64);
+    int mismatches = 0;
+
+    for (int c = 0; c < checks; c++) {
+        int size = rand_r(&seed) % (c % 4 == 0 ? MAX_BLOCKSIZE : 1024);
+        int align = rand_r(&seed) % 64;
+        int key = rand_r(&seed) % 1024 - 512;
+        char* a = expected + align;
+        char* b = actual + align;
+
+        for (int i = 0; i < size; i++)
+            a[i] = b[i] = (char)rand_r(&seed);
+        encrypt_scalar(key, a, size);
+        encrypt(key, b, size);
+        if (memcmp(a, b, size) != 0) {
+            mismatches++;
+            continue;
+        }
+        decrypt_scalar(key, a, size);
+        decrypt(key, b, size);
+        if (memcmp(a, b, size) != 0)
+            mismatches++;
+    }
+    free(expected);
+    free(actual);
+    return mismatches;
+}
+
+int check_aes(int checks, unsigned int seed) {
+    /*
+        * FIPS-197 known answers for AES-128 and AES-256 with both implementations,
+        * then CTR mode with AES-NI/VAES against the portable code on random blocks
+        * Returns the number of failures
+    */
+    u_int8_t key_bytes[32], plain[16], cipher[16];
+    u_int8_t expected[2][16] = {
+        {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+        {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89}};
+    struct aes_key_t key;
+    int failures = 0;
+
+    for (int i = 0; i < 32; i++)
+        key_bytes[i] = i;
+    for (int i = 0; i < 16; i++)
+        plain[i] = i * 0x11;
+    for (int k = 0; k < 2; k++) {
+        aes_set_key(&key, key_bytes, k ? 256 : 128);
+        aes_encrypt_block_portable(&key, plain, cipher);
+        failures += memcmp(cipher, expected[k], 16) != 0;
+        aes_encrypt_block(&key, plain, cipher);
+        failures += memcmp(cipher, expected[k], 16) != 0;
+    }
+
+    char* fast = malloc(MAX_BLOCKSIZE);
+    char* portable = malloc(MAX_BLOCKSIZE);
+    u_int8_t nonce[AES_NONCE_SIZE];
+    for (int c = 0; c < checks; c++) {
+        int size = rand_r(&seed) % (c % 4 == 0 ? MAX_BLOCKSIZE : 1024);
+        u_int32_t blocknum = rand_r(&seed);
+        for (int i = 0; i < 32; i++)
+            key_bytes[i] = rand_r(&seed);
+        for (int i = 0; i < AES_NONCE_SIZE; i++)
+            nonce[i] = rand_r(&seed);
+        for (int i = 0; i < size; i++)
+            fast[i] = portable[i] = (char)rand_r(&seed);
+        aes_set_key(&key, key_bytes, c % 2 ? 256 : 128);
+        key.use_aesni = c % (key.use_aesni + 1);    // alternate between the fast paths the CPU has
+        aes_ctr(&key, nonce, blocknum, fast, size);
+        aes_ctr_portable(&key, nonce, blocknum, portable, size);
+        failures += memcmp(fast, portable, size) != 0;
+        aes_ctr(&key, nonce, blocknum, fast, size);
+        failures += memcmp(fast, portable, size) == 0 && size >= 16;   // decrypting must change it back
+    }
+    free(fast);
+    free(portable);
+    return failures;
+}
+
+int bench_crypto(int argc, char* argv[]) {
+    /*
+        * Checks every encryption kernel the CPU supports against the scalar
+        * routines, then measures its throughput on buffers of one block
+        * Then checks AES against known answers and measures the CTR keystream
+        * Arguments: [block size] [MB per kernel] [checks]
+    */
+    int block_size = argc > 0 ? atoi(argv[0]) : BLOCKSIZE;
+    int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    int checks = argc > 2 ? atoi(argv[2]) : 2000;
+    if (block_size <= 0 || block_size > MAX_BLOCKSIZE) {
+        printf("Usage: bench crypto [block size] [MB per kernel] [checks]\n");
+        return 1;
+    }
+    long rounds = ((long)megabytes << 20) / block_size;
+    char* buf = malloc(block_size);
+    int failed = 0;
+
+    memset(buf, 'A', block_size);
+    printf("Selected kernel: %s\n", crypt_kernel_name());
+    for (struct crypt_kernel_t* kernel = crypt_kernels; kernel->name; kernel++) {
+        if (!crypt_kernel_supported(kernel)) {
+            printf("Kernel: %s, not supported\n", kernel->name);
+            continue;
+        }
+        set_crypt_kernel(kernel->name);
+        int mismatches = check_crypt_kernel(checks, 744);
+        failed |= mismatches != 0;
+
+        double start_time = get_time_in_seconds();
+        for (long r = 0; r < rounds; r++)
+            encrypt(5, buf, block_size);
+        double encrypt_time = get_time_in_seconds() - start_time;
+        start_time = get_time_in_seconds();
+        for (long r = 0; r < rounds; r++)
+            decrypt(5, buf, block_size);
+        double decrypt_time = get_time_in_seconds() - start_time;
+
+        printf("Kernel: %s, block size: %d, encrypt: %.1f MB/s, decrypt: %.1f MB/s, mismatches: %d\n",
+               kernel->name, block_size, megabytes / encrypt_time, megabytes / decrypt_time, mismatches);
+    }
+    set_crypt_kernel(NULL);
+
+    // AES-CTR keystream of the EMUFS_AES128/EMUFS_AES256 file systems
+    int aes_failures = check_aes(checks / 4, 744);
+    failed |= aes_failures != 0;
+    printf("AES known answers and CTR checks: %d failures\n", aes_failures);
+    for (int bits = 128; bits <= 256; bits += 128) {
+        u_int8_t key_bytes[32] = {0};
+        u_int8_t nonce[AES_NONCE_SIZE] = {0};
+        struct aes_key_t key;
+        aes_set_key(&key, key_bytes, bits);
+        int aesni = key.use_aesni;
+        for (int use_aesni = 0; use_aesni <= aesni; use_aesni++) {
+            key.use_aesni = use_aesni;
+            long aes_rounds = use_aesni ? rounds : rounds / 8;  // the portable code is much slower
+            double start_time = get_time_in_seconds();
+            for (long r = 0; r < aes_rounds; r++)
+                aes_ctr(&key, nonce, (u_int32_t)r, buf, block_size);
+            double aes_time = get_time_in_seconds() - start_time;
+            printf("AES-%d-CTR: %s, block size: %d, %.1f MB/s\n", bits, use_aesni > 1 ? "vaes" : (use_aesni ? "aesni" : "portable"),
+                   block_size, (double)aes_rounds * block_size / aes_time / (1 << 20));
+        }
+    }
+    free(buf);
+    return failed;
+}
+
+/*-----------METADATA------------*/
+
+int bench_metadata(int argc, char* argv[]) {
+    /*
+        * Create/write/delete churn with the block cache disabled, so every
+        * metadata write reaches the device, followed by a create/open/delete
+        * phase without file data
+        * Arguments: <immediate|operation|deferred> [iterations] [fs_number]
+    */
+    if (argc < 1) {
+        printf("Usage: bench metadata <immediate|operation|deferred> [iterations] [fs_number]\n");
+        return 1;
+    }
+    struct device_config_t config = {0};
+    config.io_mode = EMUFS_IO_FD;
+    config.sync_policy = EMUFS_SYNC_OPERATION;
+    if (strcmp(argv[0], "immediate") == 0)
+        config.sync_policy = EMUFS_SYNC_IMMEDIATE;
+    else if (strcmp(argv[0], "deferred") == 0)
+        config.sync_policy = EMUFS_SYNC_DEFERRED;
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    int fs_number = argc > 2 ? atoi(argv[2]) : 0;
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, MAX_BLOCKS, &config);
+    if (mnt == -1 || create_file_system(mnt, fs_number) == -1)
+        return 1;
+    int dir_handle = open_root(mnt);
+
+    struct cache_stats_t before, after;
+    cache_stats(mnt, &before);
+    double start_time = get_time_in_seconds();
+    run_file_scenario(dir_handle, iterations);
+    double elapsed = get_time_in_seconds() - start_time;
+    cache_stats(mnt, &after);
+
+    start_time = get_time_in_seconds();
+    for (int it = 0; it < iterations; it++) {
+        for (int f = 0; f < 4; f++)
+            emufs_create(dir_handle, (char*)bench_files[f], f % 2);
+        for (int f = 0; f < 4; f += 2)
+            emufs_close(open_file(dir_handle, (char*)bench_files[f]), 0);
+        for (int f = 0; f < 4; f++)
+            emufs_delete(dir_handle, (char*)bench_files[f]);
+    }
+    double namespace_time = get_time_in_seconds() - start_time;
+
+    long writes = after.device_writes - before.device_writes;
+    printf("\nSync policy: %s, iterations: %d, fs_number: %d\n", argv[0], iterations, fs_number);
+    printf("Device block writes: %ld (%.1f per iteration)\n", writes, (double)writes / iterations);
+    printf("Device block reads: %ld\n", after.device_reads - before.device_reads);
+    printf("Metadata time: %f seconds\n", elapsed);
+    printf("Namespace time: %f seconds\n", namespace_time);
+
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------JOURNAL------------*/
+
+typedef struct {
+    int dir_handle;
+    int id;
+    int num_ops;
+} journal_arg_t;
+
+void* journal_thread(void* arg) {
+    journal_arg_t* a = (journal_arg_t*)arg;
+    char name[MAX_ENTITY_NAME];
+    char buf[4096];
+
+    // Each operation is one durable transaction: its data, inode and bitmap blocks
+    entity_name(name, 'j', a->id);
+    int fd = open_file(a->dir_handle, name);
+    memset(buf, 'a' + a->id % 26, sizeof(buf));
+    for (int i = 0; i < a->num_ops; i++)
+        emufs_write(fd, buf, sizeof(buf));
+    emufs_close(fd, 0);
+    return NULL;
+}
+
+int bench_journal(int argc, char* argv[]) {
+    /*
+        * Durable appends with the write-ahead journal: every thread appends 4 KB
+        * writes to its own file, each write commits a transaction (extent format,
+        * 4 KB blocks). Group commit lets concurrent commits share one fdatasync
+        * Arguments: <threads> [ops per thread] [journal KB]
+    */
+    if (argc < 1) {
+        printf("Usage: bench journal <threads> [ops per thread] [journal KB]\n");
+        return 1;
+    }
+    int num_threads = atoi(argv[0]);
+    int ops_per_thread = argc > 1 ? atoi(argv[1]) : 500;
+    int journal_kb = argc > 2 ? atoi(argv[2]) : 16384;
+    struct device_config_t config = {4096, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, journal_kb * 1024};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+    int blocks = num_threads * ops_per_thread + 4096;
+    char name[MAX_ENTITY_NAME];
+
+    if (num_threads < 1 || entity_name(name, 'j', num_threads - 1) == -1) {
+        printf("Invalid thread count\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, blocks, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    for (int t = 0; t < num_threads; t++) {
+        entity_name(name, 'j', t);
+        emufs_create(root, name, 0);
+    }
+
+    pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    journal_arg_t* args = (journal_arg_t*)malloc(num_threads * sizeof(journal_arg_t));
+    struct journal_stats_t before, after;
+    journal_stats(mnt, &before);
+    double start_time = get_time_in_seconds();
+    for (int t = 0; t < num_threads; t++) {
+        args[t].dir_handle = root;
+        args[t].id = t;
+        args[t].num_ops = ops_per_thread;
+        pthread_create(&threads[t], NULL, journal_thread, &args[t]);
+    }
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    double elapsed = get_time_in_seconds() - start_time;
+    journal_stats(mnt, &after);
+
+    long ops = (long)num_threads * ops_per_thread;
+    long transactions = after.transactions - before.transactions;
+    long syncs = after.syncs - before.syncs;
+    printf("\nThreads: %d, ops per thread: %d, journal: %d KB\n", num_threads, ops_per_thread, journal_kb);
+    printf("Throughput: %.0f ops/s\n", ops / elapsed);
+    printf("Latency: %.1f us per op\n", elapsed / ops_per_thread * 1e6);
+    printf("Transactions: %ld, blocks: %ld\n", transactions, after.blocks - before.blocks);
+    printf("Syncs: %ld (%.2f transactions per sync), checkpoints: %ld\n", syncs,
+           syncs ? (double)transactions / syncs : 0.0, after.checkpoints - before.checkpoints);
+
+    free(threads);
+    free(args);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------ASYNC I/O------------*/
+
+void drop_page_cache(const char* path) {
+    // Writes the image back and evicts it from the page cache, so device reads are cold
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+int bench_aio(int argc, char* argv[]) {
+    /*
+        * Random 4 KB reads and writes of one large file through a small block cache
+        * (extent format, 4 KB blocks): emufs_read/emufs_write one block at a time
+        * against emufs_read_async/emufs_write_async with <depth> requests in flight.
+        * The image is evicted from the page cache before each pass. Synchronous writes only
+        * reach the write-back cache and the page cache, so the asynchronous ones, which go
+        * around the cache through the engine, are expected to be slower
+        * Arguments: <depth> [file MB] [ops]
+    */
+    if (argc < 1) {
+        printf("Usage: bench aio <depth> [file MB] [ops]\n");
+        return 1;
+    }
+    int depth = atoi(argv[0]);
+    int file_mb = argc > 1 ? atoi(argv[1]) : 64;
+    int num_ops = argc > 2 ? atoi(argv[2]) : 20000;
+    struct device_config_t config = {64, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+    int file_blocks = file_mb * 256;
+    char* buf;
+
+    if (depth < 1 || file_blocks < 1) {
+        printf("Invalid depth or file size\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, file_blocks + 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    emufs_create(root, "big", 0);
+    int fd = open_file(root, "big");
+    buf = (char*)malloc((size_t)depth * 4096);
+    memset(buf, 'x', 4096);
+    for (int b = 0; b < file_blocks; b++)
+        emufs_write(fd, buf, 4096);
+    flush_device(mnt);
+
+    int* targets = (int*)malloc(num_ops * sizeof(int));
+    struct emufs_aio_t** inflight = (struct emufs_aio_t**)calloc(depth, sizeof(struct emufs_aio_t*));
+    srand(42);
+    for (int i = 0; i < num_ops; i++)
+        targets[i] = rand() % file_blocks;
+
+    printf("\nFile: %d MB, ops: %d, cache: %d blocks, depth: %d, engine: %s\n",
+           file_mb, num_ops, config.cache_blocks, depth, aio_backend(mnt));
+    for (int write = 0; write < 2; write++) {
+        // Synchronous: one block at a time
+        int offset = file_blocks * 4096;
+        drop_page_cache(BENCH_DEVICE);
+        double start_time = get_time_in_seconds();
+        for (int i = 0; i < num_ops; i++) {
+            emufs_seek(fd, targets[i] * 4096 - offset);
+            if (write)
+                emufs_write(fd, buf, 4096);
+            else
+                emufs_read(fd, buf, 4096);
+            offset = targets[i] * 4096 + 4096;
+        }
+        flush_device(mnt);
+        double sync_time = get_time_in_seconds() - start_time;
+
+        // Asynchronous: keep <depth> requests in flight, each with its own buffer
+        drop_page_cache(BENCH_DEVICE);
+        start_time = get_time_in_seconds();
+        for (int i = 0; i < num_ops; i++) {
+            int slot = i % depth;
+            if (inflight[slot])
+                emufs_aio_wait(inflight[slot]);
+            emufs_seek(fd, targets[i] * 4096 - offset);
+            if (write)
+                inflight[slot] = emufs_write_async(fd, buf + (size_t)slot * 4096, 4096);
+            else
+                inflight[slot] = emufs_read_async(fd, buf + (size_t)slot * 4096, 4096);
+            offset = targets[i] * 4096 + 4096;
+        }
+        for (int slot = 0; slot < depth; slot++) {
+            if (inflight[slot])
+                emufs_aio_wait(inflight[slot]);
+            inflight[slot] = NULL;
+        }
+        flush_device(mnt);
+        double async_time = get_time_in_seconds() - start_time;
+
+        printf("%s: sync %.0f ops/s, async %.0f ops/s (%.2fx)\n", write ? "Write" : "Read",
+               num_ops / sync_time, num_ops / async_time, sync_time / async_time);
+    }
+
+    free(targets);
+    free(inflight);
+    free(buf);
+    emufs_close(fd, 0);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------READAHEAD------------*/
+
+int bench_readahead(int argc, char* argv[]) {
+    /*
+        * Sequential reads of one file in <chunk> byte reads against a single read of the
+        * whole file (extent format, 4 KB blocks, 256-block cache). The image is evicted
+        * from the page cache before each pass, so the blocks come from the device
+        * Arguments: <chunk> [file MB]
+    */
+    if (argc < 1) {
+        printf("Usage: bench readahead <chunk> [file MB]\n");
+        return 1;
+    }
+    int chunk = atoi(argv[0]);
+    int file_mb = argc > 1 ? atoi(argv[1]) : 64;
+    struct device_config_t config = {256, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+    int size = file_mb << 20;
+
+    if (chunk < 1 || file_mb < 1 || file_mb > 1024) {
+        printf("Invalid chunk or file size\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, file_mb * 256 + 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    emufs_create(root, "seq", 0);
+    char* buf = (char*)malloc(size);
+    memset(buf, 's', size);
+    int fd = open_file(root, "seq");
+    emufs_write(fd, buf, size);
+    emufs_close(fd, 0);
+    flush_device(mnt);
+
+    printf("\nFile: %d MB, chunk: %d bytes, engine: %s\n", file_mb, chunk, aio_backend(mnt));
+    double whole_time = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        int step = pass == 0 ? size : chunk;
+        struct readahead_stats_t before, after;
+
+        fd = open_file(root, "seq");
+        drop_page_cache(BENCH_DEVICE);
+        readahead_stats(mnt, &before);
+        double start_time = get_time_in_seconds();
+        for (int offset = 0; offset < size; offset += step)
+            emufs_read(fd, buf + offset, size - offset < step ? size - offset : step);
+        double elapsed = get_time_in_seconds() - start_time;
+        readahead_stats(mnt, &after);
+        emufs_close(fd, 0);
+
+        if (pass == 0) {
+            whole_time = elapsed;
+            printf("Whole file: %.1f MB/s\n", file_mb / elapsed);
+        } else {
+            printf("Chunks: %.1f MB/s (%.2fx of the whole file read)\n", file_mb / elapsed, whole_time / elapsed);
+            printf("Readahead: %ld batches, %ld blocks, %ld hits, %ld unused, %ld dropped\n",
+                   after.readaheads - before.readaheads, after.blocks - before.blocks,
+                   after.hits - before.hits, after.unused - before.unused, after.dropped - before.dropped);
+        }
+    }
+
+    free(buf);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+int bench_smallwrite(int argc, char* argv[]) {
+    /*
+        * Appends of <bytes> each to one file, written through one at a time against combined
+        * in the write buffer of the handle (extent format). The unbuffered pass follows each
+        * write with emufs_seek(fd, 0), which flushes the buffer
+        * Arguments: <bytes> [block size] [file KB]
+    */
+    if (argc < 1) {
+        printf("Usage: bench smallwrite <bytes> [block size] [file KB]\n");
+        return 1;
+    }
+    int bytes = atoi(argv[0]);
+    int block_size = argc > 1 ? atoi(argv[1]) : 4096;
+    int file_kb = argc > 2 ? atoi(argv[2]) : 1024;
+    struct device_config_t config = {256, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, block_size, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, block_size};
+    int size = file_kb << 10;
+
+    if (bytes < 1 || file_kb < 1 || file_kb > 65536 || block_size < BLOCKSIZE || block_size > MAX_BLOCKSIZE) {
+        printf("Invalid write size, block size or file size\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, (int)(2L * size / block_size) + 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    char* data = (char*)malloc(size);
+    char* check = (char*)malloc(size);
+    for (int i = 0; i < size; i++)
+        data[i] = 'a' + i % 26;
+
+    printf("\nFile: %d KB, writes: %d bytes, block size: %d\n", file_kb, bytes, block_size);
+    double unbuffered_time = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        char name[MAX_ENTITY_NAME];
+        entity_name(name, 'w', pass);
+        emufs_create(root, name, 0);
+        int fd = open_file(root, name);
+
+        double start_time = get_time_in_seconds();
+        for (int offset = 0; offset < size; offset += bytes) {
+            emufs_write(fd, data + offset, size - offset < bytes ? size - offset : bytes);
+            if (pass == 0)
+                emufs_seek(fd, 0);
+        }
+        emufs_close(fd, 0);
+        double elapsed = get_time_in_seconds() - start_time;
+
+        fd = open_file(root, name);
+        memset(check, 0, size);
+        emufs_read(fd, check, size);
+        emufs_close(fd, 0);
+        if (memcmp(check, data, size) != 0)
+            printf("Mismatch in the file written\n");
+
+        double writes = (double)((size + bytes - 1) / bytes);
+        if (pass == 0) {
+            unbuffered_time = elapsed;
+            printf("Unbuffered: %.0f writes/s\n", writes / elapsed);
+        } else
+            printf("Buffered: %.0f writes/s (%.2fx)\n", writes / elapsed, unbuffered_time / elapsed);
+    }
+
+    free(data);
+    free(check);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+int bench_aging(int argc, char* argv[]) {
+    /*
+        * <files> files appended to in turn, <bytes> per write, through handles open together
+        * (extent format, 4 KB blocks). Every other file is then deleted and written again, so
+        * the second half lands in the holes of an aged device. Reports the layout of the files
+        * (emufs_fragmentation) and a cold sequential read of all of them in 64 KB reads
+        * Arguments: <files> [file MB] [bytes]
+    */
+    if (argc < 1) {
+        printf("Usage: bench aging <files> [file MB] [bytes]\n");
+        return 1;
+    }
+    int files = atoi(argv[0]);
+    int file_mb = argc > 1 ? atoi(argv[1]) : 8;
+    int bytes = argc > 2 ? atoi(argv[2]) : 4096;
+    struct device_config_t config = {256, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+    int size = file_mb << 20;
+    int chunk = 65536;
+
+    if (files < 1 || files > 64 || file_mb < 1 || file_mb > 256 || bytes < 1 || bytes > size) {
+        printf("Invalid number of files, file size or write size\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, files * file_mb * 384 + 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    char* data = (char*)malloc(size);
+    char* buf = (char*)malloc(chunk);
+    int fds[64];
+    memset(data, 'g', size);
+
+    for (int round = 0; round < 2; round++) {
+        int first = round == 0 ? 0 : 1;
+        int step = round == 0 ? 1 : 2;
+        for (int i = first; i < files; i += step) {
+            char name[MAX_ENTITY_NAME];
+            entity_name(name, 'a', i);
+            if (round == 1)
+                emufs_delete(root, name);
+            emufs_create(root, name, 0);
+            fds[i] = open_file(root, name);
+        }
+        for (int offset = 0; offset < size; offset += bytes)
+            for (int i = first; i < files; i += step)
+                emufs_write(fds[i], data + offset, size - offset < bytes ? size - offset : bytes);
+        for (int i = first; i < files; i += step)
+            emufs_close(fds[i], 0);
+    }
+    flush_device(mnt);
+
+    struct fragmentation_t total = {0, 0, 0, 0};
+    for (int i = 0; i < files; i++) {
+        struct fragmentation_t report;
+        char name[MAX_ENTITY_NAME];
+        entity_name(name, 'a', i);
+        int fd = open_file(root, name);
+        emufs_fragmentation(fd, &report);
+        emufs_close(fd, 0);
+        total.blocks += report.blocks;
+        total.extents += report.extents;
+        total.backward += report.backward;
+        if (report.largest > total.largest)
+            total.largest = report.largest;
+    }
+
+    drop_page_cache(BENCH_DEVICE);
+    double start_time = get_time_in_seconds();
+    for (int i = 0; i < files; i++) {
+        char name[MAX_ENTITY_NAME];
+        entity_name(name, 'a', i);
+        int fd = open_file(root, name);
+        for (int offset = 0; offset < size; offset += chunk)
+            emufs_read(fd, buf, chunk);
+        emufs_close(fd, 0);
+    }
+    double elapsed = get_time_in_seconds() - start_time;
+
+    printf("\nFiles: %d of %d MB, writes: %d bytes\n", files, file_mb, bytes);
+    printf("Layout: %.1f extents per file, %.1f backward, longest run %ld blocks\n",
+           (double)total.extents / files, (double)total.backward / files, total.largest);
+    printf("Sequential read: %.1f MB/s\n", (double)files * file_mb / elapsed);
+
+    free(data);
+    free(buf);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+int bench_view(int argc, char* argv[]) {
+    /*
+        * A file held in a block cache large enough for all of it (extent format, 4 KB blocks),
+        * scanned in <chunk>-byte pieces by a reader that looks at one byte of every 64: copied
+        * out with emufs_read, then looked at in place through emufs_read_view. Each pass is
+        * run once to warm the cache before it is timed
+        * Arguments: <chunk> [file MB]
+    */
+    if (argc < 1) {
+        printf("Usage: bench view <chunk> [file MB]\n");
+        return 1;
+    }
+    int chunk = atoi(argv[0]);
+    int file_mb = argc > 1 ? atoi(argv[1]) : 16;
+    int size = file_mb << 20;
+
+    if (chunk < 1 || file_mb < 1 || file_mb > 256) {
+        printf("Invalid chunk or file size\n");
+        return 1;
+    }
+
+    struct device_config_t config = {size / 4096 + 1024, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, size / 4096 + 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int root = open_root(mnt);
+    char name[8] = "v";
+    char* data = (char*)malloc(size);
+    char* buf = (char*)malloc(chunk);
+    long expected = 0;
+    for (int i = 0; i < size; i++) {
+        data[i] = (char)(i * 7 + i / 4096);
+        if (i % 64 == 0)
+            expected += (unsigned char)data[i];
+    }
+    emufs_create(root, name, 0);
+    int fd = open_file(root, name);
+    emufs_write(fd, data, size);
+    emufs_close(fd, 0);
+
+    printf("\nFile: %d MB, chunk: %d bytes\n", file_mb, chunk);
+    double copy_time = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        double elapsed = 0;
+        long sum = 0;
+        for (int run = 0; run < 2; run++) {
+            fd = open_file(root, name);
+            sum = 0;
+            double start_time = get_time_in_seconds();
+            for (int offset = 0; offset < size; offset += chunk) {
+                int n = size - offset < chunk ? size - offset : chunk;
+                if (pass == 0) {
+                    emufs_read(fd, buf, n);
+                    for (int i = (64 - offset % 64) % 64; i < n; i += 64)
+                        sum += (unsigned char)buf[i];
+                } else {
+                    struct emufs_view_t* view = emufs_read_view(fd, n);
+                    if (!view)
+                        break;
+                    int at = offset;
+                    for (int s = 0; s < view->count; s++) {
+                        for (int i = (64 - at % 64) % 64; i < view->spans[s].size; i += 64)
+                            sum += (unsigned char)view->spans[s].data[i];
+                        at += view->spans[s].size;
+                    }
+                    emufs_release_view(view);
+                }
+            }
+            elapsed = get_time_in_seconds() - start_time;
+            emufs_close(fd, 0);
+        }
+        if (sum != expected)
+            printf("Checksum mismatch\n");
+
+        if (pass == 0) {
+            copy_time = elapsed;
+            printf("Copy: %.2f MB/s\n", file_mb / elapsed);
+        } else
+            printf("View: %.2f MB/s (%.2fx)\n", file_mb / elapsed, copy_time / elapsed);
+    }
+
+    struct cache_stats_t stats;
+    cache_stats(mnt, &stats);
+    printf("Block cache: %ld hits, %ld misses\n", stats.hits, stats.misses);
+
+    free(data);
+    free(buf);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+/*-----------OPEN INODES------------*/
+
+typedef struct {
+    int dir_handle;
+    int num_ops;
+    int write;              // 1: whole-block overwrites, 0: 64-byte reads
+    unsigned int seed;
+} inode_arg_t;
+
+void* inode_thread(void* arg) {
+    inode_arg_t* a = (inode_arg_t*)arg;
+    char buf[4096];
+    int fd = open_file(a->dir_handle, "file1");
+    int offset = 0;
+
+    memset(buf, 'i', sizeof(buf));
+    for (int i = 0; i < a->num_ops; i++) {
+        int target = a->write ? rand_r(&a->seed) % 64 * 4096 : rand_r(&a->seed) % (64 * 4096 - 64);
+        emufs_seek(fd, target - offset);
+        if (a->write)
+            emufs_write(fd, buf, 4096);
+        else
+            emufs_read(fd, buf, 64);
+        offset = target + (a->write ? 4096 : 64);
+    }
+    emufs_close(fd, 0);
+    return NULL;
+}
+
+int bench_inode(int argc, char* argv[]) {
+    /*
+        * Handles of several threads on one cached 256 KB file (extent format, 4 KB blocks, metadata
+        * written at the end of each operation): random 64-byte reads, then random overwrites of
+        * whole blocks, which change neither the size nor the blocks of the file
+        * Arguments: [threads] [operations per thread]
+    */
+    int num_threads = argc > 0 ? atoi(argv[0]) : 4;
+    int num_ops = argc > 1 ? atoi(argv[1]) : 200000;
+    struct device_config_t config = {256, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, 0, 4096};
+
+    if (num_threads < 1 || num_threads > 64 || num_ops < 1) {
+        printf("Invalid number of threads or operations\n");
+        return 1;
+    }
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, 4096, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return 1;
+    int dir_handle = open_root(mnt);
+    char* data = (char*)calloc(64, 4096);
+    emufs_create(dir_handle, "file1", 0);
+    int fd = open_file(dir_handle, "file1");
+    emufs_write(fd, data, 64 * 4096);
+    emufs_close(fd, 0);
+    free(data);
+
+    printf("\nThreads: %d, operations per thread: %d\n", num_threads, num_ops);
+    for (int write = 0; write < 2; write++) {
+        pthread_t threads[num_threads];
+        inode_arg_t args[num_threads];
+        double start_time = get_time_in_seconds();
+        for (int t = 0; t < num_threads; t++) {
+            args[t].dir_handle = dir_handle;
+            args[t].num_ops = num_ops;
+            args[t].write = write;
+            args[t].seed = t + 1;
+            pthread_create(&threads[t], NULL, inode_thread, &args[t]);
+        }
+        for (int t = 0; t < num_threads; t++)
+            pthread_join(threads[t], NULL);
+        double elapsed = get_time_in_seconds() - start_time;
+        printf("%s: %.0f ops/s\n", write ? "Overwrites" : "Reads", (double)num_threads * num_ops / elapsed);
+    }
+
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return 0;
+}
+
+double createmany_run(int batch, int num_files, int num_dirs) {
+    /*
+        * Builds num_dirs directories under the root of a new file system, each holding
+        * num_files files, either with one emufs_create per entry or with one emufs_create_many
+        * Return value: seconds taken, -1 on failure
+    */
+    struct device_config_t config = {1024, EMUFS_IO_FD, EMUFS_SYNC_OPERATION, 4096, 0};
+    struct fs_config_t fs_config = {EMUFS_FORMAT_EXTENT, num_dirs * (num_files + 1) + 16, 4096};
+    int count = num_dirs * (num_files + 1);
+
+    unlink(BENCH_DEVICE);
+    int mnt = opendevice_ex(BENCH_DEVICE, 1 << 16, &config);
+    if (mnt == -1 || create_file_system_ex(mnt, 0, &fs_config) == -1)
+        return -1;
+    int root = open_root(mnt);
+    char (*names)[MAX_ENTITY_NAME] = calloc(count, MAX_ENTITY_NAME);
+    struct emufs_create_t* entries = calloc(count, sizeof(struct emufs_create_t));
+    for (int d = 0, i = 0; d < num_dirs; d++) {
+        int dir_index = i;
+        entity_name(names[i], 'd', d);
+        entries[i] = (struct emufs_create_t){root, -1, names[i], 1, 0};
+        i++;
+        for (int f = 0; f < num_files; f++, i++) {
+            entity_name(names[i], 'f', f);
+            entries[i] = (struct emufs_create_t){root, dir_index, names[i], 0, 0};
+        }
+    }
+
+    int created = 0;
+    double start_time = get_time_in_seconds();
+    if (batch)
+        created = emufs_create_many(entries, count);
+    else {
+        for (int i = 0; i < count; i += num_files + 1) {
+            if (emufs_create(root, names[i], 1) == 1)
+                created++;
+            int dir = open_root(mnt);
+            change_dir(dir, names[i]);
+            for (int f = 1; f <= num_files; f++)
+                if (emufs_create(dir, names[i + f], 0) == 1)
+                    created++;
+            emufs_close(dir, 1);
+        }
+    }
+    double elapsed = get_time_in_seconds() - start_time;
+
+    free(entries);
+    free(names);
+    closedevice(mnt);
+    unlink(BENCH_DEVICE);
+    return created == count ? elapsed : -1;
+}
+
+int bench_createmany(int argc, char* argv[]) {
+    /*
+        * Creation of a tree of directories and files (extent format, 4 KB blocks, metadata
+        * written at the end of each operation): one emufs_create per entry against one
+        * emufs_create_many for the whole tree
+        * Arguments: [files per directory] [directories]
+    */
+    int num_files = argc > 0 ? atoi(argv[0]) : 256;
+    int num_dirs = argc > 1 ? atoi(argv[1]) : 16;
+
+    char name[MAX_ENTITY_NAME];
+
+    if (num_files < 0 || num_dirs < 1 || (long)num_dirs * (num_files + 1) > 1000000 ||
+        entity_name(name, 'd', num_dirs - 1) == -1 || entity_name(name, 'f', num_files) == -1) {
+        printf("Invalid number of files or directories\n");
+        return 1;
+    }
+
+    double loop_time = createmany_run(0, num_files, num_dirs);
+    double batch_time = createmany_run(1, num_files, num_dirs);
+    if (loop_time < 0 || batch_time < 0) {
+        printf("Creation failed\n");
+        return 1;
+    }
+    double entries = (double)num_dirs * (num_files + 1);
+    printf("\nDirectories: %d, files per directory: %d\n", num_dirs, num_files);
+    printf("Loop: %.0f entries/s\n", entries / loop_time);
+    printf("Batch: %.0f entries/s (%.2fx)\n", entries / batch_time, loop_time / batch_time);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <benchmark> [arguments]\n", argv[0]);
+        printf("Benchmarks: blockio, iomode, metadata, alloc, lookup, dirsize, handles, scale, blocksize, crypto, journal, aio, readahead, smallwrite, aging, view, inode, createmany\n");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "blockio") == 0)
+        return bench_blockio(argc - 2, argv + 2);
+    if (strcmp(argv[1], "iomode") == 0)
+        return bench_iomode(argc - 2, argv + 2);
+    if (strcmp(argv[1], "metadata") == 0)
+        return bench_metadata(argc - 2, argv + 2);
+    if (strcmp(argv[1], "alloc") == 0)
+        return bench_alloc(argc - 2, argv + 2);
+    if (strcmp(argv[1], "lookup") == 0)
+        return bench_lookup(argc - 2, argv + 2);
+    if (strcmp(argv[1], "dirsize") == 0)
+        return bench_dirsize(argc - 2, argv + 2);
+    if (strcmp(argv[1], "handles") == 0)
+        return bench_handles(argc - 2, argv + 2);
+    if (strcmp(argv[1], "scale") == 0)
+        return bench_scale(argc - 2, argv + 2);
+    if (strcmp(argv[1], "blocksize") == 0)
+        return bench_blocksize(argc - 2, argv + 2);
+    if (strcmp(argv[1], "crypto") == 0)
+        return bench_crypto(argc - 2, argv + 2);
+    if (strcmp(argv[1], "journal") == 0)
+        return bench_journal(argc - 2, argv + 2);
+    if (strcmp(argv[1], "aio") == 0)
+        return bench_aio(argc - 2, argv + 2);
+    if (strcmp(argv[1], "readahead") == 0)
+        return bench_readahead(argc - 2, argv + 2);
+    if (strcmp(argv[1], "smallwrite") == 0)
+        return bench_smallwrite(argc - 2, argv + 2);
+    if (strcmp(argv[1], "aging") == 0)
+        return bench_aging(argc - 2, argv + 2);
+    if (strcmp(argv[1], "view") == 0)
+        return bench_view(argc - 2, argv + 2);
+    if (strcmp(argv[1], "inode") == 0)
+        return bench_inode(argc - 2, argv + 2);
+    if (strcmp(argv[1], "createmany") == 0)
+        return bench_createmany(argc - 2, argv + 2);
+
+    printf("Unknown benchmark: %s\n", argv[1]);
+    return 1;
+}
@@ -2,20 +2,23 @@
 #include "emufs.h"
 
 struct mount_t mounts[MAX_MOUNT_POINTS];
+pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;	// protects the allocation of mount points
 
 
 /*-----------DEVICE------------*/
-int writeblock(int dev_fd, int block, char* buf)
+int writeblock(int dev_fd, int block, char* buf, int block_size)
 {
 	/*
-		* Writes the memory buffer to a block in the device
+		* Writes the memory buffer to a block (of block_size bytes) in the device
+		* Uses positional I/O, so concurrent calls on the same fd do not race on the file offset
 
 		* Return value: -1, error
 						 1, success
 	*/
 
-	int ret;
-	int offset;
+	ssize_t ret;
+	off_t offset;
+	int done = 0;
 
 	if(dev_fd < 0)
 	{
@@ -23,438 +26,5320 @@ int writeblock(int dev_fd, int block, char* buf)
 		return -1;
 	}
 
-	offset = block * BLOCKSIZE;
-	lseek(dev_fd, offset, SEEK_SET);
-	ret = write(dev_fd, buf, BLOCKSIZE);
-	if(ret != BLOCKSIZE)
+	offset = (off_t)block * block_size;
+	while(done < block_size)
 	{
-		printf("Error: Disk write error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, ret);
-		return -1;
+		ret = pwrite(dev_fd, buf + done, block_size - done, offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+		{
+			printf("Error: Disk write error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, (int)ret);
+			return -1;
+		}
+		done += ret;
 	}
 
 	return 1;
 }
 
-int readblock(int dev_fd, int block, char * buf)
+int readblock(int dev_fd, int block, char * buf, int block_size)
 {
 	/*
-		* Writes a block in the device to the memory buffer
+		* Writes a block (of block_size bytes) in the device to the memory buffer
+		* Uses positional I/O, so concurrent calls on the same fd do not race on the file offset
 
 		* Return value: -1, error
 						 1, success
 	*/
 
-	int ret;
-	int offset;
+	ssize_t ret;
+	off_t offset;
+	int done = 0;
 
 	if(dev_fd < 0)
 	{
 		printf("Devices not found\n");
 		return -1;
 	}
-	offset = block * BLOCKSIZE;
-	lseek(dev_fd, offset, SEEK_SET);
-	ret = read(dev_fd, buf, BLOCKSIZE);
-	if(ret != BLOCKSIZE)
+
+	offset = (off_t)block * block_size;
+	while(done < block_size)
 	{
-		printf("Error: Disk read error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, ret);
-		return -1;
+		ret = pread(dev_fd, buf + done, block_size - done, offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+		{
+			printf("Error: Disk read error. fd: %d. block: %d. buf: %p. ret: %d \n", dev_fd, block, buf, (int)ret);
+			return -1;
+		}
+		done += ret;
 	}
 
 	return 1;
 }
 
-
-/*-----------ENCRYPTION------------*/
-void encrypt(int key, char* buf, int size){
+int transfer_blocks(int dev_fd, int* blocks, char** bufs, int count, int block_size, int write_op)
+{
 	/*
-		* Encrypts the buffer of size 'size' using key
+		* Transfers count blocks between the device and the memory buffers
+		* Each run of physically adjacent blocks is submitted as one preadv/pwritev
+		* A run that is transferred only partially is redone block by block
+
+		* Return value: -1, error
+						 1, success
 	*/
 
-	for(int i=0; i<size; i++)
-		buf[i] = (buf[i]+key)%256;
-}
+	struct iovec iov[BLOCKS_PER_IO];
+	int ret = 1;
 
-void decrypt(int key, char* buf, int size){
-	/*
-		* Decrypts the buffer of size 'size' using key
-	*/
+	if(dev_fd < 0)
+	{
+		printf("Devices not found\n");
+		return -1;
+	}
 
-	for(int i=0; i<size; i++){
-		if(buf[i] < key)
-			buf[i] = 256 - key + buf[i];
-		else 
-			buf[i] = buf[i] - key;
+	for(int start=0, run; start<count; start+=run)
+	{
+		ssize_t done;
+
+		run = 1;
+		while(start + run < count && run < BLOCKS_PER_IO && blocks[start + run] == blocks[start] + run)
+			run++;
+
+		for(int i=0; i<run; i++)
+		{
+			iov[i].iov_base = bufs[start + i];
+			iov[i].iov_len = block_size;
+		}
+
+		if(write_op)
+			done = pwritev(dev_fd, iov, run, (off_t)blocks[start] * block_size);
+		else
+			done = preadv(dev_fd, iov, run, (off_t)blocks[start] * block_size);
+		if(done == (ssize_t)run * block_size)
+			continue;
+
+		for(int i=start; i<start+run; i++)
+			if((write_op ? writeblock(dev_fd, blocks[i], bufs[i], block_size) : readblock(dev_fd, blocks[i], bufs[i], block_size)) < 0)
+				ret = -1;
 	}
-}
 
+	return ret;
+}
 
-/*----------MOUNT-------*/
-int add_new_mount_point(int fd, char *device_name, int fs_number)
+int readblocks(int dev_fd, int* blocks, char** bufs, int count, int block_size)
 {
 	/*
-		* Creates a mount for the device
-		* Assigns an entry in the mount devices array
+		* Reads the blocks blocks[0..count-1] of the device into bufs[0..count-1]
 
-		* Return value: -1,									error
-						array entry index (mount point)		success
+		* Return value: -1, error
+						 1, success
 	*/
 
-	struct mount_t* mount_point = NULL;
+	return transfer_blocks(dev_fd, blocks, bufs, count, block_size, 0);
+}
 
-	for(int i=0; i<MAX_MOUNT_POINTS; i++)
-		if(mounts[i].device_fd <= 0 )
-		{
-			mount_point = &mounts[i];
-			mount_point->device_fd = fd;
-			strcpy(mount_point->device_name, device_name);
-			mount_point->fs_number = fs_number;
+int writeblocks(int dev_fd, int* blocks, char** bufs, int count, int block_size)
+{
+	/*
+		* Writes bufs[0..count-1] to the blocks blocks[0..count-1] of the device
 
-			return i;
-		}
+		* Return value: -1, error
+						 1, success
+	*/
 
-	return -1;
+	return transfer_blocks(dev_fd, blocks, bufs, count, block_size, 1);
 }
 
-
-int opendevice(char* device_name, int size)
+int device_readblock(struct mount_t* mount, int block, char* buf)
 {
 	/*
-		* Opens a device if it exists and do some consistency checks
-		* Creates a device of given size if not present
-		* Assigns a mount point
+		* Reads a block of a mounted device, from the mapping when the device is mapped
 
-		* Return value: -1, 			error
-						 mount point,	success	
-	*/			
+		* Return value: -1, error
+						 1, success
+	*/
 
-	int fd;
-	FILE* fp;
-	char tempBuf[BLOCKSIZE];
-	struct superblock_t* superblock;
-	int mount_point;
-	int key;
+	__sync_fetch_and_add(&mount->device_reads, 1);
+	if(!mount->device_map)
+		return readblock(mount->device_fd, block, buf, mount->block_size);
 
-	if(!device_name || strlen(device_name) == 0)
+	if(block < 0 || (size_t)(block + 1) * mount->block_size > mount->map_size)
 	{
-		printf("Error: Invalid device name \n");
+		printf("Error: Disk read error. block: %d is outside the mapped device \n", block);
 		return -1;
 	}
+	memcpy(buf, mount->device_map + (size_t)block * mount->block_size, mount->block_size);
+	return 1;
+}
+
+int device_writeblock(struct mount_t* mount, int block, char* buf)
+{
+	/*
+		* Writes a block of a mounted device, into the mapping when the device is mapped
+		* Mapped pages reach the device on msync (flush_device / closedevice_)
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	__sync_fetch_and_add(&mount->device_writes, 1);
+	if(!mount->device_map)
+		return writeblock(mount->device_fd, block, buf, mount->block_size);
 
-	if(size > MAX_BLOCKS || size < 3)
+	if(block < 0 || (size_t)(block + 1) * mount->block_size > mount->map_size)
 	{
-		printf("Error: Invalid disk size \n");
+		printf("Error: Disk write error. block: %d is outside the mapped device \n", block);
 		return -1;
 	}
+	memcpy(mount->device_map + (size_t)block * mount->block_size, buf, mount->block_size);
+	return 1;
+}
 
-	superblock = (struct superblock_t*)malloc(sizeof(struct superblock_t));
-	fp = fopen(device_name, "r");
-	if(!fp)
-	{
-		//	Creating the device
-		printf("[%s] Creating the disk image \n", device_name);
-
-		superblock->fs_number =  -1; 	//	No fs in the disk
-		strcpy(superblock->device_name, device_name);
-		superblock->disk_size = size;
-		superblock->magic_number = MAGIC_NUMBER;	
-
-		fp = fopen(device_name, "w+");
-		if(!fp)
-		{
-			printf("Error : Unable to create the device. \n");
-			free(superblock);
-			return -1;
-		}
-		fd = fileno(fp);
+int device_readblocks(struct mount_t* mount, int* blocks, char** bufs, int count)
+{
+	/*
+		* Reads several blocks of a mounted device (see readblocks)
 
-		// Make size of the disk as the total size
-		// printf("Current offset: %ld \n", lseek( fd, 0, SEEK_CUR ));
-		fseek(fp, size * BLOCKSIZE, SEEK_SET);
-		fputc('\0', fp);
-		fseek(fp, 0, SEEK_SET);
+		* Return value: -1, error
+						 1, success
+	*/
 
-		// Allocating super block on the disk
-		memcpy(tempBuf, superblock, sizeof(struct superblock_t));
-		writeblock(fd, 0, tempBuf);
+	int ret = 1;
 
-		printf("[%s] Disk image is successfully created \n", device_name);
-	}
-	else
+	if(!mount->device_map)
 	{
-		fclose(fp);
-		fd = open(device_name, O_RDWR);
+		__sync_fetch_and_add(&mount->device_reads, count);
+		return readblocks(mount->device_fd, blocks, bufs, count, mount->block_size);
+	}
 
-		readblock(fd, 0, tempBuf);
-		memcpy(superblock, tempBuf, sizeof(struct superblock_t));
-		if(superblock->fs_number==EMUFS_ENCRYPTED){
-			printf("Input key: ");
-			scanf("%d",&key);
-			/*
-				Decrypt Here
-			*/
-			decrypt(key, (char *)&superblock->magic_number, sizeof(superblock->magic_number));
-		}
-		if(superblock->magic_number != MAGIC_NUMBER || superblock->disk_size < 3 || superblock->disk_size > MAX_BLOCKS)
-		{
-			printf("%d,%d,%d",superblock->magic_number,superblock->disk_size,superblock->disk_size);
-			printf("Error: Inconsistent super block on device. \n");
-			free(superblock);
-			return -1;
-		}
-		printf("[%s] Disk opened \n", device_name);
+	for(int i=0; i<count; i++)
+		if(device_readblock(mount, blocks[i], bufs[i]) < 0)
+			ret = -1;
+	return ret;
+}
 
-		if(superblock->fs_number == -1)
-			printf("[%s] File system found in the disk \n", device_name);
-		else
-			printf("[%s] File system found. fs_number: %d \n", device_name, superblock->fs_number);
-		
-	}	
+int device_writeblocks(struct mount_t* mount, int* blocks, char** bufs, int count)
+{
+	/*
+		* Writes several blocks of a mounted device (see writeblocks)
 
-	mount_point = add_new_mount_point(fd, device_name, superblock->fs_number);
-	if(superblock->fs_number==1)
-		mounts[mount_point].key=key;
+		* Return value: -1, error
+						 1, success
+	*/
 
-	printf("[%s] Disk successfully mounted \n", device_name);
-	free(superblock);
+	int ret = 1;
 
-	return mount_point;	
-}
+	if(!mount->device_map)
+	{
+		__sync_fetch_and_add(&mount->device_writes, count);
+		return writeblocks(mount->device_fd, blocks, bufs, count, mount->block_size);
+	}
 
+	for(int i=0; i<count; i++)
+		if(device_writeblock(mount, blocks[i], bufs[i]) < 0)
+			ret = -1;
+	return ret;
+}
 
-int closedevice_(int mount_point)
+int map_device(struct mount_t* mount, int disk_size)
 {
 	/*
-		* Closes a device
+		* Maps the first disk_size blocks (of the block size of the mount) of the device image into memory
 
 		* Return value: -1, error
 						 1, success
 	*/
 
-	char device_name[20];
+	struct stat st;
+	size_t length = (size_t)disk_size * mount->block_size;
+	void* map;
 
-	if(mounts[mount_point].device_fd < 0)
-	{
-		printf("Error: Devices not found\n");
+	if(fstat(mount->device_fd, &st) < 0 || (size_t)st.st_size < length)
 		return -1;
-	}
-
-	strcpy(device_name, mounts[mount_point].device_name);
-	close(mounts[mount_point].device_fd);
 
-	mounts[mount_point].device_fd = -1;
-	strcpy(mounts[mount_point].device_name, "\0");
-	mounts[mount_point].fs_number = -1;
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, mount->device_fd, 0);
+	if(map == MAP_FAILED)
+		return -1;
 
-	printf("[%s] Device closed \n", device_name);
+	mount->device_map = (char*)map;
+	mount->map_size = length;
 	return 1;
 }
 
-void update_mount(int mount_point, int fs_number){
+int sync_device(struct mount_t* mount)
+{
 	/*
-		* Update the mount point with the file system number
-		* Prompts for key if its an encrypted file system
+		* Writes the dirty pages of a mapped device back to the image
+
+		* Return value: -1, error
+						 1, success
 	*/
 
-	int key;
-	mounts[mount_point].fs_number = fs_number;
-	if(fs_number == EMUFS_ENCRYPTED){
-		printf("Input key: ");
-		scanf("%d",&key);
-		mounts[mount_point].key=key;
-	}
+	if(!mount->device_map)
+		return 1;
+	return msync(mount->device_map, mount->map_size, MS_SYNC) < 0 ? -1 : 1;
 }
 
-void mount_dump(void)
+
+/*-----------BLOCK CACHE------------*/
+int cache_init(struct block_cache_t* cache, int capacity, int block_size)
 {
 	/*
-		* Prints summary of mount points
+		* Sets up an empty cache holding up to 'capacity' blocks of block_size bytes
+		* All the entries start on the LRU list as free entries
+
+		* Return value: -1, error
+						 1, success
 	*/
 
-	struct mount_t* mount_point;
+	memset(cache, 0, sizeof(struct block_cache_t));
+	cache->lru.lru_prev = cache->lru.lru_next = &cache->lru;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->filled, NULL);
+	if(capacity <= 0)
+		return 1;
 
-	printf("\n%-12s %-20s %-15s %-10s %-20s \n", "MOUNT-POINT", "DEVICE-NAME", "DEVICE-NUMBER", "FS-NUMBER", "FS-NAME");
-	for(int i=0; i< MAX_MOUNT_POINTS; i++)
+	cache->num_buckets = 1;
+	while(cache->num_buckets < capacity)
+		cache->num_buckets <<= 1;
+
+	cache->entries = (struct cache_entry_t*)calloc(capacity, sizeof(struct cache_entry_t));
+	cache->buckets = (struct cache_entry_t**)calloc(cache->num_buckets, sizeof(struct cache_entry_t*));
+	cache->pool = (char*)malloc((size_t)capacity * block_size);
+	if(!cache->entries || !cache->buckets || !cache->pool)
 	{
-		mount_point = mounts + i;
-		if(mount_point->device_fd <= 0)
-			continue;
+		free(cache->entries);
+		free(cache->buckets);
+		free(cache->pool);
+		cache->entries = NULL;
+		cache->buckets = NULL;
+		cache->pool = NULL;
+		return -1;
+	}
 
-		if(mount_point->device_fd > 0)
-			printf("%-12d %-20s %-15d %-10d %-20s\n", 
-					i, mount_point->device_name, mount_point->device_fd, mount_point->fs_number, 
-					mount_point->fs_number == EMUFS_NON_ENCRYPTED ? "emufs non-encrypted" : (mount_point->fs_number == EMUFS_ENCRYPTED ? "emufs encrypted" : "Unknown file system"));
+	cache->capacity = capacity;
+	for(int i=0; i<capacity; i++)
+	{
+		struct cache_entry_t* entry = &cache->entries[i];
+		entry->blocknum = -1;
+		entry->data = cache->pool + (size_t)i * block_size;
+		entry->lru_prev = cache->lru.lru_prev;
+		entry->lru_next = &cache->lru;
+		cache->lru.lru_prev->lru_next = entry;
+		cache->lru.lru_prev = entry;
 	}
+	return 1;
 }
 
-void read_superblock(int mount_point, struct superblock_t *superblock){
-	/*	
-		* Reads the superblock of the device
-		* If its an encrypted system, decrypts the magic number after reading
+void cache_destroy(struct block_cache_t* cache)
+{
+	/*
+		* Releases the memory of the cache. Dirty blocks must be flushed before.
 	*/
 
-	char tempBuf[BLOCKSIZE];
-	readblock(mounts[mount_point].device_fd, 0, tempBuf);
-	memcpy(superblock, tempBuf, sizeof(struct superblock_t));
-
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		decrypt(mounts[mount_point].key, (char*)&superblock->magic_number, sizeof(superblock->magic_number));
+	while(cache->spill)
+	{
+		struct cache_entry_t* entry = cache->spill;
+		cache->spill = entry->spill_next;
+		free(entry);
+	}
+	free(cache->entries);
+	free(cache->buckets);
+	free(cache->pool);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->filled);
+	memset(cache, 0, sizeof(struct block_cache_t));
 }
 
-void write_superblock(int mount_point, struct superblock_t *superblock){
-	/*
-		* Updates the superblock of the device
-		* If its an encrypted system, encrypts the magic number before writing
-	*/
-	char tempBuf[BLOCKSIZE];
-	memcpy(tempBuf, superblock, sizeof(struct superblock_t));
-
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		encrypt(mounts[mount_point].key, (char*)&superblock->magic_number, sizeof(superblock->magic_number));
+unsigned int cache_bucket(struct block_cache_t* cache, int block)
+{
+	return ((unsigned int)block * 2654435761u) & (cache->num_buckets - 1);
+}
 
-	writeblock(mounts[mount_point].device_fd, 0, tempBuf);
+struct cache_entry_t* cache_lookup(struct block_cache_t* cache, int block)
+{
+	struct cache_entry_t* entry = cache->buckets[cache_bucket(cache, block)];
+	while(entry && entry->blocknum != block)
+		entry = entry->hash_next;
+	return entry;
 }
 
-int alloc_inode(int mount_point){
+struct cache_entry_t* cache_lookup_ready(struct block_cache_t* cache, int block)
+{
 	/*
-		* Checks if there are any free inodes
-		* Update the inode bitmap and used_inodes 
-		
-		* Return value: -1,				error
-						 inode number, 	success
+		* Looks the block up, waiting for a read of it or a write back of its entry to complete
+		  (the cache lock is released meanwhile). Not for done functions, which run on the
+		  readahead's thread, nor while holding entries that are filling
 	*/
-	struct superblock_t superblock;
-	read_superblock(mount_point, &superblock);
-	for(int i=0; i<MAX_INODES; i++)
+
+	struct cache_entry_t* entry = cache_lookup(cache, block);
+	while(entry && (entry->filling || entry->writing))
 	{
-		if(superblock.inode_bitmap[i] == UNUSED){
-			superblock.inode_bitmap[i] = USED;
-			superblock.used_inodes++;
-			write_superblock(mount_point, &superblock);
-			return i;
-		}
+		pthread_cond_wait(&cache->filled, &cache->lock);
+		entry = cache_lookup(cache, block);
 	}
-	return -1;
+	return entry;
 }
 
-void free_inode(int mount_point, int inodenum){
-	/*
-		* Updates the inode bitmap and used_inodes in the superblock
-	*/
-	struct superblock_t superblock;
-	read_superblock(mount_point, &superblock);
-	if(superblock.inode_bitmap[inodenum] == USED)
-	{
-		superblock.inode_bitmap[inodenum] = UNUSED;
-		superblock.used_inodes--;
-		write_superblock(mount_point, &superblock);
-	}
+void cache_unhash(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	struct cache_entry_t** link = &cache->buckets[cache_bucket(cache, entry->blocknum)];
+	while(*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+	entry->hash_next = NULL;
 }
 
-void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr){
-	/*
-		* Reads the metadata in block 2 or 3
-		* Decrypts the metadata block if its an encrypted system
-		* Reads the inode entry from the metadata block into the memory buffer
-	*/
+void cache_unlink(struct cache_entry_t* entry)
+{
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+void cache_link_head(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	entry->lru_prev = &cache->lru;
+	entry->lru_next = cache->lru.lru_next;
+	cache->lru.lru_next->lru_prev = entry;
+	cache->lru.lru_next = entry;
+}
+
+void cache_link_tail(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	entry->lru_next = &cache->lru;
+	entry->lru_prev = cache->lru.lru_prev;
+	cache->lru.lru_prev->lru_next = entry;
+	cache->lru.lru_prev = entry;
+}
+
+void cache_touch(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	/*
+		* Moves the entry to the head (most recently used end) of the LRU list
+	*/
+
+	cache_unlink(entry);
+	cache_link_head(cache, entry);
+}
+
+void cache_release(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	/*
+		* Puts a free entry (not on any hash chain or the LRU list) at the tail of the LRU list,
+		  where free entries are reused first; a spilled entry is freed
+	*/
+
+	if(entry->spilled)
+	{
+		struct cache_entry_t** link = &cache->spill;
+		while(*link != entry)
+			link = &(*link)->spill_next;
+		*link = entry->spill_next;
+		cache->spilled--;
+		free(entry);
+		return;
+	}
+	entry->blocknum = -1;
+	entry->dirty = 0;
+	entry->prefetched = 0;
+	cache_link_tail(cache, entry);
+}
+
+struct cache_entry_t* cache_evict(struct mount_t* mount)
+{
+	/*
+		* Takes the least recently used entry out of the cache
+		* Writes it back to the device first if it is dirty, with the cache lock released:
+		  the entry is kept off the LRU list and marked writing, so lookups of its block wait
+		  for it. The caller looks its own block up again afterwards, it may be cached by now
+		* Blocks pinned by an open journal transaction or a read view are skipped
+		* A spilled entry is freed instead of being reused, and the search goes on
+
+		* Return value: NULL,	error (write back failed, or every block is pinned)
+						 entry,	success (free entry, not on any hash chain, still on the LRU list)
+	*/
+
+	struct block_cache_t* cache = &mount->cache;
+	struct cache_entry_t* entry;
+
+	while(1)
+	{
+		entry = cache->lru.lru_prev;
+		while(entry != &cache->lru && (entry->pins || entry->views))
+			entry = entry->lru_prev;
+		if(entry == &cache->lru)
+			return NULL;
+		if(entry->blocknum < 0)
+			return entry;
+
+		if(entry->dirty)
+		{
+			int ret;
+
+			cache_unlink(entry);
+			entry->writing = 1;
+			cache->writing++;
+			pthread_mutex_unlock(&cache->lock);
+			ret = device_writeblock(mount, entry->blocknum, entry->data);
+			pthread_mutex_lock(&cache->lock);
+			entry->writing = 0;
+			cache->writing--;
+			pthread_cond_broadcast(&cache->filled);
+			cache_link_tail(cache, entry);
+			if(ret < 0)
+				return NULL;
+			entry->dirty = 0;
+			cache->writebacks++;
+		}
+
+		cache_unhash(cache, entry);
+		if(entry->prefetched)
+			cache->prefetch_unused++;
+		entry->prefetched = 0;
+		entry->blocknum = -1;
+		cache->evictions++;
+		if(!entry->spilled)
+			return entry;
+		cache_unlink(entry);
+		cache_release(cache, entry);
+	}
+}
+
+struct cache_entry_t* cache_spill(struct block_cache_t* cache, int block_size)
+{
+	/*
+		* Allocates an entry past the capacity of the cache, for a write that finds every entry
+		  pinned by journal transactions or read views: the write neither waits for a commit
+		  nor fails for lack of room. The cache shrinks back as spilled entries are evicted
+
+		* Return value: NULL,	out of memory
+						 entry,	success (free entry, not on any hash chain or the LRU list)
+	*/
+
+	struct cache_entry_t* entry = (struct cache_entry_t*)calloc(1, sizeof(struct cache_entry_t) + block_size);
+
+	if(!entry)
+		return NULL;
+	entry->blocknum = -1;
+	entry->data = (char*)(entry + 1);
+	entry->lru_next = entry;			// Linked to itself, so that cache_insert can unlink it
+	entry->lru_prev = entry;
+	entry->spilled = 1;
+	entry->spill_next = cache->spill;
+	cache->spill = entry;
+	cache->spilled++;
+	return entry;
+}
+
+void cache_hash(struct block_cache_t* cache, struct cache_entry_t* entry, int block)
+{
+	unsigned int bucket = cache_bucket(cache, block);
+
+	entry->blocknum = block;
+	entry->prefetched = 0;
+	entry->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+}
+
+void cache_insert(struct block_cache_t* cache, struct cache_entry_t* entry, int block)
+{
+	cache_hash(cache, entry, block);
+	cache_touch(cache, entry);
+}
+
+void cache_claim(struct block_cache_t* cache, struct cache_entry_t* entry, int block)
+{
+	/*
+		* Hashes a free entry to the block, off the LRU list and filling: the block is read
+		  into it with the cache lock released, and lookups of the block wait for it
+	*/
+
+	cache_unlink(entry);
+	cache_hash(cache, entry, block);
+	entry->filling = 1;
+	entry->stale = 0;
+}
+
+int cache_publish(struct block_cache_t* cache, struct cache_entry_t* entry, int read_ok)
+{
+	/*
+		* Ends the filling of a claimed entry: it goes on the LRU list, or is freed if the read
+		  failed or the block was written around the cache meanwhile. The caller wakes up
+		  the lookups waiting (cache->filled)
+
+		* Return value: 0, entry freed
+						1, block cached
+	*/
+
+	entry->filling = 0;
+	if(read_ok && !entry->stale)
+	{
+		cache_link_head(cache, entry);
+		return 1;
+	}
+	cache_unhash(cache, entry);
+	cache_release(cache, entry);
+	return 0;
+}
+
+void cache_detach(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	/*
+		* Takes an entry with read views off its hash chain and the LRU list: the block it held
+		  is written or dropped, the views keep the data until the last one frees the entry
+	*/
+
+	cache_unhash(cache, entry);
+	cache_unlink(entry);
+	if(entry->prefetched)
+		cache->prefetch_unused++;
+	entry->dirty = 0;
+	entry->pins = 0;
+	entry->prefetched = 0;
+	entry->detached = 1;
+}
+
+int cache_readblock(int mount_point, int block, char* buf)
+{
+	/*
+		* Reads a block of the mounted device through the block cache
+		* On a miss the least recently used block is evicted to make room and claimed
+		  (cache_claim), and the device is read with the cache lock released; when every
+		  entry is pinned the block is read from the device without being cached
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct block_cache_t* cache = &mount->cache;
+	struct cache_entry_t* entry;
+	int ret = 1;
+
+	if(cache->capacity == 0)
+		return device_readblock(mount, block, buf);
+
+	pthread_mutex_lock(&cache->lock);
+	while(1)
+	{
+		entry = cache_lookup_ready(cache, block);
+		if(entry)
+		{
+			cache_hit(cache, entry);
+			cache_touch(cache, entry);
+			memcpy(buf, entry->data, mount->block_size);
+			break;
+		}
+
+		entry = cache_evict(mount);
+		if(entry && cache_lookup(cache, block))
+		{
+			// Cached while the victim was written back, which stays free
+			continue;
+		}
+		cache->misses++;
+		if(entry)
+			cache_claim(cache, entry, block);
+		pthread_mutex_unlock(&cache->lock);
+		ret = device_readblock(mount, block, entry ? entry->data : buf);
+		pthread_mutex_lock(&cache->lock);
+		if(entry)
+		{
+			if(ret > 0)
+				memcpy(buf, entry->data, mount->block_size);
+			cache_publish(cache, entry, ret > 0);
+			pthread_cond_broadcast(&cache->filled);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_store(struct mount_t* mount, int block, char* buf)
+{
+	/*
+		* Puts a dirty copy of the block into the cache. The cache lock must be held.
+		* The whole block is overwritten, so a miss does not read the device
+		* With a journal the block is pinned until the transaction of the thread commits
+		* When every entry is pinned the block goes into a spilled entry (cache_spill)
+
+		* Return value: -1, error (out of memory)
+						 1, success
+	*/
+
+	struct block_cache_t* cache = &mount->cache;
+	struct cache_entry_t* entry = cache_lookup_ready(cache, block);
+	struct cache_entry_t* viewed = NULL;
+
+	if(entry && entry->views)
+	{
+		// Read views keep the old data: the block moves to another entry
+		viewed = entry;
+		entry = NULL;
+	}
+	if(entry)
+		cache_touch(cache, entry);
+	else
+	{
+		entry = cache_evict(mount);
+		if(entry && (cache_lookup(cache, block) != viewed || (viewed && !viewed->views)))
+		{
+			// The block changed while the victim was written back, which stays free
+			return cache_store(mount, block, buf);
+		}
+		if(!entry)
+			entry = cache_spill(cache, mount->block_size);
+		if(!entry)
+			return -1;
+		if(viewed)
+		{
+			entry->pins = viewed->pins;
+			entry->pin_tid = viewed->pin_tid;
+			cache_detach(cache, viewed);
+		}
+		cache_insert(cache, entry, block);
+	}
+
+	memcpy(entry->data, buf, mount->block_size);
+	entry->dirty = 1;
+	entry->prefetched = 0;
+	if(mount->journal)
+		journal_pin(mount, entry);
+	return 1;
+}
+
+int cache_writeblock(int mount_point, int block, char* buf)
+{
+	/*
+		* Writes a block of the mounted device into the block cache
+		* The block only reaches the device when it is evicted or flushed
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	int ret;
+
+	if(mount->cache.capacity == 0)
+		return device_writeblock(mount, block, buf);
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->cache.lock);
+	ret = cache_store(mount, block, buf);
+	pthread_mutex_unlock(&mount->cache.lock);
+	return ret;
+}
+
+int cache_readblocks(int mount_point, int* blocks, char** bufs, int count)
+{
+	/*
+		* Reads several blocks of the mounted device through the block cache
+		* The misses are claimed (cache_claim) and read from the device with a single
+		  readblocks call, with the cache lock released
+		* Misses that find no room (every entry pinned) are read without being cached
+		* Blocks that are being read or written back by another thread (or twice in this
+		  call) are read one by one at the end: waiting for them while holding claimed
+		  entries could deadlock with a thread waiting for those
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct block_cache_t* cache = &mount->cache;
+	struct cache_entry_t* entry;
+	struct cache_entry_t* claimed[count > 0 ? count : 1];	// NULL: read into the caller's buffer
+	int miss_blocks[count > 0 ? count : 1];
+	char* miss_bufs[count > 0 ? count : 1];
+	int miss_index[count > 0 ? count : 1];
+	int busy[count > 0 ? count : 1];
+	int num_misses = 0;
+	int num_busy = 0;
+	int ret = 1;
+
+	if(count <= 0)
+		return 1;
+	if(cache->capacity == 0)
+		return device_readblocks(mount, blocks, bufs, count);
+
+	pthread_mutex_lock(&cache->lock);
+	for(int i=0; i<count; i++)
+	{
+		entry = cache_lookup(cache, blocks[i]);
+		if(entry && (entry->filling || entry->writing))
+		{
+			busy[num_busy++] = i;
+			continue;
+		}
+		if(entry)
+		{
+			cache_hit(cache, entry);
+			cache_touch(cache, entry);
+			memcpy(bufs[i], entry->data, mount->block_size);
+			continue;
+		}
+
+		entry = cache_evict(mount);
+		if(entry && cache_lookup(cache, blocks[i]))
+		{
+			// Cached while the victim was written back, which stays free
+			busy[num_busy++] = i;
+			continue;
+		}
+		cache->misses++;
+		if(entry)
+			cache_claim(cache, entry, blocks[i]);
+		claimed[num_misses] = entry;
+		miss_blocks[num_misses] = blocks[i];
+		miss_bufs[num_misses] = entry ? entry->data : bufs[i];
+		miss_index[num_misses++] = i;
+	}
+
+	if(num_misses)
+	{
+		pthread_mutex_unlock(&cache->lock);
+		ret = device_readblocks(mount, miss_blocks, miss_bufs, num_misses);
+		pthread_mutex_lock(&cache->lock);
+		for(int i=0; i<num_misses; i++)
+		{
+			if(!claimed[i])
+				continue;
+			if(ret > 0)
+				memcpy(bufs[miss_index[i]], claimed[i]->data, mount->block_size);
+			cache_publish(cache, claimed[i], ret > 0);
+		}
+		pthread_cond_broadcast(&cache->filled);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	for(int i=0; ret > 0 && i<num_busy; i++)
+		ret = cache_readblock(mount_point, blocks[busy[i]], bufs[busy[i]]);
+	return ret;
+}
+
+int cache_writeblocks(int mount_point, int* blocks, char** bufs, int count)
+{
+	/*
+		* Writes several blocks of the mounted device into the block cache
+		* Without a cache the blocks go to the device with a single writeblocks call
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	int ret = 1;
+
+	if(mount->cache.capacity == 0)
+		return device_writeblocks(mount, blocks, bufs, count);
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->cache.lock);
+	for(int i=0; i<count; i++)
+		if(cache_store(mount, blocks[i], bufs[i]) < 0)
+			ret = -1;
+	pthread_mutex_unlock(&mount->cache.lock);
+	return ret;
+}
+
+int cache_peekblock(int mount_point, int block, char* buf)
+{
+	/*
+		* Copies the block from the cache if it is there, without reading the device
+
+		* Return value: 0, not cached
+						1, copied
+	*/
+
+	struct block_cache_t* cache = &mounts[mount_point].cache;
+	struct cache_entry_t* entry;
+
+	if(cache->capacity == 0)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = cache_lookup_ready(cache, block);
+	if(entry)
+	{
+		cache_hit(cache, entry);
+		memcpy(buf, entry->data, mounts[mount_point].block_size);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return entry != NULL;
+}
+
+void cache_discard(int mount_point, int block, int keep_dirty)
+{
+	/*
+		* Drops the cached copy of a block that is written to the device directly
+		* A pinned block is kept, and a dirty one too if keep_dirty is set (it is newer
+		  than the write that went around the cache)
+		* A read of the block in flight is marked stale instead (this runs in done
+		  functions, which must not wait for a readahead), so what it read is not cached
+		* The write back of an evicted dirty copy in flight is waited for, so that it does not
+		  land after the write around the cache; with keep_dirty it is newer and is left alone
+		* An entry with read views is detached, they keep the data they point to
+	*/
+
+	struct block_cache_t* cache = &mounts[mount_point].cache;
+	struct cache_entry_t* entry;
+
+	if(cache->capacity == 0)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = cache_lookup(cache, block);
+	while(entry && entry->writing && !keep_dirty)
+	{
+		pthread_cond_wait(&cache->filled, &cache->lock);
+		entry = cache_lookup(cache, block);
+	}
+	if(entry && entry->filling)
+		entry->stale = 1;
+	else if(entry && entry->views && !entry->pins && !(keep_dirty && entry->dirty))
+		cache_detach(cache, entry);
+	else if(entry && !entry->pins && !(keep_dirty && entry->dirty))
+	{
+		if(entry->prefetched)
+			cache->prefetch_unused++;
+		cache_unhash(cache, entry);
+		cache_unlink(entry);
+		cache_release(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_hit(struct block_cache_t* cache, struct cache_entry_t* entry)
+{
+	/*
+		* Counts a lookup served by the entry, and the first use of a read ahead block
+	*/
+
+	cache->hits++;
+	if(entry->prefetched)
+	{
+		cache->prefetch_hits++;
+		entry->prefetched = 0;
+	}
+}
+
+int cache_prefetch(int mount_point, int* blocks, int count)
+{
+	/*
+		* Readahead: reads the blocks that are not cached with the asynchronous engine,
+		  straight into entries evicted for them. The entries are hashed but kept off the
+		  LRU list while filling: a lookup of the block waits for the read instead of
+		  reading it again, and cache_fill puts them on the LRU list when it completes
+		* Each run of physically consecutive blocks is read with one request
+		* At most half the cache is read ahead by one call
+
+		* Return value: number of leading blocks handled (submitted, cached already, or all of
+						 them when there is no cache or engine), less when they do not fit
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct block_cache_t* cache = &mount->cache;
+	struct aio_request_t* requests[count > 0 ? count : 1];
+	struct prefetch_t* prefetch = NULL;
+	struct cache_entry_t* entry;
+	int n = 0, blocks_read = 0, handled = 0;
+
+	if(cache->capacity == 0 || !aio_engine(mount_point))
+		return count;
+	if(count > cache->capacity / 2)
+		count = cache->capacity / 2;
+
+	pthread_mutex_lock(&cache->lock);
+	for(; handled < count; handled++)
+	{
+		int block = blocks[handled];
+
+		// Close the request unless the block extends its run
+		if(prefetch && (block != prefetch->request.blocknum + prefetch->request.count ||
+						prefetch->request.count == BLOCKS_PER_IO || cache_lookup(cache, block)))
+		{
+			requests[n++] = &prefetch->request;
+			prefetch = NULL;
+		}
+		if(cache_lookup(cache, block))
+			continue;
+		entry = cache_evict(mount);
+		if(!entry)
+			break;
+		if(cache_lookup(cache, block))
+		{
+			// Cached while the victim was written back, which stays free
+			continue;
+		}
+		if(!prefetch)
+		{
+			prefetch = (struct prefetch_t*)calloc(1, sizeof(struct prefetch_t));
+			if(!prefetch)
+				break;
+			prefetch->mount = mount;
+			prefetch->request.op = AIO_READ;
+			prefetch->request.blocknum = block;
+			prefetch->request.iovs = prefetch->iovs;
+			prefetch->request.done = cache_fill;
+		}
+		cache_claim(cache, entry, block);
+		prefetch->entries[prefetch->request.count] = entry;
+		prefetch->iovs[prefetch->request.count].iov_base = entry->data;
+		prefetch->iovs[prefetch->request.count].iov_len = mount->block_size;
+		prefetch->request.count++;
+		blocks_read++;
+	}
+	if(prefetch && prefetch->request.count)
+		requests[n++] = &prefetch->request;
+	else
+		free(prefetch);
+	if(n)
+	{
+		cache->readaheads++;
+		cache->prefetches += blocks_read;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	// The engine is running: a failure here is the kernel refusing the ring entries,
+	// which it still owns, so the requests are left to complete
+	if(n)
+		aio_submit(mount_point, requests, n);
+	return handled;
+}
+
+void cache_fill(struct aio_request_t* request)
+{
+	/*
+		* Completion of a readahead: puts each block read (as stored on the device) on the
+		  LRU list, or frees its entry if the read failed or the block was written around
+		  the cache meanwhile, and wakes up the lookups waiting for them
+	*/
+
+	struct prefetch_t* prefetch = (struct prefetch_t*)request;
+	struct block_cache_t* cache = &prefetch->mount->cache;
+	struct cache_entry_t* entry;
+
+	pthread_mutex_lock(&cache->lock);
+	for(int i=0; i<request->count; i++)
+	{
+		entry = prefetch->entries[i];
+		if(cache_publish(cache, entry, request->result > 0))
+			entry->prefetched = 1;
+		else
+			cache->prefetch_dropped++;
+	}
+	pthread_cond_broadcast(&cache->filled);
+	pthread_mutex_unlock(&cache->lock);
+	free(prefetch);
+}
+
+int cache_view_blocks(int mount_point, int* blocks, int count, struct cache_entry_t** entries)
+{
+	/*
+		* Pins blocks of the device in the block cache for a read view: each one is looked up,
+		  or read from the device into an evicted entry (all the misses with one readblocks call)
+		* Stops before the entries with views would exceed half the cache, so the other
+		  operations always find room
+
+		* Return value: number of blocks pinned, the first ones (their entries in 'entries')
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct block_cache_t* cache = &mount->cache;
+	int miss_blocks[count > 0 ? count : 1];
+	char* miss_bufs[count > 0 ? count : 1];
+	struct cache_entry_t* misses[count > 0 ? count : 1];
+	int miss_index[count > 0 ? count : 1];
+	int num_misses = 0;
+	int first_miss = count;
+	int pinned = 0;
+	int read_ok = 1;
+
+	if(cache->capacity == 0 || count <= 0)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	while(pinned<count && cache->viewed < cache->capacity / 2)
+	{
+		struct cache_entry_t* entry = cache_lookup_ready(cache, blocks[pinned]);
+		if(entry)
+		{
+			cache_hit(cache, entry);
+			cache_touch(cache, entry);
+		}
+		else
+		{
+			if(!(entry = cache_evict(mount)))
+				break;
+			// Cached while the victim was written back, which stays free
+			if(cache_lookup(cache, blocks[pinned]))
+				continue;
+			if(num_misses == 0)
+				first_miss = pinned;
+			cache->misses++;
+			miss_blocks[num_misses] = blocks[pinned];
+			miss_bufs[num_misses] = entry->data;
+			miss_index[num_misses] = pinned;
+			misses[num_misses++] = entry;
+		}
+		if(entry->views++ == 0)
+			cache->viewed++;
+		entries[pinned++] = entry;
+	}
+
+	// The evicted entries hold views, nothing takes them while the lock is released
+	if(num_misses)
+	{
+		pthread_mutex_unlock(&cache->lock);
+		read_ok = device_readblocks(mount, miss_blocks, miss_bufs, num_misses) > 0;
+		pthread_mutex_lock(&cache->lock);
+	}
+	if(!read_ok)
+	{
+		// Only the blocks before the first miss stay pinned, the evicted entries stay free
+		for(int i=first_miss; i<pinned; i++)
+			if(--entries[i]->views == 0)
+				cache->viewed--;
+		pinned = first_miss;
+	}
+	else
+		for(int i=0; i<num_misses; i++)
+		{
+			// A block cached meanwhile (while a lookup waited for a readahead) keeps its entry
+			struct cache_entry_t* entry = cache_lookup_ready(cache, miss_blocks[i]);
+			if(!entry)
+			{
+				cache_insert(cache, misses[i], miss_blocks[i]);
+				continue;
+			}
+			misses[i]->views = 0;
+			cache->viewed--;
+			if(entry->views++ == 0)
+				cache->viewed++;
+			entries[miss_index[i]] = entry;
+		}
+	pthread_mutex_unlock(&cache->lock);
+	return pinned;
+}
+
+void cache_unview(int mount_point, struct cache_entry_t** entries, int count)
+{
+	/*
+		* Releases the entries pinned by cache_view_blocks, a detached one is freed with its last view
+	*/
+
+	struct block_cache_t* cache = &mounts[mount_point].cache;
+
+	pthread_mutex_lock(&cache->lock);
+	for(int i=0; i<count; i++)
+	{
+		struct cache_entry_t* entry = entries[i];
+		if(--entry->views > 0)
+			continue;
+		cache->viewed--;
+		if(entry->detached)
+		{
+			entry->detached = 0;
+			cache_release(cache, entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int compare_entries(const void* a, const void* b)
+{
+	int block_a = (*(struct cache_entry_t**)a)->blocknum;
+	int block_b = (*(struct cache_entry_t**)b)->blocknum;
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+int cache_write_back(struct mount_t* mount)
+{
+	/*
+		* Writes the dirty blocks of the cache back to the device. The cache lock must be held.
+		* Blocks are sorted so that adjacent dirty blocks go out in one writeblocks run
+		* Blocks pinned by an open journal transaction stay dirty
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct block_cache_t* cache = &mount->cache;
+	struct cache_entry_t** dirty;
+	int* blocks;
+	char** bufs;
+	int num_dirty = 0;
+	int ret = 1;
+
+	// Evicted blocks being written back must be on the device too
+	while(cache->writing)
+		pthread_cond_wait(&cache->filled, &cache->lock);
+
+	dirty = (struct cache_entry_t**)malloc((cache->capacity + cache->spilled) * sizeof(struct cache_entry_t*));
+	blocks = (int*)malloc((cache->capacity + cache->spilled) * sizeof(int));
+	bufs = (char**)malloc((cache->capacity + cache->spilled) * sizeof(char*));
+	if(!dirty || !blocks || !bufs)
+	{
+		free(dirty);
+		free(blocks);
+		free(bufs);
+		return -1;
+	}
+
+	for(int i=0; i<cache->capacity; i++)
+		if(cache->entries[i].blocknum >= 0 && cache->entries[i].dirty && !cache->entries[i].pins)
+			dirty[num_dirty++] = &cache->entries[i];
+	for(struct cache_entry_t* entry = cache->spill; entry; entry = entry->spill_next)
+		if(entry->blocknum >= 0 && entry->dirty && !entry->pins)
+			dirty[num_dirty++] = entry;
+	qsort(dirty, num_dirty, sizeof(struct cache_entry_t*), compare_entries);
+
+	for(int i=0; i<num_dirty; i++)
+	{
+		blocks[i] = dirty[i]->blocknum;
+		bufs[i] = dirty[i]->data;
+	}
+
+	if(device_writeblocks(mount, blocks, bufs, num_dirty) > 0)
+		for(int i=0; i<num_dirty; i++)
+			dirty[i]->dirty = 0;
+	else
+	{
+		// Find out which blocks did not make it, they stay dirty
+		for(int i=0; i<num_dirty; i++)
+			if(device_writeblock(mount, blocks[i], bufs[i]) > 0)
+				dirty[i]->dirty = 0;
+			else
+				ret = -1;
+	}
+
+	for(int i=0; i<num_dirty; i++)
+		if(!dirty[i]->dirty)
+			cache->writebacks++;
+	free(dirty);
+	free(blocks);
+	free(bufs);
+	return ret;
+}
+
+int flush_cache(int mount_point)
+{
+	/*
+		* Writes all the dirty blocks of the mount back to the device
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct block_cache_t* cache = &mount->cache;
+	int ret;
+
+	if(cache->capacity == 0)
+		return 1;
+
+	pthread_mutex_lock(&cache->lock);
+	ret = cache_write_back(mount);
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_stats(int mount_point, struct cache_stats_t* stats)
+{
+	/*
+		* Copies the block cache counters of the mount point into stats
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct block_cache_t* cache;
+
+	if(mount_point < 0 || mount_point >= MAX_MOUNT_POINTS || mounts[mount_point].device_fd <= 0)
+		return -1;
+
+	cache = &mounts[mount_point].cache;
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->writebacks = cache->writebacks;
+	stats->device_reads = mounts[mount_point].device_reads;
+	stats->device_writes = mounts[mount_point].device_writes;
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+}
+
+int readahead_stats(int mount_point, struct readahead_stats_t* stats)
+{
+	/*
+		* Copies the readahead counters of the block cache of the mount point into stats
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct block_cache_t* cache;
+
+	if(mount_point < 0 || mount_point >= MAX_MOUNT_POINTS || mounts[mount_point].device_fd <= 0)
+		return -1;
+
+	cache = &mounts[mount_point].cache;
+	pthread_mutex_lock(&cache->lock);
+	stats->readaheads = cache->readaheads;
+	stats->blocks = cache->prefetches;
+	stats->hits = cache->prefetch_hits;
+	stats->unused = cache->prefetch_unused;
+	stats->dropped = cache->prefetch_dropped;
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+}
+
+
+/*-----------JOURNAL------------*/
+u_int64_t journal_ids = 0;		// ids given to the opened journals
+__thread struct journal_handle_t journal_handles[MAX_MOUNT_POINTS];	// handle of the thread on each mount
+
+u_int32_t journal_checksum(char* data, size_t length)
+{
+	/*
+		* Checksum of journal records, so that a torn or stale record is not replayed
+		* Four independent multiply-xor lanes over 64-bit words, folded to 32 bits
+	*/
+
+	u_int64_t lanes[4] = {0x9E3779B97F4A7C15ULL ^ length, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+	u_int64_t word;
+	size_t i = 0;
+
+	for(; i + 32 <= length; i += 32)
+		for(int lane=0; lane<4; lane++)
+		{
+			memcpy(&word, data + i + lane * 8, 8);
+			lanes[lane] = (lanes[lane] ^ word) * 0x100000001B3ULL;
+			lanes[lane] ^= lanes[lane] >> 29;
+		}
+	for(; i < length; i++)
+		lanes[0] = (lanes[0] ^ (unsigned char)data[i]) * 0x100000001B3ULL;
+
+	word = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+	word ^= word >> 31;
+	word *= 0x94D049BB133111EBULL;
+	return (u_int32_t)(word ^ (word >> 32));
+}
+
+u_int32_t journal_record_checksum(struct journal_record_t* record, u_int32_t body)
+{
+	/*
+		* Checksum of a record: its header (with the checksum field 0) mixed with
+		  body, the checksum of the block numbers and images that follow it
+	*/
+
+	struct journal_record_t header = *record;
+
+	header.checksum = 0;
+	return journal_checksum((char*)&header, sizeof(struct journal_record_t)) ^ body;
+}
+
+size_t journal_record_length(int count, int block_size)
+{
+	/*
+		* Return value: bytes of a record of count block images of block_size bytes
+						(block_size 0: offset of the first image)
+	*/
+
+	return sizeof(struct journal_record_t) + (((size_t)count * sizeof(u_int32_t) + 7) & ~(size_t)7) + (size_t)count * block_size;
+}
+
+struct journal_record_t* journal_next_record(char* region, size_t length, size_t offset, u_int64_t sequence)
+{
+	/*
+		* Checks the record at offset in the length bytes of records read from a journal
+
+		* Return value: NULL,	no valid record with that sequence (end of the journal)
+						 record, success
+	*/
+
+	struct journal_record_t* record;
+	size_t record_length;
+
+	if(offset + sizeof(struct journal_record_t) > length)
+		return NULL;
+	record = (struct journal_record_t*)(region + offset);
+	if(record->magic != JOURNAL_RECORD_MAGIC || record->sequence != sequence || record->count == 0 ||
+	   record->count > length || !block_size_valid(record->block_size))
+		return NULL;
+
+	record_length = journal_record_length(record->count, record->block_size);
+	if(record_length > length - offset)
+		return NULL;
+	if(journal_record_checksum(record, journal_checksum(region + offset + sizeof(struct journal_record_t),
+			record_length - sizeof(struct journal_record_t))) != record->checksum)
+		return NULL;
+	return record;
+}
+
+int journal_read(int fd, off_t offset, char* buf, size_t length)
+{
+	/*
+		* Reads length bytes of the journal region at a byte offset of the device image
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	ssize_t ret;
+	size_t done = 0;
+
+	while(done < length)
+	{
+		ret = pread(fd, buf + done, length - done, offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 1;
+}
+
+int journal_write(int fd, off_t offset, char* buf, size_t length)
+{
+	/*
+		* Writes length bytes to the journal region at a byte offset of the device image
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	ssize_t ret;
+	size_t done = 0;
+
+	while(done < length)
+	{
+		ret = pwrite(fd, buf + done, length - done, offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+		{
+			printf("Error: Journal write error. fd: %d. ret: %d \n", fd, (int)ret);
+			return -1;
+		}
+		done += ret;
+	}
+	return 1;
+}
+
+int journal_write_header(int fd, off_t start, u_int64_t sequence)
+{
+	/*
+		* Writes the header of the journal at start: records before sequence are ignored
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	char buf[JOURNAL_HEADER_SIZE];
+	struct journal_header_t* header = (struct journal_header_t*)buf;
+
+	memset(buf, 0, JOURNAL_HEADER_SIZE);
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = sequence;
+	return journal_write(fd, start, buf, JOURNAL_HEADER_SIZE);
+}
+
+int journal_format(int fd, off_t start, int size)
+{
+	/*
+		* Lays out an empty journal of size bytes at start, extending the device image
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	char zero = 0;
+
+	if(journal_write(fd, start + size - 1, &zero, 1) < 0 || journal_write_header(fd, start, 1) < 0)
+		return -1;
+	return fdatasync(fd) < 0 ? -1 : 1;
+}
+
+int journal_replay(int fd, off_t start, int size, u_int64_t* sequence, long* replayed)
+{
+	/*
+		* Recovery, when the device is opened: writes the block images of the committed
+		  transactions of the journal to their blocks, in order, then empties the journal
+		* Replay stops at the first record that is torn, stale (older sequence) or missing
+		* The images are stored as on the device (encrypted), so no key is needed
+		* sequence is set to the sequence of the next transaction
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	char* region = (char*)malloc(size);
+	struct journal_header_t* header = (struct journal_header_t*)region;
+	struct journal_record_t* record;
+	size_t offset = JOURNAL_HEADER_SIZE;
+	u_int64_t next;
+
+	*replayed = 0;
+	if(!region)
+		return -1;
+	if(journal_read(fd, start, region, size) < 0 || header->magic != JOURNAL_MAGIC)
+	{
+		free(region);
+		return -1;
+	}
+
+	next = header->sequence;
+	while((record = journal_next_record(region, size, offset, next)))
+	{
+		u_int32_t* blocks = (u_int32_t*)(record + 1);
+		char* image = (char*)record + journal_record_length(record->count, 0);
+
+		for(u_int32_t i=0; i<record->count; i++, image += record->block_size)
+			if(writeblock(fd, blocks[i], image, record->block_size) < 0)
+			{
+				free(region);
+				return -1;
+			}
+		offset += journal_record_length(record->count, record->block_size);
+		next++;
+		(*replayed)++;
+	}
+	free(region);
+
+	if(*replayed && fdatasync(fd) < 0)
+		return -1;
+	if(journal_write_header(fd, start, next) < 0 || fdatasync(fd) < 0)
+		return -1;
+	*sequence = next;
+	return 1;
+}
+
+int journal_open(int mount_point, off_t start, int size, u_int64_t sequence)
+{
+	/*
+		* Attaches an empty journal (the first transaction gets sequence) to the mount
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct journal_t* journal = (struct journal_t*)calloc(1, sizeof(struct journal_t));
+
+	if(!journal)
+		return -1;
+	journal->id = __atomic_add_fetch(&journal_ids, 1, __ATOMIC_RELAXED);
+	journal->start = start;
+	journal->size = size;
+	journal->first_sequence = journal->next_sequence = journal->tail_sequence = sequence;
+	journal->durable_sequence = sequence - 1;
+	journal->running.tid = 1;
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_cond_init(&journal->done, NULL);
+	mounts[mount_point].journal = journal;
+	return 1;
+}
+
+void journal_close(int mount_point)
+{
+	/*
+		* Frees the journal of the mount. It must have been checkpointed before.
+	*/
+
+	struct journal_t* journal = mounts[mount_point].journal;
+
+	if(!journal)
+		return;
+	mounts[mount_point].journal = NULL;
+	pthread_mutex_destroy(&journal->lock);
+	pthread_cond_destroy(&journal->done);
+	free(journal->pending);
+	free(journal->running.blocks);
+	free(journal);
+}
+
+struct journal_handle_t* journal_handle(int mount_point)
+{
+	/*
+		* Return value: handle of the calling thread on the mount (which has a journal)
+	*/
+
+	struct journal_handle_t* handle = &journal_handles[mount_point];
+
+	if(handle->journal_id != mounts[mount_point].journal->id)
+	{
+		// Left over from a journal that was closed
+		memset(handle, 0, sizeof(struct journal_handle_t));
+		handle->journal_id = mounts[mount_point].journal->id;
+	}
+	return handle;
+}
+
+void journal_start(int mount_point)
+{
+	/*
+		* Makes the operation of the calling thread join the running transaction of the mount,
+		  unless it is in it already. Called before each change of the blocks, bitmaps, inode
+		  table or superblock, so that every change of an operation goes in one transaction
+		  with the changes the other threads make meanwhile
+		* Waits while the running transaction is being committed: a thread must not start
+		  with the mount or cache lock held, nor take an inode lock while its handle is
+		  active (journal_stop), as the commit waits for the handles of the transaction
+	*/
+
+	struct journal_t* journal = mounts[mount_point].journal;
+	struct journal_handle_t* handle;
+
+	if(!journal)
+		return;
+	handle = journal_handle(mount_point);
+	if(handle->active)
+		return;
+
+	pthread_mutex_lock(&journal->lock);
+	while(journal->locked)
+		pthread_cond_wait(&journal->done, &journal->lock);
+	journal->running.updates++;
+	handle->tid = journal->running.tid;
+	handle->active = 1;
+	handle->uncommitted = 1;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_stop(int mount_point)
+{
+	/*
+		* Ends the part of the operation of the calling thread in the running transaction:
+		  the transaction can commit once the other threads in it stop too
+		* The next journal_commit of the thread still waits for it
+	*/
+
+	struct journal_t* journal = mounts[mount_point].journal;
+	struct journal_handle_t* handle;
+
+	if(!journal)
+		return;
+	handle = journal_handle(mount_point);
+	if(!handle->active)
+		return;
+
+	pthread_mutex_lock(&journal->lock);
+	if(--journal->running.updates == 0 && journal->locked)
+		pthread_cond_broadcast(&journal->done);
+	handle->active = 0;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_pin(struct mount_t* mount, struct cache_entry_t* entry)
+{
+	/*
+		* Adds the block of entry to the running transaction. The cache lock must be held.
+		* The entry is pinned (it is not written back) until the transaction commits
+	*/
+
+	struct journal_txn_t* txn = &mount->journal->running;
+
+	if(entry->pins && entry->pin_tid == txn->tid)
+		return;
+
+	if(txn->count == txn->capacity)
+	{
+		int capacity = txn->capacity ? txn->capacity * 2 : 64;
+		int* blocks = (int*)realloc(txn->blocks, capacity * sizeof(int));
+		if(!blocks)
+			return;
+		txn->blocks = blocks;
+		txn->capacity = capacity;
+	}
+	txn->blocks[txn->count] = entry->blocknum;
+	__atomic_store_n(&txn->count, txn->count + 1, __ATOMIC_RELAXED);
+	entry->pins++;
+	entry->pin_tid = txn->tid;
+}
+
+int journal_record_blocks(struct mount_t* mount)
+{
+	/*
+		* Return value: most blocks in one record: a record takes at most half of the journal,
+						so that a batch always fits once the journal is checkpointed
+	*/
+
+	size_t room = (mount->journal->size - JOURNAL_HEADER_SIZE) / 2 - sizeof(struct journal_record_t) - 8;
+	int blocks = room / (mount->block_size + sizeof(u_int32_t));
+
+	return blocks > 0 ? blocks : 1;
+}
+
+int journal_txn_limit(struct mount_t* mount)
+{
+	/*
+		* Return value: blocks after which a large write commits the running transaction,
+						so that it neither outgrows a record nor pins a quarter of the cache
+	*/
+
+	int limit = journal_record_blocks(mount);
+
+	if(limit > JOURNAL_TXN_BLOCKS)
+		limit = JOURNAL_TXN_BLOCKS;
+	if(limit > mount->cache.capacity / 4)
+		limit = mount->cache.capacity / 4;
+	return limit > 0 ? limit : 1;
+}
+
+int journal_apply(struct mount_t* mount)
+{
+	/*
+		* Checkpoint: makes the device hold every committed transaction and empties the journal
+		* The dirty blocks that are not pinned are the newest committed images and are written back;
+		  a pinned block (written again by an open transaction) gets its last image from the journal
+		* Called by the thread that holds the committing flag of the journal
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct journal_t* journal = mount->journal;
+	struct block_cache_t* cache = &mount->cache;
+	struct journal_record_t* record;
+	struct cache_entry_t* entry;
+	char* region = (char*)malloc(journal->tail + 1);
+	size_t offset = 0;
+	u_int64_t sequence = journal->first_sequence;
+	int ret = 1;
+
+	if(!region)
+		ret = -1;
+	else if(journal->tail && journal_read(mount->device_fd, journal->start + JOURNAL_HEADER_SIZE, region, journal->tail) < 0)
+		ret = -1;
+
+	if(ret > 0)
+	{
+		pthread_mutex_lock(&cache->lock);
+		while(ret > 0 && (record = journal_next_record(region, journal->tail, offset, sequence++)))
+		{
+			u_int32_t* numbers = (u_int32_t*)(record + 1);
+			char* image = (char*)record + journal_record_length(record->count, 0);
+
+			for(u_int32_t i=0; i<record->count; i++, image += record->block_size)
+			{
+				entry = cache_lookup(cache, numbers[i]);
+				if(entry && entry->pins && device_writeblock(mount, numbers[i], image) < 0)
+					ret = -1;
+			}
+			offset += journal_record_length(record->count, record->block_size);
+		}
+		if(ret > 0 && cache_write_back(mount) < 0)
+			ret = -1;
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	free(region);
+
+	if(ret > 0 && (sync_device(mount) < 0 || fdatasync(mount->device_fd) < 0))
+		ret = -1;
+	if(ret > 0 && (journal_write_header(mount->device_fd, journal->start, journal->tail_sequence) < 0 ||
+	   fdatasync(mount->device_fd) < 0))
+		ret = -1;
+	if(ret < 0)
+		return -1;
+
+	journal->tail = 0;
+	journal->first_sequence = journal->tail_sequence;
+	pthread_mutex_lock(&journal->lock);
+	journal->checkpoints++;
+	pthread_mutex_unlock(&journal->lock);
+	return 1;
+}
+
+int journal_write_batch(struct mount_t* mount, char* batch, size_t length)
+{
+	/*
+		* Appends the records of a group commit to the journal and makes them durable
+		* The records that fit go out with one write and one fdatasync; a full journal
+		  is checkpointed first
+		* Called by the thread that holds the committing flag of the journal
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct journal_t* journal = mount->journal;
+	size_t room = journal->size - JOURNAL_HEADER_SIZE;
+	size_t offset = 0;
+	size_t end;
+	int records;
+
+	while(offset < length)
+	{
+		end = offset;
+		records = 0;
+		while(end < length)
+		{
+			struct journal_record_t* record = (struct journal_record_t*)(batch + end);
+			size_t record_length = journal_record_length(record->count, record->block_size);
+			if(journal->tail + (end - offset) + record_length > room)
+				break;
+			end += record_length;
+			records++;
+		}
+
+		if(end == offset)
+		{
+			if(journal_apply(mount) < 0)
+				return -1;
+			continue;
+		}
+
+		if(journal_write(mount->device_fd, journal->start + JOURNAL_HEADER_SIZE + journal->tail, batch + offset, end - offset) < 0 ||
+		   fdatasync(mount->device_fd) < 0)
+			return -1;
+		journal->tail += end - offset;
+		journal->tail_sequence += records;
+		offset = end;
+
+		pthread_mutex_lock(&journal->lock);
+		journal->syncs++;
+		pthread_mutex_unlock(&journal->lock);
+	}
+	return 1;
+}
+
+char* journal_snapshot(struct mount_t* mount, int* blocks, int count)
+{
+	/*
+		* Builds the record of count blocks of a transaction from their images in the cache
+		  (pinned blocks are always there). The cache lock must be held.
+		* The checksum field holds the checksum of the body until journal_queue seals the record
+
+		* Return value: NULL,	out of memory
+						 record, success (freed by journal_queue)
+	*/
+
+	size_t length = journal_record_length(count, mount->block_size);
+	size_t images = journal_record_length(count, 0);
+	char* buf = (char*)malloc(length);
+	struct journal_record_t* record = (struct journal_record_t*)buf;
+	u_int32_t* numbers = (u_int32_t*)(record + 1);
+	struct cache_entry_t* entry;
+
+	if(!buf)
+		return NULL;
+	memset(buf, 0, images);
+	record->magic = JOURNAL_RECORD_MAGIC;
+	record->count = count;
+	record->block_size = mount->block_size;
+	for(int i=0; i<count; i++)
+	{
+		numbers[i] = blocks[i];
+		entry = cache_lookup(&mount->cache, blocks[i]);
+		if(entry)
+			memcpy(buf + images + (size_t)i * mount->block_size, entry->data, mount->block_size);
+	}
+	record->checksum = journal_checksum(buf + sizeof(struct journal_record_t), length - sizeof(struct journal_record_t));
+	return buf;
+}
+
+int journal_queue(struct mount_t* mount, char* buf, u_int64_t* sequence)
+{
+	/*
+		* Gives the record in buf (journal_snapshot) the next sequence and adds it to the
+		  pending batch, then frees buf. The journal lock must be held.
+
+		* Return value: -1, error
+						 1, success (*sequence: the sequence of the record)
+	*/
+
+	struct journal_t* journal = mount->journal;
+	struct journal_record_t* record = (struct journal_record_t*)buf;
+	size_t length = journal_record_length(record->count, record->block_size);
+
+	if(journal->pending_length + length > journal->pending_capacity)
+	{
+		size_t capacity = journal->pending_capacity ? journal->pending_capacity : length;
+		char* pending;
+		while(capacity < journal->pending_length + length)
+			capacity *= 2;
+		pending = (char*)realloc(journal->pending, capacity);
+		if(!pending)
+		{
+			free(buf);
+			return -1;
+		}
+		journal->pending = pending;
+		journal->pending_capacity = capacity;
+	}
+	*sequence = record->sequence = journal->next_sequence++;
+	record->checksum = journal_record_checksum(record, record->checksum);
+	memcpy(journal->pending + journal->pending_length, buf, length);
+	journal->pending_length += length;
+	journal->transactions++;
+	journal->blocks += record->count;
+	free(buf);
+	return 1;
+}
+
+int journal_sync(struct mount_t* mount, u_int64_t sequence)
+{
+	/*
+		* Waits until the records up to sequence are durable. The journal lock must be held
+		  (it is released meanwhile).
+		* Group commit: one thread at a time writes the pending batch with a single fdatasync
+		  while the others wait for it and then take their turn, so concurrent commits share
+		  their syncs
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct journal_t* journal = mount->journal;
+	u_int64_t last;
+	char* batch;
+	size_t batch_length;
+	int ret;
+
+	while(journal->durable_sequence < sequence)
+	{
+		if(journal->committing)
+		{
+			pthread_cond_wait(&journal->done, &journal->lock);
+			continue;
+		}
+
+		// Write the records of every waiting thread
+		batch = journal->pending;
+		batch_length = journal->pending_length;
+		last = journal->next_sequence - 1;
+		journal->pending = NULL;
+		journal->pending_length = journal->pending_capacity = 0;
+		journal->committing = 1;
+		pthread_mutex_unlock(&journal->lock);
+
+		ret = journal_write_batch(mount, batch, batch_length);
+		free(batch);
+
+		pthread_mutex_lock(&journal->lock);
+		if(ret < 0)
+			journal->failed = 1;
+		journal->durable_sequence = last;
+		journal->committing = 0;
+		pthread_cond_broadcast(&journal->done);
+	}
+	return journal->failed ? -1 : 1;
+}
+
+int journal_commit_running(int mount_point, int rejoin)
+{
+	/*
+		* Commits the running transaction of the mount, which the calling thread has locked
+		  (journal->locked) with no active handle of its own:
+			* waits for the handles of the other threads in it to stop
+			* with EMUFS_SYNC_OPERATION, writes the inode table, bitmaps and superblock into it,
+			  once for all its operations
+			* copies the images of its blocks into records (several for a transaction larger
+			  than a record) and queues them, then opens the next transaction (with the calling
+			  thread in it when rejoin is set)
+			* once the records are durable, unpins the blocks so that they can be written back
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct journal_t* journal = mount->journal;
+	struct journal_handle_t* handle = journal_handle(mount_point);
+	struct cache_entry_t* entry;
+	int per_record = journal_record_blocks(mount);
+	u_int64_t tid;
+	u_int64_t sequence = 0;
+	int* blocks;
+	int count;
+	int records;
+	char** bufs;
+	int ret = 1;
+
+	pthread_mutex_lock(&journal->lock);
+	while(journal->running.updates)
+		pthread_cond_wait(&journal->done, &journal->lock);
+	tid = journal->running.tid;
+	pthread_mutex_unlock(&journal->lock);
+
+	// The writes of the metadata go in the transaction without joining it
+	handle->tid = tid;
+	handle->active = 1;
+	if(mount->sync_policy == EMUFS_SYNC_OPERATION)
+	{
+		pthread_mutex_lock(&mount->lock);
+		if(mount->inode_table_dirty)
+			persist_inode_table(mount_point);
+		if(mount->bitmaps_dirty)
+			persist_bitmaps(mount_point);
+		if(mount->superblock_dirty)
+			persist_superblock(mount_point);
+		pthread_mutex_unlock(&mount->lock);
+	}
+	handle->active = 0;
+
+	pthread_mutex_lock(&mount->cache.lock);
+	blocks = journal->running.blocks;
+	count = journal->running.count;
+	journal->running.blocks = NULL;
+	journal->running.capacity = 0;
+	__atomic_store_n(&journal->running.count, 0, __ATOMIC_RELAXED);	// read by journal_commit_if_large
+	records = (count + per_record - 1) / per_record;
+	bufs = (char**)calloc(records + 1, sizeof(char*));
+	for(int r=0; bufs && r<records; r++)
+		if(!(bufs[r] = journal_snapshot(mount, blocks + r * per_record, count - r * per_record < per_record ? count - r * per_record : per_record)))
+			ret = -1;
+	pthread_mutex_unlock(&mount->cache.lock);
+	if(!bufs)
+		ret = -1;
+
+	// The records are queued before the next transaction opens, so that they replay before its own
+	pthread_mutex_lock(&journal->lock);
+	for(int r=0; bufs && r<records; r++)
+		if(bufs[r] && journal_queue(mount, bufs[r], &sequence) < 0)
+			ret = -1;
+	if(ret < 0)
+		journal->failed = 1;
+	journal->running.tid++;
+	journal->locked = 0;
+	if(rejoin)
+	{
+		journal->running.updates = 1;
+		handle->tid = journal->running.tid;
+		handle->active = 1;
+		handle->uncommitted = 1;
+	}
+	pthread_cond_broadcast(&journal->done);
+	if(journal_sync(mount, sequence) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&journal->lock);
+	free(bufs);
+
+	pthread_mutex_lock(&mount->cache.lock);
+	for(int i=0; i<count; i++)
+	{
+		entry = cache_lookup(&mount->cache, blocks[i]);
+		if(entry && entry->pins)
+			entry->pins--;
+	}
+	pthread_mutex_unlock(&mount->cache.lock);
+	free(blocks);
+
+	pthread_mutex_lock(&journal->lock);
+	if(journal->committed_tid < tid)
+		journal->committed_tid = tid;
+	pthread_cond_broadcast(&journal->done);
+	pthread_mutex_unlock(&journal->lock);
+	return ret;
+}
+
+int journal_commit(int mount_point)
+{
+	/*
+		* Ends the operation of the calling thread on the mount: its handle stops, then it
+		  waits until the transaction it joined last is on the device, committing it unless
+		  another thread of the transaction does (the others find it committed)
+
+		* Return value: -1, error
+						 1, success (or nothing to commit, or no journal)
+	*/
+
+	struct journal_t* journal = mounts[mount_point].journal;
+	struct journal_handle_t* handle;
+	u_int64_t tid;
+	int ret = 1;
+
+	if(!journal)
+		return 1;
+	handle = journal_handle(mount_point);
+	if(!handle->uncommitted)
+		return 1;
+	journal_stop(mount_point);
+	handle->uncommitted = 0;
+	tid = handle->tid;
+
+	pthread_mutex_lock(&journal->lock);
+	while(journal->committed_tid < tid)
+	{
+		// While a batch is being written the transaction stays open to the operations ending meanwhile
+		if(journal->running.tid == tid && !journal->locked && !journal->committing)
+		{
+			journal->locked = 1;
+			pthread_mutex_unlock(&journal->lock);
+			if(journal_commit_running(mount_point, 0) < 0)
+				ret = -1;
+			pthread_mutex_lock(&journal->lock);
+		}
+		else
+			pthread_cond_wait(&journal->done, &journal->lock);
+	}
+	if(journal->failed)
+		ret = -1;
+	pthread_mutex_unlock(&journal->lock);
+	return ret;
+}
+
+void journal_commit_if_large(int mount_point)
+{
+	/*
+		* Commits the running transaction early once it holds journal_txn_limit blocks, when
+		  the calling thread is the only one in it: the write goes on in the next transaction
+		  (with other threads in it, the commit would wait for them under the inode lock of
+		  the write, so the transaction grows until they stop)
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct journal_t* journal = mount->journal;
+	struct journal_handle_t* handle;
+	int alone;
+
+	if(!journal || __atomic_load_n(&journal->running.count, __ATOMIC_RELAXED) < journal_txn_limit(mount))
+		return;
+	handle = journal_handle(mount_point);
+	if(!handle->active)
+		return;
+
+	pthread_mutex_lock(&journal->lock);
+	alone = journal->running.updates == 1 && !journal->locked;
+	if(alone)
+	{
+		journal->running.updates = 0;
+		journal->locked = 1;
+		handle->active = 0;
+	}
+	pthread_mutex_unlock(&journal->lock);
+	if(alone)
+		journal_commit_running(mount_point, 1);
+}
+
+int journal_checkpoint(int mount_point)
+{
+	/*
+		* Waits for the group commit in progress, then checkpoints the journal of the mount
+
+		* Return value: -1, error
+						 1, success (or no journal)
+	*/
+
+	struct journal_t* journal = mounts[mount_point].journal;
+	int ret;
+
+	if(!journal)
+		return 1;
+
+	pthread_mutex_lock(&journal->lock);
+	while(journal->committing)
+		pthread_cond_wait(&journal->done, &journal->lock);
+	journal->committing = 1;
+	pthread_mutex_unlock(&journal->lock);
+
+	ret = journal_apply(&mounts[mount_point]);
+
+	pthread_mutex_lock(&journal->lock);
+	journal->committing = 0;
+	pthread_cond_broadcast(&journal->done);
+	pthread_mutex_unlock(&journal->lock);
+	return ret;
+}
+
+int journal_stats(int mount_point, struct journal_stats_t* stats)
+{
+	/*
+		* Copies the journal counters of the mount point into stats
+
+		* Return value: -1, error (or the mount has no journal)
+						 1, success
+	*/
+
+	struct journal_t* journal;
+
+	if(mount_point < 0 || mount_point >= MAX_MOUNT_POINTS || mounts[mount_point].device_fd <= 0 || !mounts[mount_point].journal)
+		return -1;
+
+	journal = mounts[mount_point].journal;
+	pthread_mutex_lock(&journal->lock);
+	stats->transactions = journal->transactions;
+	stats->blocks = journal->blocks;
+	stats->syncs = journal->syncs;
+	stats->checkpoints = journal->checkpoints;
+	stats->replayed = journal->replayed;
+	pthread_mutex_unlock(&journal->lock);
+	return 1;
+}
+
+
+/*-----------ASYNC I/O------------*/
+int aio_uring_setup(struct aio_engine_t* engine)
+{
+	/*
+		* Sets up an io_uring instance of AIO_QUEUE_DEPTH entries and maps its rings
+
+		* Return value: -1, error (io_uring not supported, the engine uses worker threads)
+						 1, success
+	*/
+
+#ifdef EMUFS_HAVE_IO_URING
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	engine->ring_fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &params);
+	if(engine->ring_fd < 0)
+	{
+		engine->ring_fd = -1;
+		return -1;
+	}
+
+	engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(engine->cq_ring_size > engine->sq_ring_size)
+			engine->sq_ring_size = engine->cq_ring_size;
+		engine->cq_ring_size = 0;
+	}
+
+	engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQ_RING);
+	if(engine->sq_ring == MAP_FAILED)
+		engine->sq_ring = NULL;
+	if(engine->cq_ring_size == 0)
+		engine->cq_ring = engine->sq_ring;
+	else if((engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		engine->cq_ring = NULL;
+	engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+	if(engine->sqes == MAP_FAILED)
+		engine->sqes = NULL;
+	if(!engine->sq_ring || !engine->cq_ring || !engine->sqes)
+	{
+		aio_uring_teardown(engine);
+		return -1;
+	}
+
+	engine->sq_tail = (unsigned int*)((char*)engine->sq_ring + params.sq_off.tail);
+	engine->sq_mask = (unsigned int*)((char*)engine->sq_ring + params.sq_off.ring_mask);
+	engine->sq_array = (unsigned int*)((char*)engine->sq_ring + params.sq_off.array);
+	engine->cq_head = (unsigned int*)((char*)engine->cq_ring + params.cq_off.head);
+	engine->cq_tail = (unsigned int*)((char*)engine->cq_ring + params.cq_off.tail);
+	engine->cq_mask = (unsigned int*)((char*)engine->cq_ring + params.cq_off.ring_mask);
+	engine->cqes = (char*)engine->cq_ring + params.cq_off.cqes;
+	return 1;
+#else
+	engine->ring_fd = -1;
+	return -1;
+#endif
+}
+
+void aio_uring_teardown(struct aio_engine_t* engine)
+{
+	/*
+		* Unmaps the rings and closes the io_uring instance of the engine
+	*/
+
+	if(engine->sqes)
+		munmap(engine->sqes, engine->sqes_size);
+	if(engine->cq_ring && engine->cq_ring != engine->sq_ring)
+		munmap(engine->cq_ring, engine->cq_ring_size);
+	if(engine->sq_ring)
+		munmap(engine->sq_ring, engine->sq_ring_size);
+	if(engine->ring_fd >= 0)
+		close(engine->ring_fd);
+	engine->sqes = engine->cq_ring = engine->sq_ring = NULL;
+	engine->ring_fd = -1;
+}
+
+int aio_uring_enter(struct aio_engine_t* engine, unsigned int submit, unsigned int wait)
+{
+	/*
+		* Hands submit queued entries to the kernel and/or waits for wait completions
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+#ifdef EMUFS_HAVE_IO_URING
+	long ret;
+
+	for(;;)
+	{
+		ret = syscall(__NR_io_uring_enter, engine->ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if(ret >= 0)
+		{
+			if((unsigned int)ret >= submit)
+				return 1;
+			submit -= ret;
+			continue;
+		}
+		if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			printf("Error: io_uring_enter failed: %s \n", strerror(errno));
+			return -1;
+		}
+	}
+#else
+	return -1;
+#endif
+}
+
+int aio_uring_push(struct aio_engine_t* engine, int opcode, struct aio_request_t* request)
+{
+	/*
+		* Fills the next submission queue entry of the ring. The engine lock must be held.
+		* request NULL: an entry that completes with no request (stops the completion thread)
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+#ifdef EMUFS_HAVE_IO_URING
+	unsigned int tail = *engine->sq_tail;
+	unsigned int index = tail & *engine->sq_mask;
+	struct io_uring_sqe* sqe = &((struct io_uring_sqe*)engine->sqes)[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = engine->fd;
+	if(request)
+	{
+		sqe->addr = (unsigned long)(request->iovs ? request->iovs : &request->iov);
+		sqe->len = request->iovs ? request->count : 1;
+		sqe->off = request->offset;
+	}
+	sqe->user_data = (unsigned long)request;
+	engine->sq_array[index] = index;
+	__atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+#else
+	return -1;
+#endif
+}
+
+void* aio_uring_thread(void* arg)
+{
+	/*
+		* Completion thread of an io_uring engine: waits for completion queue entries
+		  and completes their requests until it gets the entry without a request
+	*/
+
+#ifdef EMUFS_HAVE_IO_URING
+	struct aio_engine_t* engine = (struct aio_engine_t*)arg;
+	struct io_uring_cqe* cqe;
+	struct aio_request_t* request;
+	unsigned int head, tail;
+	long result;
+	int stop = 0;
+
+	while(!stop && aio_uring_enter(engine, 0, 1) > 0)
+	{
+		head = *engine->cq_head;
+		tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+
+		// The kernel orders the requests after their submission, but the thread sanitizer
+		// only sees it through the lock aio_submit held
+		pthread_mutex_lock(&engine->lock);
+		pthread_mutex_unlock(&engine->lock);
+		for(; head != tail; head++)
+		{
+			cqe = &((struct io_uring_cqe*)engine->cqes)[head & *engine->cq_mask];
+			request = (struct aio_request_t*)(unsigned long)cqe->user_data;
+			result = cqe->res;
+			__atomic_store_n(engine->cq_head, head + 1, __ATOMIC_RELEASE);
+			if(request)
+				aio_complete(engine, request, result);
+			else
+				stop = 1;
+		}
+	}
+#endif
+	return NULL;
+}
+
+int aio_transfer(struct aio_engine_t* engine, struct aio_request_t* request, size_t done)
+{
+	/*
+		* Transfers the bytes of a request from done on with pread/pwrite
+		  (the worker threads, and short transfers of io_uring)
+
+		* Return value: -1, error (or the end of the device)
+						 1, success
+	*/
+
+	ssize_t ret;
+	char* buf;
+	size_t length, block_size;
+
+	while(done < request->iov.iov_len)
+	{
+		buf = request->buf + done;
+		length = request->iov.iov_len - done;
+		if(request->iovs)
+		{
+			// One block buffer at a time
+			block_size = request->iovs[0].iov_len;
+			buf = (char*)request->iovs[done / block_size].iov_base + done % block_size;
+			length = block_size - done % block_size;
+		}
+		if(request->op == AIO_READ)
+			ret = pread(engine->fd, buf, length, request->offset + done);
+		else
+			ret = pwrite(engine->fd, buf, length, request->offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 1;
+}
+
+void* aio_worker(void* arg)
+{
+	/*
+		* Worker thread of the fallback engine: takes requests from the submission queue
+		  and transfers them with pread/pwrite
+	*/
+
+	struct aio_engine_t* engine = (struct aio_engine_t*)arg;
+	struct aio_request_t* request;
+	int ret;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&engine->lock);
+		while(!engine->queue_head && !engine->stopping)
+			pthread_cond_wait(&engine->work, &engine->lock);
+		request = engine->queue_head;
+		if(request)
+		{
+			engine->queue_head = request->next;
+			if(!engine->queue_head)
+				engine->queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&engine->lock);
+		if(!request)
+			break;
+
+		ret = aio_transfer(engine, request, 0);
+		aio_complete(engine, request, ret > 0 ? (long)request->iov.iov_len : -1);
+	}
+	return NULL;
+}
+
+void aio_complete(struct aio_engine_t* engine, struct aio_request_t* request, long result)
+{
+	/*
+		* Completes a request with result (bytes transferred, or negative on error)
+		* A short transfer is finished synchronously
+		* Runs the done function of the request, or queues it for aio_reap
+	*/
+
+	void (*done)(struct aio_request_t*) = request->done;
+	int write = request->op == AIO_WRITE;
+	int slot = request->slot;
+	int ret = result < 0 ? -1 : 1;
+
+	if(result >= 0 && (size_t)result < request->iov.iov_len)
+		ret = aio_transfer(engine, request, result);
+	request->result = ret;
+
+	// The request may be freed by done
+	if(done)
+		done(request);
+
+	pthread_mutex_lock(&engine->lock);
+	if(write)
+	{
+		engine->write_blocks[slot] = -1;
+		engine->free_slots[engine->num_free_slots++] = slot;
+	}
+	if(!done)
+	{
+		request->next = NULL;
+		if(engine->done_tail)
+			engine->done_tail->next = request;
+		else
+			engine->done_head = request;
+		engine->done_tail = request;
+		engine->done_count++;
+	}
+	engine->in_flight--;
+	engine->completions++;
+	pthread_cond_broadcast(&engine->completed);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+struct aio_engine_t* aio_engine(int mount_point)
+{
+	/*
+		* Returns the asynchronous I/O engine of the mount, starting it on first use:
+		  io_uring with a completion thread when the kernel supports it, AIO_WORKERS
+		  threads doing pread/pwrite otherwise (EMUFS_AIO=threads forces them)
+
+		* Return value: NULL,	error
+						 engine, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	struct aio_engine_t* engine = __atomic_load_n(&mount->aio, __ATOMIC_ACQUIRE);
+	char* forced = getenv("EMUFS_AIO");
+	int threads;
+
+	if(engine)
+		return engine;
+
+	pthread_mutex_lock(&mount->lock);
+	engine = mount->aio;
+	if(!engine && (engine = (struct aio_engine_t*)calloc(1, sizeof(struct aio_engine_t))))
+	{
+		engine->fd = mount->device_fd;
+		engine->ring_fd = -1;
+		pthread_mutex_init(&engine->lock, NULL);
+		pthread_cond_init(&engine->work, NULL);
+		pthread_cond_init(&engine->completed, NULL);
+		for(int i=0; i<AIO_QUEUE_DEPTH; i++)
+		{
+			engine->write_blocks[i] = -1;
+			engine->free_slots[i] = i;
+		}
+		engine->num_free_slots = AIO_QUEUE_DEPTH;
+		if(!forced || strcmp(forced, "threads") != 0)
+			aio_uring_setup(engine);
+
+		threads = engine->ring_fd >= 0 ? 1 : AIO_WORKERS;
+		engine->threads = (pthread_t*)malloc(threads * sizeof(pthread_t));
+		for(int i=0; engine->threads && i<threads; i++)
+			if(pthread_create(&engine->threads[engine->num_threads], NULL, engine->ring_fd >= 0 ? aio_uring_thread : aio_worker, engine) == 0)
+				engine->num_threads++;
+
+		if(engine->num_threads == 0)
+		{
+			aio_uring_teardown(engine);
+			pthread_mutex_destroy(&engine->lock);
+			pthread_cond_destroy(&engine->work);
+			pthread_cond_destroy(&engine->completed);
+			free(engine->threads);
+			free(engine);
+			engine = NULL;
+		}
+		else
+			__atomic_store_n(&mount->aio, engine, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mount->lock);
+	return engine;
+}
+
+int aio_submit(int mount_point, struct aio_request_t** requests, int count)
+{
+	/*
+		* Queues count block reads/writes (op, blocknum, buf, done and data set by the caller)
+		* The requests bypass the block cache and transfer the blocks as stored on the device
+		* At most AIO_QUEUE_DEPTH requests are in flight, the call waits for completions beyond
+		* A done function runs on an engine thread and must not submit requests itself
+
+		* Return value: -1, error (the engine could not be started, nothing was submitted)
+						 1, success
+	*/
+
+	struct aio_engine_t* engine = aio_engine(mount_point);
+	int block_size = mounts[mount_point].block_size;
+	unsigned int queued = 0;
+	int ret = 1;
+
+	if(!engine)
+		return -1;
+
+	pthread_mutex_lock(&engine->lock);
+	for(int i=0; i<count; i++)
+	{
+		struct aio_request_t* request = requests[i];
+
+		while(engine->in_flight >= AIO_QUEUE_DEPTH)
+		{
+			// The entries filled so far must reach the kernel before waiting for completions
+			if(queued && aio_uring_enter(engine, queued, 0) < 0)
+				ret = -1;
+			queued = 0;
+			pthread_cond_wait(&engine->completed, &engine->lock);
+		}
+
+		request->offset = (off_t)request->blocknum * block_size;
+		request->iov.iov_base = request->buf;
+		request->iov.iov_len = (size_t)block_size * (request->count > 0 ? request->count : 1);
+		request->result = 0;
+		request->next = NULL;
+		engine->in_flight++;
+		engine->submitted++;
+		if(!request->done)
+			engine->unreaped++;
+		if(request->op == AIO_WRITE)
+		{
+			request->slot = engine->free_slots[--engine->num_free_slots];
+			engine->write_blocks[request->slot] = request->blocknum;
+		}
+
+		if(engine->ring_fd >= 0)
+		{
+#ifdef EMUFS_HAVE_IO_URING
+			aio_uring_push(engine, request->op == AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV, request);
+			queued++;
+#endif
+		}
+		else
+		{
+			if(engine->queue_tail)
+				engine->queue_tail->next = request;
+			else
+				engine->queue_head = request;
+			engine->queue_tail = request;
+			pthread_cond_signal(&engine->work);
+		}
+	}
+	if(queued && aio_uring_enter(engine, queued, 0) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&engine->lock);
+	return ret;
+}
+
+int aio_reap(int mount_point, struct aio_request_t** completed, int min, int max)
+{
+	/*
+		* Takes up to max completed requests (submitted without a done function) off the
+		  completion queue, waiting until there are at least min of them
+		  (or as many as are still outstanding)
+
+		* Return value: -1,		error
+						 number of requests, success
+	*/
+
+	struct aio_engine_t* engine = aio_engine(mount_point);
+	int n = 0;
+
+	if(!engine)
+		return -1;
+
+	pthread_mutex_lock(&engine->lock);
+	if(min > engine->unreaped)
+		min = engine->unreaped;
+	while(engine->done_count < min)
+		pthread_cond_wait(&engine->completed, &engine->lock);
+	while(n < max && engine->done_head)
+	{
+		completed[n++] = engine->done_head;
+		engine->done_head = engine->done_head->next;
+	}
+	if(!engine->done_head)
+		engine->done_tail = NULL;
+	engine->done_count -= n;
+	engine->unreaped -= n;
+	pthread_mutex_unlock(&engine->lock);
+	return n;
+}
+
+void aio_wait_block(int mount_point, int block)
+{
+	/*
+		* Waits until no asynchronous write of the block is in flight
+		* Called before a partial block is read to be patched, so the patch is not applied
+		  to the contents the write is replacing
+	*/
+
+	struct aio_engine_t* engine = __atomic_load_n(&mounts[mount_point].aio, __ATOMIC_ACQUIRE);
+	int busy = 1;
+
+	if(!engine)
+		return;
+	pthread_mutex_lock(&engine->lock);
+	while(busy)
+	{
+		busy = 0;
+		for(int i=0; i<AIO_QUEUE_DEPTH && !busy; i++)
+			busy = engine->write_blocks[i] == block;
+		if(busy)
+			pthread_cond_wait(&engine->completed, &engine->lock);
+	}
+	pthread_mutex_unlock(&engine->lock);
+}
+
+void aio_drain(int mount_point)
+{
+	/*
+		* Waits until no asynchronous request of the mount is in flight
+	*/
+
+	struct aio_engine_t* engine = __atomic_load_n(&mounts[mount_point].aio, __ATOMIC_ACQUIRE);
+
+	if(!engine)
+		return;
+	pthread_mutex_lock(&engine->lock);
+	while(engine->in_flight)
+		pthread_cond_wait(&engine->completed, &engine->lock);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+void aio_shutdown(int mount_point)
+{
+	/*
+		* Waits for the requests in flight, then stops the engine of the mount
+		* Completed requests that were never reaped are dropped
+	*/
+
+	struct aio_engine_t* engine = mounts[mount_point].aio;
+
+	if(!engine)
+		return;
+
+	aio_drain(mount_point);
+	pthread_mutex_lock(&engine->lock);
+	engine->stopping = 1;
+	pthread_cond_broadcast(&engine->work);
+	if(engine->ring_fd >= 0 && aio_uring_push(engine, 0, NULL) > 0)
+		aio_uring_enter(engine, 1, 0);
+	pthread_mutex_unlock(&engine->lock);
+
+	for(int i=0; i<engine->num_threads; i++)
+		pthread_join(engine->threads[i], NULL);
+	aio_uring_teardown(engine);
+	pthread_mutex_destroy(&engine->lock);
+	pthread_cond_destroy(&engine->work);
+	pthread_cond_destroy(&engine->completed);
+	free(engine->threads);
+	free(engine);
+	mounts[mount_point].aio = NULL;
+}
+
+char* aio_backend(int mount_point)
+{
+	/*
+		* Return value: name of the asynchronous I/O engine of the mount ("io_uring" or "threads"),
+						"none" if it could not be started
+	*/
+
+	struct aio_engine_t* engine = aio_engine(mount_point);
+
+	if(!engine)
+		return "none";
+	return engine->ring_fd >= 0 ? "io_uring" : "threads";
+}
+
+
+/*-----------BITMAPS------------*/
+int bitmap_test(u_int64_t* words, int bit)
+{
+	return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+void bitmap_set(u_int64_t* words, int bit)
+{
+	words[bit / 64] |= (u_int64_t)1 << (bit % 64);
+}
+
+void bitmap_clear(u_int64_t* words, int bit)
+{
+	words[bit / 64] &= ~((u_int64_t)1 << (bit % 64));
+}
+
+int bitmap_scan(u_int64_t* words, int start, int end, u_int64_t invert)
+{
+	/*
+		* Finds the first bit in [start, end) whose value differs from the 'invert' pattern
+		* Skips 64 bits at a time and uses count-trailing-zeros inside a word
+
+		* Return value: -1,				no such bit
+						 bit number,	success
+	*/
+
+	int word = start / 64;
+	u_int64_t bits;
+
+	if(start >= end)
+		return -1;
+
+	bits = (words[word] ^ invert) & (~(u_int64_t)0 << (start % 64));
+	while(1)
+	{
+		if(bits)
+		{
+			int bit = word * 64 + __builtin_ctzll(bits);
+			return bit < end ? bit : -1;
+		}
+		if(++word * 64 >= end)
+			return -1;
+		bits = words[word] ^ invert;
+	}
+}
+
+int bitmap_find_free(u_int64_t* words, int start, int end)
+{
+	/*
+		* Return value: -1,				no free bit in [start, end)
+						 bit number,	first free (0) bit in [start, end)
+	*/
+
+	return bitmap_scan(words, start, end, ~(u_int64_t)0);
+}
+
+int bitmap_find_used(u_int64_t* words, int start, int end)
+{
+	/*
+		* Return value: -1,				no used bit in [start, end)
+						 bit number,	first used (1) bit in [start, end)
+	*/
+
+	return bitmap_scan(words, start, end, 0);
+}
+
+int bitmap_next_fit(u_int64_t* words, int first, int end, int* cursor)
+{
+	/*
+		* Allocates the first free bit at or after *cursor, wrapping around to 'first'
+		* Moves the cursor past the allocated bit
+
+		* Return value: -1,				no free bit in [first, end)
+						 bit number,	success
+	*/
+
+	int start = (*cursor >= first && *cursor < end) ? *cursor : first;
+	int bit = bitmap_find_free(words, start, end);
+
+	if(bit == -1)
+		bit = bitmap_find_free(words, first, start);
+	if(bit == -1)
+		return -1;
+
+	bitmap_set(words, bit);
+	*cursor = bit + 1;
+	return bit;
+}
+
+int bitmap_find_run(u_int64_t* words, int first, int end, int start, int length)
+{
+	/*
+		* Finds 'length' consecutive free bits in [first, end), looking at or after 'start' first
+		* The bits are not allocated
+
+		* Return value: -1,				no such run
+						 bit number,	first bit of the run
+	*/
+
+	for(int pass=0; pass<2; pass++)
+	{
+		int from = pass == 0 ? start : first;
+		int to = pass == 0 ? end : start + length - 1;
+
+		if(to > end)
+			to = end;
+		while(1)
+		{
+			int free_bit = bitmap_find_free(words, from, to);
+			int used_bit;
+
+			if(free_bit == -1 || free_bit + length > to)
+				break;
+			used_bit = bitmap_find_used(words, free_bit, free_bit + length);
+			if(used_bit == -1)
+				return free_bit;
+			from = used_bit + 1;
+		}
+	}
+	return -1;
+}
+
+
+/*-----------ENCRYPTION------------*/
+void encrypt_scalar(int key, char* buf, int size){
+	/*
+		* Encrypts the buffer of size 'size' using key, one byte at a time
+		* Reference for the vector kernels below
+	*/
+
+	for(int i=0; i<size; i++)
+		buf[i] = (buf[i]+key)%256;
+}
+
+void decrypt_scalar(int key, char* buf, int size){
+	/*
+		* Decrypts the buffer of size 'size' using key, one byte at a time
+		* Reference for the vector kernels below
+	*/
+
+	for(int i=0; i<size; i++){
+		if(buf[i] < key)
+			buf[i] = 256 - key + buf[i];
+		else 
+			buf[i] = buf[i] - key;
+	}
+}
+
+/*
+	* Both transforms are a byte-wise addition modulo 256: encryption adds the
+	* low byte of the key, and both branches of decryption subtract it (256 - key
+	* and -key are the same byte). The kernels below add 'delta' to every byte.
+*/
+void crypt_add_scalar(char* buf, int size, unsigned char delta){
+	unsigned char *bytes = (unsigned char*)buf;
+
+	for(int i=0; i<size; i++)
+		bytes[i] += delta;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+void crypt_add_sse2(char* buf, int size, unsigned char delta){
+	__m128i add = _mm_set1_epi8((char)delta);
+	int i = 0;
+
+	for(; i + 64 <= size; i += 64){
+		__m128i a = _mm_loadu_si128((__m128i*)(buf + i));
+		__m128i b = _mm_loadu_si128((__m128i*)(buf + i + 16));
+		__m128i c = _mm_loadu_si128((__m128i*)(buf + i + 32));
+		__m128i d = _mm_loadu_si128((__m128i*)(buf + i + 48));
+		_mm_storeu_si128((__m128i*)(buf + i), _mm_add_epi8(a, add));
+		_mm_storeu_si128((__m128i*)(buf + i + 16), _mm_add_epi8(b, add));
+		_mm_storeu_si128((__m128i*)(buf + i + 32), _mm_add_epi8(c, add));
+		_mm_storeu_si128((__m128i*)(buf + i + 48), _mm_add_epi8(d, add));
+	}
+	for(; i + 16 <= size; i += 16)
+		_mm_storeu_si128((__m128i*)(buf + i), _mm_add_epi8(_mm_loadu_si128((__m128i*)(buf + i)), add));
+	crypt_add_scalar(buf + i, size - i, delta);
+}
+
+__attribute__((target("avx2")))
+void crypt_add_avx2(char* buf, int size, unsigned char delta){
+	__m256i add = _mm256_set1_epi8((char)delta);
+	int i = 0;
+
+	for(; i + 128 <= size; i += 128){
+		__m256i a = _mm256_loadu_si256((__m256i*)(buf + i));
+		__m256i b = _mm256_loadu_si256((__m256i*)(buf + i + 32));
+		__m256i c = _mm256_loadu_si256((__m256i*)(buf + i + 64));
+		__m256i d = _mm256_loadu_si256((__m256i*)(buf + i + 96));
+		_mm256_storeu_si256((__m256i*)(buf + i), _mm256_add_epi8(a, add));
+		_mm256_storeu_si256((__m256i*)(buf + i + 32), _mm256_add_epi8(b, add));
+		_mm256_storeu_si256((__m256i*)(buf + i + 64), _mm256_add_epi8(c, add));
+		_mm256_storeu_si256((__m256i*)(buf + i + 96), _mm256_add_epi8(d, add));
+	}
+	for(; i + 32 <= size; i += 32)
+		_mm256_storeu_si256((__m256i*)(buf + i), _mm256_add_epi8(_mm256_loadu_si256((__m256i*)(buf + i)), add));
+	// Not crypt_add_sse2: mixing its legacy SSE encoding with AVX code stalls on the transition
+	for(; i + 16 <= size; i += 16)
+		_mm_storeu_si128((__m128i*)(buf + i), _mm_add_epi8(_mm_loadu_si128((__m128i*)(buf + i)), _mm256_castsi256_si128(add)));
+	for(; i < size; i++)
+		buf[i] = (unsigned char)buf[i] + delta;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void crypt_add_avx512(char* buf, int size, unsigned char delta){
+	__m512i add = _mm512_set1_epi8((char)delta);
+	int i = 0;
+
+	for(; i + 256 <= size; i += 256){
+		__m512i a = _mm512_loadu_si512((void*)(buf + i));
+		__m512i b = _mm512_loadu_si512((void*)(buf + i + 64));
+		__m512i c = _mm512_loadu_si512((void*)(buf + i + 128));
+		__m512i d = _mm512_loadu_si512((void*)(buf + i + 192));
+		_mm512_storeu_si512((void*)(buf + i), _mm512_add_epi8(a, add));
+		_mm512_storeu_si512((void*)(buf + i + 64), _mm512_add_epi8(b, add));
+		_mm512_storeu_si512((void*)(buf + i + 128), _mm512_add_epi8(c, add));
+		_mm512_storeu_si512((void*)(buf + i + 192), _mm512_add_epi8(d, add));
+	}
+	for(; i + 64 <= size; i += 64)
+		_mm512_storeu_si512((void*)(buf + i), _mm512_add_epi8(_mm512_loadu_si512((void*)(buf + i)), add));
+	if(i < size){
+		// The tail is done with a masked load and store instead of falling back
+		__mmask64 mask = (1ULL << (size - i)) - 1;
+		__m512i tail = _mm512_maskz_loadu_epi8(mask, buf + i);
+		_mm512_mask_storeu_epi8(buf + i, mask, _mm512_add_epi8(tail, add));
+	}
+}
+#endif
+
+struct crypt_kernel_t crypt_kernels[] = {
+	{"scalar", crypt_add_scalar, NULL},
+#if defined(__x86_64__) || defined(__i386__)
+	{"sse2", crypt_add_sse2, "sse2"},
+	{"avx2", crypt_add_avx2, "avx2"},
+	{"avx512", crypt_add_avx512, "avx512bw"},
+#endif
+	{NULL, NULL, NULL}
+};
+void (*crypt_add)(char* buf, int size, unsigned char delta) = NULL;	// selected kernel
+pthread_once_t crypt_once = PTHREAD_ONCE_INIT;
+
+int crypt_kernel_supported(struct crypt_kernel_t *kernel){
+	/*
+		* Return value: 1, the CPU has the instructions of the kernel
+						 0, it does not
+	*/
+	if(!kernel->cpu_feature)
+		return 1;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(strcmp(kernel->cpu_feature, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+	if(strcmp(kernel->cpu_feature, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if(strcmp(kernel->cpu_feature, "avx512bw") == 0)
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+	return 0;
+}
+
+void select_crypt_kernel(void){
+	/*
+		* Picks the last (widest) kernel of crypt_kernels that the CPU supports
+		* The EMUFS_CRYPT environment variable can name a kernel instead
+	*/
+	char *forced = getenv("EMUFS_CRYPT");
+
+	if(forced && choose_crypt_kernel(forced) == 1)
+		return;
+	choose_crypt_kernel(NULL);
+}
+
+int choose_crypt_kernel(char* name){
+	/*
+		* Selects the kernel 'name' of crypt_kernels, or the widest supported one if name is NULL
+
+		* Return value: -1, unknown kernel or not supported by the CPU
+						 1, success
+	*/
+	struct crypt_kernel_t *chosen = NULL;
+
+	for(struct crypt_kernel_t *kernel = crypt_kernels; kernel->name; kernel++){
+		if(!crypt_kernel_supported(kernel))
+			continue;
+		if(!name || strcmp(kernel->name, name) == 0)
+			chosen = kernel;
+	}
+	if(!chosen)
+		return -1;
+	__atomic_store_n(&crypt_add, chosen->add, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int set_crypt_kernel(char* name){
+	/*
+		* Overrides the kernel picked for the CPU, see choose_crypt_kernel
+
+		* Return value: -1, unknown kernel or not supported by the CPU
+						 1, success
+	*/
+	pthread_once(&crypt_once, select_crypt_kernel);
+	return choose_crypt_kernel(name);
+}
+
+char* crypt_kernel_name(void){
+	/*
+		* Return value: name of the selected kernel
+	*/
+	pthread_once(&crypt_once, select_crypt_kernel);
+	void (*add)(char*, int, unsigned char) = __atomic_load_n(&crypt_add, __ATOMIC_ACQUIRE);
+
+	for(struct crypt_kernel_t *kernel = crypt_kernels; kernel->name; kernel++)
+		if(kernel->add == add)
+			return kernel->name;
+	return "unknown";
+}
+
+void encrypt(int key, char* buf, int size){
+	/*
+		* Encrypts the buffer of size 'size' using key
+		* Same result as encrypt_scalar, with the kernel selected for the CPU
+	*/
+	pthread_once(&crypt_once, select_crypt_kernel);
+	__atomic_load_n(&crypt_add, __ATOMIC_ACQUIRE)(buf, size, (unsigned char)key);
+}
+
+void decrypt(int key, char* buf, int size){
+	/*
+		* Decrypts the buffer of size 'size' using key
+		* Same result as decrypt_scalar, with the kernel selected for the CPU
+	*/
+	pthread_once(&crypt_once, select_crypt_kernel);
+	__atomic_load_n(&crypt_add, __ATOMIC_ACQUIRE)(buf, size, (unsigned char)-key);
+}
+
+
+/*-----------AES------------*/
+/*
+	* AES-128/256 in CTR mode for the EMUFS_AES128 and EMUFS_AES256 file systems
+	* The counter block of a device block is: nonce of the file system (8 bytes,
+	* from the superblock) | block number (big endian) | index of the 16-byte chunk
+	* (big endian), so each block has its own keystream and no IV is stored
+*/
+u_int8_t aes_sbox[256];
+u_int32_t aes_te[4][256];		// S-box and MixColumns of one byte, rotated for each row
+pthread_once_t aes_once = PTHREAD_ONCE_INIT;
+
+u_int8_t aes_xtime(u_int8_t x){
+	return (u_int8_t)((x << 1) ^ (x & 0x80 ? 0x1B : 0));
+}
+
+void aes_init_tables(void){
+	/*
+		* Computes the S-box (multiplicative inverse in GF(2^8), then the affine map)
+		* and the encryption tables of the portable implementation
+	*/
+	u_int8_t p = 1, q = 1;
+
+	do{
+		p = p ^ aes_xtime(p);		// p *= 3, q /= 3: q stays the inverse of p
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if(q & 0x80)
+			q ^= 0x09;
+		u_int8_t x = q ^ (u_int8_t)((q << 1) | (q >> 7)) ^ (u_int8_t)((q << 2) | (q >> 6))
+					   ^ (u_int8_t)((q << 3) | (q >> 5)) ^ (u_int8_t)((q << 4) | (q >> 4));
+		aes_sbox[p] = x ^ 0x63;
+	}while(p != 1);
+	aes_sbox[0] = 0x63;
+
+	for(int i=0; i<256; i++){
+		u_int8_t s = aes_sbox[i];
+		u_int32_t word = (u_int32_t)aes_xtime(s) | (u_int32_t)s << 8 | (u_int32_t)s << 16
+						 | (u_int32_t)(aes_xtime(s) ^ s) << 24;
+		for(int r=0; r<4; r++){
+			aes_te[r][i] = word;
+			word = word << 8 | word >> 24;
+		}
+	}
+}
+
+u_int32_t aes_load_word(u_int8_t *bytes){
+	return (u_int32_t)bytes[0] | (u_int32_t)bytes[1] << 8 | (u_int32_t)bytes[2] << 16 | (u_int32_t)bytes[3] << 24;
+}
+
+int aes_set_key(struct aes_key_t *key, u_int8_t *bytes, int bits){
+	/*
+		* Expands a 128 or 256-bit key into the round keys (FIPS-197 byte order, which
+		* is also the order AES-NI expects)
+		* Uses AES-NI for the blocks when the CPU has it (key->use_aesni), unless EMUFS_CRYPT is "scalar"
+
+		* Return value: -1, invalid key length
+						 1, success
+	*/
+	int nk = bits / 32;
+	u_int8_t *w = key->round_keys;
+	u_int8_t rcon = 1;
+
+	if(bits != 128 && bits != 256)
+		return -1;
+	pthread_once(&aes_once, aes_init_tables);
+	key->rounds = nk + 6;
+	memcpy(w, bytes, nk * 4);
+	for(int i=nk; i<4 * (key->rounds + 1); i++){
+		u_int8_t t[4];
+		memcpy(t, w + (i - 1) * 4, 4);
+		if(i % nk == 0){
+			u_int8_t first = t[0];
+			t[0] = aes_sbox[t[1]] ^ rcon;
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[first];
+			rcon = aes_xtime(rcon);
+		}
+		else if(nk > 6 && i % nk == 4)
+			for(int j=0; j<4; j++)
+				t[j] = aes_sbox[t[j]];
+		for(int j=0; j<4; j++)
+			w[i * 4 + j] = w[(i - nk) * 4 + j] ^ t[j];
+	}
+	for(int i=0; i<4 * (key->rounds + 1); i++)
+		key->round_words[i] = aes_load_word(w + i * 4);
+	key->use_aesni = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	key->use_aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+	if(key->use_aesni && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f"))
+		key->use_aesni = 2;
+	if(getenv("EMUFS_CRYPT") && strcmp(getenv("EMUFS_CRYPT"), "scalar") == 0)
+		key->use_aesni = 0;
+#endif
+	return 1;
+}
+
+void aes_encrypt_block_portable(struct aes_key_t *key, u_int8_t *in, u_int8_t *out){
+	/*
+		* Encrypts one 16-byte block with the lookup tables
+		* A column is a word with the byte of row 0 in its low bits
+	*/
+	u_int32_t *rw = key->round_words;
+	u_int8_t *rk = key->round_keys + key->rounds * 16;
+	u_int32_t s[4], t[4];
+
+	for(int c=0; c<4; c++)
+		s[c] = aes_load_word(in + c * 4) ^ rw[c];
+	for(int round=1; round<key->rounds; round++){
+		rw += 4;
+#pragma GCC unroll 4
+		for(int c=0; c<4; c++)
+			t[c] = aes_te[0][s[c] & 0xFF] ^ aes_te[1][(s[(c + 1) & 3] >> 8) & 0xFF]
+				 ^ aes_te[2][(s[(c + 2) & 3] >> 16) & 0xFF] ^ aes_te[3][s[(c + 3) & 3] >> 24]
+				 ^ rw[c];
+		memcpy(s, t, sizeof(s));
+	}
+	for(int c=0; c<4; c++){
+		out[c * 4] = aes_sbox[s[c] & 0xFF] ^ rk[c * 4];
+		out[c * 4 + 1] = aes_sbox[(s[(c + 1) & 3] >> 8) & 0xFF] ^ rk[c * 4 + 1];
+		out[c * 4 + 2] = aes_sbox[(s[(c + 2) & 3] >> 16) & 0xFF] ^ rk[c * 4 + 2];
+		out[c * 4 + 3] = aes_sbox[s[(c + 3) & 3] >> 24] ^ rk[c * 4 + 3];
+	}
+}
+
+void aes_counter_block(u_int8_t *nonce, u_int32_t blocknum, u_int32_t index, u_int8_t *counter){
+	memcpy(counter, nonce, AES_NONCE_SIZE);
+	for(int i=0; i<4; i++){
+		counter[8 + i] = (u_int8_t)(blocknum >> (24 - 8 * i));
+		counter[12 + i] = (u_int8_t)(index >> (24 - 8 * i));
+	}
+}
+
+void aes_ctr_portable(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size){
+	u_int8_t counter[16], stream[16];
+
+	for(int i=0; i<size; i+=16){
+		int n = size - i < 16 ? size - i : 16;
+		aes_counter_block(nonce, blocknum, (u_int32_t)(i / 16), counter);
+		aes_encrypt_block_portable(key, counter, stream);
+		for(int j=0; j<n; j++)
+			buf[i + j] ^= stream[j];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+
+__attribute__((target("aes,sse2")))
+void aes_encrypt_block_aesni(struct aes_key_t *key, u_int8_t *in, u_int8_t *out){
+	__m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i*)in), _mm_loadu_si128((__m128i*)key->round_keys));
+
+	for(int round=1; round<key->rounds; round++)
+		x = _mm_aesenc_si128(x, _mm_loadu_si128((__m128i*)(key->round_keys + round * 16)));
+	x = _mm_aesenclast_si128(x, _mm_loadu_si128((__m128i*)(key->round_keys + key->rounds * 16)));
+	_mm_storeu_si128((__m128i*)out, x);
+}
+
+__attribute__((target("aes,sse2")))
+void aes_ctr_aesni(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size){
+	/*
+		* Eight counter blocks are encrypted together to keep the AES unit busy
+		* The chunk index is the last word of the counter, which is zero in 'base'
+	*/
+	__m128i rk[15];
+	u_int8_t counter[16];
+	int i = 0;
+
+	for(int r=0; r<=key->rounds; r++)
+		rk[r] = _mm_loadu_si128((__m128i*)(key->round_keys + r * 16));
+	aes_counter_block(nonce, blocknum, 0, counter);
+	__m128i base = _mm_loadu_si128((__m128i*)counter);
+
+	for(; i + 128 <= size; i += 128){
+		__m128i x[8];
+		int index = i / 16;
+#pragma GCC unroll 8
+		for(int j=0; j<8; j++)
+			x[j] = _mm_xor_si128(_mm_xor_si128(base, _mm_set_epi32((int)__builtin_bswap32(index + j), 0, 0, 0)), rk[0]);
+		for(int r=1; r<key->rounds; r++){
+			__m128i round_key = rk[r];
+			x[0] = _mm_aesenc_si128(x[0], round_key);
+			x[1] = _mm_aesenc_si128(x[1], round_key);
+			x[2] = _mm_aesenc_si128(x[2], round_key);
+			x[3] = _mm_aesenc_si128(x[3], round_key);
+			x[4] = _mm_aesenc_si128(x[4], round_key);
+			x[5] = _mm_aesenc_si128(x[5], round_key);
+			x[6] = _mm_aesenc_si128(x[6], round_key);
+			x[7] = _mm_aesenc_si128(x[7], round_key);
+		}
+#pragma GCC unroll 8
+		for(int j=0; j<8; j++){
+			__m128i data = _mm_loadu_si128((__m128i*)(buf + i + j * 16));
+			x[j] = _mm_aesenclast_si128(x[j], rk[key->rounds]);
+			_mm_storeu_si128((__m128i*)(buf + i + j * 16), _mm_xor_si128(data, x[j]));
+		}
+	}
+	for(; i < size; i += 16){
+		u_int8_t stream[16];
+		__m128i x = _mm_xor_si128(_mm_xor_si128(base, _mm_set_epi32((int)__builtin_bswap32(i / 16), 0, 0, 0)), rk[0]);
+		for(int r=1; r<key->rounds; r++)
+			x = _mm_aesenc_si128(x, rk[r]);
+		_mm_storeu_si128((__m128i*)stream, _mm_aesenclast_si128(x, rk[key->rounds]));
+		for(int j=0; j<16 && i + j < size; j++)
+			buf[i + j] ^= stream[j];
+	}
+}
+__attribute__((target("vaes,avx512f,aes,sse2")))
+void aes_ctr_vaes(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size){
+	/*
+		* VAES encrypts four counter blocks per 512-bit register, sixteen per iteration
+		* The rest of the block goes to aes_ctr_aesni
+	*/
+	__m512i rk[15];
+	u_int8_t counter[16];
+	int i = 0;
+
+	for(int r=0; r<=key->rounds; r++)
+		rk[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i*)(key->round_keys + r * 16)));
+	aes_counter_block(nonce, blocknum, 0, counter);
+	__m512i base = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i*)counter));
+
+	for(; i + 256 <= size; i += 256){
+		__m512i x[4];
+		int index = i / 16;
+#pragma GCC unroll 4
+		for(int j=0; j<4; j++){
+			int first = index + j * 4;
+			__m512i indexes = _mm512_set_epi32((int)__builtin_bswap32(first + 3), 0, 0, 0, (int)__builtin_bswap32(first + 2), 0, 0, 0,
+											   (int)__builtin_bswap32(first + 1), 0, 0, 0, (int)__builtin_bswap32(first), 0, 0, 0);
+			x[j] = _mm512_xor_si512(_mm512_xor_si512(base, indexes), rk[0]);
+		}
+		for(int r=1; r<key->rounds; r++){
+			__m512i round_key = rk[r];
+			x[0] = _mm512_aesenc_epi128(x[0], round_key);
+			x[1] = _mm512_aesenc_epi128(x[1], round_key);
+			x[2] = _mm512_aesenc_epi128(x[2], round_key);
+			x[3] = _mm512_aesenc_epi128(x[3], round_key);
+		}
+#pragma GCC unroll 4
+		for(int j=0; j<4; j++){
+			__m512i data = _mm512_loadu_si512((void*)(buf + i + j * 64));
+			x[j] = _mm512_aesenclast_epi128(x[j], rk[key->rounds]);
+			_mm512_storeu_si512((void*)(buf + i + j * 64), _mm512_xor_si512(data, x[j]));
+		}
+	}
+	if(i < size){
+		// Same keystream as chunk i / 16 onwards, with the block pointer moved along
+		u_int8_t tail[16];
+		for(; i < size; i += 16){
+			int n = size - i < 16 ? size - i : 16;
+			aes_counter_block(nonce, blocknum, (u_int32_t)(i / 16), counter);
+			aes_encrypt_block_aesni(key, counter, tail);
+			for(int j=0; j<n; j++)
+				buf[i + j] ^= tail[j];
+		}
+	}
+}
+#endif
+
+void aes_encrypt_block(struct aes_key_t *key, u_int8_t *in, u_int8_t *out){
+	/*
+		* Encrypts one 16-byte block (AES-NI or the portable implementation)
+	*/
+#if defined(__x86_64__) || defined(__i386__)
+	if(key->use_aesni){
+		aes_encrypt_block_aesni(key, in, out);
+		return;
+	}
+#endif
+	aes_encrypt_block_portable(key, in, out);
+}
+
+void aes_ctr(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size){
+	/*
+		* Encrypts or decrypts (the same operation in CTR mode) 'size' bytes of device block 'blocknum'
+	*/
+#if defined(__x86_64__) || defined(__i386__)
+	if(key->use_aesni > 1){
+		aes_ctr_vaes(key, nonce, blocknum, buf, size);
+		return;
+	}
+	if(key->use_aesni){
+		aes_ctr_aesni(key, nonce, blocknum, buf, size);
+		return;
+	}
+#endif
+	aes_ctr_portable(key, nonce, blocknum, buf, size);
+}
+
+int parse_hex_key(char *hex, u_int8_t *bytes, int bits){
+	/*
+		* Return value: -1, 'hex' is not bits/4 hexadecimal digits
+						 1, success
+	*/
+	int length = bits / 4;
+
+	if((int)strlen(hex) != length)
+		return -1;
+	for(int i=0; i<length; i+=2){
+		unsigned int byte;
+		if(!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]) || sscanf(hex + i, "%2x", &byte) != 1)
+			return -1;
+		bytes[i / 2] = (u_int8_t)byte;
+	}
+	return 1;
+}
+
+int read_key(int fs_number, int *key, struct aes_key_t *aes){
+	/*
+		* Prompts for the key of an encrypted file system
+		* EMUFS_ENCRYPTED: an integer, the AES file systems: 32 or 64 hex digits
+
+		* Return value: -1, invalid key
+						 1, success (or the file system is not encrypted)
+	*/
+	char hex[AES_MAX_KEY_BYTES * 2 + 1];
+	u_int8_t bytes[AES_MAX_KEY_BYTES];
+	int bits = fs_number == EMUFS_AES256 ? 256 : 128;
+
+	if(fs_number == EMUFS_ENCRYPTED){
+		printf("Input key: ");
+		scanf("%d",key);
+		return 1;
+	}
+	if(fs_number != EMUFS_AES128 && fs_number != EMUFS_AES256)
+		return 1;
+	printf("Input key: ");
+	if(scanf("%64s", hex) != 1 || parse_hex_key(hex, bytes, bits) < 0 || aes_set_key(aes, bytes, bits) < 0){
+		printf("Error: the key must be %d hex digits \n", bits / 4);
+		return -1;
+	}
+	return 1;
+}
+
+void new_nonce(u_int8_t *nonce){
+	/*
+		* Fills the nonce of a new AES file system from /dev/urandom
+		* (from the clock and the process id if it cannot be read)
+	*/
+	int fd = open("/dev/urandom", O_RDONLY);
+	ssize_t got = fd >= 0 ? read(fd, nonce, AES_NONCE_SIZE) : -1;
+
+	if(fd >= 0)
+		close(fd);
+	if(got != AES_NONCE_SIZE){
+		struct timespec now;
+		u_int64_t seed;
+		clock_gettime(CLOCK_REALTIME, &now);
+		seed = (u_int64_t)now.tv_sec * 1000000007ULL ^ (u_int64_t)now.tv_nsec ^ (u_int64_t)getpid() << 32;
+		memcpy(nonce, &seed, AES_NONCE_SIZE);
+	}
+}
+
+int fs_encrypted(int fs_number){
+	return fs_number == EMUFS_ENCRYPTED || fs_number == EMUFS_AES128 || fs_number == EMUFS_AES256;
+}
+
+void crypt_magic(int fs_number, int key, struct aes_key_t *aes, struct superblock_t *superblock, int encrypting){
+	/*
+		* Encrypts (or decrypts) the magic number of a superblock, the only encrypted field
+		* AES file systems use the keystream of block 0, whose other bytes are never encrypted
+	*/
+	if(fs_number == EMUFS_ENCRYPTED){
+		if(encrypting)
+			encrypt(key, (char*)&superblock->magic_number, sizeof(superblock->magic_number));
+		else
+			decrypt(key, (char*)&superblock->magic_number, sizeof(superblock->magic_number));
+	}
+	else if(fs_number == EMUFS_AES128 || fs_number == EMUFS_AES256)
+		aes_ctr(aes, superblock->nonce, 0, (char*)&superblock->magic_number, sizeof(superblock->magic_number));
+}
+
+void encrypt_block(struct mount_t *mount, int blocknum, char *buf){
+	/*
+		* Encrypts a block of the mount in place (it must be an encrypted file system)
+	*/
+	if(mount->fs_number == EMUFS_ENCRYPTED)
+		encrypt(mount->key, buf, mount->block_size);
+	else
+		aes_ctr(&mount->aes, mount->superblock.nonce, (u_int32_t)blocknum, buf, mount->block_size);
+}
+
+void decrypt_block(struct mount_t *mount, int blocknum, char *buf){
+	if(mount->fs_number == EMUFS_ENCRYPTED)
+		decrypt(mount->key, buf, mount->block_size);
+	else
+		aes_ctr(&mount->aes, mount->superblock.nonce, (u_int32_t)blocknum, buf, mount->block_size);
+}
+
+
+/*----------MOUNT-------*/
+int add_new_mount_point(int fd, char *device_name, int fs_number)
+{
+	/*
+		* Creates a mount for the device
+		* Assigns an entry in the mount devices array
+
+		* Return value: -1,									error
+						array entry index (mount point)		success
+	*/
+
+	struct mount_t* mount_point = NULL;
+
+	pthread_mutex_lock(&mounts_lock);
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+		if(mounts[i].device_fd <= 0 )
+		{
+			mount_point = &mounts[i];
+			mount_point->device_fd = fd;
+			strcpy(mount_point->device_name, device_name);
+			mount_point->fs_number = fs_number;
+			pthread_mutex_init(&mount_point->lock, NULL);
+
+			pthread_mutex_unlock(&mounts_lock);
+			return i;
+		}
+	pthread_mutex_unlock(&mounts_lock);
+
+	return -1;
+}
+
+
+void flush_all_devices(void)
+{
+	/*
+		* Writes back the cached blocks of every mounted device
+		* Registered with atexit so that programs which never close their devices keep their data
+	*/
+
+	for(int i=0; i<MAX_MOUNT_POINTS; i++)
+		if(mounts[i].device_fd > 0)
+			flush_device(i);
+}
+
+int block_size_valid(int block_size)
+{
+	/*
+		* Return value: 1 if block_size is a power of two from BLOCKSIZE to MAX_BLOCKSIZE, 0 otherwise
+	*/
+
+	return block_size >= BLOCKSIZE && block_size <= MAX_BLOCKSIZE && (block_size & (block_size - 1)) == 0;
+}
+
+int device_block_size(struct superblock_t* superblock)
+{
+	/*
+		* Return value: block size of a device, from its (decrypted) superblock
+						BLOCKSIZE for a legacy file system, or when none is recorded
+	*/
+
+	if(superblock->magic_number == MAGIC_NUMBER && superblock->fs_number != -1)
+		return BLOCKSIZE;
+	return block_size_valid(superblock->block_size) ? superblock->block_size : BLOCKSIZE;
+}
+
+void check_superblock_extension(int fd, struct superblock_t* superblock)
+{
+	/*
+		* Validates the fields after block_bitmap of a raw superblock read from block 0 (in a buffer
+		  of BLOCKSIZE bytes)
+		* The original layout wrote block 0 from an uninitialized buffer: without SUPERBLOCK_EXTENSION_MAGIC
+		  the rest of the block is cleared and the magic set, as on a new image
+		* A journal must start after the blocks of the device and end within the image file,
+		  otherwise the device is opened without it
+	*/
+
+	char* extension = (char*)&superblock->inode_size;
+	struct stat st;
+
+	if(superblock->extension_magic != SUPERBLOCK_EXTENSION_MAGIC)
+	{
+		memset(extension, 0, BLOCKSIZE - (extension - (char*)superblock));
+		superblock->extension_magic = SUPERBLOCK_EXTENSION_MAGIC;
+		return;
+	}
+	if(superblock->journal_size == 0)
+		return;
+	int block_size = block_size_valid(superblock->block_size) ? superblock->block_size : BLOCKSIZE;
+	if(superblock->journal_size < JOURNAL_MIN_SIZE ||
+	   superblock->journal_start < (u_int64_t)superblock->disk_size * block_size ||
+	   fstat(fd, &st) < 0 || superblock->journal_start + superblock->journal_size > (u_int64_t)st.st_size)
+	{
+		printf("[%.20s] Warning: Invalid journal location, opening the device without it \n", superblock->device_name);
+		superblock->journal_start = 0;
+		superblock->journal_size = 0;
+	}
+}
+
+int opendevice(char* device_name, int size)
+{
+	return opendevice_ex(device_name, size, NULL);
+}
+
+int opendevice_ex(char* device_name, int size, struct device_config_t* config)
+{
+	/*
+		* Opens a device if it exists and do some consistency checks
+		* Creates a device of given size if not present, in blocks of config->block_size bytes
+		  (an existing device keeps the block size recorded in its superblock)
+		* Assigns a mount point
+		* Sets up the block cache and the I/O mode of the mount (config may be NULL for the defaults)
+		* Replays the write-ahead journal of the device, if it has one, before anything reads it;
+		  a device without one gets a journal of config->journal_size bytes after its blocks
+
+		* Return value: -1, 			error
+						 mount point,	success	
+	*/			
+
+	static int exit_flush_registered = 0;
+	int fd;
+	FILE* fp;
 	char tempBuf[BLOCKSIZE];
-	int blocknum = 1 + inodenum / (BLOCKSIZE / sizeof(struct inode_t));
-	readblock(mounts[mount_point].device_fd, blocknum, tempBuf);
+	struct superblock_t* superblock;
+	int mount_point;
+	int key;
+	struct aes_key_t aes;
+	int block_size = config && config->block_size ? config->block_size : BLOCKSIZE;
+	int journal_size = config ? config->journal_size : 0;
+	u_int64_t journal_sequence = 1;
+	long replayed = 0;
+
+	if(!device_name || strlen(device_name) == 0)
+	{
+		printf("Error: Invalid device name \n");
+		return -1;
+	}
+
+	if(size > MAX_DEVICE_BLOCKS || size < 3)
+	{
+		printf("Error: Invalid disk size \n");
+		return -1;
+	}
+
+	if(!block_size_valid(block_size))
+	{
+		printf("Error: Invalid block size \n");
+		return -1;
+	}
+
+	if(journal_size && journal_size < JOURNAL_MIN_SIZE)
+	{
+		printf("Error: Invalid journal size \n");
+		return -1;
+	}
+
+	superblock = (struct superblock_t*)calloc(1, sizeof(struct superblock_t));
+	fp = fopen(device_name, "r");
+	if(!fp)
+	{
+		//	Creating the device
+		printf("[%s] Creating the disk image \n", device_name);
+
+		superblock->fs_number =  -1; 	//	No fs in the disk
+		strcpy(superblock->device_name, device_name);
+		superblock->disk_size = size;
+		superblock->magic_number = MAGIC_NUMBER;	
+		superblock->block_size = block_size;
+		superblock->extension_magic = SUPERBLOCK_EXTENSION_MAGIC;
+		if(journal_size)
+		{
+			superblock->journal_start = (u_int64_t)size * block_size;
+			superblock->journal_size = journal_size;
+		}
+
+		fp = fopen(device_name, "w+");
+		if(!fp)
+		{
+			printf("Error : Unable to create the device. \n");
+			free(superblock);
+			return -1;
+		}
+		fd = fileno(fp);
+
+		// Make size of the disk as the total size
+		// printf("Current offset: %ld \n", lseek( fd, 0, SEEK_CUR ));
+		fseek(fp, (long)size * block_size, SEEK_SET);
+		fputc('\0', fp);
+		fseek(fp, 0, SEEK_SET);
+
+		// Allocating super block on the disk (it is in the first BLOCKSIZE bytes whatever the block size)
+		memset(tempBuf, 0, BLOCKSIZE);
+		memcpy(tempBuf, superblock, sizeof(struct superblock_t));
+		writeblock(fd, 0, tempBuf, BLOCKSIZE);
+		if(journal_size && journal_format(fd, superblock->journal_start, journal_size) < 0)
+			printf("[%s] Warning: Unable to create the journal \n", device_name);
+
+		printf("[%s] Disk image is successfully created \n", device_name);
+	}
+	else
+	{
+		fclose(fp);
+		fd = open(device_name, O_RDWR);
+
+		readblock(fd, 0, tempBuf, BLOCKSIZE);
+		check_superblock_extension(fd, (struct superblock_t*)tempBuf);
+		memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+		if(superblock->journal_size > 0)
+		{
+			// Recovery: the journal may also hold a newer block 0
+			if(journal_replay(fd, superblock->journal_start, superblock->journal_size, &journal_sequence, &replayed) < 0)
+				printf("[%s] Warning: Unable to replay the journal \n", device_name);
+			else if(replayed)
+				printf("[%s] Journal replayed: %ld transactions \n", device_name, replayed);
+			readblock(fd, 0, tempBuf, BLOCKSIZE);
+			check_superblock_extension(fd, (struct superblock_t*)tempBuf);
+			memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+		}
+		if(fs_encrypted(superblock->fs_number)){
+			if(read_key(superblock->fs_number, &key, &aes) < 0){
+				close(fd);
+				free(superblock);
+				return -1;
+			}
+			/*
+				Decrypt Here
+			*/
+			crypt_magic(superblock->fs_number, key, &aes, superblock, 0);
+		}
+		if((superblock->magic_number != MAGIC_NUMBER && superblock->magic_number != MAGIC_NUMBER_EXTENT) ||
+		   superblock->disk_size < 3 || superblock->disk_size > MAX_DEVICE_BLOCKS)
+		{
+			printf("%d,%d,%d",superblock->magic_number,superblock->disk_size,superblock->disk_size);
+			printf("Error: Inconsistent super block on device. \n");
+			free(superblock);
+			return -1;
+		}
+		printf("[%s] Disk opened \n", device_name);
+		block_size = device_block_size(superblock);
+
+		if(journal_size && superblock->journal_size == 0)
+		{
+			// The raw block 0 keeps its encrypted magic number
+			struct superblock_t* raw = (struct superblock_t*)tempBuf;
+			raw->journal_start = superblock->journal_start = (u_int64_t)superblock->disk_size * block_size;
+			raw->journal_size = superblock->journal_size = journal_size;
+			if(journal_format(fd, superblock->journal_start, journal_size) < 0 || writeblock(fd, 0, tempBuf, BLOCKSIZE) < 0)
+			{
+				printf("[%s] Warning: Unable to create the journal \n", device_name);
+				superblock->journal_size = 0;
+			}
+		}
+
+		if(superblock->fs_number == -1)
+			printf("[%s] File system found in the disk \n", device_name);
+		else
+			printf("[%s] File system found. fs_number: %d \n", device_name, superblock->fs_number);
+		
+	}	
+
+	mount_point = add_new_mount_point(fd, device_name, superblock->fs_number);
+	if(mount_point == -1)
+	{
+		printf("Error: No free mount point \n");
+		close(fd);
+		free(superblock);
+		return -1;
+	}
+	if(superblock->fs_number==EMUFS_ENCRYPTED)
+		mounts[mount_point].key=key;
+	else if(fs_encrypted(superblock->fs_number))
+		mounts[mount_point].aes=aes;
+	memcpy(&mounts[mount_point].superblock, superblock, sizeof(struct superblock_t));
+	mounts[mount_point].superblock_dirty = 0;
+	mounts[mount_point].block_size = block_size;
+	load_geometry(mount_point);
+	if(load_bitmaps(mount_point) < 0 || init_inode_table(mount_point) < 0)
+	{
+		printf("Error: Unable to allocate the bitmaps \n");
+		closedevice_(mount_point);
+		free(superblock);
+		return -1;
+	}
+	mounts[mount_point].sync_policy = config ? config->sync_policy : EMUFS_SYNC_OPERATION;
+	mounts[mount_point].device_reads = 0;
+	mounts[mount_point].device_writes = 0;
+
+	if(config && config->io_mode == EMUFS_IO_MMAP && map_device(&mounts[mount_point], superblock->disk_size) < 0)
+		printf("[%s] Warning: Unable to map the device, using file I/O \n", device_name);
+	if(cache_init(&mounts[mount_point].cache, config ? config->cache_blocks : DEFAULT_CACHE_BLOCKS, block_size) < 0)
+		printf("[%s] Warning: Unable to allocate the block cache \n", device_name);
+	if(superblock->journal_size > 0)
+	{
+		// Blocks are pinned in the cache until their transaction commits
+		if(mounts[mount_point].cache.capacity == 0)
+			printf("[%s] Warning: The journal needs the block cache, writes are not journaled \n", device_name);
+		else if(journal_open(mount_point, superblock->journal_start, superblock->journal_size, journal_sequence) < 0)
+			printf("[%s] Warning: Unable to allocate the journal \n", device_name);
+		else
+			mounts[mount_point].journal->replayed = replayed;
+	}
+	if(!exit_flush_registered)
+	{
+		atexit(flush_all_devices);
+		exit_flush_registered = 1;
+	}
+
+	printf("[%s] Disk successfully mounted \n", device_name);
+	free(superblock);
+
+	return mount_point;	
+}
+
+
+int closedevice_(int mount_point)
+{
+	/*
+		* Closes a device
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	char device_name[20];
+
+	if(mounts[mount_point].device_fd <= 0)
+	{
+		printf("Error: Devices not found\n");
+		return -1;
+	}
+
+	strcpy(device_name, mounts[mount_point].device_name);
+	aio_shutdown(mount_point);
+	if(sync_mount(mount_point) < 0 || journal_checkpoint(mount_point) < 0)
+		printf("[%s] Error: Unable to write back cached blocks \n", device_name);
+	journal_close(mount_point);
+	cache_destroy(&mounts[mount_point].cache);
+	free_bitmaps(mount_point);
+	free_inode_table(mount_point);
+	if(mounts[mount_point].device_map)
+		munmap(mounts[mount_point].device_map, mounts[mount_point].map_size);
+	mounts[mount_point].device_map = NULL;
+	mounts[mount_point].map_size = 0;
+	close(mounts[mount_point].device_fd);
+	pthread_mutex_destroy(&mounts[mount_point].lock);
+
+	pthread_mutex_lock(&mounts_lock);
+	mounts[mount_point].device_fd = -1;
+	strcpy(mounts[mount_point].device_name, "\0");
+	mounts[mount_point].fs_number = -1;
+	pthread_mutex_unlock(&mounts_lock);
+
+	printf("[%s] Device closed \n", device_name);
+	return 1;
+}
+
+int flush_device(int mount_point)
+{
+	/*
+		* Writes back all the cached blocks of the device
+		* Syncs the mapping if the device is memory mapped
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	if(mount_point < 0 || mount_point >= MAX_MOUNT_POINTS || mounts[mount_point].device_fd <= 0)
+	{
+		printf("Error: Devices not found\n");
+		return -1;
+	}
+
+	return sync_mount(mount_point);
+}
+
+int set_block_size(int mount_point, int block_size)
+{
+	/*
+		* Switches the mount to blocks of block_size bytes, when a new file system is laid out
+		* The cached blocks are written back (and the journal checkpointed) and the cache is
+		  rebuilt for the new size, with the same number of blocks
+		* The device keeps its length: its disk_size is recomputed in the new blocks
+
+		* Return value: -1, error
+						 1, success
+	*/
+
+	struct mount_t* mount = &mounts[mount_point];
+	int capacity = mount->cache.capacity;
+	long bytes;
+
+	if(!block_size_valid(block_size))
+		return -1;
+	if(mount->block_size == block_size)
+		return 1;
+	if(sync_mount(mount_point) < 0 || journal_checkpoint(mount_point) < 0)
+		return -1;
+
+	cache_destroy(&mount->cache);
+	pthread_mutex_lock(&mount->lock);
+	bytes = (long)mount->superblock.disk_size * mount->block_size;
+	mount->block_size = block_size;
+	mount->superblock.disk_size = bytes / block_size;
+	mount->superblock.block_size = block_size;
+	pthread_mutex_unlock(&mount->lock);
+	if(cache_init(&mount->cache, capacity, block_size) < 0)
+		printf("[%s] Warning: Unable to allocate the block cache \n", mount->device_name);
+	return 1;
+}
+
+int update_mount(int mount_point, int fs_number){
+	/*
+		* Update the mount point with the file system number
+		* Prompts for key if its an encrypted file system
+
+		* Return value: -1, invalid key
+						 1, success
+	*/
+
+	int key;
+	struct aes_key_t aes;
+	if(read_key(fs_number, &key, &aes) < 0)
+		return -1;
+	pthread_mutex_lock(&mounts[mount_point].lock);
+	mounts[mount_point].fs_number = fs_number;
+	if(fs_number == EMUFS_ENCRYPTED)
+		mounts[mount_point].key=key;
+	else if(fs_encrypted(fs_number))
+		mounts[mount_point].aes=aes;
+	pthread_mutex_unlock(&mounts[mount_point].lock);
+	return 1;
+}
+
+int mount_format(int mount_point){
+	/*
+		* Return value: on-disk format of the file system of the mount (EMUFS_FORMAT_*)
+	*/
+	return mounts[mount_point].format;
+}
+
+int mount_block_size(int mount_point){
+	/*
+		* Return value: bytes per block of the device of the mount
+	*/
+	return mounts[mount_point].block_size;
+}
+
+int mount_journaled(int mount_point){
+	/*
+		* Return value: 1 if the writes of the mount go through a write-ahead journal, 0 otherwise
+	*/
+	return mounts[mount_point].journal != NULL;
+}
+
+int mount_encrypted(int mount_point){
+	/*
+		* Return value: 1 if the data blocks of the mount are stored encrypted, 0 otherwise
+	*/
+	return fs_encrypted(mounts[mount_point].fs_number);
+}
+
+int mount_sync_policy(int mount_point){
+	/*
+		* Return value: when the metadata of the mount is written back (EMUFS_SYNC_*)
+	*/
+	return mounts[mount_point].sync_policy;
+}
+
+int mount_inode_count(int mount_point){
+	/*
+		* Return value: number of inodes of the file system of the mount
+	*/
+	return mounts[mount_point].inode_count;
+}
+
+void mount_dump(void)
+{
+	/*
+		* Prints summary of mount points
+	*/
+
+	struct mount_t* mount_point;
+
+	printf("\n%-12s %-20s %-15s %-10s %-20s \n", "MOUNT-POINT", "DEVICE-NAME", "DEVICE-NUMBER", "FS-NUMBER", "FS-NAME");
+	for(int i=0; i< MAX_MOUNT_POINTS; i++)
+	{
+		mount_point = mounts + i;
+		if(mount_point->device_fd <= 0)
+			continue;
+
+		if(mount_point->device_fd > 0)
+			printf("%-12d %-20s %-15d %-10d %-20s\n", 
+					i, mount_point->device_name, mount_point->device_fd, mount_point->fs_number, 
+					mount_point->fs_number == EMUFS_NON_ENCRYPTED ? "emufs non-encrypted" : (mount_point->fs_number == EMUFS_ENCRYPTED ? "emufs encrypted" :
+					(mount_point->fs_number == EMUFS_AES128 ? "emufs aes-128" : (mount_point->fs_number == EMUFS_AES256 ? "emufs aes-256" : "Unknown file system"))));
+	}
+}
+
+int alloc_bitmaps(int mount_point){
+	/*
+		* Allocates the packed bitmaps of the mount for the layout set by load_geometry, all bits clear
+		* Extent format: the words cover whole bitmap blocks, so a block is copied to or from them as is
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	size_t inode_bytes = BITMAP_WORDS(MAX_INODES) * sizeof(u_int64_t);
+	size_t block_bytes = BITMAP_WORDS(MAX_BLOCKS) * sizeof(u_int64_t);
+
+	free_bitmaps(mount_point);
+	if(mount->format == EMUFS_FORMAT_EXTENT){
+		inode_bytes = (size_t)mount->inode_bitmap_blocks * mount->block_size;
+		block_bytes = (size_t)mount->block_bitmap_blocks * mount->block_size;
+		mount->bitmap_dirty = (char*)calloc(mount->inode_bitmap_blocks + mount->block_bitmap_blocks, 1);
+		if(!mount->bitmap_dirty)
+			return -1;
+	}
+	mount->inode_words = (u_int64_t*)calloc(1, inode_bytes);
+	mount->block_words = (u_int64_t*)calloc(1, block_bytes);
+	mount->bitmaps_dirty = 0;
+	mount->inode_cursor = 0;
+	mount->block_cursor = 0;
+	memset(mount->reservations, 0, sizeof(mount->reservations));
+	mount->reservation_clock = 0;
+	mount->delalloc_blocks = 0;
+	if(!mount->inode_words || !mount->block_words)
+		return -1;
+	return 1;
+}
+
+int load_bitmaps(int mount_point){
+	/*
+		* Builds the packed bitmaps of the mount
+		* Legacy format: from the bitmaps of the in-memory superblock
+		* Extent format: reads and decrypts the bitmap blocks, BLOCKS_PER_IO at a time
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(alloc_bitmaps(mount_point) < 0)
+		return -1;
+
+	if(mount->format == EMUFS_FORMAT_LEGACY){
+		for(int i=0; i<MAX_INODES; i++)
+			if(mount->superblock.inode_bitmap[i] == USED)
+				bitmap_set(mount->inode_words, i);
+		for(int i=0; i<MAX_BLOCKS; i++)
+			if(mount->superblock.block_bitmap[i] == USED)
+				bitmap_set(mount->block_words, i);
+		return 1;
+	}
+
+	int total = mount->inode_bitmap_blocks + mount->block_bitmap_blocks;
+	int blocks[BLOCKS_PER_IO];
+	char *bufs[BLOCKS_PER_IO];
+
+	for(int first=0; first<total; first+=BLOCKS_PER_IO){
+		int n = total - first < BLOCKS_PER_IO ? total - first : BLOCKS_PER_IO;
+		for(int i=0; i<n; i++){
+			blocks[i] = mount->inode_bitmap_start + first + i;	// the block bitmap follows the inode bitmap
+			bufs[i] = bitmap_block_data(mount, first + i);
+		}
+		if(cache_readblocks(mount_point, blocks, bufs, n) < 0)
+			return -1;
+		if(fs_encrypted(mount->fs_number))
+			for(int i=0; i<n; i++)
+				decrypt_block(mount, blocks[i], bufs[i]);
+	}
+	return 1;
+}
+
+void free_bitmaps(int mount_point){
+	free(mounts[mount_point].inode_words);
+	free(mounts[mount_point].block_words);
+	free(mounts[mount_point].bitmap_dirty);
+	mounts[mount_point].inode_words = NULL;
+	mounts[mount_point].block_words = NULL;
+	mounts[mount_point].bitmap_dirty = NULL;
+}
+
+char* bitmap_block_data(struct mount_t *mount, int index){
+	/*
+		* Return value: the bytes of bitmap block 'index' (inode bitmap blocks first) in the packed bitmaps
+	*/
+	if(index < mount->inode_bitmap_blocks)
+		return (char*)mount->inode_words + (size_t)index * mount->block_size;
+	return (char*)mount->block_words + (size_t)(index - mount->inode_bitmap_blocks) * mount->block_size;
+}
+
+int persist_bitmaps(int mount_point){
+	/*
+		* Encrypts and writes the dirty bitmap blocks of an extent format mount
+		* The caller holds the mount lock
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	char tempBuf[mount->block_size];
+	int total = mount->inode_bitmap_blocks + mount->block_bitmap_blocks;
+	int ret = 1;
+
+	for(int i=0; i<total; i++){
+		if(!mount->bitmap_dirty[i])
+			continue;
+		memcpy(tempBuf, bitmap_block_data(mount, i), mount->block_size);
+		if(fs_encrypted(mount->fs_number))
+			encrypt_block(mount, mount->inode_bitmap_start + i, tempBuf);
+		if(cache_writeblock(mount_point, mount->inode_bitmap_start + i, tempBuf) < 0)
+			ret = -1;
+		else
+			mount->bitmap_dirty[i] = 0;
+	}
+	if(ret == 1)
+		mount->bitmaps_dirty = 0;
+	return ret;
+}
+
+void bitmap_block_changed(int mount_point, int index){
+	/*
+		* Marks bitmap block 'index' dirty
+		* Writes it right away if the mount uses EMUFS_SYNC_IMMEDIATE
+		* The caller holds the mount lock
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	mount->bitmap_dirty[index] = 1;
+	mount->bitmaps_dirty = 1;
+	if(mount->sync_policy == EMUFS_SYNC_IMMEDIATE)
+		persist_bitmaps(mount_point);
+}
+
+void load_geometry(int mount_point){
+	/*
+		* Sets the format and the layout of the metadata of the mount from its superblock
+		* A legacy superblock (or one with an inconsistent layout) gives the legacy layout:
+		  bitmaps in the superblock, 16-byte inodes in blocks 1 and 2, data from block 3,
+		  and at most MAX_BLOCKS blocks in use
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	struct superblock_t *superblock = &mount->superblock;
+	int disk_size = superblock->disk_size;
+	int bits = BITS_PER_BLOCK(mount->block_size);
+
+	mount->format = EMUFS_FORMAT_LEGACY;
+	if(superblock->magic_number == MAGIC_NUMBER_EXTENT && superblock->inode_size == sizeof(struct inode_v2_t) &&
+	   superblock->inode_count > 0 && superblock->inode_count <= MAX_FS_INODES)
+	{
+		int inode_bitmap_blocks = BLOCKS_FOR(superblock->inode_count, bits);
+		int block_bitmap_blocks = BLOCKS_FOR(disk_size, bits);
+		int inode_blocks = BLOCKS_FOR((long)superblock->inode_count * superblock->inode_size, mount->block_size);
+
+		if(superblock->inode_bitmap_start == 1 &&
+		   superblock->block_bitmap_start == 1 + inode_bitmap_blocks &&
+		   superblock->inode_table_start == superblock->block_bitmap_start + block_bitmap_blocks &&
+		   superblock->data_start == superblock->inode_table_start + inode_blocks &&
+		   superblock->data_start < disk_size)
+		{
+			mount->format = EMUFS_FORMAT_EXTENT;
+			mount->inode_size = superblock->inode_size;
+			mount->inode_count = superblock->inode_count;
+			mount->inode_table_start = superblock->inode_table_start;
+			mount->data_start = superblock->data_start;
+			mount->block_count = disk_size;
+			mount->inode_bitmap_start = superblock->inode_bitmap_start;
+			mount->inode_bitmap_blocks = inode_bitmap_blocks;
+			mount->block_bitmap_start = superblock->block_bitmap_start;
+			mount->block_bitmap_blocks = block_bitmap_blocks;
+		}
+	}
+
+	if(mount->format == EMUFS_FORMAT_LEGACY)
+	{
+		mount->inode_size = sizeof(struct inode_v1_t);
+		mount->inode_count = MAX_INODES;
+		mount->inode_table_start = 1;
+		mount->data_start = 1 + LEGACY_INODE_BLOCKS;
+		mount->block_count = disk_size < MAX_BLOCKS ? disk_size : MAX_BLOCKS;
+		mount->inode_bitmap_start = 0;
+		mount->inode_bitmap_blocks = 0;
+		mount->block_bitmap_start = 0;
+		mount->block_bitmap_blocks = 0;
+	}
+	mount->inode_blocks = BLOCKS_FOR((long)mount->inode_count * mount->inode_size, mount->block_size);
+}
+
+int init_inode_table(int mount_point){
+	/*
+		* Allocates the in-memory inode table of the mount, for the layout set by load_geometry
+		* Inode table blocks are read and decrypted into it on first use
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	mount->inode_table = (char*)malloc((size_t)mount->inode_blocks * mount->block_size);
+	mount->inode_table_state = (char*)malloc(mount->inode_blocks);
+	mount->inode_dirty_list = (int*)malloc(mount->inode_blocks * sizeof(int));
+	if(!mount->inode_table || !mount->inode_table_state || !mount->inode_dirty_list)
+		return -1;
+	memset(mount->inode_table_state, INODE_BLOCK_UNLOADED, mount->inode_blocks);
+	mount->inode_table_dirty = 0;
+	return 1;
+}
+
+void free_inode_table(int mount_point){
+	free(mounts[mount_point].inode_table);
+	free(mounts[mount_point].inode_table_state);
+	free(mounts[mount_point].inode_dirty_list);
+	mounts[mount_point].inode_table = NULL;
+	mounts[mount_point].inode_table_state = NULL;
+	mounts[mount_point].inode_dirty_list = NULL;
+	mounts[mount_point].inode_table_dirty = 0;
+}
+
+char* load_inode_block(int mount_point, int index){
+	/*
+		* Returns the decrypted block 'index' of the inode table
+		* Reads and decrypts it the first time it is used
+		* The caller holds the mount lock
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	char *block = mount->inode_table + (size_t)index * mount->block_size;
+
+	if(mount->inode_table_state[index] == INODE_BLOCK_UNLOADED){
+		cache_readblock(mount_point, mount->inode_table_start + index, block);
+		if(fs_encrypted(mount->fs_number))
+			decrypt_block(mount, mount->inode_table_start + index, block);
+		mount->inode_table_state[index] = INODE_BLOCK_CLEAN;
+	}
+	return block;
+}
+
+int persist_inode_block(int mount_point, int index){
+	/*
+		* Encrypts a copy of metadata block 'index' if its an encrypted system
+		* Writes it to the device (through the block cache)
+		* The caller holds the mount lock
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	char tempBuf[mount->block_size];
+
+	memcpy(tempBuf, mount->inode_table + (size_t)index * mount->block_size, mount->block_size);
+	if(fs_encrypted(mount->fs_number))
+		encrypt_block(mount, mount->inode_table_start + index, tempBuf);
+
+	if(cache_writeblock(mount_point, mount->inode_table_start + index, tempBuf) < 0)
+		return -1;
+	mount->inode_table_state[index] = INODE_BLOCK_CLEAN;
+	return 1;
+}
+
+int persist_inode_table(int mount_point){
+	/*
+		* Writes every dirty metadata block of the mount (the ones in inode_dirty_list)
+		* Blocks that could not be written stay dirty and listed
+		* The caller holds the mount lock
+
+		* Return value: -1, error
+						 1, success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int kept = 0;
+	int ret = 1;
+
+	for(int i=0; i<mount->inode_table_dirty; i++){
+		int index = mount->inode_dirty_list[i];
+		if(mount->inode_table_state[index] == INODE_BLOCK_DIRTY && persist_inode_block(mount_point, index) < 0){
+			mount->inode_dirty_list[kept++] = index;
+			ret = -1;
+		}
+	}
+	mount->inode_table_dirty = kept;
+	return ret;
+}
+
+int persist_superblock(int mount_point){
+	/*
+		* Writes the in-memory superblock of the mount to block 0
+		* If its an encrypted system, encrypts the magic number before writing
+		* The caller holds the mount lock
+
+		* Return value: -1, error
+						 1, success
+	*/
+	char tempBuf[mounts[mount_point].block_size];
+	struct superblock_t *superblock = (struct superblock_t*)tempBuf;
+
+	memset(tempBuf, 0, mounts[mount_point].block_size);
+	memcpy(tempBuf, &mounts[mount_point].superblock, sizeof(struct superblock_t));
+
+	crypt_magic(mounts[mount_point].fs_number, mounts[mount_point].key, &mounts[mount_point].aes, superblock, 1);
+
+	if(cache_writeblock(mount_point, 0, tempBuf) < 0)
+		return -1;
+	mounts[mount_point].superblock_dirty = 0;
+	return 1;
+}
+
+void superblock_changed(int mount_point){
+	/*
+		* Marks the in-memory superblock dirty
+		* Writes it right away if the mount uses EMUFS_SYNC_IMMEDIATE
+		* The caller holds the mount lock
+	*/
+	mounts[mount_point].superblock_dirty = 1;
+	if(mounts[mount_point].sync_policy == EMUFS_SYNC_IMMEDIATE)
+		persist_superblock(mount_point);
+}
+
+void end_operation(int mount_point){
+	/*
+		* Called by the file system operations once they are done modifying the device
+		* Writes the dirty metadata blocks and the superblock back once for the whole operation (EMUFS_SYNC_OPERATION)
+		* With a journal, waits for the transaction the operation joined to commit, which writes
+		  the metadata back once for all the operations in it (journal_commit)
+	*/
+	if(mounts[mount_point].journal){
+		journal_commit(mount_point);
+		return;
+	}
+	if(mounts[mount_point].sync_policy == EMUFS_SYNC_OPERATION){
+		pthread_mutex_lock(&mounts[mount_point].lock);
+		if(mounts[mount_point].inode_table_dirty)
+			persist_inode_table(mount_point);
+		if(mounts[mount_point].bitmaps_dirty)
+			persist_bitmaps(mount_point);
+		if(mounts[mount_point].superblock_dirty)
+			persist_superblock(mount_point);
+		pthread_mutex_unlock(&mounts[mount_point].lock);
+	}
+}
+
+int sync_mount(int mount_point){
+	/*
+		* Waits for the asynchronous requests in flight
+		* Writes back the metadata, the superblock and all the cached blocks of the mount
+		  (with a journal, after committing them in the running transaction; blocks of a
+		  transaction opened meanwhile stay cached)
+		* Syncs the mapping if the device is memory mapped
+
+		* Return value: -1, error
+						 1, success
+	*/
+	int ret = 1;
+
+	aio_drain(mount_point);
+	journal_start(mount_point);
+	pthread_mutex_lock(&mounts[mount_point].lock);
+	if(mounts[mount_point].inode_table_dirty && persist_inode_table(mount_point) < 0)
+		ret = -1;
+	if(mounts[mount_point].bitmaps_dirty && persist_bitmaps(mount_point) < 0)
+		ret = -1;
+	if(mounts[mount_point].superblock_dirty && persist_superblock(mount_point) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&mounts[mount_point].lock);
+	if(journal_commit(mount_point) < 0)
+		ret = -1;
+	if(flush_cache(mount_point) < 0)
+		ret = -1;
+	if(sync_device(&mounts[mount_point]) < 0)
+		ret = -1;
+	return ret;
+}
+
+void read_superblock(int mount_point, struct superblock_t *superblock){
+	/*	
+		* Copies the in-memory superblock of the mount
+		* It was read (and the magic number decrypted) when the device was opened
+	*/
+
+	pthread_mutex_lock(&mounts[mount_point].lock);
+	memcpy(superblock, &mounts[mount_point].superblock, sizeof(struct superblock_t));
+	pthread_mutex_unlock(&mounts[mount_point].lock);
+}
+
+void write_superblock(int mount_point, struct superblock_t *superblock){
+	/*
+		* Updates the in-memory superblock of the mount and rebuilds the packed bitmaps
+		* The inode table is reloaded, as a new file system may have a different layout
+		* Legacy format: the bitmaps come from the superblock
+		* Extent format: the superblock lays out a new file system, so every block before
+		  data_start is marked used and no inode is; all the bitmap blocks are written back
+		* It reaches the device according to the sync policy of the mount
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	memcpy(&mount->superblock, superblock, sizeof(struct superblock_t));
+	free_inode_table(mount_point);
+	load_geometry(mount_point);
+	init_inode_table(mount_point);
+	if(mount->format == EMUFS_FORMAT_LEGACY)
+		load_bitmaps(mount_point);
+	else if(alloc_bitmaps(mount_point) > 0){
+		for(int i=0; i<mount->data_start; i++)
+			bitmap_set(mount->block_words, i);
+		mount->superblock.blocks_in_use = mount->data_start;
+		mount->superblock.inodes_in_use = 0;
+		memset(mount->bitmap_dirty, 1, mount->inode_bitmap_blocks + mount->block_bitmap_blocks);
+		mount->bitmaps_dirty = 1;
+		if(mount->sync_policy == EMUFS_SYNC_IMMEDIATE)
+			persist_bitmaps(mount_point);
+	}
+	superblock_changed(mount_point);
+	pthread_mutex_unlock(&mounts[mount_point].lock);
+}
+
+void mark_inode(int mount_point, int inodenum, int used){
+	/*
+		* Records an allocated (USED) or freed (UNUSED) inode in the packed bitmap and the on-disk one
+		* Legacy format: the superblock bitmap and used_inodes
+		* Extent format: the inode bitmap block holding it and inodes_in_use
+		* The caller holds the mount lock
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(used == USED)
+		bitmap_set(mount->inode_words, inodenum);
+	else
+		bitmap_clear(mount->inode_words, inodenum);
+
+	if(mount->format == EMUFS_FORMAT_LEGACY){
+		mount->superblock.inode_bitmap[inodenum] = used;
+		mount->superblock.used_inodes += used == USED ? 1 : -1;
+		return;
+	}
+	mount->superblock.inodes_in_use += used == USED ? 1 : -1;
+	bitmap_block_changed(mount_point, inodenum / BITS_PER_BLOCK(mount->block_size));
+}
+
+int alloc_inode(int mount_point){
+	/*
+		* Finds a free inode in the packed bitmap, next-fit from the inode cursor
+		* Update the inode bitmap and the count of used inodes
+		
+		* Return value: -1,				error
+						 inode number, 	success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int inodenum;
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	inodenum = bitmap_next_fit(mount->inode_words, 0, mount->inode_count, &mount->inode_cursor);
+	if(inodenum != -1)
+	{
+		mark_inode(mount_point, inodenum, USED);
+		superblock_changed(mount_point);
+	}
+	pthread_mutex_unlock(&mount->lock);
+	return inodenum;
+}
+
+int alloc_inodes(int mount_point, int count, int *inodenums){
+	/*
+		* Allocates up to count inodes like alloc_inode, under one lock and with one superblock update
+
+		* Return value: number of inodes allocated (the first ones of inodenums), fewer when they run out
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int allocated = 0;
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	for(; allocated<count; allocated++)
+	{
+		int inodenum = bitmap_next_fit(mount->inode_words, 0, mount->inode_count, &mount->inode_cursor);
+		if(inodenum == -1)
+			break;
+		mark_inode(mount_point, inodenum, USED);
+		inodenums[allocated] = inodenum;
+	}
+	if(allocated)
+		superblock_changed(mount_point);
+	pthread_mutex_unlock(&mount->lock);
+	return allocated;
+}
+void free_inode(int mount_point, int inodenum){
+	/*
+		* Updates the inode bitmap and the count of used inodes
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	if(bitmap_test(mount->inode_words, inodenum))
+	{
+		mark_inode(mount_point, inodenum, UNUSED);
+		superblock_changed(mount_point);
+	}
+	pthread_mutex_unlock(&mount->lock);
+}
 
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		decrypt(mounts[mount_point].key, tempBuf, BLOCKSIZE);
+void decode_inode(struct mount_t *mount, char *raw, struct inode_t *inodeptr){
+	/*
+		* Fills the decoded inode from its on-disk form in the format of the mount
+	*/
+	memset(inodeptr, 0, sizeof(struct inode_t));
+	if(mount->format == EMUFS_FORMAT_LEGACY){
+		struct inode_v1_t *disk = (struct inode_v1_t*)raw;
+		memcpy(inodeptr->name, disk->name, sizeof(disk->name));
+		inodeptr->type = disk->type;
+		inodeptr->parent = (unsigned char)disk->parent == 255 ? NO_PARENT : disk->parent;
+		inodeptr->size = disk->size;
+		for(int i=0; i<MAX_FILE_SIZE; i++)
+			inodeptr->mappings[i] = disk->mappings[i];
+		return;
+	}
+
+	struct inode_v2_t *disk = (struct inode_v2_t*)raw;
+	memcpy(inodeptr->name, disk->name, sizeof(disk->name));
+	inodeptr->type = disk->type;
+	inodeptr->parent = disk->parent;
+	inodeptr->size = disk->size;
+	inodeptr->extent_count = disk->extent_count;
+	memcpy(inodeptr->extents, disk->extents, sizeof(disk->extents));
+	inodeptr->indirect = disk->indirect;
+	inodeptr->double_indirect = disk->double_indirect;
+	inodeptr->table_blocks = disk->table_blocks;
+	for(int i=0; i<MAX_FILE_SIZE; i++)
+		inodeptr->mappings[i] = -1;
+}
+
+void encode_inode(struct mount_t *mount, struct inode_t *inodeptr, char *raw){
+	/*
+		* Stores the inode in its on-disk form in the format of the mount
+	*/
+	if(mount->format == EMUFS_FORMAT_LEGACY){
+		struct inode_v1_t *disk = (struct inode_v1_t*)raw;
+		memcpy(disk->name, inodeptr->name, sizeof(disk->name));
+		disk->type = inodeptr->type;
+		disk->parent = inodeptr->parent == NO_PARENT ? (char)255 : inodeptr->parent;
+		disk->size = inodeptr->size;
+		for(int i=0; i<MAX_FILE_SIZE; i++)
+			disk->mappings[i] = inodeptr->mappings[i];
+		return;
+	}
+
+	struct inode_v2_t *disk = (struct inode_v2_t*)raw;
+	memset(disk, 0, sizeof(struct inode_v2_t));
+	memcpy(disk->name, inodeptr->name, sizeof(disk->name));
+	disk->type = inodeptr->type;
+	disk->parent = inodeptr->parent;
+	disk->size = inodeptr->size;
+	disk->extent_count = inodeptr->extent_count;
+	memcpy(disk->extents, inodeptr->extents, sizeof(disk->extents));
+	disk->indirect = inodeptr->indirect;
+	disk->double_indirect = inodeptr->double_indirect;
+	disk->table_blocks = inodeptr->table_blocks;
+}
+
+void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr){
+	/*
+		* Decodes the inode entry out of the in-memory inode table
+		* The inode table block is read and decrypted only the first time
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int offset = inodenum * mount->inode_size;
+	char *block;
 
-	struct metadata_t metadata;
-	memcpy(&metadata, tempBuf, sizeof(metadata));
-	memcpy(inodeptr, &metadata.inodes[inodenum % (BLOCKSIZE / sizeof(struct inode_t))], sizeof(struct inode_t));
+	pthread_mutex_lock(&mount->lock);
+	block = load_inode_block(mount_point, offset / mount->block_size);
+	decode_inode(mount, block + offset % mount->block_size, inodeptr);
+	pthread_mutex_unlock(&mount->lock);
 }
 
 void write_inode(int mount_point, int inodenum, struct inode_t *inodeptr){
 	/*
-		* Read the metadata in block 2 or 3
-		* Decrypt the metadata block if its an encrypted system
-		* Update the inode entry in the metadata block using the memory buffer
-		* Encrypt the metadata block if its an encrypted system
-		* Write back the metadata block to the disk
+		* Update the inode entry in the in-memory inode table using the memory buffer
+		* Mark its inode table block dirty
+		* The block is encrypted and written back according to the sync policy of the mount
 	*/
-	char tempBuf[BLOCKSIZE];
-	int blocknum = 1 + inodenum / (BLOCKSIZE / sizeof(struct inode_t));
-	readblock(mounts[mount_point].device_fd, blocknum, tempBuf);
+	struct mount_t *mount = &mounts[mount_point];
+	int offset = inodenum * mount->inode_size;
+	int index = offset / mount->block_size;
+	char *block;
 
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		decrypt(mounts[mount_point].key, tempBuf, BLOCKSIZE);
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	block = load_inode_block(mount_point, index);
+	encode_inode(mount, inodeptr, block + offset % mount->block_size);
+	if(mount->inode_table_state[index] != INODE_BLOCK_DIRTY){
+		mount->inode_table_state[index] = INODE_BLOCK_DIRTY;
+		mount->inode_dirty_list[mount->inode_table_dirty++] = index;
+	}
+	if(mount->sync_policy == EMUFS_SYNC_IMMEDIATE)
+		persist_inode_table(mount_point);
+	pthread_mutex_unlock(&mount->lock);
+}
 
-	struct metadata_t metadata;
-	memcpy(&metadata, tempBuf, sizeof(metadata));
-	memcpy(&metadata.inodes[inodenum % (BLOCKSIZE / sizeof(struct inode_t))], inodeptr, sizeof(struct inode_t));
-	memcpy(tempBuf, &metadata, sizeof(metadata));
+void mark_datablock(int mount_point, int blocknum, int used){
+	/*
+		* Records an allocated (USED) or freed (UNUSED) block in the packed bitmap and the on-disk one
+		* Legacy format: the superblock bitmap and used_blocks
+		* Extent format: the block bitmap block holding it and blocks_in_use
+		* The caller holds the mount lock
+	*/
+	struct mount_t *mount = &mounts[mount_point];
 
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		encrypt(mounts[mount_point].key, tempBuf, BLOCKSIZE);
+	if(used == USED)
+		bitmap_set(mount->block_words, blocknum);
+	else
+		bitmap_clear(mount->block_words, blocknum);
 
-	writeblock(mounts[mount_point].device_fd, blocknum, tempBuf);
+	if(mount->format == EMUFS_FORMAT_LEGACY){
+		mount->superblock.block_bitmap[blocknum] = used;
+		mount->superblock.used_blocks += used == USED ? 1 : -1;
+		return;
+	}
+	mount->superblock.blocks_in_use += used == USED ? 1 : -1;
+	bitmap_block_changed(mount_point, mount->inode_bitmap_blocks + blocknum / BITS_PER_BLOCK(mount->block_size));
+}
+
+long used_block_count(struct mount_t *mount){
+	/*
+		* Return value: number of blocks in use, counting the metadata blocks
+		* The caller holds the mount lock
+	*/
+	if(mount->format == EMUFS_FORMAT_LEGACY)
+		return mount->superblock.used_blocks;
+	return (long)mount->superblock.blocks_in_use;
+}
+
+long unreserved_block_count(struct mount_t *mount, int reserved){
+	/*
+		* Return value: number of free blocks not promised to buffered writes, counting
+		  the 'reserved' blocks the caller was promised as free
+		* The caller holds the mount lock
+	*/
+	return mount->block_count - used_block_count(mount) - (mount->delalloc_blocks - reserved);
 }
 
 int alloc_datablock(int mount_point){
 	/*
-		* Checks if there are any free blocks (max number of blocks are device size in superblock)
-		* Update the block bitmap and used_blocks 
+		* Finds a free block (max number of blocks are device size in superblock) in the packed bitmap,
+		  next-fit from the block cursor
+		* Update the block bitmap and the count of used blocks
+		* The blocks promised to buffered writes are not free
 		
 		* Return value: -1,				error
 						 block number, 	success
 	*/
-	struct superblock_t superblock;
-	read_superblock(mount_point, &superblock);
-	for(int i=3; i<superblock.disk_size; i++)
+	struct mount_t *mount = &mounts[mount_point];
+	int blocknum = -1;
+
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	if(unreserved_block_count(mount, 0) >= 1)
+		blocknum = bitmap_next_fit(mount->block_words, mount->data_start, mount->block_count, &mount->block_cursor);
+	if(blocknum != -1)
 	{
-		if(superblock.block_bitmap[i] == UNUSED)
-		{
-			superblock.block_bitmap[i] = USED;
-			superblock.used_blocks++;
-			write_superblock(mount_point, &superblock);
-			return i;
+		mark_datablock(mount_point, blocknum, USED);
+		superblock_changed(mount_point);
+	}
+	pthread_mutex_unlock(&mount->lock);
+	return blocknum;
+}
+
+void take_datablocks(int mount_point, int count, int *blocknums){
+	/*
+		* Allocates count blocks, as one contiguous run when there is one
+		* Otherwise takes the blocks one by one, next-fit from the block cursor
+		* The caller holds the mount lock and checked that count blocks are free
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int disk_size = mount->block_count;
+	int start = bitmap_find_run(mount->block_words, mount->data_start, disk_size, mount->block_cursor, count);
+
+	for(int i=0; i<count; i++){
+		if(start >= 0)
+			blocknums[i] = start + i;
+		else
+			blocknums[i] = bitmap_next_fit(mount->block_words, mount->data_start, disk_size, &mount->block_cursor);
+		mark_datablock(mount_point, blocknums[i], USED);
+	}
+	if(start >= 0)
+		mount->block_cursor = start + count;
+}
+
+int alloc_datablocks(int mount_point, int count, int *blocknums, int reserved){
+	/*
+		* Allocates count blocks at once, as one contiguous run when there is one
+		* Otherwise takes the blocks one by one, next-fit from the block cursor
+		* 'reserved' of the blocks come out of the blocks promised to the caller (reserve_delalloc_blocks),
+		  the others must be free and not promised to buffered writes
+		* Nothing is allocated if fewer than count blocks are free
+
+		* Return value: -1,		error
+						 count,	success (block numbers in blocknums)
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(count <= 0)
+		return 0;
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	if(unreserved_block_count(mount, reserved) < count)
+	{
+		pthread_mutex_unlock(&mount->lock);
+		return -1;
+	}
+	mount->delalloc_blocks -= reserved;
+
+	take_datablocks(mount_point, count, blocknums);
+	superblock_changed(mount_point);
+	pthread_mutex_unlock(&mount->lock);
+	return count;
+}
+
+struct reservation_t* reservation_of(struct mount_t *mount, int next){
+	/*
+		* Return value: NULL,				no window continues a file ending before block 'next'
+						 the window,		success
+	*/
+	for(int i=0; i<RESERVATIONS; i++)
+		if(mount->reservations[i].next == next && next < mount->reservations[i].end)
+			return &mount->reservations[i];
+	return NULL;
+}
+
+int block_reserved(struct mount_t *mount, int block, struct reservation_t *own){
+	/*
+		* Return value: 1 if the block lies in the window of another file than the one of 'own', 0 otherwise
+	*/
+	for(int i=0; i<RESERVATIONS; i++)
+		if(&mount->reservations[i] != own && block >= mount->reservations[i].next && block < mount->reservations[i].end)
+			return 1;
+	return 0;
+}
+
+int alloc_file_blocks(int mount_point, int goal, int have, int count, int *blocknums, int reserved){
+	/*
+		* Allocates count blocks to append to a file of 'have' blocks, whose next block would be 'goal'
+		  (0: the file has no block yet)
+		* Goal-directed: the free blocks right after the file come first, as long as they are in
+		  its reservation window or in nobody's
+		* The other blocks start a new window of about the size of the file (RESERVE_MIN to RESERVE_MAX
+		  blocks): a free run at the block cursor, which moves past the window so other files
+		  allocate after it. The window is kept for the next blocks of the file until the cursor
+		  wraps around to it (reservations are not recorded on the device)
+		* Without a free run that long, the blocks come from take_datablocks
+		* 'reserved' of the blocks come out of the blocks promised to the caller, as in alloc_datablocks
+		* Nothing is allocated if fewer than count blocks are free
+
+		* Return value: -1,		error
+						 count,	success (block numbers in blocknums)
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	struct reservation_t *window;
+	int done = 0;
+
+	if(count <= 0)
+		return 0;
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	if(unreserved_block_count(mount, reserved) < count)
+	{
+		pthread_mutex_unlock(&mount->lock);
+		return -1;
+	}
+	mount->delalloc_blocks -= reserved;
+
+	window = goal > 0 ? reservation_of(mount, goal) : NULL;
+	while(goal > 0 && done < count && goal + done < mount->block_count &&
+		  !bitmap_test(mount->block_words, goal + done) &&
+		  ((window && goal + done < window->end) || !block_reserved(mount, goal + done, window)))
+	{
+		blocknums[done] = goal + done;
+		mark_datablock(mount_point, goal + done, USED);
+		done++;
+	}
+	if(window)
+		window->next = window->end < goal + done ? window->end : goal + done;
+
+	if(done < count){
+		int rest = count - done;
+		int size = have + count < RESERVE_MIN ? RESERVE_MIN : (have + count > RESERVE_MAX ? RESERVE_MAX : have + count);
+		int start;
+
+		if(size < rest)
+			size = rest;
+		start = bitmap_find_run(mount->block_words, mount->data_start, mount->block_count, mount->block_cursor, size);
+		if(start >= 0){
+			for(int i=0; i<rest; i++){
+				blocknums[done + i] = start + i;
+				mark_datablock(mount_point, start + i, USED);
+			}
+			window = &mount->reservations[mount->reservation_clock];
+			mount->reservation_clock = (mount->reservation_clock + 1) % RESERVATIONS;
+			window->next = start + rest;
+			window->end = start + size;
+			mount->block_cursor = start + size;
 		}
+		else
+			take_datablocks(mount_point, rest, blocknums + done);
 	}
-	return -1;
+
+	superblock_changed(mount_point);
+	pthread_mutex_unlock(&mount->lock);
+	return count;
+}
+
+int reserve_delalloc_blocks(int mount_point, int count){
+	/*
+		* Promises count free blocks to buffered writes (delayed allocation): no other allocation
+		  takes them until they are allocated (alloc_datablocks, alloc_file_blocks with 'reserved')
+		  or released (release_delalloc_blocks)
+
+		* Return value: -1, error (fewer than count blocks are free and not promised yet)
+						 1,	success
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int ret = -1;
+
+	pthread_mutex_lock(&mount->lock);
+	if(unreserved_block_count(mount, 0) >= count)
+	{
+		mount->delalloc_blocks += count;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&mount->lock);
+	return ret;
+}
+
+void release_delalloc_blocks(int mount_point, int count){
+	/*
+		* Gives back count blocks promised by reserve_delalloc_blocks that are not needed anymore
+		* The count never drops below 0: a handle revoked by a new file system releases
+		  what it reserved on the old one
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+
+	if(count <= 0)
+		return;
+	pthread_mutex_lock(&mount->lock);
+	mount->delalloc_blocks = mount->delalloc_blocks > count ? mount->delalloc_blocks - count : 0;
+	pthread_mutex_unlock(&mount->lock);
+}
+
+void release_reservation(int mount_point, int next){
+	/*
+		* Drops the window of the file whose last block is next - 1 (the file is freed)
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	struct reservation_t *window;
+
+	pthread_mutex_lock(&mount->lock);
+	if((window = reservation_of(mount, next)))
+		window->end = window->next;
+	pthread_mutex_unlock(&mount->lock);
 }
 
 void free_datablock(int mount_point, int blocknum){
 	/*
-		* Updates the block bitmap and used_blocks in the superblock
+		* Updates the block bitmap and the count of used blocks
 	*/
-	struct superblock_t superblock;
-	read_superblock(mount_point, &superblock);
+	struct mount_t *mount = &mounts[mount_point];
 
-	if(superblock.block_bitmap[blocknum] == USED)
+	journal_start(mount_point);
+	pthread_mutex_lock(&mount->lock);
+	if(bitmap_test(mount->block_words, blocknum))
 	{
-		superblock.block_bitmap[blocknum] = UNUSED;
-		superblock.used_blocks--;
-		write_superblock(mount_point, &superblock);
+		mark_datablock(mount_point, blocknum, UNUSED);
+		superblock_changed(mount_point);
 	}
+	pthread_mutex_unlock(&mount->lock);
+}
+
+int free_block_count(int mount_point){
+	/*
+		* Return value: number of unallocated blocks on the device, without the ones promised to buffered writes
+	*/
+	struct mount_t *mount = &mounts[mount_point];
+	int count;
+
+	pthread_mutex_lock(&mount->lock);
+	count = unreserved_block_count(mount, 0);
+	pthread_mutex_unlock(&mount->lock);
+	return count;
 }
 
 
-void read_datablock(int mount_point, int blocknum, char *buf){
+int read_datablock(int mount_point, int blocknum, char *buf){
 	/*
 		* Read the block into the memory buffer
 		* Decrypt the block if its an encrypted system
+
+		* Return value: -1, error
+						1, success
 	*/
-	readblock(mounts[mount_point].device_fd, blocknum, buf);
-	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		decrypt(mounts[mount_point].key, buf, BLOCKSIZE);
+	if(cache_readblock(mount_point, blocknum, buf) < 0)
+		return -1;
+	if(fs_encrypted(mounts[mount_point].fs_number))
+		decrypt_block(&mounts[mount_point], blocknum, buf);
+	return 1;
 }
 
-void write_datablock(int mount_point, int blocknum, char *buf){
+int write_datablock(int mount_point, int blocknum, char *buf){
 	/*
 		* Encrypt the memory buffer if its an encrypted system
 		* Write the metadata buffer to the block in disk
+
+		* Return value: -1, error
+						1, success
 	*/
 
-	char tempBuf[BLOCKSIZE];
-	memcpy(tempBuf, buf, BLOCKSIZE);
+	int block_size = mounts[mount_point].block_size;
+	char tempBuf[block_size];
+	memcpy(tempBuf, buf, block_size);
+
+	if(fs_encrypted(mounts[mount_point].fs_number))
+		encrypt_block(&mounts[mount_point], blocknum, tempBuf);
+
+	journal_commit_if_large(mount_point);
+	return cache_writeblock(mount_point, blocknum, tempBuf);
+}
+
+int peek_datablock(int mount_point, int blocknum, char *buf){
+	/*
+		* Read the block into the memory buffer if it is in the block cache (without device I/O)
+		* Decrypt the block if its an encrypted system
+
+		* Return value: 0, not cached
+						1, success
+	*/
+	if(!cache_peekblock(mount_point, blocknum, buf))
+		return 0;
+	decrypt_datablock(mount_point, blocknum, buf);
+	return 1;
+}
+
+void decrypt_datablock(int mount_point, int blocknum, char *buf){
+	/*
+		* Decrypt a block read from the device (asynchronously) if its an encrypted system
+	*/
+	if(fs_encrypted(mounts[mount_point].fs_number))
+		decrypt_block(&mounts[mount_point], blocknum, buf);
+}
+
+void encrypt_datablock(int mount_point, int blocknum, char *buf){
+	/*
+		* Encrypt a block to be written to the device (asynchronously) if its an encrypted system
+	*/
+	if(fs_encrypted(mounts[mount_point].fs_number))
+		encrypt_block(&mounts[mount_point], blocknum, buf);
+}
+
+void decrypt_blocks(struct mount_t *mount, int *blocknums, char **bufs, int count){
+	/*
+		* Decrypts count blocks of the mount
+		* EMUFS_ENCRYPTED merges blocks that are contiguous in memory into one call,
+		  the AES keystream depends on the block number so those go one block at a time
+	*/
+	int block_size = mount->block_size;
+
+	if(mount->fs_number != EMUFS_ENCRYPTED){
+		for(int i=0; i<count; i++)
+			decrypt_block(mount, blocknums[i], bufs[i]);
+		return;
+	}
+	for(int start=0, run; start<count; start+=run){
+		run = 1;
+		while(start + run < count && bufs[start + run] == bufs[start] + run * block_size)
+			run++;
+		decrypt(mount->key, bufs[start], run * block_size);
+	}
+}
+
+int read_datablocks(int mount_point, int *blocknums, char **bufs, int count){
+	/*
+		* Read count blocks into the memory buffers with one vectored cache/device read
+		* Decrypt the blocks if its an encrypted system
+
+		* Return value: -1, error
+						1, success
+	*/
+	if(cache_readblocks(mount_point, blocknums, bufs, count) < 0)
+		return -1;
+	if(fs_encrypted(mounts[mount_point].fs_number))
+		decrypt_blocks(&mounts[mount_point], blocknums, bufs, count);
+	return 1;
+}
+
+int write_datablocks(int mount_point, int *blocknums, char **bufs, int count){
+	/*
+		* Copy the memory buffers into one staging area and encrypt it if its an encrypted system
+		  (in a single pass for EMUFS_ENCRYPTED, block by block for AES)
+		* Write the blocks with one vectored cache/device write
+		  (with a journal, at most journal_txn_limit blocks per transaction)
+
+		* Return value: -1, error
+						1, success
+	*/
+
+	if(count <= 0)
+		return 1;
+
+	int block_size = mounts[mount_point].block_size;
+	char *staging = (char *)malloc((size_t)count * block_size);
+	char *staged[count];
+	int ret = 1;
+
+	if(!staging){
+		for(int i=0; i<count; i++)
+			if(write_datablock(mount_point, blocknums[i], bufs[i]) < 0)
+				return -1;
+		return 1;
+	}
+
+	for(int i=0; i<count; i++){
+		staged[i] = staging + (size_t)i * block_size;
+		memcpy(staged[i], bufs[i], block_size);
+	}
 
 	if(mounts[mount_point].fs_number == EMUFS_ENCRYPTED)
-		encrypt(mounts[mount_point].key, tempBuf, BLOCKSIZE);
+		encrypt(mounts[mount_point].key, staging, count * block_size);
+	else if(fs_encrypted(mounts[mount_point].fs_number))
+		for(int i=0; i<count; i++)
+			encrypt_block(&mounts[mount_point], blocknums[i], staged[i]);
+
+	// With a journal, a long run is committed in pieces so it does not pin the whole cache
+	for(int i=0, run; i<count; i+=run){
+		run = mounts[mount_point].journal ? journal_txn_limit(&mounts[mount_point]) : count;
+		if(run > count - i)
+			run = count - i;
+		journal_commit_if_large(mount_point);
+		if(cache_writeblocks(mount_point, blocknums + i, staged + i, run) < 0){
+			ret = -1;
+			break;
+		}
+	}
+	free(staging);
+	return ret;
+}
+
+/*-----------BLOCK MAPPING------------*/
+int file_blocks(int mount_point, long bytes){
+	/*
+		* Return value: number of blocks of the mount holding 'bytes' bytes
+	*/
+	return (int)BLOCKS_FOR(bytes, mounts[mount_point].block_size);
+}
+
+int extent_leaf_blocks(int mount_point, int extent_count){
+	/*
+		* Return value: number of extent blocks under the double indirect block
+						for a file with extent_count extents
+	*/
+	int per_block = EXTENTS_PER_BLOCK(mounts[mount_point].block_size);
+	int rest = extent_count - INODE_EXTENTS - per_block;
+
+	return rest > 0 ? (rest + per_block - 1) / per_block : 0;
+}
+
+struct extent_t* load_extents(int mount_point, struct inode_t *inode, int room){
+	/*
+		* Collects all the extents of an extent format inode into one array,
+		  reading its indirect and double indirect extent blocks
+		* The array is freed by the caller, it has room for 'room' more extents
+
+		* Return value: NULL, error
+						array of the extents, success
+	*/
+	int block_size = mounts[mount_point].block_size;
+	int per_block = EXTENTS_PER_BLOCK(block_size);
+	int count = inode->extent_count;
+	struct extent_t *extents = (struct extent_t*)malloc(((size_t)count + room + 1) * sizeof(struct extent_t));
+	u_int32_t pointers[POINTERS_PER_BLOCK(block_size)];
+	char buf[block_size];
+	int done;
+
+	if(!extents)
+		return NULL;
+
+	done = count < INODE_EXTENTS ? count : INODE_EXTENTS;
+	memcpy(extents, inode->extents, done * sizeof(struct extent_t));
+
+	if(done < count){
+		int n = count - done < per_block ? count - done : per_block;
+		read_datablock(mount_point, inode->indirect, buf);
+		memcpy(extents + done, buf, n * sizeof(struct extent_t));
+		done += n;
+	}
+	if(done < count){
+		read_datablock(mount_point, inode->double_indirect, (char*)pointers);
+		for(int i=0; done < count; i++){
+			int n = count - done < per_block ? count - done : per_block;
+			read_datablock(mount_point, pointers[i], buf);
+			memcpy(extents + done, buf, n * sizeof(struct extent_t));
+			done += n;
+		}
+	}
+	return extents;
+}
+
+void store_extents(int mount_point, struct inode_t *inode, struct extent_t *extents, int count, int *new_blocks){
+	/*
+		* Stores the extents back into the inode and its extent blocks
+		* Extent blocks the inode does not have yet are taken from new_blocks, which holds exactly
+		  the number grow_file counted for them
+		* Only the extent blocks from the first changed one onwards are rewritten
+	*/
+	int block_size = mounts[mount_point].block_size;
+	int per_block = EXTENTS_PER_BLOCK(block_size);
+	u_int32_t pointers[POINTERS_PER_BLOCK(block_size)];
+	char buf[block_size];
+	int old_count = inode->extent_count;
+	int old_leaves = extent_leaf_blocks(mount_point, old_count);
+	int leaves = extent_leaf_blocks(mount_point, count);
+	int first_changed = old_count > 0 ? old_count - 1 : 0;	// the last extent may have been extended
+	int base;
+
+	memcpy(inode->extents, extents, (count < INODE_EXTENTS ? count : INODE_EXTENTS) * sizeof(struct extent_t));
+	inode->extent_count = count;
+
+	base = INODE_EXTENTS;
+	if(count > base){
+		if(!inode->indirect)
+			inode->indirect = *new_blocks++;
+		if(first_changed < base + per_block){
+			memset(buf, 0, block_size);
+			memcpy(buf, extents + base, ((count - base) < per_block ? count - base : per_block) * sizeof(struct extent_t));
+			write_datablock(mount_point, inode->indirect, buf);
+		}
+	}
+
+	base += per_block;
+	if(leaves == 0)
+		return;
+
+	if(!inode->double_indirect){
+		inode->double_indirect = *new_blocks++;
+		memset(pointers, 0, block_size);
+	}
+	else
+		read_datablock(mount_point, inode->double_indirect, (char*)pointers);
+	for(int i=old_leaves; i<leaves; i++)
+		pointers[i] = *new_blocks++;
+	if(leaves != old_leaves)
+		write_datablock(mount_point, inode->double_indirect, (char*)pointers);
+
+	for(int i=0; i<leaves; i++){
+		int first = base + i * per_block;
+		int n = count - first < per_block ? count - first : per_block;
+
+		if(first + n <= first_changed)
+			continue;
+		memset(buf, 0, block_size);
+		memcpy(buf, extents + first, n * sizeof(struct extent_t));
+		write_datablock(mount_point, pointers[i], buf);
+	}
+}
+
+int map_file_blocks(int mount_point, struct inode_t *inode, int first, int count, int *blocknums){
+	/*
+		* Translates the blocks [first, first + count) of the file into device block numbers
+		* Legacy format: the direct mappings of the inode
+		* Extent format: walks the extents, through the indirect extent blocks when there are more
+
+		* Return value: -1, error (a block is not allocated)
+						 count, success
+	*/
+	struct extent_t *extents;
+	int done = 0;
+	int logical = 0;
+
+	if(count <= 0)
+		return 0;
+
+	if(mounts[mount_point].format == EMUFS_FORMAT_LEGACY){
+		if(first < 0 || first + count > MAX_FILE_SIZE)
+			return -1;
+		for(int i=0; i<count; i++){
+			if(inode->mappings[first + i] < 0)
+				return -1;
+			blocknums[i] = inode->mappings[first + i];
+		}
+		return count;
+	}
+
+	if(inode->extent_count <= INODE_EXTENTS)
+		extents = inode->extents;
+	else if(!(extents = load_extents(mount_point, inode, 0)))
+		return -1;
+
+	for(int e=0; e<inode->extent_count && done < count; e++){
+		int end = logical + extents[e].length;
+
+		while(first + done < end && done < count){
+			blocknums[done] = extents[e].start + (first + done - logical);
+			done++;
+		}
+		logical = end;
+	}
+
+	if(extents != inode->extents)
+		free(extents);
+	return done == count ? count : -1;
+}
+
+int grow_file(int mount_point, struct inode_t *inode, int count, int reserved){
+	/*
+		* Appends count new blocks at the end of a file
+		* Legacy format: fills the next direct mappings, at most MAX_FILE_SIZE blocks in all
+		* Extent format:
+			* The blocks come from one alloc_file_blocks call, right after the last extent when they are free
+			  (which just makes it longer), otherwise from the reservation window of the file
+			* Extent blocks needed for the new extents are allocated too
+		* 'reserved' (at most count) of the data blocks come out of the blocks promised to the caller
+		  for buffered writes; the extent blocks are never promised and must be free
+		* Either every block is allocated or none: nothing changes on failure, the promised blocks included
+		* The caller writes the inode back
+
+		* Return value: -1, error
+						 count, success
+	*/
+	struct extent_t *extents;
+	int *blocknums;
+	int old_count = inode->extent_count;
+	int extent_count = old_count;
+	int max_extents = MAX_EXTENTS(mounts[mount_point].block_size);
+	int meta_count;
+	int have = 0;
+	int goal = 0;
+
+	if(count <= 0)
+		return 0;
+	if(mounts[mount_point].format == EMUFS_FORMAT_LEGACY){
+		int legacy_blocks[MAX_FILE_SIZE];
+		int have = 0;
+		while(have < MAX_FILE_SIZE && inode->mappings[have] >= 0)
+			have++;
+		if(have + count > MAX_FILE_SIZE || alloc_datablocks(mount_point, count, legacy_blocks, reserved) < 0)
+			return -1;
+		for(int i=0; i<count; i++)
+			inode->mappings[have + i] = legacy_blocks[i];
+		return count;
+	}
+
+	if(!(extents = load_extents(mount_point, inode, count)))
+		return -1;
+	for(int e=0; e<old_count; e++)
+		have += extents[e].length;
+	if(old_count > 0)
+		goal = extents[old_count - 1].start + extents[old_count - 1].length;
+	if(!(blocknums = (int*)malloc(count * sizeof(int))) || alloc_file_blocks(mount_point, goal, have, count, blocknums, reserved) < 0){
+		free(blocknums);
+		free(extents);
+		return -1;
+	}
+
+	for(int i=0; i<count && extent_count <= max_extents; i++){
+		struct extent_t *last = extent_count > 0 ? &extents[extent_count - 1] : NULL;
 
-	writeblock(mounts[mount_point].device_fd, blocknum, tempBuf);
-}
\ No newline at end of file
+		if(last && last->start + last->length == (u_int32_t)blocknums[i])
+			last->length++;
+		else if(extent_count < max_extents){
+			extents[extent_count].start = blocknums[i];
+			extents[extent_count].length = 1;
+			extent_count++;
+		}
+		else
+			extent_count = max_extents + 1;	// too fragmented
+	}
+
+	meta_count = 0;
+	if(extent_count <= max_extents){
+		meta_count = extent_leaf_blocks(mount_point, extent_count) - extent_leaf_blocks(mount_point, old_count);
+		if(extent_count > INODE_EXTENTS && !inode->indirect)
+			meta_count++;
+		if(extent_leaf_blocks(mount_point, extent_count) > 0 && !inode->double_indirect)
+			meta_count++;
+	}
+
+	int meta_blocks[meta_count > 0 ? meta_count : 1];
+	if(extent_count > max_extents || (meta_count > 0 && alloc_datablocks(mount_point, meta_count, meta_blocks, 0) < 0)){
+		for(int i=0; i<count; i++)
+			free_datablock(mount_point, blocknums[i]);
+		// The freed blocks are promised to the caller again
+		pthread_mutex_lock(&mounts[mount_point].lock);
+		mounts[mount_point].delalloc_blocks += reserved;
+		pthread_mutex_unlock(&mounts[mount_point].lock);
+		free(blocknums);
+		free(extents);
+		return -1;
+	}
+
+	store_extents(mount_point, inode, extents, extent_count, meta_blocks);
+	free(blocknums);
+	free(extents);
+	return count;
+}
+
+void free_file_blocks(int mount_point, struct inode_t *inode){
+	/*
+		* Frees every block of the entity
+		* Legacy format: the mapped blocks of a file (the mappings of a directory are inode numbers)
+		* Extent format: the data blocks of a file or directory and its extent blocks
+	*/
+	struct extent_t *extents;
+
+	if(mounts[mount_point].format == EMUFS_FORMAT_LEGACY){
+		if(inode->type == 0)
+			for(int i=0; i<MAX_FILE_SIZE; i++)
+				if(inode->mappings[i] >= 0)
+					free_datablock(mount_point, inode->mappings[i]);
+		return;
+	}
+
+	if((extents = load_extents(mount_point, inode, 0))){
+		for(int e=0; e<inode->extent_count; e++)
+			for(u_int32_t b=0; b<extents[e].length; b++)
+				free_datablock(mount_point, extents[e].start + b);
+		if(inode->extent_count > 0)
+			release_reservation(mount_point, extents[inode->extent_count - 1].start + extents[inode->extent_count - 1].length);
+		free(extents);
+	}
+
+	if(inode->double_indirect){
+		u_int32_t pointers[POINTERS_PER_BLOCK(mounts[mount_point].block_size)];
+		read_datablock(mount_point, inode->double_indirect, (char*)pointers);
+		for(int i=0; i<extent_leaf_blocks(mount_point, inode->extent_count); i++)
+			free_datablock(mount_point, pointers[i]);
+		free_datablock(mount_point, inode->double_indirect);
+	}
+	if(inode->indirect)
+		free_datablock(mount_point, inode->indirect);
+
+	inode->extent_count = 0;
+	inode->indirect = 0;
+	inode->double_indirect = 0;
+}
+
+void count_run(struct fragmentation_t *report, int start, int length, int *prev_end, long *run){
+	/*
+		* Adds 'length' blocks of a file starting at device block 'start' to the report
+	*/
+	if(length <= 0)
+		return;
+	if(report->blocks > 0 && start == *prev_end)
+		*run += length;
+	else{
+		if(report->blocks > 0 && start < *prev_end)
+			report->backward++;
+		report->extents++;
+		*run = length;
+	}
+	if(*run > report->largest)
+		report->largest = *run;
+	report->blocks += length;
+	*prev_end = start + length;
+}
+
+void file_fragmentation(int mount_point, struct inode_t *inode, struct fragmentation_t *report){
+	/*
+		* Describes how the data blocks of a file are laid out on the device
+		* Extents that follow each other on the device count as one
+	*/
+	struct extent_t *extents;
+	int prev_end = 0;
+	long run = 0;
+
+	memset(report, 0, sizeof(struct fragmentation_t));
+	if(mounts[mount_point].format == EMUFS_FORMAT_LEGACY){
+		for(int i=0; i<MAX_FILE_SIZE && inode->mappings[i] >= 0; i++)
+			count_run(report, inode->mappings[i], 1, &prev_end, &run);
+		return;
+	}
+	if(!(extents = load_extents(mount_point, inode, 0)))
+		return;
+	for(int e=0; e<inode->extent_count; e++)
+		count_run(report, extents[e].start, extents[e].length, &prev_end, &run);
+	free(extents);
+}
@@ -1,38 +1,92 @@
 #include <sys/types.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
-#define BLOCKSIZE 256
+#define BLOCKSIZE 256		// block size of the legacy format and default one; the superblock fits in it
+#define MAX_BLOCKSIZE 65536	// largest block size of the extent format (a power of two from BLOCKSIZE)
 #define MAX_BLOCKS 64 	// This is superblock(1) + metadata(1) + data(40)
 #define MAX_FILE_SIZE 4 // In Blocks
 #define MAX_INODES 32 
+#define MAX_DEVICE_BLOCKS (1 << 28)	// largest device (extent format, the legacy format uses MAX_BLOCKS)
+#define MAX_FS_INODES (1 << 24)		// most inodes of an extent format file system
+#define BLOCKS_PER_INODE 16			// default inode count of the extent format: one per 16 blocks
+#define DEFAULT_CACHE_BLOCKS MAX_BLOCKS	// Enough to hold a whole device
+#define BLOCKS_PER_IO 64	// Most blocks submitted in a single preadv/pwritev
+#define RESERVE_MIN 8		// blocks reserved after a file that grows (extent format)
+#define RESERVE_MAX 1024	// the reservation grows with the file up to this many blocks
+#define RESERVATIONS 64		// reservation windows kept per mount point
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+#define BLOCKS_FOR(bytes, block_size) (((bytes) + (block_size) - 1) / (block_size))
 
 #define UNUSED 0
 #define USED 1
 #define MAGIC_NUMBER 6763
+#define MAGIC_NUMBER_EXTENT 6766	// superblock of a file system in the extent format (hashed directories)
+#define SUPERBLOCK_EXTENSION_MAGIC 0x5458454D	// "MEXT", set on the images created with the fields after block_bitmap
+
+#define NO_PARENT -1				// parent of the root directory (255 in the legacy format)
+#define INODE_EXTENTS 3				// extents held in an extent format inode
+#define EXTENTS_PER_BLOCK(block_size) ((int)((block_size) / sizeof(struct extent_t)))
+#define POINTERS_PER_BLOCK(block_size) ((int)((block_size) / sizeof(u_int32_t)))
+#define BITS_PER_BLOCK(block_size) ((block_size) * 8)	// bitmap bits held by a bitmap block
+#define MAX_EXTENTS(block_size) (INODE_EXTENTS + EXTENTS_PER_BLOCK(block_size) + POINTERS_PER_BLOCK(block_size) * EXTENTS_PER_BLOCK(block_size))
 
 #define EMUFS_NON_ENCRYPTED 0
 #define EMUFS_ENCRYPTED 1
+#define EMUFS_AES128 2		// AES-128 in CTR mode, the counter derived from the block number
+#define EMUFS_AES256 3		// AES-256 in CTR mode
+#define AES_NONCE_SIZE 8
+#define AES_MAX_KEY_BYTES 32
+
+#define JOURNAL_MAGIC 0x4C4E524A		// "JRNL"
+#define JOURNAL_RECORD_MAGIC 0x4E585254	// "TRXN"
+#define JOURNAL_HEADER_SIZE 512		// bytes before the first record of the journal region
+#define JOURNAL_TXN_BLOCKS 256		// a write alone in a transaction of more blocks commits it and goes on in the next one
+#define AIO_READ 0
+#define AIO_WRITE 1
+#define AIO_QUEUE_DEPTH 256			// block requests in flight per mount, more wait in aio_submit
+#define AIO_WORKERS 4				// threads of the fallback engine (no io_uring)
+
+#define JOURNAL_MIN_SIZE (JOURNAL_HEADER_SIZE + 4 * (MAX_BLOCKSIZE + 64))	// holds records of a block of any size
 
 /* ------------------- In-Disk objects ------------------- */
 struct superblock_t
 {
 	int magic_number;                   
 	char device_name[20];	            // name of the device
-	int disk_size;		                // size of the device in blocks
+	int disk_size;		                // size of the device in blocks (of block_size bytes)
 	int fs_number;		                // File system number
 				                        // -1: No filesystem exists
 				                        //  0: emufs not-encrypted
 				                        //  1: emufs encrypted
-	char used_inodes;					// number of inodes in use
-	char used_blocks;					// number of blocks in use
-	char inode_bitmap[MAX_INODES];      // Bitmap of Inodes
+				                        //  2, 3: emufs AES-128, AES-256 (CTR)
+	char used_inodes;					// number of inodes in use (legacy format)
+	char used_blocks;					// number of blocks in use (legacy format)
+	char inode_bitmap[MAX_INODES];      // Bitmap of Inodes (legacy format)
                                         // 0 = free inode
                                         // 1 = allocated
-	char block_bitmap[MAX_BLOCKS];    	// Bitmap of blocks
+	char block_bitmap[MAX_BLOCKS];    	// Bitmap of blocks (legacy format)
 				    					// 0 = free block
 				    					// 1 = allocated
+	// Extent format only (magic_number == MAGIC_NUMBER_EXTENT)
+	// Layout: superblock, inode bitmap blocks, block bitmap blocks, inode table, data
+	int inode_size;						// bytes per on-disk inode
+	int inode_count;					// number of inodes, chosen by create_file_system_ex
+	int inode_table_start;				// first block of the inode table
+	int data_start;						// first data block
+	int inode_bitmap_start;				// first block of the inode bitmap (BITS_PER_BLOCK inodes per block)
+	int block_bitmap_start;				// first block of the block bitmap
+	u_int64_t inodes_in_use;			// used_inodes and used_blocks of the extent format
+	u_int64_t blocks_in_use;
+	int block_size;						// bytes per block, 0: BLOCKSIZE (always BLOCKSIZE in the legacy format)
+	u_int8_t nonce[AES_NONCE_SIZE];		// AES file systems: first half of the counter blocks, random per file system
+	u_int64_t journal_start;			// byte offset of the write-ahead journal in the device image (after the last block)
+	int journal_size;					// bytes of the journal, 0: no journal
+	u_int32_t extension_magic;			// SUPERBLOCK_EXTENSION_MAGIC: the fields from inode_size on are valid
+										// (images of the original layout left them uninitialized)
 };
 
-struct inode_t		// 16 bytes
+struct inode_v1_t	// 16 bytes, legacy format
 {
 	char name[8];		    	// name of the file
     char type;                  // type of entity
@@ -48,11 +102,252 @@ struct inode_t		// 16 bytes
 struct metadata_t	// 256 bytes
 {	// Array of inodes.
 	// Stored in metadata block
-	struct inode_t inodes[BLOCKSIZE/16];		
+	struct inode_v1_t inodes[BLOCKSIZE/16];		
+};
+
+struct extent_t		// 8 bytes
+{
+	u_int32_t start;			// first block
+	u_int32_t length;			// number of blocks
+};
+
+struct inode_v2_t	// 64 bytes, extent format
+{
+	char name[8];				// name of the file
+	char type;					// 0 = file, 1 = directory
+	char unused[3];
+	int32_t parent;				// inode of parent directory, NO_PARENT for the root
+	u_int64_t size;				// bytes (files) or entries (directories)
+	u_int32_t extent_count;		// extents in use
+	struct extent_t extents[INODE_EXTENTS];	// first extents of the data
+	u_int32_t indirect;			// block of EXTENTS_PER_BLOCK more extents, 0: none
+	u_int32_t double_indirect;	// block of POINTERS_PER_BLOCK blocks of extents, 0: none
+	u_int32_t table_blocks;		// directories: blocks of the hash table of the entries (a power of two), 0: none
+};
+
+struct dir_entry_t	// 12 bytes, slot of the hash table of a directory (extent format)
+{
+	u_int32_t hash;				// name_hash of the name of the entry
+	u_int32_t inode;			// inode number of the entry, 0: free slot (the root is nobody's entry)
+	char type;					// 0 = file, 1 = directory
+	char unused[3];
 };
+// The data of a directory in the extent format is an open addressing hash table with linear probing:
+// table_blocks blocks of DIR_ENTRIES_PER_BLOCK slots each (the tail of a block is unused),
+// an entry lives in the first free slot from slot hash % slots on
+
+#define DIR_ENTRIES_PER_BLOCK(block_size) ((int)((block_size) / sizeof(struct dir_entry_t)))
+
+#define LEGACY_INODE_BLOCKS (MAX_INODES / (BLOCKSIZE / sizeof(struct inode_v1_t)))	// metadata blocks 1 and 2
+
+#define INODE_BLOCK_UNLOADED 0
+#define INODE_BLOCK_CLEAN 1
+#define INODE_BLOCK_DIRTY 2
 
 
 /* ------------------- In-Memory objects ------------------- */
+struct inode_t		// decoded inode, the same for both formats
+{
+	char name[8];				// name of the file
+	char type;					// 0 = file, 1 = directory
+	int parent;					// inode of parent directory, NO_PARENT for the root
+	long size;					// bytes (files) or entries (directories)
+	int mappings[MAX_FILE_SIZE];	// legacy format: blocks of a file or inodes of the entries of a directory
+									// mappings[i] = -1 : not allocated
+	int extent_count;			// extent format: the mapping of the data
+	struct extent_t extents[INODE_EXTENTS];
+	u_int32_t indirect;
+	u_int32_t double_indirect;
+	int table_blocks;			// extent format directories: blocks of the hash table
+};
+
+struct cache_entry_t
+{
+	int blocknum;						// block held by the entry, -1: free
+	int dirty;							// 1: modified since it was read from the device
+	struct cache_entry_t* lru_prev;		// LRU list, most recently used first
+	struct cache_entry_t* lru_next;
+	struct cache_entry_t* hash_next;	// next entry in the same hash bucket
+	char* data;							// block_size bytes of the mount, as stored on the device
+	int pins;							// journal: transactions in flight that wrote the block,
+										// it is not written back before they commit
+	u_int64_t pin_tid;					// journal: transaction that pinned it last
+	int prefetched;						// 1: put there by readahead and not read since
+	int filling;						// 1: a read (readahead or a miss) is filling it (hashed, not on the LRU list)
+	int stale;							// filling: the block was written around the cache meanwhile,
+										// the data read is dropped
+	int writing;						// 1: evicted, its dirty block is being written back with the cache
+										// lock released (hashed, not on the LRU list)
+	int views;							// read views (emufs_read_view) pointing into data: the entry
+										// is neither evicted nor changed until they are released
+	int detached;						// views: the block was written or dropped meanwhile, the entry is off
+										// the hash chains and the LRU list and is freed with its last view
+	int spilled;						// 1: allocated past the capacity (cache_spill), freed once evicted or released
+	struct cache_entry_t* spill_next;	// spill list of the cache
+};
+
+struct block_cache_t
+{
+	int capacity;						// number of entries, 0: caching disabled
+	int num_buckets;					// power of two
+	struct cache_entry_t* entries;
+	struct cache_entry_t** buckets;
+	struct cache_entry_t lru;			// sentinel of the LRU list
+	char* pool;							// storage for the entry data
+	pthread_mutex_t lock;				// protects the entries and the counters
+	long hits;
+	long misses;
+	long evictions;
+	long writebacks;
+	pthread_cond_t filled;				// broadcast when a read into the cache or a write back completes
+	long readaheads;					// counters for readahead_stats
+	long prefetches;
+	long prefetch_hits;
+	long prefetch_unused;
+	long prefetch_dropped;
+	int viewed;							// entries with read views, at most half of the capacity
+	struct cache_entry_t* spill;		// entries allocated past the capacity while every entry was pinned
+	int spilled;						// number of them
+	int writing;						// entries being written back by cache_evict
+};
+
+struct aes_key_t
+{
+	u_int8_t round_keys[15 * 16];	// expanded key, 11 (AES-128) or 15 (AES-256) round keys
+	u_int32_t round_words[15 * 4];	// the same as words (row 0 in the low byte), for the portable code
+	int rounds;						// 10 or 14
+	int use_aesni;					// 1: blocks are encrypted with the AES-NI instructions, 2: with VAES (AVX-512)
+};
+
+struct journal_header_t	// first bytes of the journal region
+{
+	u_int32_t magic;				// JOURNAL_MAGIC
+	u_int32_t unused;
+	u_int64_t sequence;				// sequence of the first record, older records are ignored
+};
+
+struct journal_record_t	// one transaction, followed by its block numbers (padded to 8 bytes) and block images
+{
+	u_int32_t magic;				// JOURNAL_RECORD_MAGIC
+	u_int32_t count;				// number of blocks
+	u_int64_t sequence;				// one more than the previous record
+	u_int32_t block_size;			// bytes per block image
+	u_int32_t checksum;				// of the whole record, computed with this field 0
+};
+
+struct journal_txn_t	// running transaction of a journal, the operations of every thread join it
+{
+	u_int64_t tid;					// one more than the previous transaction
+	int updates;					// handles of operations in the transaction (journal lock)
+	int* blocks;					// blocks written by them, pinned in the cache (cache lock)
+	int count;
+	int capacity;
+};
+
+struct journal_handle_t	// part of an operation of the thread in the transactions of a mount (thread local)
+{
+	u_int64_t journal_id;			// journal of the handle, another one: the handle is stale
+	u_int64_t tid;					// transaction joined last
+	int active;						// 1: the operation is in transaction tid, which cannot commit before it stops
+	int uncommitted;				// 1: the next journal_commit of the thread waits for transaction tid
+};
+
+struct journal_t
+{
+	u_int64_t id;					// unique per opened journal
+	off_t start;					// byte offset of the region in the device image
+	int size;						// bytes of the region, the header included
+	off_t tail;						// bytes of records after the header
+	u_int64_t first_sequence;		// sequence in the header
+	u_int64_t next_sequence;		// given to the next transaction
+	u_int64_t durable_sequence;		// every transaction up to it is on the device
+	u_int64_t tail_sequence;		// sequence of the record to be written at tail
+	char* pending;					// records of the next group commit
+	size_t pending_length;
+	size_t pending_capacity;
+	int committing;					// 1: a thread is writing a batch, the others wait for it
+	int failed;						// 1: a batch could not be written
+	struct journal_txn_t running;	// transaction the operations join
+	int locked;						// 1: the running transaction is being committed, new handles wait
+	u_int64_t committed_tid;		// every transaction up to it is on the device
+	pthread_mutex_t lock;			// protects the fields above
+	pthread_cond_t done;			// signalled when a batch is on the device, a transaction is committed
+									// or the last handle of a locked transaction stops
+	long transactions;				// counters for journal_stats
+	long blocks;
+	long syncs;
+	long checkpoints;
+	long replayed;
+};
+
+struct aio_request_t	// block read or write submitted to the asynchronous engine of a mount
+{
+	int op;							// AIO_READ or AIO_WRITE
+	int blocknum;
+	int count;						// reads: consecutive blocks from blocknum (0: one)
+	char* buf;						// the blocks, as stored on the device (not decrypted)
+	struct iovec* iovs;				// reads: one buffer per block instead of buf, NULL: buf
+	int result;						// once completed: 1, success / -1, error
+	void (*done)(struct aio_request_t* request);	// run by the engine on completion
+													// NULL: the request is queued for aio_reap
+	void* data;						// for done
+	off_t offset;					// set by aio_submit
+	int slot;						// writes: entry in write_blocks
+	struct iovec iov;
+	struct aio_request_t* next;		// submission or completion queue
+};
+
+struct prefetch_t		// readahead of consecutive blocks, straight into cache entries
+{
+	struct aio_request_t request;
+	struct mount_t* mount;
+	struct cache_entry_t* entries[BLOCKS_PER_IO];	// taken off the LRU list until the read completes
+	struct iovec iovs[BLOCKS_PER_IO];
+};
+
+struct aio_engine_t
+{
+	int fd;							// device of the mount
+	int ring_fd;					// io_uring instance, -1: worker threads
+	void* sq_ring;					// io_uring mappings: submission ring, completion ring, entries
+	void* cq_ring;
+	void* sqes;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned int* sq_tail;			// fields of the rings
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	void* cqes;
+	pthread_t* threads;				// completion thread (io_uring) or workers
+	int num_threads;
+	struct aio_request_t* queue_head;	// submission queue of the workers
+	struct aio_request_t* queue_tail;
+	struct aio_request_t* done_head;	// completed requests without a done function
+	struct aio_request_t* done_tail;
+	int done_count;
+	int unreaped;					// submitted without a done function, not returned by aio_reap yet
+	int in_flight;					// submitted and not completed (done function included)
+	int write_blocks[AIO_QUEUE_DEPTH];	// block of each write in flight, -1: free entry
+	int free_slots[AIO_QUEUE_DEPTH];	// free entries of write_blocks
+	int num_free_slots;
+	int stopping;
+	pthread_mutex_t lock;			// protects the fields above and the submission ring
+	pthread_cond_t work;			// workers: a request was queued
+	pthread_cond_t completed;		// a request completed
+	long submitted;
+	long completions;
+};
+
+struct reservation_t	// blocks held back for the next blocks of a file (in memory only)
+{
+	int next;					// block after the last one of the file: the window belongs to it
+	int end;					// end of the window, next == end: none
+};
+
 struct mount_t
 {
 	int device_fd;		        // Device number / File descriptor of opened file
@@ -60,23 +355,209 @@ struct mount_t
 					            //   > 0: file descriptor of the file used to emulate the disk
 	char device_name[20]; 	    // device name / emulated file name
 	int fs_number;              // File system number
-    int key;                    // encryption key
+    int key;                    // encryption key (EMUFS_ENCRYPTED)
+	struct aes_key_t aes;		// round keys (EMUFS_AES128, EMUFS_AES256)
+	struct block_cache_t cache;	// write-back cache of device blocks
+	char* device_map;			// mapping of the device image
+								//  NULL: blocks are accessed through device_fd
+	size_t map_size;			// length of the mapping in bytes
+	int block_size;				// bytes per block, from the superblock (BLOCKSIZE to MAX_BLOCKSIZE)
+	struct superblock_t superblock;	// decoded superblock, the copy used by the file system
+	int superblock_dirty;		// 1: superblock changed since it was last written
+	int sync_policy;			// when the superblock is written back (EMUFS_SYNC_*)
+	u_int64_t* inode_words;		// inode bitmap packed 64 bits per word
+	u_int64_t* block_words;		// block bitmap packed 64 bits per word
+								// (extent format: the bitmap blocks as stored, decrypted)
+	int inode_cursor;			// next-fit positions: searches for a free
+	int block_cursor;			// inode/block start here and wrap around
+	int delalloc_blocks;		// free blocks promised to buffered writes, allocated when they are flushed
+	struct reservation_t reservations[RESERVATIONS];	// windows of the files growing on the mount
+	int reservation_clock;		// next window replaced
+	int format;					// EMUFS_FORMAT_LEGACY or EMUFS_FORMAT_EXTENT, from the superblock
+	int inode_size;				// bytes per on-disk inode
+	int inode_count;
+	int inode_table_start;		// first block of the inode table
+	int inode_blocks;			// blocks of the inode table
+	int data_start;				// first data block
+	int block_count;			// blocks covered by the block bitmap
+	int inode_bitmap_start;		// extent format: bitmap blocks, as in the superblock
+	int inode_bitmap_blocks;
+	int block_bitmap_start;
+	int block_bitmap_blocks;
+	char* bitmap_dirty;			// per bitmap block (inode bitmap blocks first): 1 if it must be written back
+	int bitmaps_dirty;			// 1: some bitmap block is dirty
+	char* inode_table;			// decrypted copy of the inode table blocks
+	char* inode_table_state;	// per block: INODE_BLOCK_UNLOADED, _CLEAN or _DIRTY
+	int inode_table_dirty;		// number of INODE_BLOCK_DIRTY metadata blocks
+	int* inode_dirty_list;		// their indexes, so a write back does not scan the whole table
+	long device_reads;			// blocks transferred from/to the device
+	long device_writes;
+	struct journal_t* journal;	// write-ahead journal, NULL: none (or no block cache)
+	struct aio_engine_t* aio;	// asynchronous I/O engine, started by the first aio_submit
+	pthread_mutex_t lock;		// protects the superblock, the bitmaps, the cursors, the counters and the inode table
+								// lock order: inode locks (emufs-ops.c) -> mount lock -> cache lock
 };
 
 /*--------Device--------------*/
+int readblock(int dev_fd, int block, char* buf, int block_size);
+int writeblock(int dev_fd, int block, char* buf, int block_size);
+int readblocks(int dev_fd, int* blocks, char** bufs, int count, int block_size);
+int writeblocks(int dev_fd, int* blocks, char** bufs, int count, int block_size);
+int block_size_valid(int block_size);
+int set_block_size(int mount_point, int block_size);
+int device_readblock(struct mount_t* mount, int block, char* buf);
+int device_writeblock(struct mount_t* mount, int block, char* buf);
+int device_readblocks(struct mount_t* mount, int* blocks, char** bufs, int count);
+int device_writeblocks(struct mount_t* mount, int* blocks, char** bufs, int count);
 int closedevice_(int mount_point);
-void update_mount(int mount_point, int fs_number);
+int cache_readblock(int mount_point, int block, char* buf);
+int cache_writeblock(int mount_point, int block, char* buf);
+int cache_readblocks(int mount_point, int* blocks, char** bufs, int count);
+int cache_writeblocks(int mount_point, int* blocks, char** bufs, int count);
+int cache_peekblock(int mount_point, int block, char* buf);
+void cache_discard(int mount_point, int block, int keep_dirty);
+void cache_hit(struct block_cache_t* cache, struct cache_entry_t* entry);
+int cache_prefetch(int mount_point, int* blocks, int count);
+void cache_fill(struct aio_request_t* request);
+int cache_view_blocks(int mount_point, int* blocks, int count, struct cache_entry_t** entries);
+void cache_unview(int mount_point, struct cache_entry_t** entries, int count);
+struct cache_entry_t* cache_spill(struct block_cache_t* cache, int block_size);
+int cache_write_back(struct mount_t* mount);
+int flush_cache(int mount_point);
+int update_mount(int mount_point, int fs_number);
+int mount_format(int mount_point);
+int mount_inode_count(int mount_point);
+int mount_block_size(int mount_point);
+int mount_journaled(int mount_point);
+int mount_encrypted(int mount_point);
+int mount_sync_policy(int mount_point);
+int sync_mount(int mount_point);
+int persist_inode_table(int mount_point);
+int persist_bitmaps(int mount_point);
+int persist_superblock(int mount_point);
+void end_operation(int mount_point);
+
+/*-----------JOURNAL------------*/
+u_int32_t journal_checksum(char* data, size_t length);
+size_t journal_record_length(int count, int block_size);
+u_int32_t journal_record_checksum(struct journal_record_t* record, u_int32_t body);
+struct journal_record_t* journal_next_record(char* region, size_t length, size_t offset, u_int64_t sequence);
+int journal_read(int fd, off_t offset, char* buf, size_t length);
+int journal_write(int fd, off_t offset, char* buf, size_t length);
+int journal_write_header(int fd, off_t start, u_int64_t sequence);
+int journal_format(int fd, off_t start, int size);
+int journal_replay(int fd, off_t start, int size, u_int64_t* sequence, long* replayed);
+int journal_open(int mount_point, off_t start, int size, u_int64_t sequence);
+void journal_close(int mount_point);
+struct journal_handle_t* journal_handle(int mount_point);
+void journal_start(int mount_point);
+void journal_stop(int mount_point);
+void journal_pin(struct mount_t* mount, struct cache_entry_t* entry);
+int journal_record_blocks(struct mount_t* mount);
+int journal_txn_limit(struct mount_t* mount);
+int journal_apply(struct mount_t* mount);
+int journal_write_batch(struct mount_t* mount, char* batch, size_t length);
+char* journal_snapshot(struct mount_t* mount, int* blocks, int count);
+int journal_queue(struct mount_t* mount, char* buf, u_int64_t* sequence);
+int journal_sync(struct mount_t* mount, u_int64_t sequence);
+int journal_commit_running(int mount_point, int rejoin);
+int journal_commit(int mount_point);
+void journal_commit_if_large(int mount_point);
+int journal_checkpoint(int mount_point);
+
+/*-----------ASYNC I/O------------*/
+struct aio_engine_t* aio_engine(int mount_point);
+int aio_uring_setup(struct aio_engine_t* engine);
+void aio_uring_teardown(struct aio_engine_t* engine);
+int aio_uring_enter(struct aio_engine_t* engine, unsigned int submit, unsigned int wait);
+int aio_uring_push(struct aio_engine_t* engine, int opcode, struct aio_request_t* request);
+int aio_transfer(struct aio_engine_t* engine, struct aio_request_t* request, size_t done);
+void* aio_uring_thread(void* arg);
+void* aio_worker(void* arg);
+void aio_complete(struct aio_engine_t* engine, struct aio_request_t* request, long result);
+int aio_submit(int mount_point, struct aio_request_t** requests, int count);
+int aio_reap(int mount_point, struct aio_request_t** completed, int min, int max);
+void aio_wait_block(int mount_point, int block);
+void aio_drain(int mount_point);
+void aio_shutdown(int mount_point);
+char* aio_backend(int mount_point);
+
+/*-----------ENCRYPTION------------*/
+struct crypt_kernel_t {
+	char* name;							// "scalar", "sse2", "avx2" or "avx512"
+	void (*add)(char* buf, int size, unsigned char delta);	// adds delta to every byte
+	char* cpu_feature;					// instruction set it needs, NULL for none
+};
+extern struct crypt_kernel_t crypt_kernels[];	// terminated by an entry with a NULL name
+
+void encrypt(int key, char* buf, int size);
+void decrypt(int key, char* buf, int size);
+void encrypt_scalar(int key, char* buf, int size);
+void decrypt_scalar(int key, char* buf, int size);
+int crypt_kernel_supported(struct crypt_kernel_t *kernel);
+int choose_crypt_kernel(char* name);
+int set_crypt_kernel(char* name);
+char* crypt_kernel_name(void);
+
+int aes_set_key(struct aes_key_t *key, u_int8_t *bytes, int bits);
+void aes_encrypt_block(struct aes_key_t *key, u_int8_t *in, u_int8_t *out);
+void aes_encrypt_block_portable(struct aes_key_t *key, u_int8_t *in, u_int8_t *out);
+void aes_ctr(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size);
+void aes_ctr_portable(struct aes_key_t *key, u_int8_t *nonce, u_int32_t blocknum, char *buf, int size);
+int parse_hex_key(char *hex, u_int8_t *bytes, int bits);
+int read_key(int fs_number, int *key, struct aes_key_t *aes);
+void new_nonce(u_int8_t *nonce);
+int fs_encrypted(int fs_number);
+void crypt_magic(int fs_number, int key, struct aes_key_t *aes, struct superblock_t *superblock, int encrypting);
+void encrypt_block(struct mount_t *mount, int blocknum, char *buf);
+void decrypt_block(struct mount_t *mount, int blocknum, char *buf);
+void decrypt_blocks(struct mount_t *mount, int *blocknums, char **bufs, int count);
+
+/*-----------BITMAPS------------*/
+int bitmap_test(u_int64_t* words, int bit);
+void bitmap_set(u_int64_t* words, int bit);
+void bitmap_clear(u_int64_t* words, int bit);
+int bitmap_find_free(u_int64_t* words, int start, int end);
+int bitmap_find_used(u_int64_t* words, int start, int end);
+int bitmap_next_fit(u_int64_t* words, int first, int end, int* cursor);
+int bitmap_find_run(u_int64_t* words, int first, int end, int start, int length);
 
 /*-----------FILE SYSTEM API------------*/
+int alloc_bitmaps(int mount_point);
+int load_bitmaps(int mount_point);
+void free_bitmaps(int mount_point);
+char* bitmap_block_data(struct mount_t *mount, int index);
+void load_geometry(int mount_point);
+int init_inode_table(int mount_point);
+void free_inode_table(int mount_point);
 void read_superblock(int mount_point, struct superblock_t *superblock);
 void write_superblock(int mount_point, struct superblock_t *superblock);
 
 int alloc_inode(int mount_point);
+int alloc_inodes(int mount_point, int count, int *inodenums);
 void free_inode(int mount_point, int inodenum);
 void read_inode(int mount_point, int inodenum, struct inode_t *inodeptr);
 void write_inode(int mount_point, int inodenum, struct inode_t *inodeptr);
 
 int alloc_datablock(int mount_point);
+int alloc_datablocks(int mount_point, int count, int *blocknums, int reserved);
+int alloc_file_blocks(int mount_point, int goal, int have, int count, int *blocknums, int reserved);
+int reserve_delalloc_blocks(int mount_point, int count);
+void release_delalloc_blocks(int mount_point, int count);
+int free_block_count(int mount_point);
 void free_datablock(int mount_point, int blocknum);
-void read_datablock(int mount_point, int blocknum, char *buf);
-void write_datablock(int mount_point, int blocknum, char *buf);
+int read_datablock(int mount_point, int blocknum, char *buf);
+int write_datablock(int mount_point, int blocknum, char *buf);
+int read_datablocks(int mount_point, int *blocknums, char **bufs, int count);
+int write_datablocks(int mount_point, int *blocknums, char **bufs, int count);
+int peek_datablock(int mount_point, int blocknum, char *buf);
+void decrypt_datablock(int mount_point, int blocknum, char *buf);
+void encrypt_datablock(int mount_point, int blocknum, char *buf);
+
+/*-----------BLOCK MAPPING------------*/
+int file_blocks(int mount_point, long bytes);
+int map_file_blocks(int mount_point, struct inode_t *inode, int first, int count, int *blocknums);
+int grow_file(int mount_point, struct inode_t *inode, int count, int reserved);
+void free_file_blocks(int mount_point, struct inode_t *inode);
+struct fragmentation_t;
+void file_fragmentation(int mount_point, struct inode_t *inode, struct fragmentation_t *report);
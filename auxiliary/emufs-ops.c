@@ -3,110 +3,1695 @@
 
 /* ------------------- In-Memory objects ------------------- */
 
-int init=0; //if the file/directory handles arrays are initialized or not
+struct open_inode_t                 // inode of an open file, shared by the file handles open on it
+{
+    int refs;                       // file handles pointing at it (protected by the open list lock of the inode)
+    int dirty;                      // 1: the size changed since it was last written to the inode table
+    struct inode_t inode;           // protected by the inode lock, like the inode table
+};
+
+struct handle_t                     // file or directory handle
+{
+	int offset;		                // offset of the file (file handles only)
+	int inode_number;	            // inode number of the file/directory in the disk
+	int mount_point;    			// reference to mount point
+                                    // -1: Free
+                                    // >0: In Use
+    int generation;                 // bumped whenever the slot is freed, so stale handles don't match
+    int next_free;                  // next slot + 1 in the free list, 0: end of the list
+    int open_prev;                  // neighbours (slot + 1) in the list of handles open on the same inode
+    int open_next;                  // 0: none
+    int revoked;                    // 1: the entity was deleted or the device closed
+                                    //    the slot is only freed by emufs_close, every other call fails
+    int ra_next;                    // readahead (file handles): offset a sequential read continues at
+    int ra_window;                  // blocks to keep read ahead, 0: the reads are not sequential
+    int ra_end;                     // first block of the file past the blocks read ahead so far
+    char* held;                     // file handles: partial block where the last read ended, decrypted
+    int held_block;                 // block of the file in held, -1: none
+    int held_size;                  // bytes allocated for held (the block size when it was read)
+    u_int32_t held_version;         // data version of the inode when held was read
+    char* wbuf;                     // file handles: small sequential writes not written to the file yet
+                                    // wbuf[0] is the start of the block holding the first byte buffered
+    int wb_offset;                  // offset in the file of the first byte buffered
+    int wb_len;                     // bytes buffered, 0: none
+    int wb_size;                    // bytes allocated for wbuf (write_buffer_size when it was allocated)
+    int wb_reserved;                // blocks promised to the buffered bytes past the end of the file
+    struct open_inode_t* ino;       // file handles: the inode of the file, NULL for directory handles
+};
+
+struct handle_table_t
+{
+    struct handle_t* chunks[HANDLE_SLOTS / HANDLE_CHUNK];  // HANDLE_CHUNK slots each, allocated on demand
+    int num_chunks;
+    u_int64_t free_head;            // ABA tag << 32 | first free slot + 1, 0: no free slot
+    pthread_mutex_t grow_lock;      // serializes the allocation of chunks
+    int* open_heads[MAX_MOUNT_POINTS];  // per inode of the mount: first handle (slot + 1) open on it, 0: none
+                                        // OPEN_LIST_DELETED: the inode was deleted
+                                        // allocated with the first handle of the mount (init_open_lists)
+};
+
+#define OPEN_LIST_DELETED -1
+
+struct dir_table_t                  // hash table of an extent format directory, one block buffered at a time
+{
+    int mount_point;
+    struct inode_t* dir;
+    int per_block;                  // slots per table block
+    int slots;                      // slots of the table
+    int index;                      // table block held in block, -1: none
+    int blocknum;                   // device block of that table block
+    int dirty;                      // 1: block was modified and is written back when another is buffered
+    char* block;
+};
+
+
+struct emufs_aio_t                  // an emufs_read_async or emufs_write_async in flight
+{
+    int mount_point;
+    int inode_number;
+    int op;                         // AIO_READ or AIO_WRITE
+    int block_size;
+    int pending;                    // block requests not completed yet
+    int result;                     // 1, or -1 once a block failed
+    struct aio_request_t* requests; // one per block
+    char* staging;                  // reads: partial first and last blocks
+                                    // writes: patched partial blocks, or every block when encrypted
+    char* head_dst;                 // reads: where the bytes of the partial first block go
+    int head_off;
+    int head_len;
+    char* tail_dst;                 // reads: where the bytes of the partial last block go
+    int tail_len;
+    pthread_mutex_t lock;           // protects pending and result
+    pthread_cond_t done;            // signalled when pending drops to 0
+};
+
+struct read_view_t                  // an emufs_read_view, the part seen by the caller comes first
+{
+    struct emufs_view_t view;
+    int mount_point;
+    int pinned;                     // blocks viewed in place in the block cache
+    struct cache_entry_t** entries; // their cache entries
+    char* copies;                   // the other blocks (encrypted, or no room in the cache), decrypted
+};
+
+struct batch_name_t                 // name of an entry of emufs_create_many, checked in its directory
+{
+    u_int32_t hash;                 // name_hash of name
+    int type;
+    char name[MAX_ENTITY_NAME];     // zero padded
+    int index;                      // entry of the batch in the directory
+};
+
+struct dentry_t
+{
+    int valid;                      // 1: entry holds a cached lookup
+    int parent;                     // inode number of the directory searched
+    char name[MAX_ENTITY_NAME];     // name looked up (zero padded)
+    int inode_number;               // result of the lookup
+                                    // -1: no entity with that name (negative entry)
+};
+
+struct handle_table_t dir_table = { .grow_lock = PTHREAD_MUTEX_INITIALIZER };    // directory handles
+struct handle_table_t file_table = { .grow_lock = PTHREAD_MUTEX_INITIALIZER };   // file handles
+struct dentry_t dcache[MAX_MOUNT_POINTS][DCACHE_ENTRIES];  // direct-mapped (parent, name) -> inode cache per mount
+
+/*
+    * Locking
+    * handle tables:    lock-free, slots are popped from and pushed to the free list with compare-and-swap
+    * open_locks:       the lists of handles open on an inode (both tables) and the references to its open_inode_t,
+    *                   taken after the inode lock and never nested except by change_dir, which takes two of
+    *                   them in lock order; only the mount lock is taken under them (to read the inode table)
+    * dcache_locks:     the dentry cache of a mount
+    * inode_locks:      reader/writer lock per inode, for the data of a file or the entries of a directory
+    *                   at most one inode lock is held at a time, and always before the mount lock (emufs-disk.c)
+    * Inode and open list locks are striped: inodes with the same number modulo INODE_LOCK_STRIPES share one
+    * A handle is used by one thread at a time, different handles may be used in parallel
+*/
+pthread_rwlock_t dcache_locks[MAX_MOUNT_POINTS];
+pthread_rwlock_t inode_locks[MAX_MOUNT_POINTS][INODE_LOCK_STRIPES];
+pthread_mutex_t open_locks[MAX_MOUNT_POINTS][INODE_LOCK_STRIPES];
+pthread_mutex_t open_lists_lock = PTHREAD_MUTEX_INITIALIZER;    // allocation of the open_heads arrays
+u_int32_t data_versions[MAX_MOUNT_POINTS][INODE_LOCK_STRIPES];   // bumped whenever the data of a file (stripe) changes
+pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+/*-----------LOCKS------------*/
+
+void init_locks(void){
+    for(int i=0; i<MAX_MOUNT_POINTS; i++){
+        pthread_rwlock_init(&dcache_locks[i], NULL);
+        for(int j=0; j<INODE_LOCK_STRIPES; j++){
+            pthread_rwlock_init(&inode_locks[i][j], NULL);
+            pthread_mutex_init(&open_locks[i][j], NULL);
+        }
+    }
+}
+
+int lock_stripe(int inodenum){
+    return inodenum & (INODE_LOCK_STRIPES - 1);
+}
+
+void open_list_lock(int mount_point, int inodenum){
+    pthread_once(&locks_once, init_locks);
+    pthread_mutex_lock(&open_locks[mount_point][lock_stripe(inodenum)]);
+}
+
+void open_list_unlock(int mount_point, int inodenum){
+    pthread_mutex_unlock(&open_locks[mount_point][lock_stripe(inodenum)]);
+}
+
+void inode_lock(int mount_point, int inodenum, int write){
+    /*
+        * write = 1 : exclusive lock (the inode is modified) and 0 : shared lock
+    */
+    pthread_once(&locks_once, init_locks);
+    if(write)
+        pthread_rwlock_wrlock(&inode_locks[mount_point][lock_stripe(inodenum)]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[mount_point][lock_stripe(inodenum)]);
+}
+
+void inode_unlock(int mount_point, int inodenum){
+    pthread_rwlock_unlock(&inode_locks[mount_point][lock_stripe(inodenum)]);
+}
+
+/*-----------HANDLE TABLES------------*/
+
+#define HANDLE_GENERATION_MASK ((1 << (31 - HANDLE_INDEX_BITS)) - 1)
+
+struct handle_t* handle_slot(struct handle_table_t* table, int slot){
+    /*
+        * Return value: NULL,       the chunk of the slot is not allocated
+                        the slot,   success
+    */
+    struct handle_t* chunk = __atomic_load_n(&table->chunks[slot / HANDLE_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[slot % HANDLE_CHUNK] : NULL;
+}
+
+void push_free_slots(struct handle_table_t* table, int first, struct handle_t* last){
+    /*
+        * Puts the chain of slots from first to last at the front of the free list
+        * The tag in the upper half of free_head changes on every push and pop (no ABA)
+    */
+    u_int64_t old_head, new_head;
+    do{
+        old_head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&last->next_free, (int)(old_head & 0xffffffff), __ATOMIC_RELAXED);
+        new_head = (((old_head >> 32) + 1) << 32) | (u_int64_t)(first + 1);
+    }while(!__sync_bool_compare_and_swap(&table->free_head, old_head, new_head));
+}
+
+int grow_handle_table(struct handle_table_t* table){
+    /*
+        * Allocates the next chunk of slots and puts them on the free list
+
+		* Return value: -1,		error (table full or out of memory)
+						 1, 	success
+    */
+    int ret = 1;
+    pthread_mutex_lock(&table->grow_lock);
+    // Another thread may have grown the table meanwhile
+    if((__atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE) & 0xffffffff) == 0){
+        int base = table->num_chunks * HANDLE_CHUNK;
+        struct handle_t* chunk = NULL;
+        if(base < HANDLE_SLOTS)
+            chunk = (struct handle_t*)calloc(HANDLE_CHUNK, sizeof(struct handle_t));
+        if(chunk){
+            for(int i=0; i<HANDLE_CHUNK; i++){
+                chunk[i].mount_point = -1;
+                chunk[i].next_free = base + i + 2;
+            }
+            __atomic_store_n(&table->chunks[table->num_chunks], chunk, __ATOMIC_RELEASE);
+            __atomic_store_n(&table->num_chunks, table->num_chunks + 1, __ATOMIC_RELEASE);
+            push_free_slots(table, base, &chunk[HANDLE_CHUNK - 1]);
+        }
+        else
+            ret = -1;
+    }
+    pthread_mutex_unlock(&table->grow_lock);
+    return ret;
+}
+
+int init_open_lists(int mount_point){
+    /*
+        * Allocates the open list heads of the mount in both tables, one per inode of its file system
+        * Done once, by the first handle opened on the mount
+
+		* Return value: -1,		error
+						 1, 	success
+    */
+    int ret = 1;
+    if(__atomic_load_n(&file_table.open_heads[mount_point], __ATOMIC_ACQUIRE))
+        return 1;
+    pthread_mutex_lock(&open_lists_lock);
+    if(!file_table.open_heads[mount_point]){
+        int count = mount_inode_count(mount_point);
+        int *dir_heads = (int*)calloc(count, sizeof(int));
+        int *file_heads = (int*)calloc(count, sizeof(int));
+        if(dir_heads && file_heads){
+            __atomic_store_n(&dir_table.open_heads[mount_point], dir_heads, __ATOMIC_RELEASE);
+            __atomic_store_n(&file_table.open_heads[mount_point], file_heads, __ATOMIC_RELEASE);
+        }
+        else{
+            free(dir_heads);
+            free(file_heads);
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&open_lists_lock);
+    return ret;
+}
+
+int* open_list_head(struct handle_table_t* table, int mount_point, int inodenum){
+    /*
+        * Return value: the head of the list of handles of the table open on the inode
+        * The open lists of the mount are allocated
+    */
+    return &__atomic_load_n(&table->open_heads[mount_point], __ATOMIC_ACQUIRE)[inodenum];
+}
+
+void link_open_handle(struct handle_table_t* table, struct handle_t* slot, int slot_index){
+    /*
+        * Adds the slot to the front of the list of its inode
+        * The caller holds the open list lock of the inode
+    */
+    int *head = open_list_head(table, slot->mount_point, slot->inode_number);
+    slot->open_prev = 0;
+    slot->open_next = *head;
+    if(*head)
+        handle_slot(table, *head - 1)->open_prev = slot_index + 1;
+    *head = slot_index + 1;
+}
+
+void unlink_open_handle(struct handle_table_t* table, struct handle_t* slot){
+    /*
+        * Removes the slot from the list of its inode
+        * The caller holds the open list lock of the inode
+    */
+    if(slot->open_prev)
+        handle_slot(table, slot->open_prev - 1)->open_next = slot->open_next;
+    else
+        *open_list_head(table, slot->mount_point, slot->inode_number) = slot->open_next;
+    if(slot->open_next)
+        handle_slot(table, slot->open_next - 1)->open_prev = slot->open_prev;
+}
+
+struct open_inode_t* get_open_inode(int mount_point, int inodenum){
+    /*
+        * Takes a reference to the inode of a file for a new file handle: the one of the handles
+          already open on it, otherwise a copy read from the inode table
+        * The caller holds the open list lock of the inode
+
+		* Return value: NULL,		    error (out of memory)
+						 the inode, 	success
+    */
+    int head = *open_list_head(&file_table, mount_point, inodenum);
+    struct open_inode_t* ino;
+    if(head > 0){
+        ino = handle_slot(&file_table, head - 1)->ino;
+        ino->refs++;
+        return ino;
+    }
+    ino = (struct open_inode_t*)malloc(sizeof(struct open_inode_t));
+    if(!ino)
+        return NULL;
+    ino->refs = 1;
+    ino->dirty = 0;
+    read_inode(mount_point, inodenum, &ino->inode);
+    return ino;
+}
+
+void put_open_inode(struct handle_t* slot){
+    /*
+        * Drops the reference of a closing file handle, the last one frees the inode
+        * It was written back by file_sync_inode before, unless the handle is revoked
+          (the file was deleted, or the device closed or formatted)
+        * The caller holds the open list lock of the inode
+    */
+    struct open_inode_t* ino = slot->ino;
+    slot->ino = NULL;
+    if(ino && --ino->refs == 0)
+        free(ino);
+}
+
+int alloc_handle(struct handle_table_t* table, int mount_point, int inodenum){
+    /*
+        * Pops a free slot (growing the table if there is none), points it at inodenum
+        * and adds it to the list of handles open on the inode
+        * A file handle shares the inode of the file with the other file handles open on it
+        * The slot is published by setting its mount point last
+
+		* Return value: -1,		error (no free slot or memory, or the inode was deleted meanwhile)
+						 handle, 	success
+    */
+    u_int64_t old_head, new_head;
+    struct handle_t* handle;
+    int slot;
+    if(init_open_lists(mount_point) == -1)
+        return -1;
+    while(1){
+        old_head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+        if((old_head & 0xffffffff) == 0){
+            if(grow_handle_table(table) == -1)
+                return -1;
+            continue;
+        }
+        slot = (int)(old_head & 0xffffffff) - 1;
+        handle = handle_slot(table, slot);
+        new_head = (((old_head >> 32) + 1) << 32) | (u_int32_t)__atomic_load_n(&handle->next_free, __ATOMIC_RELAXED);
+        if(__sync_bool_compare_and_swap(&table->free_head, old_head, new_head))
+            break;
+    }
+
+    open_list_lock(mount_point, inodenum);
+    if(*open_list_head(table, mount_point, inodenum) == OPEN_LIST_DELETED){
+        open_list_unlock(mount_point, inodenum);
+        push_free_slots(table, slot, handle);
+        return -1;
+    }
+    handle->inode_number = inodenum;
+    handle->offset = 0;
+    handle->ra_next = 0;
+    handle->ra_window = 0;
+    handle->ra_end = 0;
+    handle->held = NULL;
+    handle->held_block = -1;
+    handle->held_size = 0;
+    handle->wbuf = NULL;
+    handle->wb_len = 0;
+    handle->wb_size = 0;
+    handle->wb_reserved = 0;
+    handle->ino = NULL;
+    if(table == &file_table && !(handle->ino = get_open_inode(mount_point, inodenum))){
+        open_list_unlock(mount_point, inodenum);
+        push_free_slots(table, slot, handle);
+        return -1;
+    }
+    __atomic_store_n(&handle->revoked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&handle->mount_point, mount_point, __ATOMIC_RELEASE);
+    link_open_handle(table, handle, slot);
+    open_list_unlock(mount_point, inodenum);
+    return (__atomic_load_n(&handle->generation, __ATOMIC_RELAXED) << HANDLE_INDEX_BITS) | slot;
+}
+
+struct handle_t* lookup_handle(struct handle_table_t* table, int handle){
+    /*
+        * Return value: NULL,       invalid, closed or stale handle
+                        the slot,   success (it may be revoked)
+    */
+    struct handle_t* slot;
+    if(handle < 0)
+        return NULL;
+    slot = handle_slot(table, handle & (HANDLE_SLOTS - 1));
+    if(!slot || __atomic_load_n(&slot->mount_point, __ATOMIC_ACQUIRE) == -1 ||
+       __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != (handle >> HANDLE_INDEX_BITS))
+        return NULL;
+    return slot;
+}
+
+int handle_revoked(struct handle_t* slot){
+    return __atomic_load_n(&slot->revoked, __ATOMIC_ACQUIRE);
+}
+
+struct handle_t* get_handle(struct handle_table_t* table, int handle){
+    /*
+        * Return value: NULL,       invalid, closed, stale or revoked handle
+                        the slot,   success
+    */
+    struct handle_t* slot = lookup_handle(table, handle);
+    if(!slot || handle_revoked(slot))
+        return NULL;
+    return slot;
+}
+
+void release_slot(struct handle_table_t* table, struct handle_t* slot, int slot_index){
+    /*
+        * Marks the slot free and pushes it on the free list
+        * The caller holds the open list lock of its inode, the slot is not on the list any more
+    */
+    __atomic_store_n(&slot->mount_point, -1, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->generation, (slot->generation + 1) & HANDLE_GENERATION_MASK, __ATOMIC_RELAXED);
+    push_free_slots(table, slot_index, slot);
+}
+
+void close_handle(struct handle_table_t* table, int handle){
+    /*
+        * Unlinks the handle from the list of its inode (unless it was revoked) and frees its slot
+        * Nothing is done if the handle was closed meanwhile by another thread
+    */
+    struct handle_t* slot = lookup_handle(table, handle);
+    if(!slot)
+        return;
+    int mount_point = slot->mount_point;
+    int inodenum = slot->inode_number;
+    open_list_lock(mount_point, inodenum);
+    if(lookup_handle(table, handle) == slot){
+        if(!handle_revoked(slot))
+            unlink_open_handle(table, slot);
+        put_open_inode(slot);
+        release_slot(table, slot, handle & (HANDLE_SLOTS - 1));
+    }
+    open_list_unlock(mount_point, inodenum);
+}
+
+int move_dir_handle(int dir_handle, int inodenum){
+    /*
+        * Points the directory handle at inodenum and moves it to the list of that inode
+        * The two open list locks are taken in stripe order (once if both inodes share it)
+
+		* Return value: -1,		error (the directory was deleted meanwhile)
+						 1, 	success
+    */
+    struct handle_t* dir = get_handle(&dir_table, dir_handle);
+    if(!dir)
+        return -1;
+    int mount_point = dir->mount_point;
+    int old_inode = dir->inode_number;
+    int ret = 1;
+    if(old_inode == inodenum)
+        return 1;
+
+    int first = lock_stripe(old_inode) < lock_stripe(inodenum) ? old_inode : inodenum;
+    int second = first == old_inode ? inodenum : old_inode;
+    open_list_lock(mount_point, first);
+    if(lock_stripe(second) != lock_stripe(first))
+        open_list_lock(mount_point, second);
+    if(get_handle(&dir_table, dir_handle) != dir || *open_list_head(&dir_table, mount_point, inodenum) == OPEN_LIST_DELETED)
+        ret = -1;
+    else{
+        unlink_open_handle(&dir_table, dir);
+        dir->inode_number = inodenum;
+        link_open_handle(&dir_table, dir, dir_handle & (HANDLE_SLOTS - 1));
+    }
+    if(lock_stripe(second) != lock_stripe(first))
+        open_list_unlock(mount_point, second);
+    open_list_unlock(mount_point, first);
+    return ret;
+}
+
+void revoke_open_handles(int mount_point, int inodenum, int deleted){
+    /*
+        * Revokes the file and directory handles open on the inode, and only those
+        * Their slots stay allocated until their owners close them, so an operation
+          running on one of them never sees its slot reused
+        * deleted = 1 : the inode was deleted, later opens of it fail until it is allocated again
+    */
+    struct handle_table_t *tables[2] = {&file_table, &dir_table};
+    if(init_open_lists(mount_point) == -1)
+        return;
+    open_list_lock(mount_point, inodenum);
+    for(int t=0; t<2; t++){
+        int *head = open_list_head(tables[t], mount_point, inodenum);
+        int next = *head > 0 ? *head : 0;
+        while(next){
+            struct handle_t *slot = handle_slot(tables[t], next - 1);
+            next = slot->open_next;
+            __atomic_store_n(&slot->revoked, 1, __ATOMIC_RELEASE);
+        }
+        *head = deleted ? OPEN_LIST_DELETED : 0;
+    }
+    open_list_unlock(mount_point, inodenum);
+}
+
+void reset_open_handles(int mount_point, int inodenum){
+    /*
+        * The inode was allocated again: opening it is allowed
+    */
+    if(init_open_lists(mount_point) == -1)
+        return;
+    open_list_lock(mount_point, inodenum);
+    *open_list_head(&file_table, mount_point, inodenum) = 0;
+    *open_list_head(&dir_table, mount_point, inodenum) = 0;
+    open_list_unlock(mount_point, inodenum);
+}
+
+void drop_open_lists(int mount_point){
+    /*
+        * Revokes every handle open on the mount and frees its open lists
+        * The device is being closed or formatted: no other operation runs on the mount
+    */
+    if(!__atomic_load_n(&file_table.open_heads[mount_point], __ATOMIC_ACQUIRE))
+        return;
+    for(int i=0; i<mount_inode_count(mount_point); i++)
+        revoke_open_handles(mount_point, i, 0);
+
+    pthread_mutex_lock(&open_lists_lock);
+    free(file_table.open_heads[mount_point]);
+    free(dir_table.open_heads[mount_point]);
+    __atomic_store_n(&file_table.open_heads[mount_point], NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir_table.open_heads[mount_point], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_lists_lock);
+}
+
+/*-----------DENTRY CACHE------------*/
+
+unsigned int dcache_slot(int parent, char* name){
+    /*
+        * FNV-1a hash of the parent inode number and the zero padded name
+    */
+    unsigned int hash = 2166136261u;
+    for(int i=0; i<4; i++)
+        hash = (hash ^ ((parent >> (8*i)) & 0xff)) * 16777619u;
+    for(int i=0; i<MAX_ENTITY_NAME; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash & (DCACHE_ENTRIES - 1);
+}
+
+int dcache_lookup(int mount_point, int parent, char* name, int* inodenum){
+    /*
+        * Return value: 0, not cached
+                        1, cached, the result is stored in inodenum (-1 for a negative entry)
+    */
+    struct dentry_t *dentry = &dcache[mount_point][dcache_slot(parent, name)];
+    int found = 0;
+
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_rdlock(&dcache_locks[mount_point]);
+    if(dentry->valid && dentry->parent == parent && memcmp(dentry->name, name, MAX_ENTITY_NAME) == 0){
+        *inodenum = dentry->inode_number;
+        found = 1;
+    }
+    pthread_rwlock_unlock(&dcache_locks[mount_point]);
+    return found;
+}
+
+void dcache_insert(int mount_point, int parent, char* name, int inodenum){
+    /*
+        * The caller holds the inode lock of parent, so the result can't be made stale meanwhile
+    */
+    struct dentry_t *dentry = &dcache[mount_point][dcache_slot(parent, name)];
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&dcache_locks[mount_point]);
+    dentry->valid = 1;
+    dentry->parent = parent;
+    memcpy(dentry->name, name, MAX_ENTITY_NAME);
+    dentry->inode_number = inodenum;
+    pthread_rwlock_unlock(&dcache_locks[mount_point]);
+}
+
+void dcache_invalidate(int mount_point, int parent, char* name){
+    /*
+        * Drops the cached lookup of name in the directory parent
+    */
+    struct dentry_t *dentry = &dcache[mount_point][dcache_slot(parent, name)];
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&dcache_locks[mount_point]);
+    if(dentry->valid && dentry->parent == parent && memcmp(dentry->name, name, MAX_ENTITY_NAME) == 0)
+        dentry->valid = 0;
+    pthread_rwlock_unlock(&dcache_locks[mount_point]);
+}
+
+void dcache_invalidate_dir(int mount_point, int parent){
+    /*
+        * Drops every cached lookup made in the directory parent (the directory is deleted
+        * and its inode number may be reused)
+    */
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&dcache_locks[mount_point]);
+    for(int i=0; i<DCACHE_ENTRIES; i++)
+        if(dcache[mount_point][i].parent == parent)
+            dcache[mount_point][i].valid = 0;
+    pthread_rwlock_unlock(&dcache_locks[mount_point]);
+}
+
+void dcache_clear(int mount_point){
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&dcache_locks[mount_point]);
+    memset(dcache[mount_point], 0, sizeof(dcache[mount_point]));
+    pthread_rwlock_unlock(&dcache_locks[mount_point]);
+}
+
+
+/*-----------DIRECTORY ENTRIES------------*/
+
+void pad_entity_name(char* padded, char* name){
+    /*
+        * Copies name into the MAX_ENTITY_NAME bytes of padded, zero padded as entries store it
+          (a longer name is cut, without a terminating zero)
+    */
+    memset(padded, 0, MAX_ENTITY_NAME);
+    memcpy(padded, name, strnlen(name, MAX_ENTITY_NAME));
+}
+
+u_int32_t name_hash(char* name){
+    /*
+        * FNV-1a hash of the zero padded name, the key of the hash table of a directory
+    */
+    u_int32_t hash = 2166136261u;
+    for(int i=0; i<MAX_ENTITY_NAME; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+int dir_table_open(int mount_point, struct inode_t* dir, struct dir_table_t* table){
+    /*
+        * Prepares the access to the hash table of an extent format directory
+
+        * Return value: -1, error
+                         1, success
+    */
+    table->mount_point = mount_point;
+    table->dir = dir;
+    table->per_block = DIR_ENTRIES_PER_BLOCK(mount_block_size(mount_point));
+    table->slots = dir->table_blocks * table->per_block;
+    table->index = -1;
+    table->dirty = 0;
+    table->block = (char*)malloc(mount_block_size(mount_point));
+    return table->block ? 1 : -1;
+}
+
+int dir_table_flush(struct dir_table_t* table){
+    /*
+        * Writes the buffered table block back if it was modified
+
+        * Return value: -1, error
+                         1, success
+    */
+    int ret = 1;
+
+    if(table->dirty && write_datablock(table->mount_point, table->blocknum, table->block) < 0)
+        ret = -1;
+    table->dirty = 0;
+    return ret;
+}
+
+struct dir_entry_t* dir_table_slot(struct dir_table_t* table, int slot){
+    /*
+        * Buffers the table block holding the slot, writing back the previous one if it was modified
+
+        * Return value: NULL, error (the previous block could not be written, or this one read)
+                        the slot in the buffered block, success
+    */
+    int index = slot / table->per_block;
+
+    if(index != table->index){
+        int flushed = dir_table_flush(table);
+        table->index = -1;
+        if(flushed < 0 || map_file_blocks(table->mount_point, table->dir, index, 1, &table->blocknum) < 0 ||
+           read_datablock(table->mount_point, table->blocknum, table->block) < 0)
+            return NULL;
+        table->index = index;
+    }
+    return (struct dir_entry_t*)table->block + slot % table->per_block;
+}
+
+int dir_table_close(struct dir_table_t* table){
+    /*
+        * Writes the buffered block back if it was modified and ends the access to the table
+
+        * Return value: -1, error (the block could not be written)
+                         1, success
+    */
+    int ret = dir_table_flush(table);
+    free(table->block);
+    return ret;
+}
+
+char* read_dir_table(int mount_point, struct inode_t* dir){
+    /*
+        * Reads all the blocks of the hash table of an extent format directory with one vectored read
+        * The buffer is freed by the caller
+
+        * Return value: NULL, error (out of memory, or a block could not be read)
+                        the table, success
+    */
+    int block_size = mount_block_size(mount_point);
+    int nblocks = dir->table_blocks;
+    char *data = (char*)malloc((size_t)nblocks * block_size);
+    int *blocknums = (int*)malloc(nblocks * sizeof(int));
+    char **bufs = (char**)malloc(nblocks * sizeof(char*));
+
+    if(!data || !blocknums || !bufs || map_file_blocks(mount_point, dir, 0, nblocks, blocknums) < 0){
+        free(data);
+        data = NULL;
+    }
+    else{
+        for(int i=0; i<nblocks; i++)
+            bufs[i] = data + (size_t)i * block_size;
+        if(read_datablocks(mount_point, blocknums, bufs, nblocks) < 0){
+            free(data);
+            data = NULL;
+        }
+    }
+    free(blocknums);
+    free(bufs);
+    return data;
+}
+
+struct dir_entry_t* table_data_slot(char* data, int per_block, int block_size, int slot){
+    return (struct dir_entry_t*)(data + (size_t)(slot / per_block) * block_size) + slot % per_block;
+}
+
+int read_dir_entries(int mount_point, struct inode_t* dir, int** entries){
+    /*
+        * Points entries to the inode numbers of the entries of the directory
+        * Legacy format: the mappings of the inode
+        * Extent format: the used slots of the hash table, in table order, collected into a new array
+        * The array is given back with release_dir_entries
+
+        * Return value: -1,                 error
+                         number of entries, success
+    */
+    int count = 0;
+
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY || dir->size == 0){
+        *entries = dir->mappings;
+        return dir->size;
+    }
+
+    int block_size = mount_block_size(mount_point);
+    int per_block = DIR_ENTRIES_PER_BLOCK(block_size);
+    char *data = read_dir_table(mount_point, dir);
+    int *found = (int*)malloc(dir->size * sizeof(int));
+    if(!data || !found){
+        free(data);
+        free(found);
+        return -1;
+    }
+    for(int slot=0; slot<dir->table_blocks * per_block && count < dir->size; slot++){
+        struct dir_entry_t *entry = table_data_slot(data, per_block, block_size, slot);
+        if(entry->inode)
+            found[count++] = entry->inode;
+    }
+    free(data);
+    *entries = found;
+    return count;
+}
+
+void release_dir_entries(struct inode_t* dir, int* entries){
+    if(entries != dir->mappings)
+        free(entries);
+}
+
+int find_dir_entry(int mount_point, struct inode_t* dir, char* name, int type){
+    /*
+        * Search the directory for the first entity called name (compared on MAX_ENTITY_NAME bytes)
+        * type: 0 or 1 for an entity of that type only, -1: any type
+        * Legacy format: reads the inodes of the entries
+        * Extent format: probes the hash table from the home slot of the name, only the inodes
+          of entries with the same hash are read
+
+        * Return value: -1,             not found
+                         inode number,  success
+    */
+    struct inode_t entry;
+    struct dir_table_t table;
+    u_int32_t hash = name_hash(name);
+    int found = -1;
+
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY){
+        for(int i=0; i<dir->size; i++){
+            read_inode(mount_point, dir->mappings[i], &entry);
+            if(memcmp(name, entry.name, MAX_ENTITY_NAME) == 0 && (type == -1 || entry.type == type))
+                return dir->mappings[i];
+        }
+        return -1;
+    }
+
+    if(dir->size == 0 || dir_table_open(mount_point, dir, &table) < 0)
+        return -1;
+    for(int i=0, slot=hash % table.slots; i<table.slots; i++, slot=(slot + 1) % table.slots){
+        struct dir_entry_t *slot_entry = dir_table_slot(&table, slot);
+        if(!slot_entry || slot_entry->inode == 0)
+            break;
+        if(slot_entry->hash != hash || (type != -1 && slot_entry->type != type))
+            continue;
+        read_inode(mount_point, slot_entry->inode, &entry);
+        if(memcmp(name, entry.name, MAX_ENTITY_NAME) == 0){
+            found = slot_entry->inode;
+            break;
+        }
+    }
+    dir_table_close(&table);
+    return found;
+}
+
+int resize_dir_table(int mount_point, struct inode_t* dir, int table_blocks, struct dir_entry_t* extra, int extra_count){
+    /*
+        * Moves the entries of an extent format directory into a new hash table of table_blocks blocks,
+          followed by extra_count new entries (extra), which the caller counts in the size
+        * The new table is allocated (all or nothing) and filled in memory, then written with one
+          vectored write; the blocks of the old table are freed
+        * The caller writes the inode back
+
+        * Return value: -1, error (no free block, or the table could not be read or written;
+                             the directory is unchanged)
+                         1, success
+    */
+    int block_size = mount_block_size(mount_point);
+    int per_block = DIR_ENTRIES_PER_BLOCK(block_size);
+    int slots = table_blocks * per_block;
+    struct inode_t table_inode;     // holds the blocks of the new table until dir takes them over
+    char *old = NULL;
+    char *data = (char*)calloc(table_blocks, block_size);
+    int *blocknums = (int*)malloc(table_blocks * sizeof(int));
+    char **bufs = (char**)malloc(table_blocks * sizeof(char*));
+    int ret = -1;
+
+    memset(&table_inode, 0, sizeof(struct inode_t));
+    table_inode.type = 1;
+    if(data && blocknums && bufs && (dir->table_blocks == 0 || (old = read_dir_table(mount_point, dir))) &&
+       grow_file(mount_point, &table_inode, table_blocks, 0) > 0)
+        ret = 1;
+
+    for(int i=0; ret == 1 && i<dir->table_blocks * per_block; i++){
+        struct dir_entry_t *entry = table_data_slot(old, per_block, block_size, i);
+        int slot = entry->hash % slots;
+        if(!entry->inode)
+            continue;
+        while(table_data_slot(data, per_block, block_size, slot)->inode)
+            slot = (slot + 1) % slots;
+        *table_data_slot(data, per_block, block_size, slot) = *entry;
+    }
+    for(int i=0; ret == 1 && i<extra_count; i++){
+        int slot = extra[i].hash % slots;
+        while(table_data_slot(data, per_block, block_size, slot)->inode)
+            slot = (slot + 1) % slots;
+        *table_data_slot(data, per_block, block_size, slot) = extra[i];
+    }
+    if(ret == 1){
+        for(int i=0; i<table_blocks; i++)
+            bufs[i] = data + (size_t)i * block_size;
+        if(map_file_blocks(mount_point, &table_inode, 0, table_blocks, blocknums) < 0 ||
+           write_datablocks(mount_point, blocknums, bufs, table_blocks) < 0){
+            // The old table stays
+            free_file_blocks(mount_point, &table_inode);
+            ret = -1;
+        }
+    }
+    if(ret == 1){
+        free_file_blocks(mount_point, dir);
+        dir->extent_count = table_inode.extent_count;
+        memcpy(dir->extents, table_inode.extents, sizeof(dir->extents));
+        dir->indirect = table_inode.indirect;
+        dir->double_indirect = table_inode.double_indirect;
+        dir->table_blocks = table_blocks;
+    }
+    free(old);
+    free(data);
+    free(blocknums);
+    free(bufs);
+    return ret;
+}
+
+int add_dir_entry(int mount_point, struct inode_t* dir, int inodenum, char* name, int type){
+    /*
+        * Appends an entry to the directory, the caller writes the inode back
+        * Legacy format: at most MAX_FILE_SIZE entries in the mappings
+        * Extent format: the entry takes the first free slot from the home slot of its name;
+          the table doubles when it would become more than 3/4 full
+
+        * Return value: -1, error (directory full, no free block, or the table could not be read or written)
+                         1, success
+    */
+    struct dir_table_t table;
+    struct dir_entry_t *entry = NULL;
+    int per_block = DIR_ENTRIES_PER_BLOCK(mount_block_size(mount_point));
+
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY){
+        if(dir->size >= MAX_FILE_SIZE)
+            return -1;
+        dir->mappings[dir->size++] = inodenum;
+        return 1;
+    }
+
+    if((dir->size + 1) * 4 > (long)dir->table_blocks * per_block * 3 &&
+       resize_dir_table(mount_point, dir, dir->table_blocks ? dir->table_blocks * 2 : 1, NULL, 0) < 0)
+        return -1;
+    if(dir_table_open(mount_point, dir, &table) < 0)
+        return -1;
+    u_int32_t hash = name_hash(name);
+    for(int slot=hash % table.slots; (entry = dir_table_slot(&table, slot)) && entry->inode; slot=(slot + 1) % table.slots)
+        ;
+    if(entry){
+        memset(entry, 0, sizeof(struct dir_entry_t));
+        entry->hash = hash;
+        entry->inode = inodenum;
+        entry->type = type;
+        table.dirty = 1;
+        dir->size++;
+    }
+    if(dir_table_close(&table) < 0 && entry){
+        dir->size--;
+        entry = NULL;
+    }
+    return entry ? 1 : -1;
+}
+
+int compare_batch_names(const void* a, const void* b){
+    /*
+        * Orders the names of a batch by hash, type and name, then by their index in the batch
+    */
+    const struct batch_name_t *x = (const struct batch_name_t*)a;
+    const struct batch_name_t *y = (const struct batch_name_t*)b;
+    int order = memcmp(x->name, y->name, MAX_ENTITY_NAME);
+    if(x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if(x->type != y->type)
+        return x->type - y->type;
+    return order ? order : x->index - y->index;
+}
+
+int add_dir_entries(int mount_point, struct inode_t* dir, struct emufs_create_t** batch, int* inodenums, int count){
+    /*
+        * Adds the entries of a batch (emufs_create_many) to the directory and sets their result
+        * An entry is not added when an entity with its name and type is there already, an earlier
+          entry of the batch included
+        * Only the entries that can be added get an inode (inodenums, -1: none), allocated in batch order
+          once the names are checked: as with emufs_create, a rejected entry takes no inode a later one
+          needs; the caller writes the inodes of the added entries and frees the others (an entry
+          can still fail after getting one), then writes the directory back
+        * Legacy format: find_dir_entry, alloc_inode and add_dir_entry for each entry; the names added
+          before by the batch are compared here, their inodes are not written yet
+        * Extent format: the table is read with one vectored read and the names are checked in memory,
+          the inodes come from one alloc_inodes call; the new entries go in the new table when it has
+          to grow (written once by resize_dir_table), otherwise its modified blocks are written with
+          one vectored write
+
+        * Return value: number of entries added
+    */
+    char name[MAX_ENTITY_NAME];
+    int added = 0;
+
+    for(int i=0; i<count; i++)
+        inodenums[i] = -1;
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY){
+        for(int i=0; i<count; i++){
+            int repeated = 0;
+            pad_entity_name(name, batch[i]->name);
+            for(int k=0; k<i && dir->size < MAX_FILE_SIZE && !repeated; k++)
+                repeated = batch[k]->result == 1 && batch[k]->type == batch[i]->type &&
+                           strncmp(name, batch[k]->name, MAX_ENTITY_NAME) == 0;
+            batch[i]->result = !repeated && dir->size < MAX_FILE_SIZE && find_dir_entry(mount_point, dir, name, batch[i]->type) == -1 &&
+                               (inodenums[i] = alloc_inode(mount_point)) != -1 &&
+                               add_dir_entry(mount_point, dir, inodenums[i], name, batch[i]->type) == 1 ? 1 : -1;
+            added += batch[i]->result == 1;
+        }
+        return added;
+    }
+
+    int block_size = mount_block_size(mount_point);
+    int per_block = DIR_ENTRIES_PER_BLOCK(block_size);
+    int slots = dir->table_blocks * per_block;
+    char *data = slots ? read_dir_table(mount_point, dir) : NULL;
+    struct batch_name_t *names = (struct batch_name_t*)malloc(count * sizeof(struct batch_name_t));
+    struct dir_entry_t *extra = (struct dir_entry_t*)calloc(count, sizeof(struct dir_entry_t));
+    int *allocated = (int*)malloc(count * sizeof(int));
+    int fresh = 0;
+    int wanted = 0;
+
+    if((slots && !data) || !names || !extra || !allocated){
+        for(int i=0; i<count; i++)
+            batch[i]->result = -1;
+        free(data);
+        free(names);
+        free(extra);
+        free(allocated);
+        return 0;
+    }
+
+    // Names already in the table (probed in memory), then names repeated in the batch (sorted)
+    for(int i=0; i<count; i++){
+        struct batch_name_t *key = &names[fresh];
+        pad_entity_name(key->name, batch[i]->name);
+        key->hash = name_hash(key->name);
+        key->type = batch[i]->type;
+        key->index = i;
+        batch[i]->result = -1;
+        int exists = 0;
+        for(int slot = slots ? key->hash % slots : 0; slots && !exists; slot = (slot + 1) % slots){
+            struct dir_entry_t *entry = table_data_slot(data, per_block, block_size, slot);
+            struct inode_t other;
+            if(!entry->inode)
+                break;
+            if(entry->hash != key->hash || entry->type != key->type)
+                continue;
+            read_inode(mount_point, entry->inode, &other);
+            exists = memcmp(key->name, other.name, MAX_ENTITY_NAME) == 0;
+        }
+        fresh += !exists;
+    }
+    qsort(names, fresh, sizeof(struct batch_name_t), compare_batch_names);
+    for(int i=0; i<fresh; i++)
+        if(i == 0 || names[i].hash != names[i - 1].hash || names[i].type != names[i - 1].type ||
+           memcmp(names[i].name, names[i - 1].name, MAX_ENTITY_NAME) != 0)
+            batch[names[i].index]->result = 0;     // the first entry with the name, to add
+
+    // The inodes of the entries to add; the entries past the free inodes fail
+    for(int i=0; i<count; i++)
+        wanted += batch[i]->result == 0;
+    int got = wanted ? alloc_inodes(mount_point, wanted, allocated) : 0;
+    for(int i=0, k=0; i<count; i++)
+        if(batch[i]->result == 0){
+            if(k < got)
+                inodenums[i] = allocated[k++];
+            else
+                batch[i]->result = -1;
+        }
+
+    // The new entries, in batch order; past 3/4 of the table they fail, as in add_dir_entry,
+    // if the larger table cannot be allocated
+    for(int i=0; i<count; i++)
+        if(batch[i]->result == 0){
+            pad_entity_name(name, batch[i]->name);
+            extra[added].hash = name_hash(name);
+            extra[added].inode = inodenums[i];
+            extra[added].type = batch[i]->type;
+            added++;
+        }
+    int table_blocks = dir->table_blocks ? dir->table_blocks : 1;
+    while((dir->size + added) * 4 > (long)table_blocks * per_block * 3)
+        table_blocks *= 2;
+    if(added && table_blocks != dir->table_blocks && resize_dir_table(mount_point, dir, table_blocks, extra, added) == 1){
+        // The new table was written with the new entries in it
+        dir->size += added;
+        for(int i=0; i<count; i++)
+            if(batch[i]->result == 0)
+                batch[i]->result = 1;
+    }
+    else{
+        // Each modified block of the current table is written once
+        int *blocknums = (int*)malloc((dir->table_blocks ? dir->table_blocks : 1) * sizeof(int));
+        char **bufs = (char**)malloc((dir->table_blocks ? dir->table_blocks : 1) * sizeof(char*));
+        char *dirty = (char*)calloc(dir->table_blocks ? dir->table_blocks : 1, 1);
+        int n = 0;
+        if(!blocknums || !bufs || !dirty || (slots && map_file_blocks(mount_point, dir, 0, dir->table_blocks, blocknums) < 0))
+            slots = 0;
+        added = 0;
+        for(int i=0, e=0; i<count; i++){
+            if(batch[i]->result != 0)
+                continue;
+            struct dir_entry_t *new_entry = &extra[e++];
+            batch[i]->result = -1;
+            if((dir->size + 1) * 4 > (long)slots * 3)
+                continue;
+            int slot = new_entry->hash % slots;
+            while(table_data_slot(data, per_block, block_size, slot)->inode)
+                slot = (slot + 1) % slots;
+            *table_data_slot(data, per_block, block_size, slot) = *new_entry;
+            dirty[slot / per_block] = 1;
+            dir->size++;
+            batch[i]->result = 1;
+            added++;
+        }
+        for(int b=0; added && b<dir->table_blocks; b++)
+            if(dirty[b]){
+                blocknums[n] = blocknums[b];
+                bufs[n++] = data + (size_t)b * block_size;
+            }
+        if(n && write_datablocks(mount_point, blocknums, bufs, n) < 0){
+            // The table on the device may hold some of the entries: none is reported as added
+            dir->size -= added;
+            added = 0;
+            for(int i=0; i<count; i++)
+                if(batch[i]->result == 1)
+                    batch[i]->result = -1;
+        }
+        free(blocknums);
+        free(bufs);
+        free(dirty);
+    }
+    free(data);
+    free(names);
+    free(extra);
+    free(allocated);
+    return added;
+}
+
+int remove_dir_entry(int mount_point, struct inode_t* dir, int inodenum){
+    /*
+        * Removes an entry from the directory, the caller writes the inode back
+        * Legacy format: the following mappings are shifted down, keeping the order
+        * Extent format: the entries after it in its probe run move back into the hole when
+          their home slot allows it (backward shift deletion), so no tombstone is left
+
+        * Return value: -1, error (not an entry of the directory, or its table could not be read or written)
+                         1, success
+    */
+    struct dir_table_t table;
+    struct dir_entry_t *entry = NULL;
+    struct inode_t child;
+    int hole;
+
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY){
+        int index = -1;
+        for(int i=0; i<dir->size; i++)
+            if(dir->mappings[i] == inodenum){
+                index = i;
+                break;
+            }
+        if(index == -1)
+            return -1;
+        for(int j=index; j<dir->size-1; j++)
+            dir->mappings[j] = dir->mappings[j + 1];
+        dir->size--;
+        return 1;
+    }
+
+    if(dir->size == 0 || dir_table_open(mount_point, dir, &table) < 0)
+        return -1;
+    read_inode(mount_point, inodenum, &child);
+    hole = name_hash(child.name) % table.slots;
+    for(int i=0; i<table.slots; i++, hole=(hole + 1) % table.slots){
+        entry = dir_table_slot(&table, hole);
+        if(!entry || entry->inode == 0 || entry->inode == (u_int32_t)inodenum)
+            break;
+    }
+    if(!entry || entry->inode != (u_int32_t)inodenum){
+        dir_table_close(&table);
+        return -1;
+    }
+
+    for(int next=(hole + 1) % table.slots; next != hole; next=(next + 1) % table.slots){
+        struct dir_entry_t moved;
+        int home;
+        if(!(entry = dir_table_slot(&table, next)) || entry->inode == 0)
+            break;
+        home = entry->hash % table.slots;
+        // The entry stays if its home slot lies cyclically in (hole, next]
+        if(hole <= next ? (home > hole && home <= next) : (home > hole || home <= next))
+            continue;
+        moved = *entry;
+        if(!(entry = dir_table_slot(&table, hole)))
+            break;
+        *entry = moved;
+        table.dirty = 1;
+        hole = next;
+    }
+    if(entry && (entry = dir_table_slot(&table, hole))){
+        memset(entry, 0, sizeof(struct dir_entry_t));
+        table.dirty = 1;
+    }
+    if(dir_table_close(&table) < 0 || !entry)
+        return -1;
+    dir->size--;
+    return 1;
+}
+
+/*-----------FILE DATA------------*/
+
+u_int32_t data_version(int mount_point, int inodenum){
+    return __atomic_load_n(&data_versions[mount_point][inodenum & (INODE_LOCK_STRIPES - 1)], __ATOMIC_ACQUIRE);
+}
+
+void data_changed(int mount_point, int inodenum){
+    /*
+        * Called when the data of a file changes: the blocks held by its handles are stale
+    */
+    __atomic_add_fetch(&data_versions[mount_point][inodenum & (INODE_LOCK_STRIPES - 1)], 1, __ATOMIC_RELEASE);
+}
+
+char* file_held_block(struct handle_t* file, int block, int block_size){
+    /*
+        * Return value: NULL,                 the handle does not hold the block of the file (or it is stale)
+                        its decrypted data,   success
+    */
+    if(!file->held || file->held_block != block || file->held_size != block_size ||
+       file->held_version != data_version(file->mount_point, file->inode_number))
+        return NULL;
+    return file->held;
+}
+
+void file_hold_block(struct handle_t* file, int block, char* data, int block_size){
+    /*
+        * Keeps a partial block where a read ended, so the next read of the handle does
+          not read (and decrypt) it again. The caller holds the inode lock
+    */
+    if(file->held_size != block_size){
+        free(file->held);
+        file->held = (char*)malloc(block_size);
+        file->held_size = file->held ? block_size : 0;
+    }
+    file->held_block = -1;
+    if(!file->held)
+        return;
+    memcpy(file->held, data, block_size);
+    file->held_block = block;
+    file->held_version = data_version(file->mount_point, file->inode_number);
+}
+
+void file_readahead(struct handle_t* file, struct inode_t* inode, int offset, int size){
+    /*
+        * Called by emufs_read with the inode locked, after reading [offset, offset+size)
+        * A read that starts where the last one of the handle ended is sequential: the window
+          starts at READAHEAD_MIN blocks and doubles up to READAHEAD_MAX each time it is used,
+          any other read closes it
+        * Once less than half the window is left ahead of the read, the next blocks of the file
+          are read into the block cache asynchronously (cache_prefetch)
+    */
+    int mnt = file->mount_point;
+    int block_size = mount_block_size(mnt);
+    int next = (offset + size - 1) / block_size + 1;
+    int end = BLOCKS_FOR(inode->size, block_size);
+    int blocknums[READAHEAD_MAX];
+    int sequential = offset == file->ra_next;
+
+    file->ra_next = offset + size;
+    if (!sequential) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        return;
+    }
+    if (file->ra_end < next)
+        file->ra_end = next;
+    if (file->ra_window && file->ra_end - next >= file->ra_window / 2)
+        return;
+
+    file->ra_window = file->ra_window ? file->ra_window * 2 : READAHEAD_MIN;
+    if (file->ra_window > READAHEAD_MAX)
+        file->ra_window = READAHEAD_MAX;
+    if (end > next + file->ra_window)
+        end = next + file->ra_window;
+    if (end <= file->ra_end || map_file_blocks(mnt, inode, file->ra_end, end - file->ra_end, blocknums) < 0)
+        return;
+    file->ra_end += cache_prefetch(mnt, blocknums, end - file->ra_end);
+}
+
+void file_grew(struct handle_t* file, int grew, long end){
+    /*
+        * Called by the write paths with the inode locked exclusively, once the file was written up to end
+        * New blocks are written to the inode table at once, in the same operation as the block bitmap
+        * A larger size alone is only kept in the shared inode, and written back lazily (file_sync_inode),
+          except on EMUFS_SYNC_IMMEDIATE mounts
+    */
+    struct open_inode_t* ino = file->ino;
+    if(end > ino->inode.size){
+        ino->inode.size = end;
+        ino->dirty = 1;
+    }
+    if(grew || (ino->dirty && mount_sync_policy(file->mount_point) == EMUFS_SYNC_IMMEDIATE)){
+        write_inode(file->mount_point, file->inode_number, &ino->inode);
+        ino->dirty = 0;
+    }
+}
+
+int file_sync_inode(struct handle_t* file){
+    /*
+        * Writes the shared inode of the file to the inode table if its size changed since it was last written
+        * Done by emufs_close, emufs_fsync, fsdump and closedevice; nothing is written for a revoked handle
+
+        * Return value: 0, nothing to write
+                        1, written (the caller ends the operation)
+    */
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    int written = 0;
+
+    inode_lock(mnt, inodenum, 1);
+    if(!handle_revoked(file) && file->ino->dirty){
+        write_inode(mnt, inodenum, &file->ino->inode);
+        file->ino->dirty = 0;
+        written = 1;
+    }
+    inode_unlock(mnt, inodenum);
+    return written;
+}
+
+int file_write(struct handle_t* file, int seek, char* buf, int size, int reserved){
+    /*
+        * Writes buf into the file at seek, the write path of emufs_write
+        * Whole blocks are written from buf without reading them first
+        * reserved: blocks promised to the write by reserve_delalloc_blocks (file_flush), the new blocks
+          of the file come out of them first and the ones left over are released
+        * If a block cannot be read or written, the file keeps the blocks written before it
+          (its size grows up to them) and the blocks allocated for the rest
+
+        * Return value: -1, error
+                         1, success
+    */
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    struct inode_t *inode = &file->ino->inode;
+    long end = (long)seek + size;
+    int ret = 1;
+
+    inode_lock(mnt, inodenum, 1);
+    if(handle_revoked(file)){
+        inode_unlock(mnt, inodenum);
+        release_delalloc_blocks(mnt, reserved);
+        return -1;
+    }
+    data_changed(mnt, inodenum);
+
+    // The blocks past the end of the file are allocated together (all or none)
+    // The legacy format fails here past MAX_FILE_SIZE blocks
+    int num_blocks = file_blocks(mnt, inode->size);
+    int needed = file_blocks(mnt, (long)seek + size);
+    int taken = needed - num_blocks < reserved ? needed - num_blocks : reserved;
+    if(taken < 0)
+        taken = 0;
+    if(needed > num_blocks && grow_file(mnt, inode, needed - num_blocks, taken) == -1) {
+        inode_unlock(mnt, inodenum);
+        release_delalloc_blocks(mnt, reserved);
+        end_operation(mnt);
+        return -1;
+    }
+    release_delalloc_blocks(mnt, reserved - taken);
+
+    // Write the touched blocks BLOCKS_PER_IO at a time
+    // Whole blocks are written from buf directly; a partial first or last block is patched in a buffer,
+    // read back first only if it already held data
+    if(size > 0){
+        int block_size = mount_block_size(mnt);
+        char head_buf[block_size], tail_buf[block_size];
+        int blocknums[BLOCKS_PER_IO];
+        char *bufs[BLOCKS_PER_IO];
+        int first = seek / block_size;
+        int last = (seek + size - 1) / block_size;
+        int head_off = seek % block_size;
+        int tail_len = (seek + size) % block_size;
+        if(first == last && head_off)
+            tail_len = 0;   // the only block is the head block
+
+        for(int b = first; ret > 0 && b <= last; b += BLOCKS_PER_IO){
+            int n = last - b + 1 < BLOCKS_PER_IO ? last - b + 1 : BLOCKS_PER_IO;
+            map_file_blocks(mnt, inode, b, n, blocknums);
+            for(int i = 0; i < n; i++){
+                int blk = b + i;
+                char *edge = NULL;
+                if(blk == first && head_off)
+                    edge = head_buf;
+                else if(blk == last && tail_len)
+                    edge = tail_buf;
+                if(!edge){
+                    bufs[i] = buf + (blk * block_size - seek);
+                    continue;
+                }
+                if(blk < num_blocks){
+                    aio_wait_block(mnt, blocknums[i]);  // an emufs_write_async of the block may be in flight
+                    if(read_datablock(mnt, blocknums[i], edge) < 0){
+                        ret = -1;
+                        break;
+                    }
+                }
+                else
+                    memset(edge, 0, block_size);
+                if(edge == head_buf){
+                    int len = block_size - head_off < size ? block_size - head_off : size;
+                    memcpy(head_buf + head_off, buf, len);
+                }
+                else
+                    memcpy(tail_buf, buf + (last * block_size - seek), tail_len);
+                bufs[i] = edge;
+            }
+            if(ret < 0 || write_datablocks(mnt, blocknums, bufs, n) < 0){
+                ret = -1;
+                end = (long)b * block_size;
+            }
+        }
+    }
+
+    file_grew(file, needed > num_blocks, end);
+    inode_unlock(mnt, inodenum);
+    end_operation(mnt);
+
+    return ret;
+}
+
+
+int write_buffer_size(int block_size){
+    /*
+        * Return value: bytes of the write buffer of a file handle, whole blocks of the mount
+    */
+    return WRITE_BUFFER_SIZE > block_size ? WRITE_BUFFER_SIZE / block_size * block_size : block_size;
+}
+
+int file_flush(struct handle_t* file){
+    /*
+        * Writes the bytes buffered by small writes of the handle to the file
+        * Blocks past the end of the file are allocated only now, all together (delayed allocation),
+          out of the blocks promised to the buffer
+        * The buffer is emptied even if the write fails (or the file was deleted)
+
+        * Return value: -1, error
+                         1, success (or nothing buffered)
+    */
+    int len = file->wb_len;
+    int reserved = file->wb_reserved;
+    if(!len)
+        return 1;
+    file->wb_len = 0;
+    file->wb_reserved = 0;
+    return file_write(file, file->wb_offset, file->wbuf + file->wb_offset % mount_block_size(file->mount_point), len, reserved);
+}
+
+int file_reserve(struct handle_t* file, long end){
+    /*
+        * Promises the blocks the buffer of the handle needs past the end of the file
+          once it holds the bytes up to end, so that file_flush finds them free
+        * Only a write reaching a block the buffer did not touch yet looks at the file
+
+        * Return value: -1, error (not enough free blocks on the device)
+                         1, success
+    */
+    int mnt = file->mount_point;
+    int block_size = mount_block_size(mnt);
+    int want;
+
+    if(file->wb_len && (end - 1) / block_size == ((long)file->wb_offset + file->wb_len - 1) / block_size)
+        return 1;
+    inode_lock(mnt, file->inode_number, 0);
+    want = file_blocks(mnt, end) - file_blocks(mnt, file->ino->inode.size);
+    inode_unlock(mnt, file->inode_number);
+    if(want <= file->wb_reserved)
+        return 1;
+    if(reserve_delalloc_blocks(mnt, want - file->wb_reserved) == -1)
+        return -1;
+    file->wb_reserved = want;
+    return 1;
+}
 
-struct file_t
-{
-	int offset;		                // offset of the file
-	int inode_number;	            // inode number of the file in the disk
-	int mount_point;    			// reference to mount point
-                                    // -1: Free
-                                    // >0: In Use
-};
+int file_buffer_write(struct handle_t* file, char* buf, int size){
+    /*
+        * Write combining: a write smaller than a block that continues the bytes buffered
+          by the handle (or starts a new buffer) is copied to the buffer of the handle
+        * The buffer holds write_buffer_size bytes of whole blocks of the file and is written once
+          the writes reach its end (whole blocks then need no read, and the new ones are allocated
+          in one run), or by file_flush before any other operation of the handle, emufs_fsync,
+          emufs_close and closedevice
+        * A write that crosses the end of the buffer fills it, flushes it and buffers the rest
+        * The new blocks of the buffered bytes are promised first (file_reserve): without free blocks
+          the write is not buffered, and fails in the caller as an unbuffered write does
+
+        * Return value: -1, error (writing the buffer failed, or no free block for the rest of the write)
+                         0, not buffered: the caller flushes the buffer and writes buf itself
+                         1, buffered
+    */
+    int block_size = mount_block_size(file->mount_point);
+    int capacity = write_buffer_size(block_size);
+    if(size <= 0 || size >= block_size)
+        return 0;
+    // Past the largest legacy file the write fails now, not when the buffer is flushed
+    if(mount_format(file->mount_point) == EMUFS_FORMAT_LEGACY && (long)file->offset + size > MAX_FILE_SIZE * block_size)
+        return 0;
+    if(file->wb_len && file->offset != file->wb_offset + file->wb_len)
+        return 0;
+    if(file->wb_size != capacity){
+        if(file->wb_len && file_flush(file) == -1)
+            return -1;
+        free(file->wbuf);
+        file->wbuf = (char*)malloc(capacity);
+        file->wb_size = file->wbuf ? capacity : 0;
+        if(!file->wbuf)
+            return 0;
+    }
 
-struct directory_t
-{
-    int inode_number;               // inode number of the directory in the disk
-    int mount_point;    			// reference to mount point
-                                    // -1: Free
-                                    // >0: In Use
-};
+    int buffered = 0;
+    while(size > 0){
+        if(!file->wb_len)
+            file->wb_offset = file->offset;
+        int off = file->offset - (file->wb_offset - file->wb_offset % block_size);
+        int len = capacity - off < size ? capacity - off : size;
+        if(file_reserve(file, (long)file->offset + len) == -1)
+            return buffered ? -1 : 0;
+        buffered = 1;
+        memcpy(file->wbuf + off, buf, len);
+        file->wb_len += len;
+        file->offset += len;
+        buf += len;
+        size -= len;
+        if(off + len == capacity && file_flush(file) == -1)
+            return -1;
+    }
+    return 1;
+}
+
+void flush_open_files(int mount_point){
+    /*
+        * Flushes the buffered writes of every file handle open on the mount, then writes back their inodes
+        * The device is being closed: no other operation runs on the mount
+    */
+    int chunks = __atomic_load_n(&file_table.num_chunks, __ATOMIC_ACQUIRE);
+    for(int c=0; c<chunks; c++){
+        struct handle_t* chunk = __atomic_load_n(&file_table.chunks[c], __ATOMIC_ACQUIRE);
+        for(int i=0; chunk && i<HANDLE_CHUNK; i++)
+            if(__atomic_load_n(&chunk[i].mount_point, __ATOMIC_ACQUIRE) == mount_point && !handle_revoked(&chunk[i])){
+                if(chunk[i].wb_len)
+                    file_flush(&chunk[i]);
+                file_sync_inode(&chunk[i]);
+                journal_stop(mount_point);
+            }
+    }
+}
 
+void sync_open_inodes(int mount_point){
+    /*
+        * Writes back the inodes of the files open on the mount whose size changed, so the inode
+          table is up to date (fsdump)
+        * Other threads may use the handles meanwhile: a slot is checked again under the open list
+          lock of its inode, which keeps its reference to the inode. The inode is copied there
+          and written once the open list lock is released, still under the inode lock
+    */
+    int written = 0;
+    int chunks = __atomic_load_n(&file_table.num_chunks, __ATOMIC_ACQUIRE);
+    for(int c=0; c<chunks; c++){
+        struct handle_t* chunk = __atomic_load_n(&file_table.chunks[c], __ATOMIC_ACQUIRE);
+        for(int i=0; chunk && i<HANDLE_CHUNK; i++){
+            struct handle_t* slot = &chunk[i];
+            if(__atomic_load_n(&slot->mount_point, __ATOMIC_ACQUIRE) != mount_point || handle_revoked(slot))
+                continue;
+            int inodenum = slot->inode_number;
+            int dirty = 0;
+            struct inode_t inode;
+            inode_lock(mount_point, inodenum, 1);
+            open_list_lock(mount_point, inodenum);
+            if(__atomic_load_n(&slot->mount_point, __ATOMIC_ACQUIRE) == mount_point && slot->inode_number == inodenum &&
+               !handle_revoked(slot) && slot->ino && slot->ino->dirty){
+                inode = slot->ino->inode;
+                slot->ino->dirty = 0;
+                dirty = 1;
+            }
+            open_list_unlock(mount_point, inodenum);
+            if(dirty){
+                write_inode(mount_point, inodenum, &inode);
+                written = 1;
+            }
+            inode_unlock(mount_point, inodenum);
+            journal_stop(mount_point);
+        }
+    }
+    if(written)
+        end_operation(mount_point);
+}
 
-struct directory_t dir[MAX_DIR_HANDLES];    // array of directory handles
-struct file_t files[MAX_FILE_HANDLES];      // array of file handles
+/*-----------FILE SYSTEM API------------*/
 
 int closedevice(int mount_point){
     /*
-        * Close all the associated handles
+        * Close all the associated handles (writes still buffered by file handles are flushed first)
         * Unmount the device
         
         * Return value: -1,     error
                          1,     success
     */
 
-    for(int i=0; i<MAX_DIR_HANDLES; i++)
-        dir[i].mount_point = (dir[i].mount_point==mount_point ? -1 : dir[i].mount_point);
-    for(int i=0; i<MAX_FILE_HANDLES; i++)
-        files[i].mount_point = (files[i].mount_point==mount_point ? -1 : files[i].mount_point);
+    flush_open_files(mount_point);
+    drop_open_lists(mount_point);
+    dcache_clear(mount_point);
     
     return closedevice_(mount_point);
 }
 
 int create_file_system(int mount_point, int fs_number){
+    return create_file_system_ex(mount_point, fs_number, NULL);
+}
+
+int create_file_system_ex(int mount_point, int fs_number, struct fs_config_t* config){
     /*
 	   	* Read the superblock.
-        * Update the mount point with the file system number
-	    * Set file system number on superblock
+        * Update the mount point with the file system number (prompts for the key, fails on an invalid one)
+	    * Set file system number (AES file systems get a new nonce) and the layout (config->format, legacy by default) on superblock
+        * The device is switched to the block size of the format (config->block_size, BLOCKSIZE for legacy)
 		* Clear the bitmaps.  values on the bitmap will be either '0', or '1'. 
+          (extent format: write_superblock clears the bitmap blocks)
         * Update the used inodes and blocks
 		* Create Inode 0 (root) in metadata block in disk
 		* Write superblock and metadata block back to disk.
+        * Handles still open on the mount are revoked
 
 		* Return value: -1,		error
 						 1, 	success
 	*/
+    int format = config ? config->format : EMUFS_FORMAT_LEGACY;
+    int block_size = BLOCKSIZE;
     struct superblock_t superblock;
     read_superblock(mount_point, &superblock);
 
-    update_mount(mount_point, fs_number);
+    if(format == EMUFS_FORMAT_EXTENT)
+        block_size = config->block_size ? config->block_size : mount_block_size(mount_point);
+    if(!block_size_valid(block_size))
+        return -1;
+    // The device keeps its length in bytes
+    superblock.disk_size = (long)superblock.disk_size * mount_block_size(mount_point) / block_size;
+    superblock.block_size = block_size;
+
+    int data_start = 1 + LEGACY_INODE_BLOCKS;
+    int bits = BITS_PER_BLOCK(block_size);
+    superblock.magic_number = MAGIC_NUMBER;
+    if(format == EMUFS_FORMAT_EXTENT){
+        // superblock | inode bitmap | block bitmap | inode table | data
+        long inode_count = config->inode_count > 0 ? config->inode_count : superblock.disk_size / BLOCKS_PER_INODE;
+        if(inode_count < MAX_INODES)
+            inode_count = MAX_INODES;
+        if(inode_count > MAX_FS_INODES)
+            inode_count = MAX_FS_INODES;
+        superblock.magic_number = MAGIC_NUMBER_EXTENT;
+        superblock.inode_size = sizeof(struct inode_v2_t);
+        superblock.inode_count = inode_count;
+        superblock.inode_bitmap_start = 1;
+        superblock.block_bitmap_start = 1 + BLOCKS_FOR(inode_count, bits);
+        superblock.inode_table_start = superblock.block_bitmap_start + BLOCKS_FOR(superblock.disk_size, bits);
+        superblock.data_start = superblock.inode_table_start + BLOCKS_FOR(inode_count * sizeof(struct inode_v2_t), block_size);
+        data_start = superblock.data_start;
+        if(data_start >= superblock.disk_size)
+            return -1;
+    }
+    else if(superblock.disk_size <= data_start)
+        return -1;
+    if(update_mount(mount_point, fs_number) < 0 || set_block_size(mount_point, block_size) < 0)
+        return -1;
+    drop_open_lists(mount_point);
+    dcache_clear(mount_point);
 
     superblock.fs_number=fs_number;
-    for(int i=3; i<MAX_BLOCKS; i++)
-        superblock.block_bitmap[i]=0;
-    for(int i=0; i<3; i++)
-        superblock.block_bitmap[i]=1;
-    for(int i=1; i<MAX_INODES; i++)
-        superblock.inode_bitmap[i]=0;
-    superblock.inode_bitmap[0]=1;
-    superblock.used_blocks=3;
-    superblock.used_inodes=1;
+    if(fs_number == EMUFS_AES128 || fs_number == EMUFS_AES256)
+        new_nonce(superblock.nonce);
+    if(format == EMUFS_FORMAT_LEGACY){
+        for(int i=data_start; i<MAX_BLOCKS; i++)
+            superblock.block_bitmap[i]=0;
+        for(int i=0; i<data_start; i++)
+            superblock.block_bitmap[i]=1;
+        for(int i=1; i<MAX_INODES; i++)
+            superblock.inode_bitmap[i]=0;
+        superblock.inode_bitmap[0]=1;
+        superblock.used_blocks=data_start;
+        superblock.used_inodes=1;
+    }
     write_superblock(mount_point, &superblock);
+    if(format == EMUFS_FORMAT_EXTENT)
+        alloc_inode(mount_point);   // the root, inode 0 of the empty inode bitmap
 
     struct inode_t inode;
     memset(&inode,0,sizeof(struct inode_t));
     inode.name[0]='/';
-    inode.parent=255;
+    inode.parent=NO_PARENT;
     inode.type=1;
     write_inode(mount_point, 0, &inode);
+    end_operation(mount_point);
+    return 1;
 }
 
-int alloc_dir_handle(){
+int alloc_dir_handle(int mount_point, int inodenum){
     /*
-        * Initialize the arrays if not already done
-        * check and return if there is any free entry
+        * Take a free entry of the directory handle table, it grows when there is none
         
 		* Return value: -1,		error
-						 1, 	success
+						 handle, 	success
     */
-    if(init==0){
-        for(int i=0; i<MAX_DIR_HANDLES; i++)
-            dir[i].mount_point = -1;
-        for(int i=0; i<MAX_FILE_HANDLES; i++)
-            files[i].mount_point = -1;
-        init=1;
-    }
-    for(int i=0; i<MAX_DIR_HANDLES; i++)
-        if(dir[i].mount_point==-1)
-            return i;
-    return -1;
+    return alloc_handle(&dir_table, mount_point, inodenum);
 }
 
-int alloc_file_handle(){
-    for(int i=0; i<MAX_FILE_HANDLES; i++)
-        if(files[i].mount_point==-1)
-            return i;
-    return -1;
+int alloc_file_handle(int mount_point, int inodenum){
+    return alloc_handle(&file_table, mount_point, inodenum);
 }
 
 int goto_parent(int dir_handle){
@@ -117,12 +1702,14 @@ int goto_parent(int dir_handle){
 						 1, 	success
     */
 
+    struct handle_t *dir = get_handle(&dir_table, dir_handle);
     struct inode_t inode;
-    read_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, &inode);
-    if(inode.parent==255)
+    if(!dir)
         return -1;
-    dir[dir_handle].inode_number = inode.parent;
-    return 1;
+    read_inode(dir->mount_point, dir->inode_number, &inode);
+    if(inode.parent==NO_PARENT)
+        return -1;
+    return move_dir_handle(dir_handle, inode.parent);
 }
 
 int open_root(int mount_point){
@@ -136,13 +1723,29 @@ int open_root(int mount_point){
    if(mount_point < 0 || mount_point >= MAX_MOUNT_POINTS) // || mounts[mount_point].device_fd <= 0)
         return -1;
         
-   int handle = alloc_dir_handle();
-   if(handle == -1)
-        return -1;
-        
-    dir[handle].inode_number = 0;
-    dir[handle].mount_point = mount_point;
-    return handle;
+   return alloc_dir_handle(mount_point, 0);
+}
+
+int dir_lookup(int mount_point, int dirnum, char* name){
+    /*
+        * Search the directory for the first entity called name (zero padded to MAX_ENTITY_NAME)
+        * The result, found or not, is remembered in the dentry cache
+        * The entries are searched (find_dir_entry) under a shared lock of the directory
+
+        * Return value: -1,             not found
+                         inode number,  success
+    */
+    int inodenum;
+    struct inode_t dir_inode;
+    if(dcache_lookup(mount_point, dirnum, name, &inodenum))
+        return inodenum;
+
+    inode_lock(mount_point, dirnum, 0);
+    read_inode(mount_point, dirnum, &dir_inode);
+    inodenum = find_dir_entry(mount_point, &dir_inode, name, -1);
+    dcache_insert(mount_point, dirnum, name, inodenum);
+    inode_unlock(mount_point, dirnum);
+    return inodenum;
 }
 
 int return_inode(int mount_point, int inodenum, char* path){
@@ -194,20 +1797,18 @@ int return_inode(int mount_point, int inodenum, char* path){
             int found=0;
             buf[ptr2++]=path[ptr1++];
             if(path[ptr1]==0 || path[ptr1]=='/'){
-                for(int i=0; i<inode.size; i++){
+                int child = dir_lookup(mount_point, inodenum, buf);
+                if(child != -1){
                     struct inode_t entry;
-                    read_inode(mount_point, inode.mappings[i], &entry);
-                    if(memcmp(buf,entry.name,MAX_ENTITY_NAME)==0){
-                        inodenum = inode.mappings[i];
-                        inode = entry;
-                        if(path[ptr1]=='/')
-                            if(entry.type==0)
-                                return -1;
-                        ptr2=0;
-                        memset(buf,0,MAX_ENTITY_NAME);
-                        found=1;
-                        break;
-                    }
+                    read_inode(mount_point, child, &entry);
+                    inodenum = child;
+                    inode = entry;
+                    if(path[ptr1]=='/')
+                        if(entry.type==0)
+                            return -1;
+                    ptr2=0;
+                    memset(buf,0,MAX_ENTITY_NAME);
+                    found=1;
                 }
                 if(found)
                     break;
@@ -229,24 +1830,41 @@ int change_dir(int dir_handle, char* path){
 						 1, 	success
     */
 
-    int inodenum = return_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, path);
+    struct handle_t *dir = get_handle(&dir_table, dir_handle);
+    if(!dir)
+        return -1;
+
+    int inodenum = return_inode(dir->mount_point, dir->inode_number, path);
     if(inodenum == -1)
         return -1;
-    dir[dir_handle].inode_number = inodenum;
-    return 1;
+    return move_dir_handle(dir_handle, inodenum);
 }
 
 void emufs_close(int handle, int type){
     /*
         * type = 1 : Directory handle and 0 : File Handle
         * Close the file/directory handle
+        * A file handle writes its buffered bytes, then the inode of the file if its size changed
     */
-    if(type == 1)
-        // if(handle >=0 && handle < MAX_DIR_HANDLES)
-        dir[handle].mount_point = -1;
-    else
-        // if(handle >=0 && handle < MAX_FILE_HANDLES)
-        files[handle].mount_point = -1;
+    if(type == 0){
+        struct handle_t* slot = lookup_handle(&file_table, handle);
+        if(slot){
+            if(!handle_revoked(slot)){
+                file_flush(slot);
+                if(file_sync_inode(slot))
+                    end_operation(slot->mount_point);
+            }
+            free(slot->held);
+            slot->held = NULL;
+            free(slot->wbuf);
+            slot->wbuf = NULL;
+            slot->wb_len = 0;
+            slot->wb_size = 0;
+            release_delalloc_blocks(slot->mount_point, slot->wb_reserved);  // a revoked handle was not flushed
+            slot->wb_reserved = 0;
+        }
+    }
+    close_handle(type == 1 ? &dir_table : &file_table, handle);
 }
 
 int delete_entity(int mount_point, int inodenum){
@@ -256,32 +1874,40 @@ int delete_entity(int mount_point, int inodenum){
         * If its a file then free all the allocated blocks
         * If its a directory call delete_entity on all the entities present
         * Free the inode
+        * The entity is already unlinked from its parent, so no other lookup can reach it
+        * The changes of each entity go in the running journal transaction without holding it
+          while the next inode lock is taken (journal_stop), so a large tree may be deleted in
+          several transactions
         
         * Return value : inode number of the parent directory
     */
 
     struct inode_t inode;
+    inode_lock(mount_point, inodenum, 1);
     read_inode(mount_point, inodenum, &inode);
     if(inode.type==0){
-        for(int i=0; i<MAX_FILE_HANDLES; i++)
-            if(files[i].inode_number==inodenum)
-                files[i].mount_point=-1;
-        int num_blocks = inode.size/BLOCKSIZE;
-        if(num_blocks*BLOCKSIZE<inode.size)
-            num_blocks++;
-        for(int i=0; i<num_blocks; i++)
-            free_datablock(mount_point, inode.mappings[i]);
+        revoke_open_handles(mount_point, inodenum, 1);
+        free_file_blocks(mount_point, &inode);
         free_inode(mount_point, inodenum);
+        inode_unlock(mount_point, inodenum);
+        journal_stop(mount_point);
         return inode.parent;
     }
 
-    for(int i=0; i<MAX_DIR_HANDLES; i++)
-        if(dir[i].inode_number==inodenum)
-            dir[i].mount_point=-1;
+    revoke_open_handles(mount_point, inodenum, 1);
+    inode_unlock(mount_point, inodenum);
     
-    for(int i=0; i<inode.size; i++)
-        delete_entity(mount_point, inode.mappings[i]);
+    // The children take their own locks, only one inode lock is held at a time
+    int *entries;
+    int count = read_dir_entries(mount_point, &inode, &entries);
+    for(int i=0; i<count; i++)
+        delete_entity(mount_point, entries[i]);
+    if(count >= 0)
+        release_dir_entries(&inode, entries);
+    free_file_blocks(mount_point, &inode);
+    dcache_invalidate_dir(mount_point, inodenum);
     free_inode(mount_point, inodenum);
+    journal_stop(mount_point);
     return inode.parent;
 }
 
@@ -290,46 +1916,42 @@ int emufs_delete(int dir_handle, char* path){
         * Delete the entity at the path
         * Use return_inode and delete_entry functions for searching and deleting entities 
         * Update the parent root of the entity to mark the deletion
-        * Remove the entity's inode number from the mappings array and decrease the size of the directory
-        * For removing entity do the following : 
-            * Lets say we have to remove ith entry in mappings
-            * We'll make mappings[j-1] = mappings[j] for all i < j < size 
+        * Remove the entity's inode number from the entries of the directory and decrease its size
+        * (remove_dir_entry)
         * Then write the inode back to the disk
         
         * Return value: -1, error
                          1, success
     */
-    if (!path || dir_handle < 0 || dir_handle >= MAX_DIR_HANDLES)
+    struct handle_t *dir = get_handle(&dir_table, dir_handle);
+    if (!path || !dir)
         return -1;
 
-    int target_inode = return_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, path);
+    int mnt = dir->mount_point;
+    int target_inode = return_inode(mnt, dir->inode_number, path);
     if (target_inode == -1)
         return -1;
 
     struct inode_t curr_inode;
-    read_inode(dir[dir_handle].mount_point, target_inode, &curr_inode);
+    read_inode(mnt, target_inode, &curr_inode);
 
     int parent_inode_num = curr_inode.parent;
     struct inode_t parent_inode;
-    read_inode(dir[dir_handle].mount_point, parent_inode_num, &parent_inode);
-
-    int found = 0;
-    for (int i = 0; i < parent_inode.size; i++) {
-        if (parent_inode.mappings[i] == target_inode) {
-            found = 1;
-            for (int j = i; j < parent_inode.size - 1; j++) {
-                parent_inode.mappings[j] = parent_inode.mappings[j + 1];
-            }
-            parent_inode.size--;
-            break;
-        }
-    }
+    inode_lock(mnt, parent_inode_num, 1);
+    read_inode(mnt, parent_inode_num, &parent_inode);
 
-    if (!found)
+    // Another thread deleted it first
+    if (remove_dir_entry(mnt, &parent_inode, target_inode) == -1) {
+        inode_unlock(mnt, parent_inode_num);
         return -1;
+    }
 
-    write_inode(dir[dir_handle].mount_point, parent_inode_num, &parent_inode);
-    delete_entity(dir[dir_handle].mount_point, target_inode);
+    write_inode(mnt, parent_inode_num, &parent_inode);
+    dcache_invalidate(mnt, parent_inode_num, curr_inode.name);
+    inode_unlock(mnt, parent_inode_num);
+    journal_stop(mnt);
+    delete_entity(mnt, target_inode);
+    end_operation(mnt);
 
     return 1;
 }
@@ -344,38 +1966,49 @@ int emufs_create(int dir_handle, char* name, int type){
                          1, success
     */
     // Read the inode of the parent directory specified by dir_handle
-    if(dir_handle < 0 || dir_handle >= MAX_DIR_HANDLES)
+    struct handle_t *dir = get_handle(&dir_table, dir_handle);
+    if(!dir)
         return -1;
+    int mnt = dir->mount_point;
+    int dirnum = dir->inode_number;
+
+    // Entries are compared and hashed over MAX_ENTITY_NAME bytes, zero padded as stored
+    char padded[MAX_ENTITY_NAME];
+    pad_entity_name(padded, name);
 
     // Read the inode of the parent directory specified by dir_handle
+    // The parent stays locked until the new entry is linked in
     struct inode_t parent_inode;
-    read_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, &parent_inode);
+    inode_lock(mnt, dirnum, 1);
+    read_inode(mnt, dirnum, &parent_inode);
 
     // Check if an entity with the same name and type already exists in the parent directory
-    for(int i = 0; i < parent_inode.size; i++) {
-        struct inode_t entry;
-        read_inode(dir[dir_handle].mount_point, parent_inode.mappings[i], &entry);
-        if(memcmp(name, entry.name, MAX_ENTITY_NAME) == 0 && entry.type == type)
-            return -1; // Entity already exists, return error
+    if (find_dir_entry(mnt, &parent_inode, padded, type) != -1) {
+        inode_unlock(mnt, dirnum);
+        return -1; // Entity already exists, return error
     }
 
-    // Check if the parent directory is full (assuming a max size of 4)
-    if (parent_inode.size >= 4) {
+    // Check if the parent directory is full (4 entries in the legacy format)
+    if (mount_format(mnt) == EMUFS_FORMAT_LEGACY && parent_inode.size >= MAX_FILE_SIZE) {
+        inode_unlock(mnt, dirnum);
         return -1; // Directory full, return error
     }
 
     // Allocate a new inode for the new entity
-    int inode_num = alloc_inode(dir[dir_handle].mount_point);
+    int inode_num = alloc_inode(mnt);
     if (inode_num == -1) {
+        inode_unlock(mnt, dirnum);
+        end_operation(mnt);
         return -1; // Failed to allocate inode, return error
     }
+    reset_open_handles(mnt, inode_num); // Handles may be opened on the new entity
 
     // Initialize the new inode
     struct inode_t new_inode;
     memset(&new_inode, 0, sizeof(struct inode_t)); // Clear the new inode structure
-    strncpy(new_inode.name, name, MAX_ENTITY_NAME); // Set the name of the new entity
+    memcpy(new_inode.name, padded, MAX_ENTITY_NAME); // Set the name of the new entity
     new_inode.type = type; // Set the type (file or directory)
-    new_inode.parent = dir[dir_handle].inode_number; // Set the parent to the current directory
+    new_inode.parent = dirnum; // Set the parent to the current directory
     new_inode.size = 0; // Initialize size to 0
 
     // Initialize mappings to -1
@@ -384,16 +2017,131 @@ int emufs_create(int dir_handle, char* name, int type){
     }
 
     // Write the new inode to disk
-    write_inode(dir[dir_handle].mount_point, inode_num, &new_inode);
-
-    // Update the parent directory's mappings to include the new inode
-    parent_inode.mappings[parent_inode.size++] = inode_num;
-    write_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, &parent_inode);
+    write_inode(mnt, inode_num, &new_inode);
+
+    // A cached lookup of the name in the parent (e.g. a negative entry) is now stale
+    dcache_invalidate(mnt, dirnum, new_inode.name);
+
+    // Update the parent directory's entries to include the new inode
+    if (add_dir_entry(mnt, &parent_inode, inode_num, new_inode.name, type) == -1) {
+        free_inode(mnt, inode_num);
+        write_inode(mnt, dirnum, &parent_inode);    // its table may have moved before the failure
+        inode_unlock(mnt, dirnum);
+        end_operation(mnt);
+        return -1; // No block for the entry, return error
+    }
+    write_inode(mnt, dirnum, &parent_inode);
+    inode_unlock(mnt, dirnum);
+    end_operation(mnt);
 
     // Return success
     return 1;
 }
 
+int emufs_create_many(struct emufs_create_t* entries, int count){
+    /*
+        * Creates the entries in order, each as emufs_create(dir_handle, name, type) would, and sets their result
+        * An entry with parent i goes in the directory created by the earlier entry i, so a whole
+          tree is created by one call; all the entries are on the mount of the first directory handle
+        * The entries of each directory are added with its inode lock taken once (add_dir_entries),
+          which allocates the inodes of the entries it accepts together, and the metadata is written
+          back once at the end (with a journal, the directories may go in different transactions)
+
+        * Return value: -1,                        error (no valid directory handle, or out of memory)
+                         number of entries created, success
+    */
+    int mnt = -1;
+    int created = 0;
+    int *dirs = (int*)malloc((count > 0 ? count : 1) * sizeof(int));          // directory of each entry, -1: invalid
+    int *inodenums = (int*)malloc((count > 0 ? count : 1) * sizeof(int));     // inode of each entry created, -1: none
+    int *group = (int*)malloc((count > 0 ? count : 1) * sizeof(int));
+    struct emufs_create_t **batch = (struct emufs_create_t**)malloc((count > 0 ? count : 1) * sizeof(struct emufs_create_t*));
+
+    if(!entries || !dirs || !inodenums || !group || !batch){
+        free(dirs);
+        free(inodenums);
+        free(group);
+        free(batch);
+        return -1;
+    }
+
+    // Entries in a directory of the batch are resolved (-2) once their parent is created
+    for(int i=0; i<count; i++){
+        struct emufs_create_t *entry = &entries[i];
+        dirs[i] = -1;
+        if(!entry->name)
+            continue;
+        if(entry->parent == -1){
+            struct handle_t *dir = get_handle(&dir_table, entry->dir_handle);
+            if(!dir || (mnt != -1 && dir->mount_point != mnt))
+                continue;
+            mnt = dir->mount_point;
+            dirs[i] = dir->inode_number;
+        }
+        else if(entry->parent >= 0 && entry->parent < i && dirs[entry->parent] != -1 && entries[entry->parent].type == 1)
+            dirs[i] = -2;
+    }
+    for(int i=0; i<count; i++){
+        inodenums[i] = -1;
+        entries[i].result = dirs[i] != -1 ? 0 : -1;  // 0: not created yet
+    }
+
+    // One directory at a time, from the first entry still to create
+    // The entries before it are settled: the directory of an entry of the batch exists
+    // once that entry was created, otherwise the entries in it fail
+    for(int i=0; i<count; i++){
+        if(dirs[i] == -2)
+            dirs[i] = entries[entries[i].parent].result == 1 ? inodenums[entries[i].parent] : -1;
+        if(dirs[i] == -1)
+            entries[i].result = -1;
+        if(entries[i].result != 0)
+            continue;
+        int dirnum = dirs[i];
+        int n = 0;
+        for(int j=i; j<count; j++){
+            if(dirs[j] == -2 && entries[j].parent < i && entries[entries[j].parent].result == 1)
+                dirs[j] = inodenums[entries[j].parent];
+            if(entries[j].result == 0 && dirs[j] == dirnum)
+                batch[n++] = &entries[j];
+        }
+
+        struct inode_t parent_inode;
+        inode_lock(mnt, dirnum, 1);
+        read_inode(mnt, dirnum, &parent_inode);
+        created += add_dir_entries(mnt, &parent_inode, batch, group, n);
+        for(int k=0; k<n; k++){
+            struct inode_t new_inode;
+            if(batch[k]->result != 1){
+                if(group[k] != -1)
+                    free_inode(mnt, group[k]);  // the entry could not be added after all
+                continue;
+            }
+            inodenums[batch[k] - entries] = group[k];
+            reset_open_handles(mnt, group[k]);
+            memset(&new_inode, 0, sizeof(struct inode_t));
+            pad_entity_name(new_inode.name, batch[k]->name);
+            new_inode.type = batch[k]->type;
+            new_inode.parent = dirnum;
+            for(int m = 0; m < MAX_FILE_SIZE; m++)
+                new_inode.mappings[m] = -1;
+            write_inode(mnt, group[k], &new_inode);
+            dcache_invalidate(mnt, dirnum, new_inode.name);
+        }
+        write_inode(mnt, dirnum, &parent_inode);
+        inode_unlock(mnt, dirnum);
+        journal_stop(mnt);
+    }
+
+    if(mnt != -1)
+        end_operation(mnt);
+
+    free(dirs);
+    free(inodenums);
+    free(group);
+    free(batch);
+    return mnt == -1 ? -1 : created;
+}
+
 int open_file(int dir_handle, char* path){
     /*
         * Open a file_handle to point to the file denoted by path
@@ -404,19 +2152,19 @@ int open_file(int dir_handle, char* path){
         * Return value: -1, error
                          1, success
     */
-    int handle = alloc_file_handle();
-    if(handle == -1)
-        return -1; // Return error if no file handle is available
+    struct handle_t *dir = get_handle(&dir_table, dir_handle);
+    if(!dir)
+        return -1;
 
     // Get the inode number of the file using the path
-    int inode_num = return_inode(dir[dir_handle].mount_point, dir[dir_handle].inode_number, path);
+    int inode_num = return_inode(dir->mount_point, dir->inode_number, path);
     if(inode_num == -1)
         return -1; // Return error if the inode is not found
 
-    // Initialize the file handle
-    files[handle].inode_number = inode_num; // Set the inode number
-    files[handle].mount_point = dir[dir_handle].mount_point; // Set the mount point
-    files[handle].offset = 0; // Set the offset to the beginning of the file
+    // Initialize the file handle (inode number, mount point, offset at the beginning of the file)
+    int handle = alloc_file_handle(dir->mount_point, inode_num);
+    if(handle == -1)
+        return -1; // Return error if no file handle is available
 
     // Return the file handle
     return handle;
@@ -426,46 +2174,96 @@ int emufs_read(int file_handle, char* buf, int size){
     /*
         * Read the file into buf starting from seek(offset) 
         * The size of the chunk to be read is given
-        * size can and can't be a multiple of BLOCKSIZE
+        * size can and can't be a multiple of the block size
         * Update the offset = offset+size in the file handle (update the seek)
         * Hint: 
-            * Use a buffer of BLOCKSIZE and read the file blocks in it
+            * Use a buffer of one block and read the file blocks in it
             * Then use this buffer to populate buf (use memcpy)
         
         * Return value: -1, error
                          1, success
     */
-    if (file_handle < 0 || file_handle >= MAX_FILE_HANDLES || !buf || size < 0)
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if (!file || !buf || size < 0 || file_flush(file) == -1)
         return -1;
 
-    int curr_offset = files[file_handle].offset;
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    int curr_offset = file->offset;
 
-    struct inode_t inode;
-    read_inode(files[file_handle].mount_point, files[file_handle].inode_number, &inode);
+    struct inode_t *inode = &file->ino->inode;
+    inode_lock(mnt, inodenum, 0);
+    // The file may have been deleted while waiting for the lock
+    if (handle_revoked(file)) {
+        inode_unlock(mnt, inodenum);
+        return -1;
+    }
 
     // Check if the read exceeds the file size
-    if (inode.size < curr_offset + size)
-        size = inode.size - curr_offset; // Adjust size to read only available data
-
-    char temp_buf[BLOCKSIZE];
-    int bytes_read = 0;
-
-    while (bytes_read < size) {
-        int block_index = (curr_offset + bytes_read) / BLOCKSIZE;
-        int block_offset = (curr_offset + bytes_read) % BLOCKSIZE;
-        int bytes_to_copy = BLOCKSIZE - block_offset;
-
-        if (bytes_to_copy > size - bytes_read)
-            bytes_to_copy = size - bytes_read;
-
-        read_datablock(files[file_handle].mount_point, inode.mappings[block_index], temp_buf);
-        memcpy(buf + bytes_read, temp_buf + block_offset, bytes_to_copy);
+    if (inode->size < curr_offset + size)
+        size = inode->size - curr_offset; // Adjust size to read only available data
+
+    // Read the blocks covering [curr_offset, curr_offset+size) BLOCKS_PER_IO at a time
+    // Whole blocks land in buf directly, only a partial first or last block goes through a buffer
+    int bytes_read = size > 0 ? size : 0;
+
+    if (bytes_read > 0) {
+        int block_size = mount_block_size(mnt);
+        char head_buf[block_size], tail_buf[block_size];
+        int blocknums[BLOCKS_PER_IO];
+        char *bufs[BLOCKS_PER_IO];
+        int first = curr_offset / block_size;
+        int last = (curr_offset + bytes_read - 1) / block_size;
+        int head_off = curr_offset % block_size;
+        int tail_len = (curr_offset + bytes_read) % block_size;
+        if (first == last && head_off)
+            tail_len = 0;   // the only block is the head block
+
+        // A partial block the handle holds from its last read is not read again
+        char *head_held = head_off ? file_held_block(file, first, block_size) : NULL;
+        char *tail_held = tail_len ? file_held_block(file, last, block_size) : NULL;
+        int to = tail_held ? last - 1 : last;
+
+        for (int b = head_held ? first + 1 : first; b <= to; b += BLOCKS_PER_IO) {
+            int n = to - b + 1 < BLOCKS_PER_IO ? to - b + 1 : BLOCKS_PER_IO;
+            if (map_file_blocks(mnt, inode, b, n, blocknums) < 0) {
+                inode_unlock(mnt, inodenum);
+                return -1;
+            }
+            for (int i = 0; i < n; i++) {
+                if (b + i == first && head_off)
+                    bufs[i] = head_buf;
+                else if (b + i == last && tail_len)
+                    bufs[i] = tail_buf;
+                else
+                    bufs[i] = buf + ((b + i) * block_size - curr_offset);
+            }
+            if (read_datablocks(mnt, blocknums, bufs, n) < 0) {
+                inode_unlock(mnt, inodenum);
+                return -1;
+            }
+        }
 
-        bytes_read += bytes_to_copy;
+        // Copy out the partial blocks
+        if (head_off) {
+            int len = block_size - head_off < bytes_read ? block_size - head_off : bytes_read;
+            memcpy(buf, (head_held ? head_held : head_buf) + head_off, len);
+        }
+        if (tail_len)
+            memcpy(buf + (last * block_size - curr_offset), tail_held ? tail_held : tail_buf, tail_len);
+
+        // Hold the block the read ended in, the next sequential read starts there
+        if (tail_len && !tail_held)
+            file_hold_block(file, last, tail_buf, block_size);
+        else if (!tail_len && head_off && !head_held && (curr_offset + bytes_read) % block_size)
+            file_hold_block(file, first, head_buf, block_size);
     }
+    if (bytes_read > 0)
+        file_readahead(file, inode, curr_offset, bytes_read);
+    inode_unlock(mnt, inodenum);
 
     // Update the file offset
-    files[file_handle].offset += bytes_read;
+    file->offset += bytes_read;
 
     return 1;
 }
@@ -474,70 +2272,29 @@ int emufs_write(int file_handle, char* buf, int size){
     /*
         * Write the memory buffer into file starting from seek(offset) 
         * The size of the chunk to be written is given
-        * size can and can't be a multiple of BLOCKSIZE
+        * size can and can't be a multiple of the block size
         * Update the inode of the file if need to be (mappings and size changed)
         * Update the offset = offset+size in the file handle (update the seek)
         * Hint: 
-            * Use a buffer of BLOCKSIZE and read the file blocks in it
+            * Use a buffer of one block and read the file blocks in it
             * Then write to this buffer from buf (use memcpy)
             * Then write back this buffer to the file
+        * Writes smaller than a block are combined in the buffer of the handle while they
+          stay sequential (file_buffer_write), other handles see them once it is flushed
         
         * Return value: -1, error
                          1, success
     */
-    int mnt = files[file_handle].mount_point;
-    int seek = files[file_handle].offset;
-    int inodenum = files[file_handle].inode_number;
-
-    if(seek+size > BLOCKSIZE*MAX_FILE_SIZE)
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if(!file || size < 0)
         return -1;
 
-    struct superblock_t superblock;
-    read_superblock(mnt, &superblock);
-
-    struct inode_t inode;
-    read_inode(mnt, inodenum, &inode);
-
-    if(seek+size > inode.size){
-        int num_req;
-        int k=(seek+size)/BLOCKSIZE;
-        num_req = k;
-        if(k*BLOCKSIZE < (seek+size))
-            num_req++;
-        
-        k=inode.size/BLOCKSIZE;
-        num_req-=k;
-        if(k*BLOCKSIZE<inode.size)
-            num_req--;
-        
-        if(superblock.disk_size-superblock.used_blocks < num_req)
-            return -1;
-    }
-
-    char temp_buf[BLOCKSIZE];
-    int num_blocks = inode.size/BLOCKSIZE;
-    if(num_blocks*BLOCKSIZE<inode.size)
-        num_blocks++;
-    for(int i=seek/BLOCKSIZE; i*BLOCKSIZE<(seek+size); i++){
-        int a, b;
-        a = i*BLOCKSIZE > seek ? i*BLOCKSIZE : seek;
-        b = (i+1)*BLOCKSIZE < (seek+size) ? (i+1)*BLOCKSIZE : (seek+size);
-        if(i==num_blocks){
-            inode.mappings[i] = alloc_datablock(mnt);
-            memcpy(temp_buf,buf+a-seek,b-a);
-            write_datablock(mnt, inode.mappings[i], temp_buf);
-            num_blocks++;
-        }
-        else{
-            read_datablock(mnt, inode.mappings[i], temp_buf);
-            memcpy(temp_buf+a-i*BLOCKSIZE,buf+a-seek,b-a);
-            write_datablock(mnt, inode.mappings[i], temp_buf);
-        }
-    }
-    inode.size = inode.size > (seek+size) ? inode.size : (seek+size);
-    write_inode(mnt, inodenum, &inode);
-
-    files[file_handle].offset+=size;
+    int ret = file_buffer_write(file, buf, size);
+    if(ret)
+        return ret;
+    if(file_flush(file) == -1 || file_write(file, file->offset, buf, size, 0) == -1)
+        return -1;
+    file->offset+=size;
 
     return 1;
 }
@@ -550,26 +2307,558 @@ int emufs_seek(int file_handle, int nseek){
         * Return value: -1, error
                          1, success
     */
-    if (file_handle < 0 || file_handle >= MAX_FILE_HANDLES)
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if (!file || file_flush(file) == -1)
         return -1;
 
-    int curr_offset = files[file_handle].offset;
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    int curr_offset = file->offset;
 
     if (nseek > 0) {
-        struct inode_t inode;
-        read_inode(files[file_handle].mount_point, files[file_handle].inode_number, &inode);
-        if (inode.size < nseek + curr_offset)
+        inode_lock(mnt, inodenum, 0);
+        long file_size = file->ino->inode.size;
+        inode_unlock(mnt, inodenum);
+        if (file_size < nseek + curr_offset)
             return -1;
     } else if (nseek < 0) {
         if (curr_offset + nseek < 0)
             return -1;
     }
 
-    files[file_handle].offset += nseek;
+    file->offset += nseek;
+
+    return 1;
+}
+
+int emufs_fsync(int file_handle){
+    /*
+        * Writes the bytes buffered by small writes of the handle to the file, and its inode
+          if the size changed, then writes back the cached blocks of its device (flush_device)
+
+        * Return value: -1, error
+                         1, success
+    */
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if(!file)
+        return -1;
+    if(file_flush(file) == -1)
+        return -1;
+    file_sync_inode(file);
+    return flush_device(file->mount_point);
+}
+
+int emufs_fragmentation(int file_handle, struct fragmentation_t *report){
+    /*
+        * Reports how the blocks of the file are laid out on the device (file_fragmentation)
+        * Bytes buffered by the handle are written first, so their blocks are counted
+
+        * Return value: -1, error
+                         1, success
+    */
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if(!file || !report || file_flush(file) == -1)
+        return -1;
 
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+
+    inode_lock(mnt, inodenum, 0);
+    if(handle_revoked(file)){
+        inode_unlock(mnt, inodenum);
+        return -1;
+    }
+    file_fragmentation(mnt, &file->ino->inode, report);
+    inode_unlock(mnt, inodenum);
     return 1;
 }
 
+struct emufs_view_t* emufs_read_view(int file_handle, int size){
+    /*
+        * Reads like emufs_read without copying: returns spans that point straight into the
+          block cache, and advances the offset of the handle
+        * The blocks of an unencrypted file are pinned in the cache (cache_view_blocks); a
+          write of them meanwhile moves the block to another entry, so the view does not change
+        * Encrypted blocks, and blocks past the half of the cache views may pin, are
+          decrypted into a buffer of the view instead
+        * The view must be released with emufs_release_view, before the device is closed
+          or formatted
+
+        * Return value: NULL, error
+                        the view, success
+    */
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if (!file || size < 0 || file_flush(file) == -1)
+        return NULL;
+
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    int curr_offset = file->offset;
+
+    struct inode_t *inode = &file->ino->inode;
+    inode_lock(mnt, inodenum, 0);
+    if (handle_revoked(file)) {
+        inode_unlock(mnt, inodenum);
+        return NULL;
+    }
+    if (inode->size < curr_offset + size)
+        size = inode->size - curr_offset;
+    if (size < 0)
+        size = 0;
+
+    int block_size = mount_block_size(mnt);
+    int first = curr_offset / block_size;
+    int count = size > 0 ? (curr_offset + size - 1) / block_size - first + 1 : 0;
+    int blocknums[count > 0 ? count : 1];
+
+    // The spans and the entries are allocated with the view
+    struct read_view_t* view = (struct read_view_t*)calloc(1, sizeof(struct read_view_t) +
+        (size_t)count * (sizeof(struct emufs_span_t) + sizeof(struct cache_entry_t*)));
+    if (view) {
+        view->mount_point = mnt;
+        view->entries = (struct cache_entry_t**)(view + 1);
+        view->view.spans = (struct emufs_span_t*)(view->entries + count);
+    }
+    if (!view || map_file_blocks(mnt, inode, first, count, blocknums) < 0) {
+        inode_unlock(mnt, inodenum);
+        free(view);
+        return NULL;
+    }
+
+    if (!mount_encrypted(mnt))
+        view->pinned = cache_view_blocks(mnt, blocknums, count, view->entries);
+    if (view->pinned < count) {
+        char* bufs[BLOCKS_PER_IO];
+        view->copies = (char*)malloc((size_t)(count - view->pinned) * block_size);
+        if (!view->copies) {
+            inode_unlock(mnt, inodenum);
+            emufs_release_view(&view->view);
+            return NULL;
+        }
+        for (int b = view->pinned; b < count; b += BLOCKS_PER_IO) {
+            int n = count - b < BLOCKS_PER_IO ? count - b : BLOCKS_PER_IO;
+            for (int i = 0; i < n; i++)
+                bufs[i] = view->copies + (size_t)(b + i - view->pinned) * block_size;
+            if (read_datablocks(mnt, blocknums + b, bufs, n) < 0) {
+                inode_unlock(mnt, inodenum);
+                emufs_release_view(&view->view);
+                return NULL;
+            }
+        }
+    }
+
+    // One span per block, merged when the blocks follow each other in memory
+    for (int i = 0; i < count; i++) {
+        const char* data = i < view->pinned ? view->entries[i]->data : view->copies + (size_t)(i - view->pinned) * block_size;
+        int from = i == 0 ? curr_offset % block_size : 0;
+        int to = i == count - 1 ? (curr_offset + size - 1) % block_size + 1 : block_size;
+        struct emufs_span_t* last = view->view.count ? &view->view.spans[view->view.count - 1] : NULL;
+        if (last && last->data + last->size == data + from) {
+            last->size += to - from;
+            continue;
+        }
+        view->view.spans[view->view.count].data = data + from;
+        view->view.spans[view->view.count++].size = to - from;
+    }
+    view->view.size = size;
+
+    if (size > 0)
+        file_readahead(file, inode, curr_offset, size);
+    inode_unlock(mnt, inodenum);
+
+    file->offset += size;
+    return &view->view;
+}
+
+void emufs_release_view(struct emufs_view_t* view){
+    /*
+        * Unpins the cache blocks of a view returned by emufs_read_view and frees it
+    */
+    struct read_view_t* read_view = (struct read_view_t*)view;
+    if (!read_view)
+        return;
+    if (read_view->pinned)
+        cache_unview(read_view->mount_point, read_view->entries, read_view->pinned);
+    free(read_view->copies);
+    free(read_view);
+}
+
+/*-----------ASYNC READ/WRITE------------*/
+
+void emufs_aio_copy_out(struct emufs_aio_t* aio, char* block){
+    /*
+        * Copies the bytes of a partial first or last block of a read into the user buffer
+    */
+    if(block == aio->staging && aio->head_len)
+        memcpy(aio->head_dst, block + aio->head_off, aio->head_len);
+    else if(block == aio->staging + aio->block_size && aio->tail_len)
+        memcpy(aio->tail_dst, block, aio->tail_len);
+}
+
+void emufs_aio_block_done(struct aio_request_t* request){
+    /*
+        * Completion of one block of an asynchronous read or write, run by the I/O engine
+        * Reads: decrypts the block, then copies out a partial first or last block
+        * Writes: drops a clean copy that a reader may have cached (or held) while the write was in flight
+    */
+    struct emufs_aio_t* aio = (struct emufs_aio_t*)request->data;
+
+    if(aio->op == AIO_READ && request->result > 0){
+        decrypt_datablock(aio->mount_point, request->blocknum, request->buf);
+        emufs_aio_copy_out(aio, request->buf);
+    }
+    else if(aio->op == AIO_WRITE){
+        cache_discard(aio->mount_point, request->blocknum, 1);
+        data_changed(aio->mount_point, aio->inode_number);
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    if(request->result < 0)
+        aio->result = -1;
+    if(--aio->pending == 0)
+        pthread_cond_broadcast(&aio->done);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+struct emufs_aio_t* emufs_aio_alloc(int mount_point, int op, int blocks, int staging_blocks){
+    /*
+        * Allocates an asynchronous operation with room for its block requests and staging blocks
+
+        * Return value: NULL, error
+                        operation, success
+    */
+    struct emufs_aio_t* aio = (struct emufs_aio_t*)calloc(1, sizeof(struct emufs_aio_t));
+    if(!aio)
+        return NULL;
+
+    aio->mount_point = mount_point;
+    aio->op = op;
+    aio->block_size = mount_block_size(mount_point);
+    aio->result = 1;
+    aio->requests = (struct aio_request_t*)calloc(blocks > 0 ? blocks : 1, sizeof(struct aio_request_t));
+    aio->staging = (char*)malloc((size_t)(staging_blocks > 0 ? staging_blocks : 1) * aio->block_size);
+    if(!aio->requests || !aio->staging){
+        free(aio->requests);
+        free(aio->staging);
+        free(aio);
+        return NULL;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    return aio;
+}
+
+void emufs_aio_free(struct emufs_aio_t* aio){
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->done);
+    free(aio->requests);
+    free(aio->staging);
+    free(aio);
+}
+
+int emufs_aio_start(struct emufs_aio_t* aio, struct aio_request_t** submit, int count){
+    /*
+        * Submits the block requests of the operation that are not complete already
+        * Without an I/O engine they are transferred synchronously
+
+        * Return value: -1, error
+                         1, success
+    */
+    int mnt = aio->mount_point;
+    int blocknums[count > 0 ? count : 1];
+    char* bufs[count > 0 ? count : 1];
+
+    aio->pending = count;
+    if(count == 0 || aio_submit(mnt, submit, count) > 0)
+        return 1;
+
+    // No engine: nothing was submitted
+    for(int i = 0; i < count; i++){
+        blocknums[i] = submit[i]->blocknum;
+        bufs[i] = submit[i]->buf;
+    }
+    if(aio->op == AIO_READ){
+        if(read_datablocks(mnt, blocknums, bufs, count) < 0)
+            aio->result = -1;
+        else
+            for(int i = 0; i < count; i++)
+                emufs_aio_copy_out(aio, bufs[i]);
+    }
+    else if(cache_writeblocks(mnt, blocknums, bufs, count) < 0){
+        aio->result = -1;
+    }
+    aio->pending = 0;
+    return aio->result;
+}
+
+struct emufs_aio_t* emufs_read_async(int file_handle, char* buf, int size){
+    /*
+        * Starts reading the file into buf from the offset of the handle, like emufs_read,
+          and returns without waiting for the device
+        * Blocks found in the block cache are copied right away, the others are submitted
+          to the asynchronous I/O engine of the mount (io_uring or worker threads) and
+          decrypted as they complete
+        * The offset is advanced at once, so the next read can be submitted immediately
+        * buf must stay valid, and the file must not be written, truncated or deleted,
+          until emufs_aio_wait returns
+
+        * Return value: NULL, error
+                        operation to pass to emufs_aio_wait, success
+    */
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if (!file || !buf || size < 0 || file_flush(file) == -1)
+        return NULL;
+
+    int mnt = file->mount_point;
+    int inodenum = file->inode_number;
+    int curr_offset = file->offset;
+
+    struct inode_t *inode = &file->ino->inode;
+    inode_lock(mnt, inodenum, 0);
+    if (handle_revoked(file)) {
+        inode_unlock(mnt, inodenum);
+        return NULL;
+    }
+    if (inode->size < curr_offset + size)
+        size = inode->size - curr_offset;
+    int bytes_read = size > 0 ? size : 0;
+
+    int block_size = mount_block_size(mnt);
+    int first = curr_offset / block_size;
+    int last = bytes_read > 0 ? (curr_offset + bytes_read - 1) / block_size : first - 1;
+    int count = last - first + 1;
+    struct emufs_aio_t* aio = emufs_aio_alloc(mnt, AIO_READ, count, 2);
+    int* blocknums = (int*)malloc((count > 0 ? count : 1) * sizeof(int));
+    struct aio_request_t** submit = (struct aio_request_t**)malloc((count > 0 ? count : 1) * sizeof(struct aio_request_t*));
+    int num_submit = 0;
+
+    if (!aio || !blocknums || !submit || map_file_blocks(mnt, inode, first, count, blocknums) < 0) {
+        inode_unlock(mnt, inodenum);
+        if (aio)
+            emufs_aio_free(aio);
+        free(blocknums);
+        free(submit);
+        return NULL;
+    }
+
+    if (count > 0) {
+        // A partial first block goes through staging block 0, a partial last one through block 1
+        int head_off = curr_offset % block_size;
+        int tail_len = (curr_offset + bytes_read) % block_size;
+        if (first == last && head_off)
+            tail_len = 0;
+        if (head_off) {
+            aio->head_dst = buf;
+            aio->head_off = head_off;
+            aio->head_len = block_size - head_off < bytes_read ? block_size - head_off : bytes_read;
+        }
+        if (tail_len) {
+            aio->tail_dst = buf + (last * block_size - curr_offset);
+            aio->tail_len = tail_len;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct aio_request_t* request = &aio->requests[i];
+            int blk = first + i;
+            request->op = AIO_READ;
+            request->blocknum = blocknums[i];
+            request->done = emufs_aio_block_done;
+            request->data = aio;
+            if (blk == first && head_off)
+                request->buf = aio->staging;
+            else if (blk == last && tail_len)
+                request->buf = aio->staging + block_size;
+            else
+                request->buf = buf + ((long)blk * block_size - curr_offset);
+
+            if (peek_datablock(mnt, blocknums[i], request->buf))
+                emufs_aio_copy_out(aio, request->buf);
+            else
+                submit[num_submit++] = request;
+        }
+    }
+    emufs_aio_start(aio, submit, num_submit);
+    inode_unlock(mnt, inodenum);
+
+    file->offset += bytes_read;
+    free(blocknums);
+    free(submit);
+    return aio;
+}
+
+struct emufs_aio_t* emufs_write_async(int file_handle, char* buf, int size){
+    /*
+        * Starts writing buf into the file at the offset of the handle, like emufs_write,
+          and returns without waiting for the device
+        * The blocks are allocated, the inode updated and a partial first or last block
+          patched synchronously; the data blocks then go around the block cache (their
+          cached copies are dropped) to the asynchronous I/O engine of the mount
+        * Encrypted blocks are copied and encrypted first, otherwise whole blocks are
+          written from buf, which must not change until emufs_aio_wait returns
+        * A mount with a journal writes synchronously (emufs_write), as its blocks must
+          be committed through the journal
+        * Slower than emufs_write when the device write does not block (it only reaches the
+          write-back cache or the page cache): each call stages its blocks and goes through
+          the engine, which costs more than the copy it saves
+
+        * Return value: NULL, error
+                        operation to pass to emufs_aio_wait, success
+    */
+    struct handle_t *file = get_handle(&file_table, file_handle);
+    if(!file || !buf || size < 0 || file_flush(file) == -1)
+        return NULL;
+
+    int mnt = file->mount_point;
+    int seek = file->offset;
+    int inodenum = file->inode_number;
+    struct emufs_aio_t* aio;
+
+    if(mount_journaled(mnt) || size == 0){
+        if(!(aio = emufs_aio_alloc(mnt, AIO_WRITE, 0, 0)))
+            return NULL;
+        aio->result = emufs_write(file_handle, buf, size);
+        return aio;
+    }
+
+    struct inode_t *inode = &file->ino->inode;
+    inode_lock(mnt, inodenum, 1);
+    if(handle_revoked(file)){
+        inode_unlock(mnt, inodenum);
+        return NULL;
+    }
+    data_changed(mnt, inodenum);
+
+    int num_blocks = file_blocks(mnt, inode->size);
+    int needed = file_blocks(mnt, (long)seek + size);
+    if(needed > num_blocks && grow_file(mnt, inode, needed - num_blocks, 0) == -1){
+        inode_unlock(mnt, inodenum);
+        end_operation(mnt);
+        return NULL;
+    }
+
+    int block_size = mount_block_size(mnt);
+    int first = seek / block_size;
+    int last = (seek + size - 1) / block_size;
+    int count = last - first + 1;
+    int head_off = seek % block_size;
+    int tail_len = (seek + size) % block_size;
+    if(first == last && head_off)
+        tail_len = 0;
+    int encrypted = mount_encrypted(mnt);
+    int* blocknums = (int*)malloc(count * sizeof(int));
+    struct aio_request_t** submit = (struct aio_request_t**)malloc(count * sizeof(struct aio_request_t*));
+
+    aio = emufs_aio_alloc(mnt, AIO_WRITE, count, encrypted ? count : 2);
+    if(!aio || !blocknums || !submit || map_file_blocks(mnt, inode, first, count, blocknums) < 0){
+        file_grew(file, needed > num_blocks, 0);    // blocks allocated above stay with the file
+        inode_unlock(mnt, inodenum);
+        end_operation(mnt);
+        if(aio)
+            emufs_aio_free(aio);
+        free(blocknums);
+        free(submit);
+        return NULL;
+    }
+    aio->inode_number = inodenum;
+
+    int failed = 0;
+    for(int i = 0; !failed && i < count; i++){
+        struct aio_request_t* request = &aio->requests[i];
+        int blk = first + i;
+        int edge = (blk == first && head_off) || (blk == last && tail_len);
+        request->op = AIO_WRITE;
+        request->blocknum = blocknums[i];
+        request->done = emufs_aio_block_done;
+        request->data = aio;
+        submit[i] = request;
+
+        if(encrypted)
+            request->buf = aio->staging + (size_t)i * block_size;
+        else if(edge)
+            request->buf = aio->staging + (blk == first && head_off ? 0 : block_size);
+        else{
+            request->buf = buf + ((long)blk * block_size - seek);
+            continue;
+        }
+
+        if(edge){
+            // Patch the partial block, read back first only if it already held data
+            if(blk < num_blocks){
+                aio_wait_block(mnt, blocknums[i]);
+                if(read_datablock(mnt, blocknums[i], request->buf) < 0){
+                    failed = 1;
+                    break;
+                }
+            }
+            else
+                memset(request->buf, 0, block_size);
+            if(blk == first && head_off){
+                int len = block_size - head_off < size ? block_size - head_off : size;
+                memcpy(request->buf + head_off, buf, len);
+            }
+            else
+                memcpy(request->buf, buf + ((long)last * block_size - seek), tail_len);
+        }
+        else
+            memcpy(request->buf, buf + ((long)blk * block_size - seek), block_size);
+        encrypt_datablock(mnt, blocknums[i], request->buf);
+    }
+    if(failed){
+        file_grew(file, needed > num_blocks, 0);
+        inode_unlock(mnt, inodenum);
+        end_operation(mnt);
+        emufs_aio_free(aio);
+        free(blocknums);
+        free(submit);
+        return NULL;
+    }
+
+    // The cached copies are dropped only once nothing can fail, as they may hold the latest data
+    for(int i = 0; i < count; i++)
+        cache_discard(mnt, blocknums[i], 0);
+    file_grew(file, needed > num_blocks, (long)seek + size);
+    emufs_aio_start(aio, submit, count);
+    inode_unlock(mnt, inodenum);
+    end_operation(mnt);
+
+    file->offset += size;
+    free(blocknums);
+    free(submit);
+    return aio;
+}
+
+int emufs_aio_done(struct emufs_aio_t* aio){
+    /*
+        * Return value: 1 if every block of the asynchronous operation has completed, 0 otherwise
+    */
+    int done;
+
+    pthread_mutex_lock(&aio->lock);
+    done = aio->pending == 0;
+    pthread_mutex_unlock(&aio->lock);
+    return done;
+}
+
+int emufs_aio_wait(struct emufs_aio_t* aio){
+    /*
+        * Waits for an emufs_read_async or emufs_write_async to complete and frees it
+
+        * Return value: -1, error
+                         1, success
+    */
+    int result;
+
+    if(!aio)
+        return -1;
+    pthread_mutex_lock(&aio->lock);
+    while(aio->pending)
+        pthread_cond_wait(&aio->done, &aio->lock);
+    result = aio->result;
+    pthread_mutex_unlock(&aio->lock);
+    emufs_aio_free(aio);
+    return result;
+}
+
 void flush_dir(int mount_point, int inodenum, int depth){
     /*
         * Print the directory structure of the device
@@ -585,11 +2874,18 @@ void flush_dir(int mount_point, int inodenum, int depth){
     for(int i=0; i<MAX_ENTITY_NAME && inode.name[i]>0; i++)
         printf("%c",inode.name[i]);
     if(inode.type==0)
-        printf(" (%d bytes)\n", inode.size);
+        if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY)
+            printf(" (%ld bytes)\n", inode.size);
+        else
+            printf(" (%ld bytes, %d extents)\n", inode.size, inode.extent_count);
     else{
+        int *entries;
+        int count = read_dir_entries(mount_point, &inode, &entries);
         printf("\n");
-        for(int i=0; i<inode.size; i++)
-            flush_dir(mount_point, inode.mappings[i], depth+1);
+        for(int i=0; i<count; i++)
+            flush_dir(mount_point, entries[i], depth+1);
+        if(count >= 0)
+            release_dir_entries(&inode, entries);
     }
 }
 
@@ -600,8 +2896,14 @@ void fsdump(int mount_point)
     */
    
     struct superblock_t superblock;
+    sync_open_inodes(mount_point);
     read_superblock(mount_point, &superblock);
     printf("\n[%s] fsdump \n", superblock.device_name);
     flush_dir(mount_point, 0, 0);
-    printf("Inodes in use: %d, Blocks in use: %d\n",superblock.used_inodes, superblock.used_blocks);
+    if(mount_format(mount_point) == EMUFS_FORMAT_LEGACY)
+        printf("Inodes in use: %d, Blocks in use: %d\n",superblock.used_inodes, superblock.used_blocks);
+    else
+        printf("Inodes in use: %llu, Blocks in use: %llu, Block size: %d\n",
+               (unsigned long long)superblock.inodes_in_use, (unsigned long long)superblock.blocks_in_use,
+               mount_block_size(mount_point));
 }
\ No newline at end of file
@@ -6,19 +6,131 @@
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <pthread.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define EMUFS_HAVE_IO_URING 1
+#endif
 
-#define MAX_FILE_HANDLES 2048
-#define MAX_DIR_HANDLES 2048
+#define HANDLE_INDEX_BITS 20		// handle = generation << HANDLE_INDEX_BITS | slot
+#define HANDLE_SLOTS (1 << HANDLE_INDEX_BITS)	// most open file (and directory) handles
+#define HANDLE_CHUNK 1024			// handle slots allocated at a time, as they are needed
+#define READAHEAD_MIN 4				// blocks read ahead when a handle starts reading sequentially
+#define READAHEAD_MAX 64			// the window doubles up to this many blocks while the reads stay sequential
+#define WRITE_BUFFER_SIZE 65536		// bytes of small sequential writes a file handle buffers (at least one block)
 #define MAX_MOUNT_POINTS 10
 #define MAX_ENTITY_NAME 8
+#define DCACHE_ENTRIES 4096		// path lookups cached per mount point (power of two)
+#define INODE_LOCK_STRIPES 1024	// inode and open list locks per mount point (power of two)
+
+#define EMUFS_IO_FD 0		// blocks are transferred with pread/pwrite
+#define EMUFS_IO_MMAP 1		// the device image is mapped, blocks are copied in memory
+
+#define EMUFS_SYNC_OPERATION 0	// metadata written once at the end of each operation
+#define EMUFS_SYNC_DEFERRED 1	// metadata written only on flush_device/closedevice
+#define EMUFS_SYNC_IMMEDIATE 2	// metadata written on every change
+
+#define EMUFS_FORMAT_LEGACY 0	// 16-byte inodes with 4 direct block mappings (files up to 1 KB)
+#define EMUFS_FORMAT_EXTENT 1	// 64-byte inodes with extents, bitmaps in their own blocks (large devices)
+
+struct device_config_t
+{
+	int cache_blocks;			// capacity of the block cache (in blocks)
+								// 0: no caching, every access goes to the device
+	int io_mode;				// EMUFS_IO_FD or EMUFS_IO_MMAP
+	int sync_policy;			// when the in-memory superblock and inode table are written back
+								// (EMUFS_SYNC_OPERATION, _DEFERRED or _IMMEDIATE)
+	int block_size;				// bytes per block of a new device image, 0: BLOCKSIZE
+								// (an existing image keeps the block size of its superblock)
+	int journal_size;			// bytes of the write-ahead journal added after the blocks of a device without one
+								// 0: none (a device keeps the journal recorded in its superblock)
+};
+
+struct fs_config_t
+{
+	int format;					// on-disk layout, EMUFS_FORMAT_LEGACY or EMUFS_FORMAT_EXTENT
+	int inode_count;			// extent format: number of inodes
+								// 0: one per BLOCKS_PER_INODE blocks of the device (at least MAX_INODES)
+	int block_size;				// extent format: bytes per block, a power of two from BLOCKSIZE to MAX_BLOCKSIZE
+								// 0: the block size of the device (the legacy format always uses BLOCKSIZE)
+};
+
+struct cache_stats_t
+{
+	long hits;					// lookups served from the cache
+	long misses;				// lookups that had to read the device
+	long evictions;				// blocks dropped to make room
+	long writebacks;			// dirty blocks written to the device
+	long device_reads;			// blocks read from the device
+	long device_writes;			// blocks written to the device
+};
+
+struct journal_stats_t
+{
+	long transactions;			// records committed: one per transaction, several for a large one
+	long blocks;				// block images written to the journal
+	long syncs;					// fdatasync calls: one per group commit
+	long checkpoints;			// times the journal was applied to the device and emptied
+	long replayed;				// transactions applied when the device was opened
+};
+
+struct readahead_stats_t
+{
+	long readaheads;			// readahead batches started by sequential reads
+	long blocks;				// blocks submitted for readahead
+	long hits;					// read ahead blocks found in the cache by a later read
+	long unused;				// read ahead blocks evicted before they were read
+	long dropped;				// read ahead blocks not cached: the read failed or the block was written meanwhile
+};
+
+struct fragmentation_t
+{
+	long blocks;				// data blocks of the file
+	long extents;				// runs of consecutive device blocks
+	long largest;				// blocks of the longest run
+	long backward;				// runs that start before the end of the previous one (a backward seek)
+};
+
+struct emufs_span_t
+{
+	const char* data;			// bytes of the file, read only
+	int size;
+};
+
+struct emufs_view_t				// returned by emufs_read_view, valid until emufs_release_view
+{
+	int count;					// spans, in the order of the file
+	int size;					// bytes in all the spans (fewer than asked at the end of the file)
+	struct emufs_span_t* spans;
+};
+
+struct emufs_create_t			// one entry of emufs_create_many
+{
+	int dir_handle;				// directory to create the entry in, when parent is -1
+	int parent;					// -1: dir_handle, i: the directory created by the earlier entry i of the batch
+	char* name;
+	int type;					// 0: file, 1: directory
+	int result;					// set by emufs_create_many: 1 created, -1 failed (as emufs_create would)
+};
 
 /*-----------DEVICE------------*/
 int opendevice(char *device_name, int size);
+int opendevice_ex(char *device_name, int size, struct device_config_t *config);
 int closedevice(int mount_point);
+int flush_device(int mount_point);
+int cache_stats(int mount_point, struct cache_stats_t *stats);
+int journal_stats(int mount_point, struct journal_stats_t *stats);
+int readahead_stats(int mount_point, struct readahead_stats_t *stats);
 void mount_dump(void);
 
 /*-----------FILE SYSTEM API------------*/
 int create_file_system(int mount_point, int fs_number);
+int create_file_system_ex(int mount_point, int fs_number, struct fs_config_t *config);
 void fsdump(int mount_point);
 
 int open_root(int mount_point);
@@ -27,9 +139,20 @@ int change_dir(int dir_handle, char* path);
 int open_file(int dir_handle, char* path);
 
 int emufs_create(int dir_handle, char* name, int type);
+int emufs_create_many(struct emufs_create_t* entries, int count);
 int emufs_delete(int dir_handle, char* path);
 void emufs_close(int handle, int type);
 
 int emufs_read(int file_handle, char* buf, int size);
 int emufs_write(int file_handle, char* buf, int size);
 int emufs_seek(int file_handle, int nseek);
+int emufs_fsync(int file_handle);
+int emufs_fragmentation(int file_handle, struct fragmentation_t *report);
+struct emufs_view_t* emufs_read_view(int file_handle, int size);
+void emufs_release_view(struct emufs_view_t* view);
+
+struct emufs_aio_t;
+struct emufs_aio_t* emufs_read_async(int file_handle, char* buf, int size);
+struct emufs_aio_t* emufs_write_async(int file_handle, char* buf, int size);
+int emufs_aio_done(struct emufs_aio_t* aio);
+int emufs_aio_wait(struct emufs_aio_t* aio);
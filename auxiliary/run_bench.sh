@@ -0,0 +1,258 @@
+#!/bin/bash
+
+# Array of number of threads (same sweep as run_tests.sh)
+threads=(1 2 5 10 20 30 50 70 100 130 150 200 250 300 350 500 750 1000)
+
+# Compile the benchmarks
+gcc -O2 -o bench bench.c emufs-disk.c emufs-ops.c -lpthread
+
+# Block I/O: lseek+read/write vs pread/pwrite
+blockio_output="blockio_output.txt"
+rm -f $blockio_output
+for num_threads in "${threads[@]}"; do
+    echo "Running block I/O benchmark with $num_threads threads..."
+    ./bench blockio $num_threads > temp_output.txt
+
+    # Extract average latency per operation
+    seek_latency=$(grep "lseek+read/write" temp_output.txt | awk '{print $6}')
+    pread_latency=$(grep "pread/pwrite" temp_output.txt | awk '{print $6}')
+    echo "$num_threads $seek_latency $pread_latency" >> $blockio_output
+done
+
+# Device access modes: plain fd, mapped image, fd with the block cache
+iomode_output="iomode_output.txt"
+rm -f $iomode_output
+for mode in fd mmap cached; do
+    for fs_number in 0 1; do
+        echo "Running I/O mode benchmark: $mode, fs_number $fs_number..."
+        yes 5 | ./bench iomode $mode $fs_number > temp_output.txt
+
+        scenario_time=$(grep "File scenario time" temp_output.txt | awk '{print $4}')
+        workload_time=$(grep "Mixed workload time" temp_output.txt | awk '{print $4}')
+        echo "$mode $fs_number $scenario_time $workload_time" >> $iomode_output
+    done
+done
+
+# Superblock sync policies: device block writes per create/write/delete iteration
+metadata_output="metadata_output.txt"
+rm -f $metadata_output
+for policy in immediate operation deferred; do
+    echo "Running metadata benchmark with the $policy sync policy..."
+    ./bench metadata $policy > temp_output.txt
+
+    block_writes=$(grep "Device block writes" temp_output.txt | awk '{print $4}')
+    metadata_time=$(grep "Metadata time" temp_output.txt | awk '{print $3}')
+    echo "$policy $block_writes $metadata_time" >> $metadata_output
+done
+
+# Allocator: byte-per-bit linear scan vs packed words with next-fit
+alloc_output="alloc_output.txt"
+rm -f $alloc_output
+for bits in 64 1024 16384 262144; do
+    echo "Running allocator benchmark with $bits bits..."
+    ./bench alloc $bits > temp_output.txt
+
+    linear_rate=$(grep "Linear scan" temp_output.txt | awk '{print $3}')
+    word_rate=$(grep "Word next-fit" temp_output.txt | awk '{print $3}')
+    echo "$bits $linear_rate $word_rate" >> $alloc_output
+done
+
+# Path lookups in deep trees
+lookup_output="lookup_output.txt"
+rm -f $lookup_output
+for depth in 2 4 7; do
+    echo "Running lookup benchmark with depth $depth..."
+    ./bench lookup $depth > temp_output.txt
+
+    absolute_us=$(grep "Absolute path lookup" temp_output.txt | awk '{print $4}')
+    relative_us=$(grep "Relative path lookup" temp_output.txt | awk '{print $4}')
+    echo "$depth $absolute_us $relative_us" >> $lookup_output
+done
+
+# Handle tables: open/close cost as the number of open handles grows
+handles_output="handles_output.txt"
+rm -f $handles_output
+for count in 1000 10000 100000 500000; do
+    echo "Running handle benchmark with $count handles..."
+    ./bench handles $count > temp_output.txt
+
+    opened=$(grep "Handles:" temp_output.txt | awk '{print $4}')
+    open_us=$(grep "Open:" temp_output.txt | awk '{print $2}')
+    close_us=$(grep "Close:" temp_output.txt | awk '{print $2}')
+    delete_us=$(grep "Create/open/delete:" temp_output.txt | awk '{print $2}')
+    echo "$count $opened $open_us $close_us $delete_us" >> $handles_output
+done
+
+# Device size scaling: extent format, half of the device filled by one file
+scale_output="scale_output.txt"
+rm -f $scale_output
+for blocks in 65536 262144 1048576; do
+    echo "Running scaling benchmark with $blocks blocks..."
+    ./bench scale $blocks > temp_output.txt
+
+    format_s=$(grep "Format:" temp_output.txt | awk '{print $2}')
+    mount_s=$(grep "Mount:" temp_output.txt | awk '{print $2}')
+    alloc_us=$(grep "Allocate:" temp_output.txt | awk '{print $2}')
+    create_us=$(grep "Create:" temp_output.txt | awk '{print $2}')
+    lookup_us=$(grep "Lookup:" temp_output.txt | awk '{print $2}')
+    fsdump_s=$(grep "Fsdump:" temp_output.txt | awk '{print $2}')
+    echo "$blocks $format_s $mount_s $alloc_us $create_us $lookup_us $fsdump_s" >> $scale_output
+done
+
+# Block sizes: the same workloads on devices of the same length formatted with each block size
+blocksize_output="blocksize_output.txt"
+rm -f $blocksize_output
+# fs_number 2 and 3 (AES-128/256-CTR) take a hex key at the key prompt
+aes128_key="000102030405060708090a0b0c0d0e0f"
+aes256_key="000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+for block_size in 256 512 1024 4096 16384 65536; do
+    for fs_number in 0 1 2 3; do
+        key=5
+        [ $fs_number -eq 2 ] && key=$aes128_key
+        [ $fs_number -eq 3 ] && key=$aes256_key
+        echo "Running block size benchmark with $block_size-byte blocks, fs_number $fs_number..."
+        yes $key | ./bench blocksize $block_size $fs_number > temp_output.txt
+
+        seq_write=$(grep "Sequential write:" temp_output.txt | awk '{print $3}')
+        seq_read=$(grep "Sequential read:" temp_output.txt | awk '{print $3}')
+        rand_read=$(grep "Random read:" temp_output.txt | awk '{print $3}')
+        rand_write=$(grep "Random write:" temp_output.txt | awk '{print $3}')
+        small_us=$(grep "Small files:" temp_output.txt | awk '{print $3}')
+        small_bytes=$(grep "Small files:" temp_output.txt | awk '{print $7}')
+        echo "$block_size $fs_number $seq_write $seq_read $rand_read $rand_write $small_us $small_bytes" >> $blocksize_output
+    done
+done
+
+# Large directories: create, lookup and delete cost against the number of entries
+dirsize_output="dirsize_output.txt"
+rm -f $dirsize_output
+for entries in 100 1000 10000 50000; do
+    echo "Running directory size benchmark with $entries entries..."
+    ./bench dirsize $entries > temp_output.txt
+
+    create_us=$(grep "Create:" temp_output.txt | awk '{print $2}')
+    lookup_us=$(grep "Lookup:" temp_output.txt | awk '{print $2}')
+    delete_us=$(grep "Delete:" temp_output.txt | awk '{print $2}')
+    echo "$entries $create_us $lookup_us $delete_us" >> $dirsize_output
+done
+
+# Encryption kernels: throughput of each kernel the CPU supports, checked against the scalar routines
+crypto_output="crypto_output.txt"
+rm -f $crypto_output
+for block_size in 256 4096 65536; do
+    echo "Running encryption benchmark with $block_size-byte buffers..."
+    ./bench crypto $block_size > temp_output.txt || echo "Encryption kernel mismatch with $block_size-byte buffers"
+
+    grep "Kernel:" temp_output.txt | grep -v "not supported" | tr -d ',' | \
+        awk '{print $5, $2, $7, $10, $13}' >> $crypto_output
+done
+
+# Journal: durable 4 KB appends, group commit against the number of threads
+journal_output="journal_output.txt"
+rm -f $journal_output
+for threads in 1 2 4 8 16; do
+    echo "Running journal benchmark with $threads threads..."
+    ./bench journal $threads > temp_output.txt
+
+    ops=$(grep "Throughput:" temp_output.txt | awk '{print $2}')
+    latency_us=$(grep "Latency:" temp_output.txt | awk '{print $2}')
+    syncs=$(grep "Syncs:" temp_output.txt | awk '{print $2}')
+    per_sync=$(grep "Syncs:" temp_output.txt | awk '{print $3}' | tr -d '(')
+    echo "$threads $ops $latency_us $syncs $per_sync" >> $journal_output
+done
+
+# Asynchronous I/O: cold random 4 KB reads and writes, synchronous against async requests in flight
+aio_output="aio_output.txt"
+rm -f $aio_output
+for backend in io_uring threads; do
+    for depth in 1 8 64; do
+        echo "Running async I/O benchmark with $backend and $depth requests in flight..."
+        EMUFS_AIO=$backend ./bench aio $depth > temp_output.txt
+
+        engine=$(grep "engine:" temp_output.txt | awk '{print $NF}')
+        read_sync=$(grep "Read:" temp_output.txt | awk '{print $3}')
+        read_async=$(grep "Read:" temp_output.txt | awk '{print $6}')
+        write_sync=$(grep "Write:" temp_output.txt | awk '{print $3}')
+        write_async=$(grep "Write:" temp_output.txt | awk '{print $6}')
+        echo "$engine $depth $read_sync $read_async $write_sync $write_async" >> $aio_output
+    done
+done
+
+# Readahead: sequential reads in small chunks against one read of the whole file
+readahead_output="readahead_output.txt"
+rm -f $readahead_output
+for chunk in 512 4096 65536; do
+    echo "Running readahead benchmark with $chunk-byte reads..."
+    ./bench readahead $chunk > temp_output.txt
+
+    whole=$(grep "Whole file:" temp_output.txt | awk '{print $3}')
+    chunks=$(grep "Chunks:" temp_output.txt | awk '{print $2}')
+    hits=$(grep "Readahead:" temp_output.txt | awk '{print $6}')
+    echo "$chunk $whole $chunks $hits" >> $readahead_output
+done
+
+# Write combining: small appends written one at a time against buffered in the file handle
+smallwrite_output="smallwrite_output.txt"
+rm -f $smallwrite_output
+for bytes in 1 16 100; do
+    echo "Running small write benchmark with $bytes-byte appends..."
+    ./bench smallwrite $bytes > temp_output.txt
+
+    unbuffered=$(grep "Unbuffered:" temp_output.txt | awk '{print $2}')
+    buffered=$(grep "^Buffered:" temp_output.txt | awk '{print $2}')
+    speedup=$(grep "^Buffered:" temp_output.txt | awk '{print $4}' | tr -d '()')
+    echo "$bytes $unbuffered $buffered $speedup" >> $smallwrite_output
+done
+
+# Aging: files written at the same time, half of them rewritten, then read back in order
+aging_output="aging_output.txt"
+rm -f $aging_output
+for bytes in 100 4096 65536; do
+    echo "Running aging benchmark with $bytes-byte writes..."
+    ./bench aging 8 8 $bytes > temp_output.txt
+
+    extents=$(grep "Layout:" temp_output.txt | awk '{print $2}')
+    longest=$(grep "Layout:" temp_output.txt | awk '{print $10}')
+    read_mbs=$(grep "Sequential read:" temp_output.txt | awk '{print $3}')
+    echo "$bytes $extents $longest $read_mbs" >> $aging_output
+done
+
+# Read views: a cached file scanned through copies (emufs_read) against views of the cache
+view_output="view_output.txt"
+rm -f $view_output
+for chunk in 512 4096 65536; do
+    echo "Running read view benchmark with $chunk-byte chunks..."
+    ./bench view $chunk > temp_output.txt
+
+    copy=$(grep "Copy:" temp_output.txt | awk '{print $2}')
+    view=$(grep "View:" temp_output.txt | awk '{print $2}')
+    speedup=$(grep "View:" temp_output.txt | awk '{print $4}' | tr -d '()')
+    echo "$chunk $copy $view $speedup" >> $view_output
+done
+
+# Open inodes: reads and in-place overwrites through handles sharing the inode of one file
+inode_output="inode_output.txt"
+rm -f $inode_output
+for threads in 1 4 8; do
+    echo "Running open inode benchmark with $threads threads..."
+    ./bench inode $threads > temp_output.txt
+
+    reads=$(grep "Reads:" temp_output.txt | awk '{print $2}')
+    overwrites=$(grep "Overwrites:" temp_output.txt | awk '{print $2}')
+    echo "$threads $reads $overwrites" >> $inode_output
+done
+
+# Batched creation: a tree of 16 directories created entry by entry and with one emufs_create_many
+createmany_output="createmany_output.txt"
+rm -f $createmany_output
+for files in 16 256 4096; do
+    echo "Running batched creation benchmark with $files files per directory..."
+    ./bench createmany $files 16 > temp_output.txt
+
+    loop=$(grep "Loop:" temp_output.txt | awk '{print $2}')
+    batch=$(grep "Batch:" temp_output.txt | awk '{print $2}')
+    echo "$files $loop $batch" >> $createmany_output
+done
+
+# Clean up
+rm -f temp_output.txt
@@ -5,17 +5,9 @@
 #include <time.h>
 #include "emufs.h"
 
-pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t readers_proceed = PTHREAD_COND_INITIALIZER;
-pthread_cond_t writers_proceed = PTHREAD_COND_INITIALIZER;
-
-int waiting_writers = 0;
-int active_readers = 0;
-int active_writers = 0;
-
+// The library locks each mount and each inode itself, so the threads
+// below run their requests concurrently without any locking of their own
 int tcounter = 0;
-int current_timestamp = 0;
 
 typedef struct {
     int thread_id;
@@ -60,46 +52,6 @@ void sort_operations() {
     qsort(operations, operation_count, sizeof(operation_t), compare_operations);
 }
 
-void start_read() {
-    pthread_mutex_lock(&reader_mutex);
-    while (active_writers > 0 || waiting_writers > 0) {
-        pthread_cond_wait(&readers_proceed, &reader_mutex);
-    }
-    active_readers++;
-    pthread_mutex_unlock(&reader_mutex);
-}
-
-void end_read() {
-    pthread_mutex_lock(&reader_mutex);
-    active_readers--;
-    if (active_readers == 0) {
-        pthread_cond_signal(&writers_proceed);
-    }
-    pthread_mutex_unlock(&reader_mutex);
-}
-
-void start_write() {
-    pthread_mutex_lock(&writer_mutex);
-    waiting_writers++;
-    while (active_writers > 0 || active_readers > 0) {
-        pthread_cond_wait(&writers_proceed, &writer_mutex);
-    }
-    waiting_writers--;
-    active_writers++;
-    pthread_mutex_unlock(&writer_mutex);
-}
-
-void end_write() {
-    pthread_mutex_lock(&writer_mutex);
-    active_writers--;
-    if (waiting_writers > 0) {
-        pthread_cond_signal(&writers_proceed);
-    } else {
-        pthread_cond_broadcast(&readers_proceed);
-    }
-    pthread_mutex_unlock(&writer_mutex);
-}
-
 void generate_random_requests(int num_requests, int dir_handle) {
     srand(time(NULL));
     const char* files[] = {"file1", "file2", "file3", "file4"};
@@ -135,60 +87,39 @@ void* thread_func(void* arg) {
     thread_arg_t* thread_arg = (thread_arg_t*)arg;
     int thread_id = thread_arg->thread_id;
     
-    // Wait until it's this thread's turn to execute
-    pthread_mutex_lock(&writer_mutex);
-    while (thread_arg->timestamp != current_timestamp) {
-        pthread_cond_wait(&writers_proceed, &writer_mutex);
-    }
-    pthread_mutex_unlock(&writer_mutex);
-    
     if (thread_arg->type == 1) { // Write operation
-        start_write();
         int fd = open_file(thread_arg->dir_handle, thread_arg->file_name);
         // sleep(1); // Simulate CPU operation
         emufs_write(fd, thread_arg->data, thread_arg->data_size);
         printf("Thread %d wrote data to %s at %f\n", thread_id, thread_arg->file_name, thread_arg->timestamp);
         emufs_close(fd, 0);
-        end_write();
     } else { // Read operation
-        start_read();
         int fd = open_file(thread_arg->dir_handle, thread_arg->file_name);
         char buf[1024] = {0}; // Initialize read buffer
         // sleep(1); // Simulate CPU operation
         emufs_read(fd, buf, thread_arg->data_size);
         printf("Thread %d read data from %s at %f: %s\n", thread_id, thread_arg->file_name, thread_arg->timestamp, buf);
         emufs_close(fd, 0);
-        end_read();
     }
     
-    // Increment the global timestamp counter
-    pthread_mutex_lock(&writer_mutex);
-    current_timestamp++;
-    pthread_cond_broadcast(&writers_proceed);
-    pthread_mutex_unlock(&writer_mutex);
-    
     return NULL;
 }
 
 void execute_single_threaded() {
     for (int i = 0; i < operation_count; i++) {
         if (operations[i].type == 1) { // Write operation
-            start_write();
             int fd = open_file(operations[i].arg->dir_handle, operations[i].arg->file_name);
             // sleep(1); // Simulate CPU operation
             emufs_write(fd, operations[i].arg->data, operations[i].arg->data_size);
             printf("Single-threaded: Thread %d wrote data to %s at %f\n", operations[i].arg->thread_id, operations[i].arg->file_name, operations[i].timestamp);
             emufs_close(fd, 0);
-            end_write();
         } else { // Read operation
-            start_read();
             int fd = open_file(operations[i].arg->dir_handle, operations[i].arg->file_name);
             char buf[1024] = {0}; // Initialize read buffer
             // sleep(1); // Simulate CPU operation
             emufs_read(fd, buf, operations[i].arg->data_size);
             printf("Single-threaded: Thread %d read data from %s at %f: %s\n", operations[i].arg->thread_id, operations[i].arg->file_name, operations[i].timestamp, buf);
             emufs_close(fd, 0);
-            end_read();
         }
     }
 }
@@ -277,5 +208,9 @@ int main(int argc, char* argv[]) {
     printf("Multithreaded execution time: %f seconds\n", multithreaded_time);
 
     fsdump(mnt2);
+
+    struct cache_stats_t stats;
+    cache_stats(mnt2, &stats);
+    printf("Block cache: %ld hits, %ld misses, %ld writebacks\n", stats.hits, stats.misses, stats.writebacks);
     return 0;
 }
\ No newline at end of file